@@ -79,6 +79,8 @@ static int act_redirect_check_duplicate
 	(const struct sieve_runtime_env *renv,
 		const struct sieve_action *act,
 		const struct sieve_action *act_other);
+static const char *act_redirect_duplicate_key
+	(const struct sieve_runtime_env *renv, const struct sieve_action *act);
 static void act_redirect_print
 	(const struct sieve_action *action, const struct sieve_result_print_env *rpenv,
 		bool *keep);
@@ -91,6 +93,7 @@ const struct sieve_action_def act_redirect = {
 	.flags = SIEVE_ACTFLAG_TRIES_DELIVER,
 	.equals = act_redirect_equals,
 	.check_duplicate = act_redirect_check_duplicate,
+	.duplicate_key = act_redirect_duplicate_key,
 	.print = act_redirect_print,
 	.commit = act_redirect_commit
 };
@@ -262,6 +265,21 @@ static int act_redirect_check_duplicate
 		(renv->scriptenv, act, act_other) ? 1 : 0 );
 }
 
+static const char *act_redirect_duplicate_key
+(const struct sieve_runtime_env *renv ATTR_UNUSED,
+	const struct sieve_action *act)
+{
+	struct act_redirect_context *ctx =
+		(struct act_redirect_context *) act->context;
+
+	if ( ctx == NULL )
+		return "";
+
+	/* The domain part is compared case-insensitively; folding the whole
+	   address merely lets a few distinct addresses share a key */
+	return t_str_lcase(smtp_address_encode(ctx->to_address));
+}
+
 static void act_redirect_print
 (const struct sieve_action *action,
 	const struct sieve_result_print_env *rpenv, bool *keep)
@@ -275,10 +293,31 @@ static void act_redirect_print
 	*keep = FALSE;
 }
 
+/* Redirects of the same message are submitted together in a single SMTP
+   transaction with multiple recipients. The first redirect action to commit
+   sends the message for itself and all pending redirect actions of the same
+   message; the others report the outcome for their own address when they
+   commit. If the batched submission fails, each redirect action submits the
+   message on its own, so that every address gets its own status. */
+
+struct act_redirect_batch {
+	struct mail *mail;
+	const char *msg_id, *new_msg_id;
+	const char *resent_id, *list_id;
+
+	int status;
+	/* SMTP error (NULL if the submission did not fail at SMTP level) */
+	const char *error;
+
+	/* The batched submission failed; members submit on their own */
+	bool fallback:1;
+};
+
 static int act_redirect_send
 (const struct sieve_action_exec_env *aenv, struct mail *mail,
-	struct act_redirect_context *ctx, const char *new_msg_id)
-	ATTR_NULL(4)
+	const struct smtp_address *const *recipients, unsigned int count,
+	const char *new_msg_id, const char **smtp_error_r)
+	ATTR_NULL(5)
 {
 	static const char *hide_headers[] =
 		{ "Return-Path", "X-Sieve", "X-Sieve-Redirected-From" };
@@ -291,8 +330,11 @@ static int act_redirect_send
 	const struct smtp_address *sender;
 	const char *error;
 	struct sieve_smtp_context *sctx;
+	unsigned int i;
 	int ret;
 
+	*smtp_error_r = NULL;
+
 	/* Just to be sure */
 	if ( !sieve_smtp_available(senv) ) {
 		sieve_result_global_warning
@@ -336,7 +378,10 @@ static int act_redirect_send
 	}
 
 	/* Open SMTP transport */
-	sctx = sieve_smtp_start_single(senv, ctx->to_address, sender, &output);
+	sctx = sieve_smtp_start(senv, sender);
+	for ( i = 0; i < count; i++ )
+		sieve_smtp_add_rcpt(sctx, recipients[i]);
+	output = sieve_smtp_send(sctx);
 
 	/* Remove unwanted headers */
 	input = i_stream_create_header_filter
@@ -382,26 +427,139 @@ static int act_redirect_send
 
 	/* Close SMTP transport */
 	if ( (ret=sieve_smtp_finish(sctx, &error)) <= 0 ) {
-		if ( ret < 0 ) {
-			sieve_result_global_error(aenv,
-				"failed to redirect message to <%s>: %s "
-				"(temporary failure)",
-				smtp_address_encode(ctx->to_address),
-				str_sanitize(error, 512));
-			return SIEVE_EXEC_TEMP_FAILURE;
-		}
-
-		sieve_result_global_log_error(aenv,
-			"failed to redirect message to <%s>: %s "
-			"(permanent failure)",
-			smtp_address_encode(ctx->to_address),
-			str_sanitize(error, 512));
-		return SIEVE_EXEC_FAILURE;
+		*smtp_error_r = error;
+		return ( ret < 0 ? SIEVE_EXEC_TEMP_FAILURE : SIEVE_EXEC_FAILURE );
 	}
 
 	return SIEVE_EXEC_OK;
 }
 
+static const char *act_redirect_get_duplicate_id
+(const struct sieve_action_exec_env *aenv, const char *msg_id,
+	const char *resent_id, const char *list_id,
+	const struct smtp_address *to_address)
+{
+	const struct smtp_address *recipient;
+
+	if ( (aenv->flags & SIEVE_EXECUTE_FLAG_NO_ENVELOPE) == 0 )
+		recipient = sieve_message_get_orig_recipient(aenv->msgctx);
+	else
+		recipient = sieve_get_user_email(aenv->svinst);
+
+	/* Base the duplicate ID on:
+	   - the message id
+	   - the recipient running this Sieve script
+	   - redirect target address
+	   - if this message is resent: the message-id or from-address of
+		   the original message
+	   - if the message came through a mailing list: the mailinglist ID
+	 */
+	return t_strdup_printf("%s-%s-%s-%s-%s", msg_id,
+		(recipient != NULL ? smtp_address_encode(recipient) : ""),
+		smtp_address_encode(to_address),
+		(resent_id != NULL ? resent_id : ""),
+		(list_id != NULL ? list_id : ""));
+}
+
+static struct act_redirect_batch *act_redirect_batch_create
+(const struct sieve_action *action,
+	const struct sieve_action_exec_env *aenv, struct mail *mail,
+	const char *msg_id, const char *resent_id, const char *list_id,
+	bool *duplicate_r, const struct smtp_address ***recipients_r,
+	unsigned int *count_r)
+{
+	struct sieve_instance *svinst = aenv->svinst;
+	struct sieve_message_context *msgctx = aenv->msgctx;
+	const struct sieve_script_env *senv = aenv->scriptenv;
+	pool_t pool = sieve_result_pool(aenv->result);
+	struct act_redirect_context *ctx =
+		(struct act_redirect_context *) action->context;
+	struct act_redirect_batch *batch;
+	ARRAY(struct act_redirect_context *) candidates;
+	ARRAY(struct sieve_duplicate_id) ids;
+	struct act_redirect_context *const *cctxs;
+	struct sieve_duplicate_id *id;
+	const char *dupeid;
+	unsigned int count, i;
+	bool *duplicates;
+
+	batch = p_new(pool, struct act_redirect_batch, 1);
+	batch->mail = mail;
+
+	/* Create Message-ID for the message if it has none */
+	if ( msg_id == NULL ) {
+		msg_id = batch->new_msg_id =
+			p_strdup(pool, sieve_message_get_new_id(svinst));
+	}
+	batch->msg_id = p_strdup(pool, msg_id);
+	batch->resent_id = p_strdup(pool, resent_id);
+	batch->list_id = p_strdup(pool, list_id);
+
+	t_array_init(&candidates, 4);
+	t_array_init(&ids, 4);
+
+	dupeid = act_redirect_get_duplicate_id
+		(aenv, msg_id, resent_id, list_id, ctx->to_address);
+	id = array_append_space(&ids);
+	id->id = dupeid;
+	id->id_size = strlen(dupeid);
+	array_append(&candidates, &ctx, 1);
+
+	/* Collect the pending redirects of the same message that follow this
+	   one in the result */
+	if ( svinst->redirect_batch ) {
+		struct sieve_result_iterate_context *rictx;
+		const struct sieve_action *oact;
+		bool found = FALSE;
+
+		rictx = sieve_result_iterate_init(aenv->result);
+		while ( (oact=sieve_result_iterate_next(rictx, NULL)) != NULL ) {
+			struct act_redirect_context *octx =
+				(struct act_redirect_context *) oact->context;
+			struct mail *omail;
+
+			if ( oact == action ) {
+				found = TRUE;
+				continue;
+			}
+			if ( !found || oact->def != &act_redirect ||
+				oact->executed || octx->batch != NULL )
+				continue;
+
+			omail = ( oact->mail != NULL ?
+				oact->mail : sieve_message_get_mail(msgctx) );
+			if ( omail != mail )
+				continue;
+
+			dupeid = act_redirect_get_duplicate_id
+				(aenv, msg_id, resent_id, list_id, octx->to_address);
+			id = array_append_space(&ids);
+			id->id = dupeid;
+			id->id_size = strlen(dupeid);
+			array_append(&candidates, &octx, 1);
+		}
+	}
+
+	/* Check all addresses for duplicates at once; duplicates are left out
+	   of the batch and discarded by the action itself */
+	cctxs = array_get(&candidates, &count);
+	duplicates = t_new(bool, count);
+	sieve_action_duplicate_check_multiple
+		(senv, array_idx(&ids, 0), count, duplicates);
+
+	*duplicate_r = duplicates[0];
+	*recipients_r = t_new(const struct smtp_address *, count);
+	*count_r = 0;
+	for ( i = 0; i < count; i++ ) {
+		if ( duplicates[i] )
+			continue;
+		if ( i > 0 )
+			cctxs[i]->batch = batch;
+		(*recipients_r)[(*count_r)++] = cctxs[i]->to_address;
+	}
+	return batch;
+}
+
 static int act_redirect_commit
 (const struct sieve_action *action,
 	const struct sieve_action_exec_env *aenv, void *tr_context ATTR_UNUSED,
@@ -414,80 +572,92 @@ static int act_redirect_commit
 	struct mail *mail =	( action->mail != NULL ?
 		action->mail : sieve_message_get_mail(msgctx) );
 	const struct sieve_message_data *msgdata = aenv->msgdata;
-	const struct sieve_script_env *senv = aenv->scriptenv;
-	const struct smtp_address *recipient;
-	const char *msg_id = msgdata->id, *new_msg_id = NULL;
-	const char *dupeid, *resent_id = NULL;
-	const char *list_id = NULL;
+	struct act_redirect_batch *batch = ctx->batch;
+	const char *dupeid, *error;
 	int ret;
 
-	/*
-	 * Prevent mail loops
-	 */
+	if ( batch == NULL ) {
+		const struct smtp_address **recipients;
+		const char *resent_id = NULL, *list_id = NULL;
+		unsigned int count;
+		bool duplicate = FALSE;
 
-	/* Read identifying headers */
-	if ( mail_get_first_header
-		(msgdata->mail, "resent-message-id", &resent_id) < 0 ) {
-		return sieve_result_mail_error(aenv, mail,
-			"failed to read header field `resent-message-id'");
-	}
-	if ( resent_id == NULL ) {
+		/*
+		 * Prevent mail loops
+		 */
+
+		/* Read identifying headers */
 		if ( mail_get_first_header
-			(msgdata->mail, "resent-from", &resent_id) < 0 ) {
+			(msgdata->mail, "resent-message-id", &resent_id) < 0 ) {
 			return sieve_result_mail_error(aenv, mail,
-				"failed to read header field `resent-from'");
+				"failed to read header field `resent-message-id'");
+		}
+		if ( resent_id == NULL ) {
+			if ( mail_get_first_header
+				(msgdata->mail, "resent-from", &resent_id) < 0 ) {
+				return sieve_result_mail_error(aenv, mail,
+					"failed to read header field `resent-from'");
+			}
+		}
+		if ( mail_get_first_header
+			(msgdata->mail, "list-id", &list_id) < 0 ) {
+			return sieve_result_mail_error(aenv, mail,
+				"failed to read header field `list-id'");
 		}
-	}
-	if ( mail_get_first_header
-		(msgdata->mail, "list-id", &list_id) < 0 ) {
-		return sieve_result_mail_error(aenv, mail,
-			"failed to read header field `list-id'");
-	}
 
-	/* Create Message-ID for the message if it has none */
-	if ( msg_id == NULL ) {	
-		msg_id = new_msg_id =
-			sieve_message_get_new_id(aenv->svinst);
-	}
+		/* Check whether we've seen this message before and collect the
+		   other redirects of this message */
+		batch = act_redirect_batch_create(action, aenv, mail,
+			msgdata->id, resent_id, list_id, &duplicate,
+			&recipients, &count);
 
-	if ( (aenv->flags & SIEVE_EXECUTE_FLAG_NO_ENVELOPE) == 0 )
-		recipient = sieve_message_get_orig_recipient(msgctx);
-	else
-		recipient = sieve_get_user_email(aenv->svinst);
+		/*
+		 * Try to forward the message
+		 */
 
-	/* Base the duplicate ID on:
-	   - the message id
-	   - the recipient running this Sieve script
-	   - redirect target address
-	   - if this message is resent: the message-id or from-address of
-		   the original message
-	   - if the message came through a mailing list: the mailinglist ID
-	 */
-	dupeid = t_strdup_printf("%s-%s-%s-%s-%s", msg_id,
-		(recipient != NULL ? smtp_address_encode(recipient) : ""),
-		smtp_address_encode(ctx->to_address),
-		(resent_id != NULL ? resent_id : ""),
-		(list_id != NULL ? list_id : ""));
+		if ( count > 0 ) {
+			if ( svinst->debug && count > 1 ) {
+				sieve_sys_debug(svinst, "redirect action: "
+					"submitting message for %u recipients at once", count);
+			}
 
-	/* Check whether we've seen this message before */
-	if (sieve_action_duplicate_check
-		(senv, dupeid, strlen(dupeid))) {
-		sieve_result_global_log(aenv,
-			"discarded duplicate forward to <%s>",
-			smtp_address_encode(ctx->to_address));
-		*keep = FALSE;
-		return SIEVE_EXEC_OK;
-	}
+			batch->status = act_redirect_send(aenv, mail,
+				recipients, count, batch->new_msg_id, &error);
+			batch->error = p_strdup(sieve_result_pool(aenv->result), error);
+
+			if ( batch->status != SIEVE_EXEC_OK && count > 1 ) {
+				if ( svinst->debug ) {
+					sieve_sys_debug(svinst, "redirect action: "
+						"batched submission failed; "
+						"submitting message for each recipient");
+				}
+				batch->fallback = TRUE;
+			}
+		}
 
-	/*
-	 * Try to forward the message
-	 */
+		if ( duplicate ) {
+			sieve_result_global_log(aenv,
+				"discarded duplicate forward to <%s>",
+				smtp_address_encode(ctx->to_address));
+			*keep = FALSE;
+			return SIEVE_EXEC_OK;
+		}
+	}
 
-	if ( (ret=act_redirect_send
-		(aenv, mail, ctx, new_msg_id)) == SIEVE_EXEC_OK) {
+	if ( batch->fallback ) {
+		/* Submit the message for this address only */
+		ret = act_redirect_send(aenv, batch->mail, &ctx->to_address, 1,
+			batch->new_msg_id, &error);
+	} else {
+		ret = batch->status;
+		error = batch->error;
+	}
 
+	if ( ret == SIEVE_EXEC_OK ) {
 		/* Mark this message id as forwarded to the specified destination */
-		sieve_action_duplicate_mark(senv, dupeid, strlen(dupeid),
+		dupeid = act_redirect_get_duplicate_id(aenv, batch->msg_id,
+			batch->resent_id, batch->list_id, ctx->to_address);
+		sieve_result_duplicate_mark(aenv, dupeid, strlen(dupeid),
 			ioloop_time + svinst->redirect_duplicate_period);
 
 		sieve_result_global_log(aenv, "forwarded to <%s>",
@@ -502,7 +672,21 @@ static int act_redirect_commit
 		return SIEVE_EXEC_OK;
 	}
 
+	if ( error != NULL ) {
+		if ( ret == SIEVE_EXEC_TEMP_FAILURE ) {
+			sieve_result_global_error(aenv,
+				"failed to redirect message to <%s>: %s "
+				"(temporary failure)",
+				smtp_address_encode(ctx->to_address),
+				str_sanitize(error, 512));
+		} else {
+			sieve_result_global_log_error(aenv,
+				"failed to redirect message to <%s>: %s "
+				"(permanent failure)",
+				smtp_address_encode(ctx->to_address),
+				str_sanitize(error, 512));
+		}
+	}
+
 	return ret;
 }
-
-
@@ -39,7 +39,8 @@ const struct sieve_comparator_def i_ascii_casemap_comparator = {
 		SIEVE_COMPARATOR_FLAG_PREFIX_MATCH,
 	.compare = cmp_i_ascii_casemap_compare,
 	.char_match = cmp_i_ascii_casemap_char_match,
-	.char_skip = sieve_comparator_octet_skip
+	.char_skip = sieve_comparator_octet_skip,
+	.substring_find = sieve_comparator_casemap_substring_find
 };
 
 /*
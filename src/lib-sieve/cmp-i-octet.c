@@ -38,7 +38,8 @@ const struct sieve_comparator_def i_octet_comparator = {
 		SIEVE_COMPARATOR_FLAG_PREFIX_MATCH,
 	.compare = cmp_i_octet_compare,
 	.char_match = cmp_i_octet_char_match,
-	.char_skip = sieve_comparator_octet_skip
+	.char_skip = sieve_comparator_octet_skip,
+	.substring_find = sieve_comparator_octet_substring_find
 };
 
 /*
@@ -25,6 +25,7 @@
 #include "sieve-match-types.h"
 #include "sieve-address-parts.h"
 #include "sieve-message.h"
+#include "sieve-manifest.h"
 
 #include "sieve-validator.h"
 #include "sieve-generator.h"
@@ -160,6 +161,7 @@ static const struct sieve_command_def envelope_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_CHEAP,
 	.registered = tst_envelope_registered,
 	.validate = tst_envelope_validate,
 	.generate = tst_envelope_generate
@@ -532,6 +534,7 @@ static int _envelope_part_is_supported
 {
 	const struct sieve_envelope_part **not_address =
 		(const struct sieve_envelope_part **) context;
+	struct sieve_manifest *manifest = sieve_ast_manifest(arg->ast);
 
 	if ( sieve_argument_is_string_literal(arg) ) {
 		const struct sieve_envelope_part *epart;
@@ -542,12 +545,14 @@ static int _envelope_part_is_supported
 					*not_address = epart;
 			}
 
+			sieve_manifest_add_envelope_part(manifest, epart->identifier);
 			return 1;
 		}
 
 		return 0;
 	}
 
+	sieve_manifest_add_flags(manifest, SIEVE_MANIFEST_FLAG_ENVELOPE);
 	return 1; /* Can't check at compile time */
 }
 
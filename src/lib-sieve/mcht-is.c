@@ -5,7 +5,13 @@
  */
 
 #include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "str.h"
+#include "str-sanitize.h"
 
+#include "sieve-stringlist.h"
+#include "sieve-runtime-trace.h"
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
 #include "sieve-match.h"
@@ -17,6 +23,10 @@
  * Forward declarations
  */
 
+static void mcht_is_match_init(struct sieve_match_context *mctx);
+static int mcht_is_match_keys
+	(struct sieve_match_context *mctx, const char *val, size_t val_size,
+		struct sieve_stringlist *key_list);
 static int mcht_is_match_key
 	(struct sieve_match_context *mctx, const char *val, size_t val_size,
 		const char *key, size_t key_size);
@@ -28,6 +38,8 @@ static int mcht_is_match_key
 const struct sieve_match_type_def is_match_type = {
 	SIEVE_OBJECT("is",
 		&match_type_operand, SIEVE_MATCH_TYPE_IS),
+	.match_init = mcht_is_match_init,
+	.match_keys = mcht_is_match_keys,
 	.match_key = mcht_is_match_key
 };
 
@@ -50,3 +62,208 @@ static int mcht_is_match_key
 	return 0;
 }
 
+/*
+ * Hashed key set
+ */
+
+/* For large lists of constant keys, a hash set of the keys is built once and
+ * cached in the binary. Matching a value against the list then costs a single
+ * lookup rather than a comparison with every key.
+ */
+
+#define MCHT_IS_KEYSET_MIN_KEYS 8
+
+struct mcht_is_keyset {
+	const char **slots;
+	unsigned int mask;
+
+	bool casefold:1;
+	/* Key list is not suitable for hashing */
+	bool unusable:1;
+};
+
+struct mcht_is_context {
+	const struct mcht_is_keyset *keyset;
+
+	bool keyset_resolved:1;
+};
+
+static inline unsigned int
+mcht_is_keyset_hash(const struct mcht_is_keyset *keyset, const char *str)
+{
+	return ( keyset->casefold ? strcase_hash(str) : str_hash(str) );
+}
+
+static inline bool
+mcht_is_keyset_equals(const struct mcht_is_keyset *keyset,
+	const char *str1, const char *str2)
+{
+	return ( keyset->casefold ?
+		strcasecmp(str1, str2) == 0 : strcmp(str1, str2) == 0 );
+}
+
+static bool
+mcht_is_keyset_lookup(const struct mcht_is_keyset *keyset, const char *val)
+{
+	unsigned int idx = mcht_is_keyset_hash(keyset, val) & keyset->mask;
+
+	while ( keyset->slots[idx] != NULL ) {
+		if ( mcht_is_keyset_equals(keyset, keyset->slots[idx], val) )
+			return TRUE;
+		idx = (idx + 1) & keyset->mask;
+	}
+	return FALSE;
+}
+
+static void
+mcht_is_keyset_insert(struct mcht_is_keyset *keyset, const char *key)
+{
+	unsigned int idx = mcht_is_keyset_hash(keyset, key) & keyset->mask;
+
+	while ( keyset->slots[idx] != NULL ) {
+		if ( mcht_is_keyset_equals(keyset, keyset->slots[idx], key) )
+			return;
+		idx = (idx + 1) & keyset->mask;
+	}
+	keyset->slots[idx] = key;
+}
+
+static const struct mcht_is_keyset *
+mcht_is_keyset_get(struct sieve_match_context *mctx,
+	struct sieve_stringlist *key_list, bool casefold)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	struct mcht_is_keyset *keyset;
+	ARRAY_TYPE(const_string) keys;
+	const char *const *key_items;
+	string_t *key_item = NULL;
+	const char *first;
+	unsigned int count, size, i;
+	bool usable = TRUE;
+	int ret = 0;
+
+	/* The key set is identified by the first key of the list, which is unique
+	   for a list of constant keys */
+	if ( sieve_stringlist_next_item(key_list, &key_item) <= 0 )
+		return NULL;
+	first = str_c(key_item);
+	if ( !sieve_match_key_is_constant(renv, first) )
+		return NULL;
+
+	keyset = (struct mcht_is_keyset *)
+		sieve_match_key_cache_lookup(renv, first);
+	if ( keyset != NULL ) {
+		if ( keyset->unusable || keyset->casefold != casefold )
+			return NULL;
+		return keyset;
+	}
+
+	/* Collect keys; all must be constant and free of NUL characters */
+	t_array_init(&keys, 64);
+	do {
+		const char *key = str_c(key_item);
+
+		if ( !sieve_match_key_is_constant(renv, key) ||
+			strlen(key) != str_len(key_item) ) {
+			usable = FALSE;
+			break;
+		}
+		array_append(&keys, &key, 1);
+	} while ( (ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 );
+
+	if ( usable && ret < 0 )
+		return NULL;
+
+	keyset = p_new(sieve_match_key_cache_pool(renv), struct mcht_is_keyset, 1);
+	keyset->casefold = casefold;
+
+	key_items = array_get(&keys, &count);
+	if ( !usable || count < MCHT_IS_KEYSET_MIN_KEYS ) {
+		keyset->unusable = TRUE;
+	} else {
+		/* Keep load factor at or below 1/2 */
+		for ( size = 16; size < count * 2; size <<= 1 );
+
+		keyset->slots = p_new
+			(sieve_match_key_cache_pool(renv), const char *, size);
+		keyset->mask = size - 1;
+
+		for ( i = 0; i < count; i++ )
+			mcht_is_keyset_insert(keyset, key_items[i]);
+	}
+
+	sieve_match_key_cache_insert(renv, first, keyset);
+
+	if ( keyset->unusable )
+		return NULL;
+
+	if ( mctx->trace ) {
+		sieve_runtime_trace(renv, 0,
+			"built hashed key set for %u keys", count);
+	}
+	return keyset;
+}
+
+static void mcht_is_match_init
+(struct sieve_match_context *mctx)
+{
+	mctx->data = p_new(mctx->pool, struct mcht_is_context, 1);
+}
+
+static int mcht_is_match_keys
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	struct sieve_stringlist *key_list)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct mcht_is_context *ctx = (struct mcht_is_context *) mctx->data;
+	string_t *key_item = NULL;
+	int match, ret = 0;
+
+	if ( !ctx->keyset_resolved ) {
+		/* Use a hashed key set when the comparator allows it */
+		if ( sieve_comparator_is(cmp, i_octet_comparator) ||
+			sieve_comparator_is(cmp, i_ascii_casemap_comparator) ) {
+			bool casefold =
+				sieve_comparator_is(cmp, i_ascii_casemap_comparator);
+
+			T_BEGIN {
+				ctx->keyset = mcht_is_keyset_get(mctx, key_list, casefold);
+			} T_END;
+			sieve_stringlist_reset(key_list);
+		}
+		ctx->keyset_resolved = TRUE;
+	}
+
+	if ( ctx->keyset != NULL && strlen(val) == val_size ) {
+		match = ( mcht_is_keyset_lookup(ctx->keyset, val) ? 1 : 0 );
+
+		if ( mctx->trace ) {
+			sieve_runtime_trace(renv, 0,
+				"with hashed key set => %d", match);
+		}
+		return match;
+	}
+
+	/* Default key match loop */
+	match = 0;
+	while ( match == 0 &&
+		(ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		T_BEGIN {
+			match = mcht_is_match_key
+				(mctx, val, val_size, str_c(key_item), str_len(key_item));
+
+			if ( mctx->trace ) {
+				sieve_runtime_trace(renv, 0,
+					"with key `%s' => %d", str_sanitize(str_c(key_item), 80),
+					match);
+			}
+		} T_END;
+	}
+
+	if ( ret < 0 ) {
+		mctx->exec_status = key_list->exec_status;
+		match = -1;
+	}
+	return match;
+}
@@ -6,6 +6,7 @@
 
 #include "lib.h"
 #include "str.h"
+#include "mempool.h"
 
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
@@ -33,6 +34,308 @@ const struct sieve_match_type_def matches_match_type = {
 	.match_key = mcht_matches_match_key
 };
 
+/*
+ * Compiled wildcard program
+ */
+
+/* A key is compiled into a series of sections separated by '*' wildcards:
+ *
+ *   <pattern> = <section>*<section>*...*<section>
+ *
+ * Each section has a fixed length and consists of literal characters and '?'
+ * wildcards. The first section is anchored at the beginning of the value and
+ * the last section at the end. The sections in between are searched
+ * left-to-right, each at its leftmost occurrence, which yields the shortest
+ * possible expansion for each '*' wildcard. For this search, every floating
+ * section carries a precomputed Boyer-Moore-Horspool skip table.
+ *
+ * Programs compiled from constant keys are cached in the binary.
+ */
+
+struct mcht_matches_section {
+	const unsigned char *chars;
+	const bool *wild;
+	size_t len;
+
+	/* Skip table (NULL for anchored and short sections) */
+	const size_t *skip;
+};
+
+struct mcht_matches_program {
+	const struct mcht_matches_section *sections;
+	unsigned int count;
+
+	bool casefold:1;
+};
+
+static void
+mcht_matches_section_init_skip(pool_t pool,
+	struct mcht_matches_section *sect)
+{
+	size_t *skip, last = sect->len - 1, dflt = sect->len, i;
+
+	/* A '?' matches any character, so the skip distance can never exceed the
+	   distance to the last '?' in the section */
+	for ( i = 0; i < last; i++ ) {
+		if ( sect->wild[i] )
+			dflt = last - i;
+	}
+
+	skip = p_new(pool, size_t, 256);
+	for ( i = 0; i < 256; i++ )
+		skip[i] = dflt;
+	for ( i = 0; i < last; i++ ) {
+		if ( !sect->wild[i] && last - i < skip[sect->chars[i]] )
+			skip[sect->chars[i]] = last - i;
+	}
+	sect->skip = skip;
+}
+
+static struct mcht_matches_program *
+mcht_matches_compile(pool_t pool, const char *key, size_t key_size,
+	bool casefold)
+{
+	struct mcht_matches_program *prog;
+	struct mcht_matches_section *sections;
+	unsigned char *chars;
+	bool *wild;
+	const char *kp, *kend = key + key_size;
+	unsigned int count, i;
+
+	/* Count sections */
+	count = 1;
+	for ( kp = key; kp < kend; kp++ ) {
+		if ( *kp == '\\' )
+			kp++;
+		else if ( *kp == '*' )
+			count++;
+	}
+
+	prog = p_new(pool, struct mcht_matches_program, 1);
+	sections = p_new(pool, struct mcht_matches_section, count);
+	prog->sections = sections;
+	prog->count = count;
+	prog->casefold = casefold;
+
+	/* Section contents are stored consecutively */
+	chars = p_malloc(pool, key_size + 1);
+	wild = p_new(pool, bool, key_size + 1);
+
+	kp = key;
+	for ( i = 0; i < count; i++ ) {
+		struct mcht_matches_section *sect = &sections[i];
+
+		sect->chars = chars;
+		sect->wild = wild;
+		for ( ; kp < kend && *kp != '*'; kp++ ) {
+			unsigned char c;
+
+			if ( *kp == '?' ) {
+				*wild = TRUE;
+				c = '?';
+			} else {
+				/* A trailing backslash is taken literally */
+				if ( *kp == '\\' && kp + 1 < kend )
+					kp++;
+				c = (unsigned char)*kp;
+				if ( casefold )
+					c = (unsigned char)i_tolower(c);
+			}
+			*chars++ = c;
+			wild++;
+			sect->len++;
+		}
+		kp++;
+
+		if ( i > 0 && i < count - 1 && sect->len > 1 )
+			mcht_matches_section_init_skip(pool, sect);
+	}
+
+	return prog;
+}
+
+static inline bool
+mcht_matches_section_match_at(const struct mcht_matches_program *prog,
+	const struct mcht_matches_section *sect, const unsigned char *vp)
+{
+	size_t i;
+
+	for ( i = 0; i < sect->len; i++ ) {
+		unsigned char c = vp[i];
+
+		if ( sect->wild[i] )
+			continue;
+		if ( prog->casefold )
+			c = (unsigned char)i_tolower(c);
+		if ( c != sect->chars[i] )
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static const unsigned char *
+mcht_matches_section_find(const struct mcht_matches_program *prog,
+	const struct mcht_matches_section *sect,
+	const unsigned char *vp, const unsigned char *vend)
+{
+	size_t last;
+
+	if ( sect->len == 0 )
+		return vp;
+	if ( (size_t)(vend - vp) < sect->len )
+		return NULL;
+
+	last = sect->len - 1;
+	if ( sect->skip == NULL ) {
+		for ( ; vp + last < vend; vp++ ) {
+			if ( mcht_matches_section_match_at(prog, sect, vp) )
+				return vp;
+		}
+		return NULL;
+	}
+
+	while ( vp + last < vend ) {
+		unsigned char c = vp[last];
+
+		if ( mcht_matches_section_match_at(prog, sect, vp) )
+			return vp;
+		if ( prog->casefold )
+			c = (unsigned char)i_tolower(c);
+		vp += sect->skip[c];
+	}
+	return NULL;
+}
+
+static bool
+mcht_matches_program_match(const struct mcht_matches_program *prog,
+	const char *val, size_t val_size, struct sieve_match_values *mvalues)
+{
+	const struct mcht_matches_section *first, *last;
+	const unsigned char *vstart = (const unsigned char *)val;
+	const unsigned char *vend = vstart + val_size;
+	const unsigned char *vp, *vlimit, **positions;
+	unsigned int i;
+	size_t j;
+
+	first = &prog->sections[0];
+	last = &prog->sections[prog->count - 1];
+
+	if ( prog->count == 1 ) {
+		/* No '*' wildcard; key must match the whole value */
+		if ( val_size != first->len ||
+			!mcht_matches_section_match_at(prog, first, vstart) )
+			return FALSE;
+	} else {
+		/* Check whether the value can hold the anchored sections */
+		if ( val_size < first->len + last->len )
+			return FALSE;
+		if ( !mcht_matches_section_match_at(prog, first, vstart) )
+			return FALSE;
+	}
+
+	positions = t_new(const unsigned char *, prog->count);
+	positions[0] = vstart;
+
+	if ( prog->count > 1 ) {
+		/* Find floating sections before the final anchored one */
+		vp = vstart + first->len;
+		vlimit = vend - last->len;
+		for ( i = 1; i < prog->count - 1; i++ ) {
+			const struct mcht_matches_section *sect = &prog->sections[i];
+
+			vp = mcht_matches_section_find(prog, sect, vp, vlimit);
+			if ( vp == NULL )
+				return FALSE;
+			positions[i] = vp;
+			vp += sect->len;
+		}
+
+		/* Match final section at end of value */
+		if ( !mcht_matches_section_match_at(prog, last, vlimit) )
+			return FALSE;
+		positions[prog->count - 1] = vlimit;
+	}
+
+	if ( mvalues == NULL )
+		return TRUE;
+
+	/* Record match values in the order of the wildcards in the key */
+	for ( i = 0; i < prog->count; i++ ) {
+		const struct mcht_matches_section *sect = &prog->sections[i];
+
+		if ( i > 0 ) {
+			const unsigned char *pend =
+				positions[i - 1] + prog->sections[i - 1].len;
+
+			sieve_match_values_add_data
+				(mvalues, pend, positions[i] - pend);
+		}
+
+		for ( j = 0; j < sect->len; j++ ) {
+			if ( sect->wild[j] )
+				sieve_match_values_add_char(mvalues, positions[i][j]);
+		}
+	}
+	return TRUE;
+}
+
+static const struct mcht_matches_program *
+mcht_matches_get_program(struct sieve_match_context *mctx,
+	const char *key, size_t key_size, bool casefold)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	struct mcht_matches_program *prog;
+
+	if ( !sieve_match_key_is_constant(renv, key) ) {
+		/* Key is composed at runtime; compile it for this match only */
+		return mcht_matches_compile
+			(pool_datastack_create(), key, key_size, casefold);
+	}
+
+	prog = (struct mcht_matches_program *)
+		sieve_match_key_cache_lookup(renv, key);
+	if ( prog != NULL && prog->casefold == casefold )
+		return prog;
+
+	prog = mcht_matches_compile
+		(sieve_match_key_cache_pool(renv), key, key_size, casefold);
+	sieve_match_key_cache_insert(renv, key, prog);
+	return prog;
+}
+
+static int mcht_matches_match_key_compiled
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	const char *key, size_t key_size, bool casefold)
+{
+	const struct mcht_matches_program *prog;
+	struct sieve_match_values *mvalues;
+
+	prog = mcht_matches_get_program(mctx, key, key_size, casefold);
+
+	/* Start match values list if requested */
+	if ( (mvalues = sieve_match_values_start(mctx->runenv)) != NULL ) {
+		/* Skip ${0} for now; added when match succeeds */
+		sieve_match_values_add(mvalues, NULL);
+	}
+
+	if ( !mcht_matches_program_match(prog, val, val_size, mvalues) ) {
+		/* No match; drop collected match values */
+		sieve_match_values_abort(&mvalues);
+		return 0;
+	}
+
+	/* Activate new match values after successful match */
+	if ( mvalues != NULL ) {
+		/* Set ${0} */
+		string_t *matched = str_new_const(pool_datastack_create(), val, val_size);
+		sieve_match_values_set(mvalues, 0, matched);
+
+		/* Commit new match values */
+		sieve_match_values_commit(mctx->runenv, &mvalues);
+	}
+	return 1;
+}
+
 /*
  * Match-type implementation
  */
@@ -80,7 +383,7 @@ static char _scan_key_section
 	return '\0';
 }
 
-static int mcht_matches_match_key
+static int mcht_matches_match_key_chars
 (struct sieve_match_context *mctx, const char *val, size_t val_size,
 	const char *key, size_t key_size)
 {
@@ -438,3 +741,21 @@ static int mcht_matches_match_key
 	return 0;
 }
 
+static int mcht_matches_match_key
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	const char *key, size_t key_size)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+
+	/* The core comparators use the compiled wildcard program; others fall
+	   back to generic character matching */
+	if ( sieve_comparator_is(cmp, i_octet_comparator) ) {
+		return mcht_matches_match_key_compiled
+			(mctx, val, val_size, key, key_size, FALSE);
+	}
+	if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) ) {
+		return mcht_matches_match_key_compiled
+			(mctx, val, val_size, key, key_size, TRUE);
+	}
+	return mcht_matches_match_key_chars(mctx, val, val_size, key, key_size);
+}
@@ -12,8 +12,11 @@
 #include "sieve-common.h"
 #include "sieve-stringlist.h"
 #include "sieve-code.h"
+#include "sieve-comparators.h"
+#include "sieve-match-types.h"
 #include "sieve-message.h"
 #include "sieve-interpreter.h"
+#include "sieve-match.h"
 
 #include "ext-body-common.h"
 
@@ -100,3 +103,235 @@ static void ext_body_stringlist_reset
 
 	strlist->body_parts_iter = strlist->body_parts;
 }
+
+/*
+ * Body match
+ */
+
+/* Substring matches (:contains, and :matches with keys of the form "*text*")
+   are performed while the message body is read, so that large body parts
+   need not be kept in memory. Keys are searched in each block, and in the
+   region around the boundary with the previous block to find matches that
+   span two blocks.
+ */
+
+struct ext_body_stream_match {
+	const struct sieve_comparator *cmp;
+
+	ARRAY(string_t *) keys;
+	size_t max_key_size;
+	bool have_empty_key;
+
+	/* Tail of the previous block */
+	buffer_t *overlap;
+
+	bool matched;
+};
+
+static bool
+ext_body_stream_match_find(struct ext_body_stream_match *smatch,
+	const unsigned char *data, size_t size, size_t min_key_size)
+{
+	const struct sieve_comparator *cmp = smatch->cmp;
+	string_t *const *keys;
+	unsigned int count, i;
+
+	keys = array_get(&smatch->keys, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( str_len(keys[i]) < min_key_size )
+			continue;
+		if ( cmp->def->substring_find(cmp, (const char *)data, size,
+			str_c(keys[i]), str_len(keys[i])) != NULL )
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static bool
+ext_body_stream_match_data(void *context,
+	const unsigned char *data, size_t size)
+{
+	struct ext_body_stream_match *smatch =
+		(struct ext_body_stream_match *)context;
+	buffer_t *overlap = smatch->overlap;
+	size_t tail_size = smatch->max_key_size - 1;
+	size_t overlap_size = overlap->used;
+
+	/* Matches that span the boundary with the previous block */
+	if ( overlap_size > 0 ) {
+		buffer_append(overlap, data, I_MIN(size, tail_size));
+		smatch->matched = ext_body_stream_match_find
+			(smatch, overlap->data, overlap->used, 2);
+		buffer_set_used_size(overlap, overlap_size);
+		if ( smatch->matched )
+			return TRUE;
+	}
+
+	/* Matches within this block */
+	if ( ext_body_stream_match_find(smatch, data, size, 0) ) {
+		smatch->matched = TRUE;
+		return TRUE;
+	}
+
+	/* Retain the tail of the data seen so far */
+	if ( tail_size > 0 ) {
+		if ( size >= tail_size ) {
+			buffer_set_used_size(overlap, 0);
+			buffer_append(overlap, data + size - tail_size, tail_size);
+		} else {
+			buffer_append(overlap, data, size);
+			if ( overlap->used > tail_size )
+				buffer_delete(overlap, 0, overlap->used - tail_size);
+		}
+	}
+	return FALSE;
+}
+
+static bool ext_body_stream_match_end(void *context)
+{
+	struct ext_body_stream_match *smatch =
+		(struct ext_body_stream_match *)context;
+
+	/* An empty key is contained in any part, including empty ones */
+	buffer_set_used_size(smatch->overlap, 0);
+	if ( smatch->have_empty_key )
+		smatch->matched = TRUE;
+	return smatch->matched;
+}
+
+static const struct sieve_message_body_stream_vfuncs
+ext_body_stream_match_vfuncs = {
+	.part_data = ext_body_stream_match_data,
+	.part_end = ext_body_stream_match_end
+};
+
+static bool
+ext_body_stream_match_key(const struct sieve_match_type *mcht,
+	string_t *key, string_t **substring_r)
+{
+	const char *kp = str_c(key);
+	size_t key_size = str_len(key), i;
+
+	if ( sieve_match_type_is(mcht, contains_match_type) ) {
+		*substring_r = key;
+		return TRUE;
+	}
+
+	/* Only "*text*" where text contains no wildcards or escapes */
+	i_assert( sieve_match_type_is(mcht, matches_match_type) );
+	if ( key_size < 2 || kp[0] != '*' || kp[key_size-1] != '*' )
+		return FALSE;
+	for ( i = 1; i < key_size - 1; i++ ) {
+		if ( kp[i] == '*' || kp[i] == '?' || kp[i] == '\\' )
+			return FALSE;
+	}
+	*substring_r = t_str_new(key_size);
+	str_append_data(*substring_r, kp + 1, key_size - 2);
+	return TRUE;
+}
+
+static int
+ext_body_stream_match(const struct sieve_runtime_env *renv,
+	enum tst_body_transform transform, const char * const *content_types,
+	const struct sieve_match_type *mcht, const struct sieve_comparator *cmp,
+	struct sieve_stringlist *key_list, bool *streamed_r, int *exec_status)
+{
+	struct ext_body_stream_match smatch;
+	string_t *key_item = NULL, *substring;
+	int ret;
+
+	i_zero(&smatch);
+	smatch.cmp = cmp;
+	t_array_init(&smatch.keys, 8);
+
+	/* Collect the keys */
+	sieve_stringlist_reset(key_list);
+	while ( (ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		if ( !ext_body_stream_match_key(mcht, key_item, &substring) ) {
+			/* Needs the complete value */
+			*streamed_r = FALSE;
+			return 0;
+		}
+		if ( str_len(substring) == 0 )
+			smatch.have_empty_key = TRUE;
+		if ( str_len(substring) > smatch.max_key_size )
+			smatch.max_key_size = str_len(substring);
+		array_append(&smatch.keys, &substring, 1);
+	}
+	*streamed_r = TRUE;
+	if ( ret < 0 ) {
+		*exec_status = key_list->exec_status;
+		return -1;
+	}
+	if ( array_count(&smatch.keys) == 0 ) {
+		/* No keys; nothing can match */
+		*exec_status = SIEVE_EXEC_OK;
+		return 0;
+	}
+
+	sieve_runtime_trace(renv, SIEVE_TRLVL_MATCHING,
+		"matching `:%s' keys while streaming message body",
+		sieve_match_type_name(mcht));
+
+	smatch.overlap = buffer_create_dynamic(default_pool,
+		( smatch.max_key_size > 0 ? smatch.max_key_size * 2 : 1 ));
+
+	if ( transform == TST_BODY_TRANSFORM_RAW ) {
+		ret = sieve_message_body_stream_raw
+			(renv, &ext_body_stream_match_vfuncs, &smatch);
+	} else {
+		ret = sieve_message_body_stream_content(renv, content_types,
+			&ext_body_stream_match_vfuncs, &smatch);
+	}
+
+	buffer_free(&smatch.overlap);
+
+	if ( ret <= 0 ) {
+		*exec_status = ret;
+		return -1;
+	}
+
+	sieve_runtime_trace(renv, SIEVE_TRLVL_MATCHING,
+		"finishing match with result: %s",
+		( smatch.matched ? "matched" : "not matched" ));
+
+	*exec_status = SIEVE_EXEC_OK;
+	return ( smatch.matched ? 1 : 0 );
+}
+
+int ext_body_match
+(const struct sieve_runtime_env *renv, enum tst_body_transform transform,
+	const char * const *content_types,
+	const struct sieve_match_type *mcht, const struct sieve_comparator *cmp,
+	struct sieve_stringlist *key_list, int *exec_status)
+{
+	struct sieve_stringlist *value_list;
+	bool streamed = FALSE;
+	int match, ret;
+
+	/* Match while streaming the body when the whole part content is not
+	   needed: match values are never set by the body test, but text extraction
+	   needs the complete part. */
+	if ( transform != TST_BODY_TRANSFORM_TEXT &&
+		(sieve_match_type_is(mcht, contains_match_type) ||
+			sieve_match_type_is(mcht, matches_match_type)) &&
+		cmp->def != NULL && cmp->def->substring_find != NULL ) {
+		T_BEGIN {
+			match = ext_body_stream_match(renv, transform, content_types,
+				mcht, cmp, key_list, &streamed, exec_status);
+		} T_END;
+
+		if ( streamed )
+			return match;
+	}
+
+	/* Extract requested parts */
+	if ( (ret=ext_body_get_part_list(renv, transform, content_types,
+		&value_list)) <= 0 ) {
+		*exec_status = ret;
+		return -1;
+	}
+
+	/* Perform match */
+	return sieve_match(renv, mcht, cmp, value_list, key_list, exec_status);
+}
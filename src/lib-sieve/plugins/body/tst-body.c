@@ -15,6 +15,7 @@
 #include "sieve-interpreter.h"
 #include "sieve-dump.h"
 #include "sieve-match.h"
+#include "sieve-manifest.h"
 
 #include "ext-body-common.h"
 
@@ -41,6 +42,7 @@ const struct sieve_command_def body_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_EXPENSIVE,
 	.registered = tst_body_registered,
 	.validate = tst_body_validate,
 	.generate = tst_body_generate
@@ -203,6 +205,9 @@ static bool tst_body_validate
 	if ( !sieve_validator_argument_activate(valdtr, tst, arg, FALSE) )
 		return FALSE;
 
+	sieve_manifest_add_flags(sieve_ast_manifest(tst->ast_node->ast),
+		SIEVE_MANIFEST_FLAG_BODY);
+
 	/* Validate the key argument to a specified match type */
 	return sieve_match_type_validate
 		(valdtr, tst, arg, &mcht_default, &cmp_default);
@@ -302,7 +307,7 @@ static int ext_body_operation_execute
 	struct sieve_match_type mcht =
 		SIEVE_MATCH_TYPE_DEFAULT(is_match_type);
 	unsigned int transform = TST_BODY_TRANSFORM_TEXT;
-	struct sieve_stringlist *ctype_list, *value_list, *key_list;
+	struct sieve_stringlist *ctype_list, *key_list;
 	bool mvalues_active;
 	const char * const *content_types = NULL;
 	int match, ret;
@@ -362,16 +367,12 @@ static int ext_body_operation_execute
 
 	sieve_runtime_trace(renv, SIEVE_TRLVL_TESTS, "body test");
 
-	/* Extract requested parts */
-	if ( (ret=ext_body_get_part_list(renv,
-		(enum tst_body_transform) transform, content_types,&value_list)) <= 0 )
-		return ret;
-
 	/* Disable match values processing as required by RFC */
 	mvalues_active = sieve_match_values_set_enabled(renv, FALSE);
 
-	/* Perform match */
-	match = sieve_match(renv, &mcht, &cmp, value_list, key_list, &ret);
+	/* Perform match on the requested parts */
+	match = ext_body_match(renv, (enum tst_body_transform) transform,
+		content_types, &mcht, &cmp, key_list, &ret);
 
 	/* Restore match values processing */
 	(void)sieve_match_values_set_enabled(renv, mvalues_active);
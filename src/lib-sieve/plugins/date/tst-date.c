@@ -49,6 +49,7 @@ const struct sieve_command_def date_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_MEDIUM,
 	.registered = tst_date_registered,
 	.validate = tst_date_validate,
 	.generate = tst_date_generate
@@ -73,6 +74,7 @@ const struct sieve_command_def currentdate_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_CHEAP,
 	.registered = tst_currentdate_registered,
 	.validate = tst_date_validate,
 	.generate = tst_date_generate
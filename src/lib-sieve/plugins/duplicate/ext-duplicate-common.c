@@ -110,7 +110,6 @@ static void act_duplicate_mark_finish
 	const struct sieve_action_exec_env *aenv,
 	void *tr_context ATTR_UNUSED, int status)
 {
-	const struct sieve_script_env *senv = aenv->scriptenv;
 	struct act_duplicate_mark_data *data =
 		(struct act_duplicate_mark_data *) action->context;
 
@@ -118,8 +117,8 @@ static void act_duplicate_mark_finish
 		/* Message was handled successfully, so track duplicate for this
 		 * message.
 		 */
-		sieve_action_duplicate_mark
-			(senv, data->hash, sizeof(data->hash), ioloop_time + data->period);
+		sieve_result_duplicate_mark
+			(aenv, data->hash, sizeof(data->hash), ioloop_time + data->period);
 	}
 }
 
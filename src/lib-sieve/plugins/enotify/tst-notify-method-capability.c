@@ -40,6 +40,7 @@ const struct sieve_command_def notify_method_capability_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_CHEAP,
 	.registered = tst_notifymc_registered,
 	.validate = tst_notifymc_validate,
 	.generate = tst_notifymc_generate
@@ -34,6 +34,7 @@ const struct sieve_command_def valid_notify_method_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_CHEAP,
 	.validate = tst_vnotifym_validate,
 	.generate = tst_vnotifym_generate
 };
@@ -41,6 +41,7 @@ const struct sieve_command_def tst_environment = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_CHEAP,
 	.registered = tst_environment_registered,
 	.validate = tst_environment_validate,
 	.generate = tst_environment_generate
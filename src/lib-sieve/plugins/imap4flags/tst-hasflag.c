@@ -39,6 +39,7 @@ const struct sieve_command_def tst_hasflag = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_CHEAP,
 	.registered = tst_hasflag_registered,
 	.validate = tst_hasflag_validate,
 	.generate = tst_hasflag_generate
@@ -64,6 +64,7 @@ struct ext_include_binary_context {
 	struct sieve_variable_scope_binary *global_vars;
 
 	bool outdated:1;
+	bool checked:1;
 };
 
 static struct ext_include_binary_context *ext_include_binary_create_context
@@ -239,137 +240,183 @@ static bool ext_include_binary_pre_save
 	return result;
 }
 
-static bool ext_include_binary_open
-(const struct sieve_extension *ext, struct sieve_binary *sbin, void *context)
+static int ext_include_binary_read_dependency
+(const struct sieve_extension *ext, struct sieve_binary *sbin,
+	struct sieve_binary_block *sblock, sieve_size_t *offset,
+	struct sieve_script **script_r, struct sieve_binary_block **inc_block_r,
+	unsigned int *location_r, unsigned int *flags_r)
 {
 	struct sieve_instance *svinst = ext->svinst;
-	struct ext_include_context *ext_ctx =
-		(struct ext_include_context *)ext->context;
-	struct ext_include_binary_context *binctx =
-		(struct ext_include_binary_context *) context;
-	struct sieve_binary_block *sblock;
-	unsigned int depcount, i, block_id;
-	sieve_size_t offset;
-
-	sblock = sieve_binary_extension_get_block(sbin, ext);
-	block_id = sieve_binary_block_get_id(sblock);
+	unsigned int block_id = sieve_binary_block_get_id(sblock);
+	unsigned int inc_block_id;
+	struct sieve_binary_block *inc_block = NULL;
+	unsigned int location, flags;
+	string_t *script_name;
+	struct sieve_storage *storage;
+	struct sieve_script *script;
+	enum sieve_error error = SIEVE_ERROR_NONE;
+	int ret;
 
-	offset = 0;
+	*script_r = NULL;
 
-	if ( !sieve_binary_read_unsigned(sblock, &offset, &depcount) ) {
+	if (
+		!sieve_binary_read_unsigned(sblock, offset, &inc_block_id) ||
+		!sieve_binary_read_byte(sblock, offset, &location) ||
+		!sieve_binary_read_string(sblock, offset, &script_name) ||
+		!sieve_binary_read_byte(sblock, offset, &flags) ) {
+		/* Binary is corrupt, recompile */
 		sieve_sys_error(svinst,
-			"include: failed to read include count "
-			"for dependency block %d of binary %s", block_id,
+			"include: failed to read included script "
+			"from dependency block %d of binary %s", block_id,
 			sieve_binary_path(sbin));
-		return FALSE;
+		return -1;
 	}
 
-	/* Check include limit */
-	if ( depcount > ext_ctx->max_includes ) {
+	if ( inc_block_id != 0 &&
+		(inc_block=sieve_binary_block_get(sbin, inc_block_id)) == NULL ) {
 		sieve_sys_error(svinst,
-			"include: binary %s includes too many scripts (%u > %u)",
-			sieve_binary_path(sbin), depcount, ext_ctx->max_includes);
-		return FALSE;
+			"include: failed to find block %d for included script "
+			"from dependency block %d of binary %s", inc_block_id, block_id,
+			sieve_binary_path(sbin));
+		return -1;
 	}
 
-	/* Read dependencies */
-	for ( i = 0; i < depcount; i++ ) {
-		unsigned int inc_block_id;
-		struct sieve_binary_block *inc_block = NULL;
-		unsigned int location, flags;
-		string_t *script_name;
-		struct sieve_storage *storage;
-		struct sieve_script *script;
-		enum sieve_error error;
-		int ret;
-
-		if (
-			!sieve_binary_read_unsigned(sblock, &offset, &inc_block_id) ||
-			!sieve_binary_read_byte(sblock, &offset, &location) ||
-			!sieve_binary_read_string(sblock, &offset, &script_name) ||
-			!sieve_binary_read_byte(sblock, &offset, &flags) ) {
-			/* Binary is corrupt, recompile */
-			sieve_sys_error(svinst,
-				"include: failed to read included script "
-				"from dependency block %d of binary %s", block_id,
-				sieve_binary_path(sbin));
-			return FALSE;
-		}
-
-		if ( inc_block_id != 0 &&
-			(inc_block=sieve_binary_block_get(sbin, inc_block_id)) == NULL ) {
-			sieve_sys_error(svinst,
-				"include: failed to find block %d for included script "
-				"from dependency block %d of binary %s", inc_block_id, block_id,
-				sieve_binary_path(sbin));
-			return FALSE;
-		}
+	if ( location >= EXT_INCLUDE_LOCATION_INVALID ) {
+		/* Binary is corrupt, recompile */
+		sieve_sys_error(svinst,
+			"include: dependency block %d of binary %s "
+			"uses invalid script location (id %d)",
+			block_id, sieve_binary_path(sbin), location);
+		return -1;
+	}
 
-		if ( location >= EXT_INCLUDE_LOCATION_INVALID ) {
-			/* Binary is corrupt, recompile */
-			sieve_sys_error(svinst,
-				"include: dependency block %d of binary %s "
-				"uses invalid script location (id %d)",
-				block_id, sieve_binary_path(sbin), location);
-			return FALSE;
-		}
+	/* Can we find the script dependency ? */
+	storage = ext_include_get_script_storage
+		(ext, location, str_c(script_name), &error);
+	if ( storage == NULL ) {
+		/* No, recompile */
+		// FIXME: handle ':optional' in this case
+		return -1;
+	}
 
-		/* Can we find the script dependency ? */
-		storage = ext_include_get_script_storage
-			(ext, location, str_c(script_name), &error);
-		if ( storage == NULL ) {
-			/* No, recompile */
-			// FIXME: handle ':optional' in this case
-			return FALSE;
-		}
+	/* Was the script dependency opened recently? */
+	script = sieve_script_cache_lookup(storage, str_c(script_name));
 
-		/* Can we open the script dependency ? */
+	/* Can we open the script dependency ? */
+	if ( script == NULL ) {
 		script = sieve_storage_get_script
 			(storage, str_c(script_name), &error);
 		if ( script == NULL ) {
 			/* No, recompile */
-			return FALSE;
+			return -1;
+		}
+		if ( sieve_script_open(script, &error) >= 0 )
+			sieve_script_cache_insert(script);
+	}
+	if ( !sieve_script_is_open(script) ) {
+		if ( error != SIEVE_ERROR_NOT_FOUND ) {
+			/* No, recompile */
+			sieve_script_unref(&script);
+			return -1;
 		}
-		if ( sieve_script_open(script, &error) < 0 ) {
-			if ( error != SIEVE_ERROR_NOT_FOUND ) {
-				/* No, recompile */
-				return FALSE;
-			}
-
-			if ( (flags & EXT_INCLUDE_FLAG_OPTIONAL) == 0 ) {
-				/* Not supposed to be missing, recompile */
-				if ( svinst->debug ) {
-					sieve_sys_debug(svinst,
-						"include: script '%s' included in binary %s is missing, "
-						"so recompile", str_c(script_name), sieve_binary_path(sbin));
-				}
-				return FALSE;
-			}
 
-		} else if (inc_block == NULL) {
-			/* Script exists, but it is missing from the binary, recompile no matter
-			 * what.
-			 */
+		if ( (flags & EXT_INCLUDE_FLAG_OPTIONAL) == 0 ) {
+			/* Not supposed to be missing, recompile */
 			if ( svinst->debug ) {
 				sieve_sys_debug(svinst,
-					"include: script '%s' is missing in binary %s, but is now available, "
+					"include: script '%s' included in binary %s is missing, "
 					"so recompile", str_c(script_name), sieve_binary_path(sbin));
 			}
 			sieve_script_unref(&script);
-			return FALSE;
+			return -1;
 		}
 
-		/* Can we read script metadata ? */
-		if ( (ret=sieve_script_binary_read_metadata
-			(script, sblock, &offset))	< 0 ) {
-			/* Binary is corrupt, recompile */
-			sieve_sys_error(svinst,
-				"include: dependency block %d of binary %s "
-				"contains invalid script metadata for script %s",
-				block_id, sieve_binary_path(sbin), sieve_script_location(script));
-			sieve_script_unref(&script);
-			return FALSE;
+	} else if (inc_block == NULL) {
+		/* Script exists, but it is missing from the binary, recompile no matter
+		 * what.
+		 */
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst,
+				"include: script '%s' is missing in binary %s, but is now available, "
+				"so recompile", str_c(script_name), sieve_binary_path(sbin));
 		}
+		sieve_script_unref(&script);
+		return -1;
+	}
+
+	/* Can we read script metadata ? */
+	if ( (ret=sieve_script_binary_read_metadata
+		(script, sblock, offset))	< 0 ) {
+		/* Binary is corrupt, recompile */
+		sieve_sys_error(svinst,
+			"include: dependency block %d of binary %s "
+			"contains invalid script metadata for script %s",
+			block_id, sieve_binary_path(sbin), sieve_script_location(script));
+		sieve_script_unref(&script);
+		return -1;
+	}
+
+	*script_r = script;
+	*inc_block_r = inc_block;
+	*location_r = location;
+	*flags_r = flags;
+	return ret;
+}
+
+static bool ext_include_binary_read_depcount
+(const struct sieve_extension *ext, struct sieve_binary *sbin,
+	struct sieve_binary_block *sblock, sieve_size_t *offset,
+	unsigned int *depcount_r)
+{
+	struct sieve_instance *svinst = ext->svinst;
+	struct ext_include_context *ext_ctx =
+		(struct ext_include_context *)ext->context;
+
+	if ( !sieve_binary_read_unsigned(sblock, offset, depcount_r) ) {
+		sieve_sys_error(svinst,
+			"include: failed to read include count "
+			"for dependency block %d of binary %s",
+			sieve_binary_block_get_id(sblock), sieve_binary_path(sbin));
+		return FALSE;
+	}
+
+	/* Check include limit */
+	if ( *depcount_r > ext_ctx->max_includes ) {
+		sieve_sys_error(svinst,
+			"include: binary %s includes too many scripts (%u > %u)",
+			sieve_binary_path(sbin), *depcount_r, ext_ctx->max_includes);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static bool ext_include_binary_open
+(const struct sieve_extension *ext, struct sieve_binary *sbin, void *context)
+{
+	struct ext_include_binary_context *binctx =
+		(struct ext_include_binary_context *) context;
+	struct sieve_binary_block *sblock;
+	unsigned int depcount, i;
+	sieve_size_t offset;
+
+	sblock = sieve_binary_extension_get_block(sbin, ext);
+
+	offset = 0;
+
+	if ( !ext_include_binary_read_depcount
+		(ext, sbin, sblock, &offset, &depcount) )
+		return FALSE;
+
+	/* Read dependencies */
+	for ( i = 0; i < depcount; i++ ) {
+		struct sieve_binary_block *inc_block;
+		unsigned int location, flags;
+		struct sieve_script *script;
+		int ret;
+
+		if ( (ret=ext_include_binary_read_dependency(ext, sbin, sblock,
+			&offset, &script, &inc_block, &location, &flags)) < 0 )
+			return FALSE;
 
 		if ( ret == 0 )
 			binctx->outdated = TRUE;
@@ -384,17 +431,61 @@ static bool ext_include_binary_open
 		(ext, sblock, &offset, &binctx->global_vars) )
 		return FALSE;
 
+	/* Dependencies were just checked */
+	binctx->checked = TRUE;
 	return TRUE;
 }
 
+static bool ext_include_binary_check_dependencies
+(const struct sieve_extension *ext, struct sieve_binary *sbin)
+{
+	struct sieve_binary_block *sblock;
+	unsigned int depcount, i;
+	sieve_size_t offset = 0;
+	bool result = TRUE;
+
+	sblock = sieve_binary_extension_get_block(sbin, ext);
+	if ( sblock == NULL ||
+		!ext_include_binary_read_depcount
+			(ext, sbin, sblock, &offset, &depcount) )
+		return FALSE;
+
+	for ( i = 0; result && i < depcount; i++ ) {
+		struct sieve_binary_block *inc_block;
+		unsigned int location, flags;
+		struct sieve_script *script;
+
+		if ( ext_include_binary_read_dependency(ext, sbin, sblock,
+			&offset, &script, &inc_block, &location, &flags) <= 0 )
+			result = FALSE;
+		if ( script != NULL )
+			sieve_script_unref(&script);
+	}
+	return result;
+}
+
 static bool ext_include_binary_up_to_date
-(const struct sieve_extension *ext ATTR_UNUSED,
-	struct sieve_binary *sbin ATTR_UNUSED, void *context,
+(const struct sieve_extension *ext, struct sieve_binary *sbin, void *context,
 	enum sieve_compile_flags cpflags ATTR_UNUSED)
 {
 	struct ext_include_binary_context *binctx =
 		(struct ext_include_binary_context *) context;
 
+	if ( binctx->outdated )
+		return FALSE;
+
+	/* Dependencies are checked when the binary is opened. A binary that is
+	   kept open for reuse needs to check them again the next time. */
+	if ( binctx->checked ) {
+		binctx->checked = FALSE;
+		return TRUE;
+	}
+
+	T_BEGIN {
+		if ( !ext_include_binary_check_dependencies(ext, sbin) )
+			binctx->outdated = TRUE;
+	} T_END;
+
 	return !binctx->outdated;
 }
 
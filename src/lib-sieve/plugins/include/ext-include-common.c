@@ -358,9 +358,22 @@ static int ext_include_runtime_init
 	return SIEVE_EXEC_OK;
 }
 
+static void ext_include_runtime_free
+(const struct sieve_extension *ext ATTR_UNUSED,
+	struct sieve_interpreter *interp ATTR_UNUSED, void *context)
+{
+	struct ext_include_interpreter_context *ctx =
+		(struct ext_include_interpreter_context *) context;
+
+	/* The global variables are shared by all included scripts */
+	if ( ctx->parent == NULL && ctx->global != NULL )
+		sieve_variable_storage_free(&ctx->global->var_storage);
+}
+
 static struct sieve_interpreter_extension include_interpreter_extension = {
 	.ext_def = &include_extension,
-	.run = ext_include_runtime_init
+	.run = ext_include_runtime_init,
+	.free = ext_include_runtime_free
 };
 
 /*
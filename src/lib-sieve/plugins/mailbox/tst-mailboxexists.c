@@ -38,6 +38,7 @@ const struct sieve_command_def mailboxexists_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_EXPENSIVE,
 	.validate = tst_mailboxexists_validate,
 	.generate = tst_mailboxexists_generate
 };
@@ -54,6 +54,7 @@ const struct sieve_command_def metadata_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_EXPENSIVE,
 	.registered = tst_metadata_registered,
 	.validate = tst_metadata_validate,
 	.generate = tst_metadata_generate,
@@ -73,6 +74,7 @@ const struct sieve_command_def servermetadata_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_EXPENSIVE,
 	.registered = tst_metadata_registered,
 	.validate = tst_metadata_validate,
 	.generate = tst_metadata_generate
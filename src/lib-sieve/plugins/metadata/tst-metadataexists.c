@@ -50,6 +50,7 @@ const struct sieve_command_def metadataexists_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_EXPENSIVE,
 	.validate = tst_metadataexists_validate,
 	.generate = tst_metadataexists_generate,
 };
@@ -67,6 +68,7 @@ const struct sieve_command_def servermetadataexists_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_EXPENSIVE,
 	.validate = tst_metadataexists_validate,
 	.generate = tst_metadataexists_generate,
 };
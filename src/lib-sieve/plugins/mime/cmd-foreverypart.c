@@ -12,6 +12,7 @@
 #include "sieve-binary.h"
 #include "sieve-dump.h"
 #include "sieve-message.h"
+#include "sieve-manifest.h"
 
 #include "ext-mime-common.h"
 
@@ -179,6 +180,9 @@ static bool cmd_foreverypart_validate
 		return FALSE;
 	}
 
+	/* Message parts are read from the body */
+	sieve_manifest_add_flags(sieve_ast_manifest(cmd->ast_node->ast),
+		SIEVE_MANIFEST_FLAG_BODY);
 	return TRUE;
 }
 
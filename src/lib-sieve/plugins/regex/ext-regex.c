@@ -12,10 +12,11 @@
  */
 
 /* FIXME: Regular expressions are compiled during compilation and
- * again during interpretation. This is suboptimal and should be
- * changed. This requires dumping the compiled regex to the binary.
- * Most likely, this will only be possible when we implement regular
- * expressions ourselves.
+ * again during interpretation. At runtime, regular expressions from
+ * constant keys are compiled only once and cached for as long as the
+ * binary is loaded. Avoiding the compilation entirely requires dumping
+ * the compiled regex to the binary. Most likely, this will only be
+ * possible when we implement regular expressions ourselves.
  *
  */
 
@@ -8,16 +8,20 @@
 #include "mempool.h"
 #include "buffer.h"
 #include "array.h"
+#include "hash.h"
 #include "str.h"
 #include "str-sanitize.h"
+#include "str-slice.h"
 
 #include "sieve-common.h"
 #include "sieve-limits.h"
 #include "sieve-ast.h"
 #include "sieve-stringlist.h"
 #include "sieve-commands.h"
+#include "sieve-binary.h"
 #include "sieve-validator.h"
 #include "sieve-interpreter.h"
+#include "sieve-runtime-trace.h"
 #include "sieve-comparators.h"
 #include "sieve-match-types.h"
 #include "sieve-match.h"
@@ -166,16 +170,163 @@ static bool mcht_regex_validate_context
 }
 
 /*
- * Match type implementation
+ * Regex cache
+ */
+
+/* Regular expressions from constant keys are compiled only once for as long as
+ * the binary is loaded. The compiled expressions are cached in the binary,
+ * indexed by the pattern and the compile flags.
  */
 
 struct mcht_regex_key {
+	const char *pattern;
+	int cflags;
+
 	regex_t regexp;
+	const char *error;
 	int status;
+
+	/* Owned by the match context rather than the binary cache */
+	bool temporary:1;
 };
 
+struct mcht_regex_binary_context {
+	HASH_TABLE(const struct mcht_regex_key *,
+		struct mcht_regex_key *) regexps;
+
+	unsigned int hits, misses;
+};
+
+static unsigned int mcht_regex_key_hash(const struct mcht_regex_key *rkey)
+{
+	return str_hash(rkey->pattern) ^ (unsigned int)rkey->cflags;
+}
+
+static int mcht_regex_key_cmp
+(const struct mcht_regex_key *rkey1, const struct mcht_regex_key *rkey2)
+{
+	if ( rkey1->cflags != rkey2->cflags )
+		return ( rkey1->cflags < rkey2->cflags ? -1 : 1 );
+	return strcmp(rkey1->pattern, rkey2->pattern);
+}
+
+static void mcht_regex_binary_free
+(const struct sieve_extension *ext ATTR_UNUSED,
+	struct sieve_binary *sbin, void *context)
+{
+	struct mcht_regex_binary_context *bctx =
+		(struct mcht_regex_binary_context *) context;
+	struct sieve_instance *svinst = sieve_binary_svinst(sbin);
+	struct hash_iterate_context *hctx;
+	const struct mcht_regex_key *key;
+	struct mcht_regex_key *rkey;
+
+	if ( svinst->debug && (bctx->hits > 0 || bctx->misses > 0) ) {
+		sieve_sys_debug(svinst,
+			"regex: binary %s: compiled regex cache: %u hits, %u misses",
+			sieve_binary_source(sbin), bctx->hits, bctx->misses);
+	}
+
+	hctx = hash_table_iterate_init(bctx->regexps);
+	while ( hash_table_iterate(hctx, bctx->regexps, &key, &rkey) ) {
+		if ( rkey->status > 0 )
+			regfree(&rkey->regexp);
+	}
+	hash_table_iterate_deinit(&hctx);
+
+	hash_table_destroy(&bctx->regexps);
+}
+
+static const struct sieve_binary_extension regex_binary_ext = {
+	.extension = &regex_extension,
+	.binary_free = mcht_regex_binary_free
+};
+
+static struct mcht_regex_binary_context *mcht_regex_binary_get_context
+(const struct sieve_extension *this_ext, struct sieve_binary *sbin)
+{
+	struct mcht_regex_binary_context *bctx =
+		(struct mcht_regex_binary_context *)
+			sieve_binary_extension_get_context(sbin, this_ext);
+
+	if ( bctx == NULL ) {
+		bctx = p_new(sieve_binary_pool(sbin),
+			struct mcht_regex_binary_context, 1);
+		hash_table_create(&bctx->regexps, default_pool, 0,
+			mcht_regex_key_hash, mcht_regex_key_cmp);
+
+		sieve_binary_extension_set(sbin, this_ext, &regex_binary_ext, bctx);
+	}
+
+	return bctx;
+}
+
+static void mcht_regex_key_compile
+(const struct sieve_runtime_env *renv, pool_t pool,
+	struct mcht_regex_key *rkey)
+{
+	int rxret;
+
+	if ( (rxret=regcomp(&rkey->regexp, rkey->pattern, rkey->cflags)) != 0 ) {
+		rkey->error = p_strdup(pool, _regexp_error(&rkey->regexp, rxret));
+		regfree(&rkey->regexp);
+		rkey->status = -1;
+
+		sieve_runtime_trace(renv, SIEVE_TRLVL_MATCHING,
+			"failed to compile regex `%s'", str_sanitize(rkey->pattern, 80));
+	} else {
+		rkey->status = 1;
+	}
+}
+
+static struct mcht_regex_key *mcht_regex_key_get
+(struct sieve_match_context *mctx, const char *regex_str, int cflags)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	const struct sieve_extension *this_ext = mctx->match_type->object.ext;
+	struct mcht_regex_binary_context *bctx;
+	struct mcht_regex_key lookup, *rkey;
+	pool_t pool;
+
+	if ( !sieve_match_key_is_constant(renv, regex_str) ) {
+		/* Regular expression composed at runtime; compile it just for this
+		   match */
+		rkey = p_new(mctx->pool, struct mcht_regex_key, 1);
+		rkey->pattern = p_strdup(mctx->pool, regex_str);
+		rkey->cflags = cflags;
+		rkey->temporary = TRUE;
+		mcht_regex_key_compile(renv, mctx->pool, rkey);
+		return rkey;
+	}
+
+	bctx = mcht_regex_binary_get_context(this_ext, renv->sbin);
+
+	i_zero(&lookup);
+	lookup.pattern = regex_str;
+	lookup.cflags = cflags;
+	if ( (rkey=hash_table_lookup(bctx->regexps, &lookup)) != NULL ) {
+		bctx->hits++;
+		return rkey;
+	}
+
+	bctx->misses++;
+
+	pool = sieve_binary_pool(renv->sbin);
+	rkey = p_new(pool, struct mcht_regex_key, 1);
+	rkey->pattern = p_strdup(pool, regex_str);
+	rkey->cflags = cflags;
+	mcht_regex_key_compile(renv, pool, rkey);
+
+	hash_table_insert(bctx->regexps, rkey, rkey);
+	return rkey;
+}
+
+/*
+ * Match type implementation
+ */
+
 struct mcht_regex_context {
-	ARRAY(struct mcht_regex_key) reg_expressions;
+	ARRAY(struct mcht_regex_key *) reg_expressions;
 	regmatch_t *pmatch;
 	size_t nmatch;
 	bool all_compiled:1;
@@ -219,31 +370,38 @@ static int mcht_regex_match_key
 	if ( ret == 0 ) {
 		if ( ctx->nmatch > 0 ) {
 			struct sieve_match_values *mvalues;
+			struct str_slice *matched;
+			regoff_t offset = ctx->pmatch[0].rm_so;
 			size_t i;
 			int skipped = 0;
-			string_t *subst = t_str_new(32);
 
 			/* Start new list of match values */
 			mvalues = sieve_match_values_start(mctx->runenv);
 
 			i_assert( mvalues != NULL );
 
+			/* Copy the matched part of the value once; the groups all
+			   lie within it, so these refer to this copy. A group that
+			   does not extend to the end of the match is still copied
+			   when it is needed as a (NUL-terminated) string. */
+			matched = str_slice_create
+				(val + offset, ctx->pmatch[0].rm_eo - offset);
+
 			/* Add match values from regular expression */
 			for ( i = 0; i < ctx->nmatch; i++ ) {
-				str_truncate(subst, 0);
-
 				if ( ctx->pmatch[i].rm_so != -1 ) {
 					if ( skipped > 0 ) {
 						sieve_match_values_skip(mvalues, skipped);
 						skipped = 0;
 					}
 
-					str_append_data(subst, val + ctx->pmatch[i].rm_so,
+					sieve_match_values_add_slice(mvalues, matched,
+						ctx->pmatch[i].rm_so - offset,
 						ctx->pmatch[i].rm_eo - ctx->pmatch[i].rm_so);
-					sieve_match_values_add(mvalues, subst);
 				} else
 					skipped++;
 			}
+			str_slice_unref(&matched);
 
 			/* Substitute the new match values */
 			sieve_match_values_commit(mctx->runenv, &mvalues);
@@ -255,22 +413,57 @@ static int mcht_regex_match_key
 	return 0;
 }
 
+static int mcht_regex_match_compiled_key
+(struct sieve_match_context *mctx, const char *val,
+	const struct mcht_regex_key *rkey, unsigned int id)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	int match;
+
+	if ( rkey->status < 0 ) {
+		sieve_runtime_error(renv, NULL,
+			"invalid regular expression '%s' for regex match: %s",
+			str_sanitize(rkey->pattern, 128), rkey->error);
+		return 0;
+	}
+
+	match = mcht_regex_match_key(mctx, val, &rkey->regexp);
+
+	if ( mctx->trace ) {
+		sieve_runtime_trace(renv, 0,
+			"with %sregex `%s' [id=%d] => %d",
+			( rkey->temporary ? "" : "cached " ),
+			str_sanitize(rkey->pattern, 80), id, match);
+	}
+	return match;
+}
+
 static int mcht_regex_match_keys
 (struct sieve_match_context *mctx, const char *val, size_t val_size ATTR_UNUSED,
 	struct sieve_stringlist *key_list)
 {
-	const struct sieve_runtime_env *renv = mctx->runenv;
-	bool trace = sieve_runtime_trace_active(renv, SIEVE_TRLVL_MATCHING);
 	struct mcht_regex_context *ctx = (struct mcht_regex_context *) mctx->data;
 	const struct sieve_comparator *cmp = mctx->comparator;
+	struct mcht_regex_key *const *rkeys;
+	unsigned int i, count;
 	int match;
 
 	if ( !ctx->all_compiled ) {
 		string_t *key_item = NULL;
-		unsigned int i;
-		int ret;
+		int cflags, ret;
+
+		/* Configure case-sensitivity according to comparator */
+		if ( sieve_comparator_is(cmp, i_octet_comparator) )
+			cflags =  REG_EXTENDED;
+		else if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) )
+			cflags =  REG_EXTENDED | REG_ICASE;
+		else
+			return 0; /* Not supported */
+
+		/* Indicate whether match values need to be produced */
+		if ( ctx->nmatch == 0 ) cflags |= REG_NOSUB;
 
-		/* Regular expressions still need to be compiled */
+		/* Regular expressions still need to be obtained */
 
 		if ( !array_is_created(&ctx->reg_expressions) )
 			p_array_init(&ctx->reg_expressions, mctx->pool, 16);
@@ -279,55 +472,17 @@ static int mcht_regex_match_keys
 		match = 0;
 		while ( match == 0 &&
 			(ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
-
 			T_BEGIN {
 				struct mcht_regex_key *rkey;
 
 				if ( i >= array_count(&ctx->reg_expressions) ) {
-					int cflags;
-
-					rkey = array_append_space(&ctx->reg_expressions);
-
-					/* Configure case-sensitivity according to comparator */
-					if ( sieve_comparator_is(cmp, i_octet_comparator) )
-						cflags =  REG_EXTENDED;
-					else if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) )
-						cflags =  REG_EXTENDED | REG_ICASE;
-					else
-						rkey->status = -1; /* Not supported */
-
-					if ( rkey->status >= 0 ) {
-						const char *regex_str = str_c(key_item);
-						int rxret;
-
-						/* Indicate whether match values need to be produced */
-						if ( ctx->nmatch == 0 ) cflags |= REG_NOSUB;
-
-						/* Compile regular expression */
-						if ( (rxret=regcomp(&rkey->regexp, regex_str, cflags)) != 0 ) {
-							sieve_runtime_error(renv, NULL,
-								"invalid regular expression '%s' for regex match: %s",
-								str_sanitize(regex_str, 128),
-								_regexp_error(&rkey->regexp, rxret));
-							rkey->status = -1;
-						} else {
-							rkey->status = 1;
-						}
-					}
+					rkey = mcht_regex_key_get(mctx, str_c(key_item), cflags);
+					array_append(&ctx->reg_expressions, &rkey, 1);
 				} else {
-					rkey = array_idx_modifiable(&ctx->reg_expressions, 1);
+					rkey = *array_idx(&ctx->reg_expressions, i);
 				}
 
-				if ( rkey->status > 0 ) {
-					match = mcht_regex_match_key(mctx, val, &rkey->regexp);
-
-					if ( trace ) {
-						sieve_runtime_trace(renv, 0,
-							"with regex `%s' [id=%d] => %d",
-							str_sanitize(str_c(key_item), 80),
-							array_count(&ctx->reg_expressions)-1, match);
-					}
-				}
+				match = mcht_regex_match_compiled_key(mctx, val, rkey, i);
 			} T_END;
 
 			i++;
@@ -340,29 +495,16 @@ static int mcht_regex_match_keys
 			match = -1;
 		}
 
-	} else {
-		const struct mcht_regex_key *rkeys;
-		unsigned int i, count;
-
-		/* Regular expressions are compiled */
-
-		rkeys = array_get(&ctx->reg_expressions, &count);
+		return match;
+	}
 
-		i = 0;
-		match = 0;
-		while ( match == 0 && i < count ) {
-			if ( rkeys[i].status > 0 ) {
-				match = mcht_regex_match_key(mctx, val, &rkeys[i].regexp);
+	/* Regular expressions are compiled */
 
-				if ( trace ) {
-					sieve_runtime_trace(renv, 0,
-						"with compiled regex [id=%d] => %d", i, match);
-				}
-			}
+	rkeys = array_get(&ctx->reg_expressions, &count);
 
-			i++;
-		}
-	}
+	match = 0;
+	for ( i = 0; match == 0 && i < count; i++ )
+		match = mcht_regex_match_compiled_key(mctx, val, rkeys[i], i);
 
 	return match;
 }
@@ -371,15 +513,15 @@ void mcht_regex_match_deinit
 (struct sieve_match_context *mctx)
 {
 	struct mcht_regex_context *ctx = (struct mcht_regex_context *) mctx->data;
-	struct mcht_regex_key *rkeys;
+	struct mcht_regex_key *const *rkeys;
 	unsigned int count, i;
 
-	/* Clean up compiled regular expressions */
+	/* Clean up regular expressions that are not cached in the binary */
 	if ( array_is_created(&ctx->reg_expressions) ) {
-		rkeys = array_get_modifiable(&ctx->reg_expressions, &count);
+		rkeys = array_get(&ctx->reg_expressions, &count);
 		for ( i = 0; i < count; i++ ) {
-			regfree(&rkeys[i].regexp);
+			if ( rkeys[i]->temporary && rkeys[i]->status > 0 )
+				regfree(&rkeys[i]->regexp);
 		}
 	}
 }
-
@@ -44,6 +44,7 @@ const struct sieve_command_def spamtest_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_EXPENSIVE,
 	.registered = tst_spamvirustest_registered,
 	.validate = tst_spamvirustest_validate,
 	.generate = tst_spamvirustest_generate
@@ -62,6 +63,7 @@ const struct sieve_command_def virustest_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_EXPENSIVE,
 	.registered = tst_spamvirustest_registered,
 	.validate = tst_spamvirustest_validate,
 	.generate = tst_spamvirustest_generate
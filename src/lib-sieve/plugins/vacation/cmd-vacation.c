@@ -13,6 +13,7 @@
 #include "var-expand.h"
 #include "ioloop.h"
 #include "mail-storage.h"
+#include "mail-user.h"
 
 #include "rfc2822.h"
 
@@ -846,7 +847,7 @@ static inline bool _is_system_address
 }
 
 static inline bool _contains_my_address
-(const char * const *headers,
+(struct sieve_message_context *msgctx, const char * const *headers,
 	const struct smtp_address *my_address)
 {
 	const char *const *hdsp = headers;
@@ -855,25 +856,21 @@ static inline bool _contains_my_address
 	while ( *hdsp != NULL && !result ) {
 		const struct message_address *msg_addr;
 
-		T_BEGIN {
-			msg_addr = message_address_parse
-				(pool_datastack_create(), (const unsigned char *) *hdsp,
-					strlen(*hdsp), 256, 0);
-			while ( msg_addr != NULL && !result ) {
-				if (msg_addr->domain != NULL) {
-					struct smtp_address addr;
-
-					i_assert(msg_addr->mailbox != NULL);
-					if ( smtp_address_init_from_msg(&addr, msg_addr) >= 0 &&
-						smtp_address_equals(&addr, my_address) ) {
-						result = TRUE;
-						break;
-					}
-				}
+		msg_addr = sieve_message_get_addresses(msgctx, *hdsp);
+		while ( msg_addr != NULL && !result ) {
+			if (msg_addr->domain != NULL) {
+				struct smtp_address addr;
 
-				msg_addr = msg_addr->next;
+				i_assert(msg_addr->mailbox != NULL);
+				if ( smtp_address_init_from_msg(&addr, msg_addr) >= 0 &&
+					smtp_address_equals(&addr, my_address) ) {
+					result = TRUE;
+					break;
+				}
 			}
-		} T_END;
+
+			msg_addr = msg_addr->next;
+		}
 
 		hdsp++;
 	}
@@ -915,9 +912,7 @@ static int _get_full_reply_recipient
 		if ( ret > 0 && header != NULL ) {
 			const struct message_address *addr;
 
-			addr = message_address_parse
-				(pool_datastack_create(), (const unsigned char *) header,
-					strlen(header), 256, 0);
+			addr = sieve_message_get_addresses(aenv->msgctx, header);
 
 			while ( addr != NULL ) {
 				if ( addr->domain != NULL && !addr->invalid_syntax ) {
@@ -1151,6 +1146,77 @@ static void act_vacation_hash
 	md5_final(&ctx, hash_r);
 }
 
+/* Checking for earlier replies */
+
+static void act_vacation_filter_key
+(const struct sieve_script_env *senv,
+	const unsigned char dupl_hash[MD5_RESULTLEN],
+	unsigned char key_r[MD5_RESULTLEN])
+{
+	const char *username =
+		( senv->user == NULL ? "" : senv->user->username );
+	struct md5_context ctx;
+
+	/* The duplicate database is per user, the filter is shared */
+	md5_init(&ctx);
+	md5_update(&ctx, dupl_hash, MD5_RESULTLEN);
+	md5_update(&ctx, username, strlen(username));
+	md5_final(&ctx, key_r);
+}
+
+static bool act_vacation_replied_before
+(const struct sieve_extension *ext, const struct sieve_script_env *senv,
+	const unsigned char dupl_hash[MD5_RESULTLEN])
+{
+	const struct ext_vacation_config *config =
+		(const struct ext_vacation_config *) ext->context;
+	struct ext_vacation_filter *filter = ext_vacation_get_filter(ext);
+	unsigned char key[MD5_RESULTLEN];
+	bool replied;
+
+	if ( filter == NULL ) {
+		return sieve_action_duplicate_check
+			(senv, dupl_hash, MD5_RESULTLEN);
+	}
+
+	act_vacation_filter_key(senv, dupl_hash, key);
+	switch ( ext_vacation_filter_lookup(filter, key) ) {
+	case EXT_VACATION_FILTER_REPLIED:
+		return TRUE;
+	case EXT_VACATION_FILTER_NOT_REPLIED:
+		return FALSE;
+	case EXT_VACATION_FILTER_UNKNOWN:
+		break;
+	}
+
+	/* Ask the duplicate database and remember its answer for a while */
+	replied = sieve_action_duplicate_check(senv, dupl_hash, MD5_RESULTLEN);
+	if ( replied ) {
+		ext_vacation_filter_mark_replied
+			(filter, key, ioloop_time + config->filter_ttl);
+	} else {
+		ext_vacation_filter_mark_not_replied
+			(filter, key, ioloop_time + config->filter_ttl);
+	}
+	return replied;
+}
+
+static void act_vacation_mark_replied
+(const struct sieve_extension *ext, const struct sieve_action_exec_env *aenv,
+	const unsigned char dupl_hash[MD5_RESULTLEN], time_t until)
+{
+	const struct sieve_script_env *senv = aenv->scriptenv;
+	struct ext_vacation_filter *filter = ext_vacation_get_filter(ext);
+	unsigned char key[MD5_RESULTLEN];
+
+	sieve_result_duplicate_mark(aenv, dupl_hash, MD5_RESULTLEN, until);
+
+	if ( filter != NULL && sieve_action_duplicate_check_available(senv) ) {
+		act_vacation_filter_key(senv, dupl_hash, key);
+		ext_vacation_filter_mark_replied(filter, key, until);
+	}
+}
+
 static int act_vacation_commit
 (const struct sieve_action *action, const struct sieve_action_exec_env *aenv,
 	void *tr_context ATTR_UNUSED, bool *keep ATTR_UNUSED)
@@ -1230,8 +1296,7 @@ static int act_vacation_commit
 		act_vacation_hash(ctx,
 			smtp_address_encode(sender), dupl_hash);
 
-		if ( sieve_action_duplicate_check
-			(senv, dupl_hash, sizeof(dupl_hash)) )
+		if ( act_vacation_replied_before(ext, senv, dupl_hash) )
 		{
 			sieve_result_global_log(aenv,
 				"discarded duplicate vacation response to <%s>",
@@ -1362,7 +1427,7 @@ static int act_vacation_commit
 		if ( ret > 0 && headers[0] != NULL ) {
 
 			/* Final recipient directly listed in headers? */
-			if ( _contains_my_address(headers, recipient) ) {
+			if ( _contains_my_address(aenv->msgctx, headers, recipient) ) {
 				smtp_from = recipient;
 				message_address_init_from_smtp(&reply_from,
 					NULL, recipient);
@@ -1371,7 +1436,7 @@ static int act_vacation_commit
 
 			/* Original recipient directly listed in headers? */
 			if ( !smtp_address_isnull(orig_recipient) &&
-				_contains_my_address(headers, orig_recipient) ) {
+				_contains_my_address(aenv->msgctx, headers, orig_recipient) ) {
 				smtp_from = orig_recipient;
 				message_address_init_from_smtp(&reply_from,
 					NULL, orig_recipient);
@@ -1385,7 +1450,8 @@ static int act_vacation_commit
 
 				my_address = ctx->addresses;
 				while ( !found && *my_address != NULL ) {
-					if ( (found=_contains_my_address(headers, *my_address)) ) {
+					if ( (found=_contains_my_address
+						(aenv->msgctx, headers, *my_address)) ) {
 						/* Avoid letting user determine SMTP sender directly */
 						smtp_from =
 							( orig_recipient == NULL ? recipient : orig_recipient );
@@ -1401,7 +1467,7 @@ static int act_vacation_commit
 			/* Explicitly-configured user email address directly listed in
 			   headers? */
 			if ( user_email != NULL &&
-				_contains_my_address(headers, user_email) ) {
+				_contains_my_address(aenv->msgctx, headers, user_email) ) {
 				smtp_from = user_email;
 				message_address_init_from_smtp(&reply_from,
 					NULL, smtp_from);
@@ -1471,8 +1537,8 @@ static int act_vacation_commit
 
 		/* Mark as replied */
 		if ( seconds > 0  ) {
-			sieve_action_duplicate_mark
-				(senv, dupl_hash, sizeof(dupl_hash), ioloop_time + seconds);
+			act_vacation_mark_replied
+				(ext, aenv, dupl_hash, ioloop_time + seconds);
 		}
 	}
 
@@ -20,6 +20,9 @@ bool ext_vacation_load
 		to_header_ignore_envelope;
 	unsigned long long max_subject_codepoints;
 	const char *default_subject, *default_subject_template;
+	const char *filter_path;
+	unsigned long long filter_slots;
+	sieve_number_t filter_ttl;
 
 	if ( *context != NULL ) {
 		ext_vacation_unload(ext);
@@ -84,6 +87,20 @@ bool ext_vacation_load
 		to_header_ignore_envelope = FALSE;
 	}
 
+	filter_path = sieve_setting_get
+		(svinst, "sieve_vacation_suppression_filter");
+
+	if ( !sieve_setting_get_uint_value(svinst,
+		"sieve_vacation_suppression_filter_slots", &filter_slots) ||
+		filter_slots == 0 || filter_slots > (1 << 24) ) {
+		filter_slots = EXT_VACATION_DEFAULT_FILTER_SLOTS;
+	}
+
+	if ( !sieve_setting_get_duration_value(svinst,
+		"sieve_vacation_suppression_filter_ttl", &filter_ttl) ) {
+		filter_ttl = EXT_VACATION_DEFAULT_FILTER_TTL;
+	}
+
 	config = i_new(struct ext_vacation_config, 1);
 	config->min_period = min_period;
 	config->max_period = max_period;
@@ -95,6 +112,9 @@ bool ext_vacation_load
 	config->dont_check_recipient = dont_check_recipient;
 	config->send_from_recipient = send_from_recipient;
 	config->to_header_ignore_envelope = to_header_ignore_envelope;
+	config->filter_path = i_strdup_empty(filter_path);
+	config->filter_slots = (unsigned int)filter_slots;
+	config->filter_ttl = (unsigned int)filter_ttl;
 
 	*context = (void *) config;
 
@@ -107,7 +127,31 @@ void ext_vacation_unload
 	struct ext_vacation_config *config =
 		(struct ext_vacation_config *) ext->context;
 
+	ext_vacation_filter_close(&config->filter);
+	i_free(config->filter_path);
 	i_free(config->default_subject);
 	i_free(config->default_subject_template);
 	i_free(config);
 }
+
+struct ext_vacation_filter *ext_vacation_get_filter
+(const struct sieve_extension *ext)
+{
+	struct ext_vacation_config *config =
+		(struct ext_vacation_config *) ext->context;
+
+	if ( config->filter_path == NULL || config->filter_ttl == 0 )
+		return NULL;
+
+	/* Only Sieve instances that actually execute vacation actions open the
+	   filter. Since there is an instance for every delivery, the file is
+	   mapped (and a failure to open it is logged) once per delivery; this
+	   merely avoids retrying for every further vacation action within the
+	   same delivery. */
+	if ( config->filter == NULL && !config->filter_failed ) {
+		config->filter = ext_vacation_filter_open
+			(ext->svinst, config->filter_path, config->filter_slots);
+		config->filter_failed = ( config->filter == NULL );
+	}
+	return config->filter;
+}
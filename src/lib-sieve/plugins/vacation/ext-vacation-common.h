@@ -1,6 +1,8 @@
 #ifndef EXT_VACATION_COMMON_H
 #define EXT_VACATION_COMMON_H
 
+#include "md5.h"
+
 #include "sieve-common.h"
 
 /*
@@ -11,6 +13,8 @@
 #define EXT_VACATION_DEFAULT_MIN_PERIOD (24*60*60)
 #define EXT_VACATION_DEFAULT_MAX_PERIOD 0
 #define EXT_VACATION_DEFAULT_MAX_SUBJECT_CODEPOINTS 256
+#define EXT_VACATION_DEFAULT_FILTER_SLOTS 65536
+#define EXT_VACATION_DEFAULT_FILTER_TTL (5*60)
 
 struct ext_vacation_config {
 	unsigned int min_period;
@@ -23,8 +27,45 @@ struct ext_vacation_config {
 	bool dont_check_recipient;
 	bool send_from_recipient;
 	bool to_header_ignore_envelope;
+
+	/* Suppression filter (opened on first use) */
+	char *filter_path;
+	unsigned int filter_slots;
+	unsigned int filter_ttl;
+	struct ext_vacation_filter *filter;
+	bool filter_failed;
 };
 
+/*
+ * Suppression filter
+ */
+
+enum ext_vacation_filter_result {
+	/* Not in the filter; consult the duplicate database */
+	EXT_VACATION_FILTER_UNKNOWN = 0,
+	/* A reply was sent recently */
+	EXT_VACATION_FILTER_REPLIED,
+	/* The duplicate database recently said no reply was sent */
+	EXT_VACATION_FILTER_NOT_REPLIED
+};
+
+struct ext_vacation_filter *ext_vacation_filter_open
+	(struct sieve_instance *svinst, const char *path, unsigned int slot_count);
+void ext_vacation_filter_close(struct ext_vacation_filter **_filter);
+
+enum ext_vacation_filter_result ext_vacation_filter_lookup
+	(struct ext_vacation_filter *filter,
+		const unsigned char key[MD5_RESULTLEN]);
+void ext_vacation_filter_mark_replied
+	(struct ext_vacation_filter *filter,
+		const unsigned char key[MD5_RESULTLEN], time_t until);
+void ext_vacation_filter_mark_not_replied
+	(struct ext_vacation_filter *filter,
+		const unsigned char key[MD5_RESULTLEN], time_t until);
+
+struct ext_vacation_filter *ext_vacation_get_filter
+	(const struct sieve_extension *ext);
+
 /*
  * Commands
  */
@@ -0,0 +1,303 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "crc32.h"
+#include "md5.h"
+#include "eacces-error.h"
+#include "ioloop.h"
+
+#include "sieve-common.h"
+#include "sieve-error.h"
+
+#include "ext-vacation-common.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/*
+ * Suppression filter
+ *
+ *   A fixed-size hash table in a file that is mapped into memory by all
+ *   processes performing deliveries. It remembers for a limited time whether
+ *   the duplicate database recently said that a reply was or was not sent
+ *   already, so that floods of messages to the same recipient do not cause a
+ *   duplicate database lookup for every single one of them. Slots are updated
+ *   without locking; a checksum allows readers to detect (and ignore) slots
+ *   that are being written concurrently. Anything that is not found in the
+ *   filter is looked up in the duplicate database, which stays authoritative.
+ */
+
+#define EXT_VACATION_FILTER_MAGIC 0x56414346 /* "VACF" */
+#define EXT_VACATION_FILTER_VERSION 1
+
+/* Number of slots examined for each key */
+#define EXT_VACATION_FILTER_PROBES 4
+
+struct ext_vacation_filter_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_count;
+	uint32_t unused;
+};
+
+struct ext_vacation_filter_slot {
+	unsigned char key[MD5_RESULTLEN];
+	uint64_t replied_until;
+	uint64_t checked_until;
+
+	/* CRC32 of the fields above */
+	uint32_t checksum;
+	uint32_t unused;
+};
+
+struct ext_vacation_filter {
+	struct sieve_instance *svinst;
+	char *path;
+
+	void *mmap_base;
+	size_t mmap_size;
+
+	struct ext_vacation_filter_header *hdr;
+	struct ext_vacation_filter_slot *slots;
+	unsigned int slot_count;
+};
+
+static size_t ext_vacation_filter_size(unsigned int slot_count)
+{
+	return sizeof(struct ext_vacation_filter_header) +
+		slot_count * sizeof(struct ext_vacation_filter_slot);
+}
+
+static int ext_vacation_filter_map
+(struct ext_vacation_filter *filter, int fd, unsigned int slot_count)
+{
+	struct sieve_instance *svinst = filter->svinst;
+	struct ext_vacation_filter_header *hdr;
+	struct stat st;
+
+	if ( fstat(fd, &st) < 0 ) {
+		sieve_sys_error(svinst, "vacation filter: "
+			"fstat(%s) failed: %m", filter->path);
+		return -1;
+	}
+
+	/* New file: size it for the configured number of slots. When several
+	   processes do this at once, they all end up with the same result. */
+	if ( st.st_size == 0 ) {
+		st.st_size = ext_vacation_filter_size(slot_count);
+		if ( ftruncate(fd, st.st_size) < 0 ) {
+			sieve_sys_error(svinst, "vacation filter: "
+				"ftruncate(%s) failed: %m", filter->path);
+			return -1;
+		}
+	}
+
+	if ( (uoff_t)st.st_size < sizeof(*hdr) ||
+		(uoff_t)st.st_size > SSIZE_T_MAX ) {
+		sieve_sys_error(svinst, "vacation filter: "
+			"%s has invalid size %"PRIuUOFF_T, filter->path,
+			(uoff_t)st.st_size);
+		return -1;
+	}
+
+	filter->mmap_size = (size_t)st.st_size;
+	filter->mmap_base = mmap(NULL, filter->mmap_size,
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if ( filter->mmap_base == MAP_FAILED ) {
+		filter->mmap_base = NULL;
+		sieve_sys_error(svinst, "vacation filter: "
+			"mmap(%s) failed: %m", filter->path);
+		return -1;
+	}
+
+	hdr = filter->hdr = filter->mmap_base;
+	if ( hdr->magic == 0 && hdr->slot_count == 0 &&
+		filter->mmap_size == ext_vacation_filter_size(slot_count) ) {
+		hdr->version = EXT_VACATION_FILTER_VERSION;
+		hdr->slot_count = slot_count;
+		hdr->magic = EXT_VACATION_FILTER_MAGIC;
+	}
+
+	/* The file determines the number of slots; the setting only applies to
+	   files that are created */
+	if ( hdr->magic != EXT_VACATION_FILTER_MAGIC ||
+		hdr->version != EXT_VACATION_FILTER_VERSION ||
+		hdr->slot_count == 0 ||
+		ext_vacation_filter_size(hdr->slot_count) > filter->mmap_size ) {
+		sieve_sys_error(svinst, "vacation filter: "
+			"%s is corrupt or has an unsupported format "
+			"(delete it to have it recreated)", filter->path);
+		return -1;
+	}
+
+	filter->slots = PTR_OFFSET(filter->mmap_base, sizeof(*hdr));
+	filter->slot_count = hdr->slot_count;
+	return 0;
+}
+
+struct ext_vacation_filter *ext_vacation_filter_open
+(struct sieve_instance *svinst, const char *path, unsigned int slot_count)
+{
+	struct ext_vacation_filter *filter;
+	int fd, ret;
+
+	i_assert( slot_count > 0 );
+
+	fd = open(path, O_RDWR | O_CREAT, 0660);
+	if ( fd == -1 ) {
+		if ( errno == EACCES ) {
+			sieve_sys_error(svinst, "vacation filter: %s",
+				eacces_error_get_creating("open", path));
+		} else {
+			sieve_sys_error(svinst, "vacation filter: "
+				"open(%s) failed: %m", path);
+		}
+		return NULL;
+	}
+
+	filter = i_new(struct ext_vacation_filter, 1);
+	filter->svinst = svinst;
+	filter->path = i_strdup(path);
+
+	ret = ext_vacation_filter_map(filter, fd, slot_count);
+
+	/* The mapping stays valid after the file is closed */
+	if ( close(fd) < 0 ) {
+		sieve_sys_error(svinst, "vacation filter: "
+			"close(%s) failed: %m", path);
+	}
+
+	if ( ret < 0 ) {
+		ext_vacation_filter_close(&filter);
+		return NULL;
+	}
+	return filter;
+}
+
+void ext_vacation_filter_close(struct ext_vacation_filter **_filter)
+{
+	struct ext_vacation_filter *filter = *_filter;
+
+	if ( filter == NULL )
+		return;
+	*_filter = NULL;
+
+	if ( filter->mmap_base != NULL &&
+		munmap(filter->mmap_base, filter->mmap_size) < 0 ) {
+		sieve_sys_error(filter->svinst, "vacation filter: "
+			"munmap(%s) failed: %m", filter->path);
+	}
+	i_free(filter->path);
+	i_free(filter);
+}
+
+/*
+ * Slot access
+ */
+
+static uint32_t
+ext_vacation_filter_slot_checksum(const struct ext_vacation_filter_slot *slot)
+{
+	return crc32_data(slot, offsetof(struct ext_vacation_filter_slot, checksum));
+}
+
+static unsigned int ext_vacation_filter_slot_first
+(const struct ext_vacation_filter *filter,
+	const unsigned char key[MD5_RESULTLEN])
+{
+	uint32_t hash;
+
+	memcpy(&hash, key, sizeof(hash));
+	return hash % filter->slot_count;
+}
+
+static bool ext_vacation_filter_slot_read
+(const struct ext_vacation_filter *filter, unsigned int idx,
+	struct ext_vacation_filter_slot *slot_r)
+{
+	/* Copy first; the shared slot can change while we look at it */
+	memcpy(slot_r, &filter->slots[idx], sizeof(*slot_r));
+	return ( slot_r->checksum == ext_vacation_filter_slot_checksum(slot_r) );
+}
+
+enum ext_vacation_filter_result ext_vacation_filter_lookup
+(struct ext_vacation_filter *filter, const unsigned char key[MD5_RESULTLEN])
+{
+	struct ext_vacation_filter_slot slot;
+	unsigned int idx, i;
+
+	idx = ext_vacation_filter_slot_first(filter, key);
+	for ( i = 0; i < EXT_VACATION_FILTER_PROBES; i++ ) {
+		if ( ext_vacation_filter_slot_read(filter, idx, &slot) &&
+			memcmp(slot.key, key, MD5_RESULTLEN) == 0 ) {
+			if ( slot.replied_until > (uint64_t)ioloop_time )
+				return EXT_VACATION_FILTER_REPLIED;
+			if ( slot.checked_until > (uint64_t)ioloop_time )
+				return EXT_VACATION_FILTER_NOT_REPLIED;
+			break;
+		}
+		idx = (idx + 1) % filter->slot_count;
+	}
+	return EXT_VACATION_FILTER_UNKNOWN;
+}
+
+static void ext_vacation_filter_update
+(struct ext_vacation_filter *filter, const unsigned char key[MD5_RESULTLEN],
+	time_t replied_until, time_t checked_until)
+{
+	struct ext_vacation_filter_slot slot;
+	uint64_t expires, oldest_expires = (uint64_t)-1;
+	unsigned int idx, oldest_idx, i;
+
+	/* Reuse the slot of this key, or else the one that expires first.
+	   Slots that fail their checksum are up for grabs. */
+	idx = oldest_idx = ext_vacation_filter_slot_first(filter, key);
+	for ( i = 0; i < EXT_VACATION_FILTER_PROBES; i++ ) {
+		if ( !ext_vacation_filter_slot_read(filter, idx, &slot) ) {
+			oldest_idx = idx;
+			oldest_expires = 0;
+		} else if ( memcmp(slot.key, key, MD5_RESULTLEN) == 0 ) {
+			/* Merge with what another process recorded; in particular,
+			   a slow "not replied" answer from the database must not
+			   wipe out a reply that was recorded in the meantime */
+			replied_until = I_MAX((uint64_t)replied_until,
+				slot.replied_until);
+			checked_until = I_MAX((uint64_t)checked_until,
+				slot.checked_until);
+			oldest_idx = idx;
+			break;
+		} else {
+			expires = I_MAX(slot.replied_until, slot.checked_until);
+			if ( expires < oldest_expires ) {
+				oldest_idx = idx;
+				oldest_expires = expires;
+			}
+		}
+		idx = (idx + 1) % filter->slot_count;
+	}
+
+	i_zero(&slot);
+	memcpy(slot.key, key, MD5_RESULTLEN);
+	slot.replied_until = replied_until;
+	slot.checked_until = checked_until;
+	slot.checksum = ext_vacation_filter_slot_checksum(&slot);
+	memcpy(&filter->slots[oldest_idx], &slot, sizeof(slot));
+}
+
+void ext_vacation_filter_mark_replied
+(struct ext_vacation_filter *filter, const unsigned char key[MD5_RESULTLEN],
+	time_t until)
+{
+	ext_vacation_filter_update(filter, key, until, 0);
+}
+
+void ext_vacation_filter_mark_not_replied
+(struct ext_vacation_filter *filter, const unsigned char key[MD5_RESULTLEN],
+	time_t until)
+{
+	ext_vacation_filter_update(filter, key, 0, until);
+}
@@ -18,6 +18,8 @@
 #include "sieve-interpreter.h"
 #include "sieve-dump.h"
 
+#include "str-slice.h"
+
 #include "ext-variables-common.h"
 
 /*
@@ -180,6 +182,7 @@ static int cmd_set_operation_execute
 	ARRAY_TYPE(sieve_variables_modifier) modifiers;
 	unsigned int var_index;
 	string_t *value;
+	struct str_slice *slice;
 	int ret = SIEVE_EXEC_OK;
 
 	/*
@@ -190,7 +193,8 @@ static int cmd_set_operation_execute
 		(renv, address, "variable", &storage, &var_index)) <= 0 )
 		return ret;
 
-	if ( (ret=sieve_opr_string_read(renv, address, "string", &value)) <= 0 )
+	if ( (ret=sieve_variables_opr_string_read_shared
+		(renv, address, "string", &value, &slice)) <= 0 )
 		return ret;
 
 	if ( (ret=sieve_variables_modifiers_code_read
@@ -209,10 +213,16 @@ static int cmd_set_operation_execute
 		(renv, this_ext, &modifiers, &value)) <= 0 )
 		return ret;
 
-	/* Actually assign the value if all is well */
+	/* Actually assign the value if all is well; when the value is an
+	   unmodified match value or variable, it is shared rather than copied */
 	i_assert ( value != NULL );
-	if ( !sieve_variable_assign(storage, var_index, value) )
-		return SIEVE_EXEC_BIN_CORRUPT;
+	if ( slice != NULL && value == str_slice_get_str(slice) ) {
+		if ( !sieve_variable_assign_slice(storage, var_index, slice) )
+			return SIEVE_EXEC_BIN_CORRUPT;
+	} else {
+		if ( !sieve_variable_assign(storage, var_index, value) )
+			return SIEVE_EXEC_BIN_CORRUPT;
+	}
 
 	/* Trace */
 	if ( sieve_runtime_trace_active(renv, SIEVE_TRLVL_COMMANDS) ) {
@@ -4,7 +4,9 @@
 #include "lib.h"
 #include "hash.h"
 #include "str.h"
+#include "unichar.h"
 #include "array.h"
+#include "str-slice.h"
 
 #include "sieve-common.h"
 #include "sieve-settings.h"
@@ -497,6 +499,15 @@ struct sieve_variable_storage {
 	struct sieve_variable_scope_binary *scope_bin;
 	unsigned int max_size;
 	ARRAY(string_t *) var_values;
+
+	/* Values shared with other variables and match values; where a slice
+	   is present, it is the value of the variable and the string above is
+	   only kept for reuse */
+	ARRAY(struct str_slice *) var_slices;
+	/* Slices detached from a variable when it was made modifiable; these
+	   are kept until the variable is made modifiable again, since the
+	   current operation may still hold its value */
+	ARRAY(struct str_slice *) var_detached;
 };
 
 struct sieve_variable_storage *sieve_variable_storage_create
@@ -514,10 +525,43 @@ struct sieve_variable_storage *sieve_variable_storage_create
 	storage->max_size = sieve_variable_scope_binary_get_size(scpbin);
 
 	p_array_init(&storage->var_values, pool, 4);
+	p_array_init(&storage->var_slices, pool, 4);
+	p_array_init(&storage->var_detached, pool, 4);
 
 	return storage;
 }
 
+void sieve_variable_storage_free
+(struct sieve_variable_storage **_storage)
+{
+	struct sieve_variable_storage *storage = *_storage;
+	struct str_slice **slicep;
+
+	if ( storage == NULL )
+		return;
+	*_storage = NULL;
+
+	/* The storage itself is allocated from the pool */
+	array_foreach_modifiable(&storage->var_slices, slicep)
+		str_slice_unref(slicep);
+	array_clear(&storage->var_slices);
+	array_foreach_modifiable(&storage->var_detached, slicep)
+		str_slice_unref(slicep);
+	array_clear(&storage->var_detached);
+}
+
+static struct str_slice **sieve_variable_slice
+(struct sieve_variable_storage *storage, unsigned int index)
+{
+	struct str_slice **slicep;
+
+	if ( index >= array_count(&storage->var_slices) )
+		return NULL;
+
+	slicep = array_idx_modifiable(&storage->var_slices, index);
+	return ( *slicep == NULL ? NULL : slicep );
+}
+
 static inline bool sieve_variable_valid
 (struct sieve_variable_storage *storage, unsigned int index)
 {
@@ -572,9 +616,13 @@ const char *sieve_variable_get_varid
 bool sieve_variable_get
 (struct sieve_variable_storage *storage, unsigned int index, string_t **value)
 {
+	struct str_slice **slicep;
+
 	*value = NULL;
 
-	if  ( index < array_count(&storage->var_values) ) {
+	if ( (slicep=sieve_variable_slice(storage, index)) != NULL ) {
+		*value = str_slice_get_str(*slicep);
+	} else if  ( index < array_count(&storage->var_values) ) {
 		string_t * const *varent;
 
 		varent = array_idx(&storage->var_values, index);
@@ -586,19 +634,55 @@ bool sieve_variable_get
 	return TRUE;
 }
 
+static bool sieve_variable_get_private
+(struct sieve_variable_storage *storage, unsigned int index, string_t **value)
+{
+	string_t *const *varent;
+
+	if ( !sieve_variable_valid(storage, index) )
+		return FALSE;
+
+	*value = NULL;
+	if  ( index < array_count(&storage->var_values) ) {
+		varent = array_idx(&storage->var_values, index);
+		*value = *varent;
+	}
+
+	if ( *value == NULL ) {
+		*value = str_new(storage->pool, 256);
+		array_idx_set(&storage->var_values, index, value);
+	}
+
+	return TRUE;
+}
+
 bool sieve_variable_get_modifiable
 (struct sieve_variable_storage *storage, unsigned int index, string_t **value)
 {
+	struct str_slice **slicep, **detachedp;
 	string_t *dummy;
 
 	if ( value == NULL ) value = &dummy;
 
-	if ( !sieve_variable_get(storage, index, value) )
+	if ( !sieve_variable_get_private(storage, index, value) )
 		return FALSE;
 
-	if ( *value == NULL ) {
-		*value = str_new(storage->pool, 256);
-		array_idx_set(&storage->var_values, index, value);
+	/* Release the slice detached the previous time this was called for
+	   this variable */
+	if ( index < array_count(&storage->var_detached) ) {
+		detachedp = array_idx_modifiable(&storage->var_detached, index);
+		str_slice_unref(detachedp);
+	}
+
+	/* Copy on write; the caller may have read the shared value before
+	   calling this (e.g. `addflag "a" "${a}"'), so the slice is not
+	   released until later */
+	if ( (slicep=sieve_variable_slice(storage, index)) != NULL ) {
+		str_truncate(*value, 0);
+		str_append_data(*value,
+			str_slice_data(*slicep), str_slice_len(*slicep));
+		array_idx_set(&storage->var_detached, index, slicep);
+		*slicep = NULL;
 	}
 
 	return TRUE;
@@ -610,14 +694,20 @@ bool sieve_variable_assign
 {
 	const struct ext_variables_config *config =
 		ext_variables_get_config(storage->var_ext);
+	struct str_slice **slicep;
 	string_t *varval;
 
-	if ( !sieve_variable_get_modifiable(storage, index, &varval) )
+	if ( !sieve_variable_get_private(storage, index, &varval) )
 		return FALSE;
 
 	str_truncate(varval, 0);
 	str_append_str(varval, value);
 
+	/* The value may be the variable's own shared value, so the slice is
+	   only released once the value is copied */
+	if ( (slicep=sieve_variable_slice(storage, index)) != NULL )
+		str_slice_unref(slicep);
+
 	/* Just a precaution, caller should prevent this in the first place */
 	if ( str_len(varval) > config->max_variable_size )
 		str_truncate_utf8(varval, config->max_variable_size);
@@ -631,14 +721,20 @@ bool sieve_variable_assign_cstr
 {
 	const struct ext_variables_config *config =
 		ext_variables_get_config(storage->var_ext);
+	struct str_slice **slicep;
 	string_t *varval;
 
-	if ( !sieve_variable_get_modifiable(storage, index, &varval) )
+	if ( !sieve_variable_get_private(storage, index, &varval) )
 		return FALSE;
 
 	str_truncate(varval, 0);
 	str_append(varval, value);
 
+	/* The value may be the variable's own shared value, so the slice is
+	   only released once the value is copied */
+	if ( (slicep=sieve_variable_slice(storage, index)) != NULL )
+		str_slice_unref(slicep);
+
 	/* Just a precaution, caller should prevent this in the first place */
 	if ( str_len(varval) > config->max_variable_size )
 		str_truncate_utf8(varval, config->max_variable_size);
@@ -646,6 +742,43 @@ bool sieve_variable_assign_cstr
 	return TRUE;
 }
 
+bool sieve_variable_assign_slice
+(struct sieve_variable_storage *storage, unsigned int index,
+	struct str_slice *value)
+{
+	const struct ext_variables_config *config =
+		ext_variables_get_config(storage->var_ext);
+	struct str_slice **slicep;
+	size_t size = str_slice_len(value);
+
+	if ( !sieve_variable_valid(storage, index) )
+		return FALSE;
+
+	/* Just a precaution, caller should prevent this in the first place */
+	if ( size > config->max_variable_size ) {
+		size = uni_utf8_data_truncate(str_slice_data(value),
+			size, config->max_variable_size);
+		value = str_slice_sub(value, 0, size);
+	} else {
+		str_slice_ref(value);
+	}
+
+	if ( (slicep=sieve_variable_slice(storage, index)) != NULL )
+		str_slice_unref(slicep);
+	array_idx_set(&storage->var_slices, index, &value);
+	return TRUE;
+}
+
+struct str_slice *sieve_variable_get_slice
+(struct sieve_variable_storage *storage, unsigned int index)
+{
+	struct str_slice **slicep;
+
+	if ( (slicep=sieve_variable_slice(storage, index)) == NULL )
+		return NULL;
+	return *slicep;
+}
+
 /*
  * AST Context
  */
@@ -830,6 +963,7 @@ static void ext_variables_interpreter_free
 		(struct ext_variables_interpreter_context *)context;
 
 	sieve_variable_scope_binary_unref(&ctx->local_scope_bin);
+	sieve_variable_storage_free(&ctx->local_storage);
 }
 
 static struct sieve_interpreter_extension
@@ -18,6 +18,8 @@
 #include "sieve-dump.h"
 #include "sieve-interpreter.h"
 
+#include "str-slice.h"
+
 #include "ext-variables-common.h"
 #include "ext-variables-limits.h"
 #include "ext-variables-name.h"
@@ -196,6 +198,48 @@ int sieve_variable_operand_read
 		(renv, &operand, address, field_name, storage_r, var_index_r);
 }
 
+int sieve_variables_opr_string_read_shared
+(const struct sieve_runtime_env *renv, sieve_size_t *address,
+	const char *field_name, string_t **str_r, struct str_slice **slice_r)
+{
+	struct sieve_operand operand;
+	sieve_size_t data_address;
+	int ret;
+
+	*slice_r = NULL;
+
+	if ( (ret=sieve_operand_runtime_read(renv, address, field_name, &operand))
+		<= 0)
+		return ret;
+
+	data_address = *address;
+	if ( (ret=sieve_opr_string_read_data
+		(renv, &operand, address, field_name, str_r)) <= 0 )
+		return ret;
+
+	/* Re-read the operand data to find out where the value came from */
+	if ( sieve_operand_is_variable(&operand) ) {
+		struct sieve_variable_storage *storage;
+		unsigned int index;
+
+		if ( sieve_variable_operand_read_data(renv, &operand, &data_address,
+			field_name, &storage, &index) <= 0 )
+			return SIEVE_EXEC_BIN_CORRUPT;
+		*slice_r = sieve_variable_get_slice(storage, index);
+	} else if ( sieve_operand_is(&operand, match_value_operand) ) {
+		unsigned int index = 0;
+
+		if ( !sieve_binary_read_unsigned(renv->sblock, &data_address, &index) )
+			return SIEVE_EXEC_BIN_CORRUPT;
+		*slice_r = sieve_match_values_get_slice(renv, index);
+	}
+
+	/* Don't share a value that was truncated while reading */
+	if ( *slice_r != NULL && str_slice_len(*slice_r) != str_len(*str_r) )
+		*slice_r = NULL;
+	return SIEVE_EXEC_OK;
+}
+
 /*
  * Match value operand
  */
@@ -266,8 +310,14 @@ static int opr_match_value_read
 
 			if ( *str_r == NULL )
 				*str_r = t_str_new(0);
-			else if ( str_len(*str_r) > config->max_variable_size )
-				str_truncate_utf8(*str_r, config->max_variable_size);
+			else if ( str_len(*str_r) > config->max_variable_size ) {
+				/* The match value is shared; truncate a copy */
+				string_t *value = t_str_new(config->max_variable_size + 3);
+
+				str_append_str(value, *str_r);
+				str_truncate_utf8(value, config->max_variable_size);
+				*str_r = value;
+			}
 		}
 
 		return SIEVE_EXEC_OK;
@@ -186,10 +186,13 @@ struct sieve_variable * const *sieve_variable_scope_get_variables
  */
 
 struct sieve_variable_storage;
+struct str_slice;
 
 struct sieve_variable_storage *sieve_variable_storage_create
 	(const struct sieve_extension *var_ext, pool_t pool,
 		struct sieve_variable_scope_binary *scpbin);
+void sieve_variable_storage_free
+	(struct sieve_variable_storage **_storage);
 bool sieve_variable_get
 	(struct sieve_variable_storage *storage, unsigned int index,
 		string_t **value);
@@ -202,6 +205,15 @@ bool sieve_variable_assign
 bool sieve_variable_assign_cstr
 	(struct sieve_variable_storage *storage, unsigned int index,
 		const char *value);
+/* Shares the (immutable) value rather than copying it; it is only copied
+   once the variable is modified in place */
+bool sieve_variable_assign_slice
+	(struct sieve_variable_storage *storage, unsigned int index,
+		struct str_slice *value);
+/* Returns the value of the variable if it is held in a form that can be
+   shared (i.e., it was assigned as a slice); NULL otherwise */
+struct str_slice *sieve_variable_get_slice
+	(struct sieve_variable_storage *storage, unsigned int index);
 bool sieve_variable_get_identifier
 	(struct sieve_variable_storage *storage, unsigned int index,
 		const char **identifier);
@@ -279,6 +291,13 @@ static inline bool sieve_operand_is_variable
 		operand->def == &variable_operand );
 }
 
+/* Reads a string operand. If it is a single variable or match value that
+   is held as a slice, that slice is returned as well, so that it can be
+   shared rather than copied; the slice is not referenced */
+int sieve_variables_opr_string_read_shared
+	(const struct sieve_runtime_env *renv, sieve_size_t *address,
+		const char *field_name, string_t **str_r, struct str_slice **slice_r);
+
 /*
  * Modifiers
  */
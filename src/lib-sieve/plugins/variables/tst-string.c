@@ -28,6 +28,9 @@ static bool tst_string_registered
 		struct sieve_command_registration *cmd_reg);
 static bool tst_string_validate
 	(struct sieve_validator *valdtr, struct sieve_command *tst);
+static bool tst_string_validate_const
+	(struct sieve_validator *valdtr, struct sieve_command *tst,
+		int *const_current, int const_next);
 static bool tst_string_generate
 	(const struct sieve_codegen_env *cgenv, struct sieve_command *ctx);
 
@@ -38,8 +41,10 @@ const struct sieve_command_def tst_string = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_CHEAP,
 	.registered = tst_string_registered,
 	.validate = tst_string_validate,
+	.validate_const = tst_string_validate_const,
 	.generate = tst_string_generate
 };
 
@@ -121,6 +126,121 @@ static bool tst_string_validate
 		(valdtr, tst, arg, &mcht_default, &cmp_default);
 }
 
+/* When optimizing, a test that compares only literal strings using :is or
+ * :contains is evaluated at compile time. The validator then drops it like a
+ * constant true/false test.
+ */
+
+static bool tst_string_literal_list
+(struct sieve_ast_argument *arg)
+{
+	struct sieve_ast_argument *stritem;
+
+	if ( sieve_argument_is_string_literal(arg) )
+		return TRUE;
+	if ( !sieve_argument_is(arg, string_list_argument) )
+		return FALSE;
+
+	stritem = sieve_ast_strlist_first(arg);
+	while ( stritem != NULL ) {
+		if ( stritem->argument == NULL ||
+			!sieve_argument_is_string_literal(stritem) )
+			return FALSE;
+		stritem = sieve_ast_strlist_next(stritem);
+	}
+	return TRUE;
+}
+
+static bool tst_string_const_match
+(const struct sieve_comparator *cmp, bool contains, string_t *value,
+	string_t *key)
+{
+	const char *val = str_c(value), *kval = str_c(key);
+	size_t val_size = str_len(value), key_size = str_len(key);
+
+	/* Same semantics as the :is and :contains match types */
+	if ( val_size == 0 )
+		return ( key_size == 0 );
+	if ( contains ) {
+		return ( cmp->def->substring_find
+			(cmp, val, val_size, kval, key_size) != NULL );
+	}
+	return ( cmp->def->compare(cmp, val, val_size, kval, key_size) == 0 );
+}
+
+static bool tst_string_validate_const
+(struct sieve_validator *valdtr, struct sieve_command *tst,
+	int *const_current, int const_next ATTR_UNUSED)
+{
+	const struct sieve_comparator cmp_default =
+		SIEVE_COMPARATOR_DEFAULT(i_octet_comparator);
+	const struct sieve_comparator *cmp = NULL;
+	const struct sieve_match_type *mcht = NULL;
+	struct sieve_ast_argument *arg, *source, *keys, *value, *key;
+	bool contains;
+
+	*const_current = -1;
+
+	if ( (sieve_validator_compile_flags(valdtr) &
+		SIEVE_COMPILE_FLAG_OPTIMIZE) == 0 )
+		return TRUE;
+
+	/* Only comparator and match type tags are supported */
+	arg = sieve_command_first_argument(tst);
+	while ( arg != NULL && arg != tst->first_positional ) {
+		if ( sieve_argument_is_comparator(arg) ) {
+			cmp = sieve_comparator_tag_get(arg);
+		} else if ( sieve_argument_is_match_type(arg) &&
+			arg->argument->data != NULL ) {
+			struct sieve_match_type_context *mtctx =
+				(struct sieve_match_type_context *)arg->argument->data;
+
+			mcht = mtctx->match_type;
+		} else {
+			return TRUE;
+		}
+		arg = sieve_ast_argument_next(arg);
+	}
+
+	if ( mcht == NULL || sieve_match_type_is(mcht, is_match_type) )
+		contains = FALSE;
+	else if ( sieve_match_type_is(mcht, contains_match_type) )
+		contains = TRUE;
+	else
+		return TRUE;
+
+	if ( cmp == NULL ) {
+		cmp = &cmp_default;
+	} else if ( !sieve_comparator_is(cmp, i_octet_comparator) &&
+		!sieve_comparator_is(cmp, i_ascii_casemap_comparator) ) {
+		return TRUE;
+	}
+
+	source = tst->first_positional;
+	keys = sieve_ast_argument_next(source);
+	if ( keys == NULL || !tst_string_literal_list(source) ||
+		!tst_string_literal_list(keys) )
+		return TRUE;
+
+	*const_current = 0;
+	value = ( sieve_argument_is_string_literal(source) ?
+		source : sieve_ast_strlist_first(source) );
+	while ( value != NULL ) {
+		key = ( sieve_argument_is_string_literal(keys) ?
+			keys : sieve_ast_strlist_first(keys) );
+		while ( key != NULL ) {
+			if ( tst_string_const_match(cmp, contains,
+				sieve_ast_argument_str(value), sieve_ast_argument_str(key)) ) {
+				*const_current = 1;
+				return TRUE;
+			}
+			key = ( key == keys ? NULL : sieve_ast_strlist_next(key) );
+		}
+		value = ( value == source ? NULL : sieve_ast_strlist_next(value) );
+	}
+	return TRUE;
+}
+
 /*
  * Test generation
  */
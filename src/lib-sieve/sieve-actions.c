@@ -5,6 +5,7 @@
 #include "str.h"
 #include "strfuncs.h"
 #include "ioloop.h"
+#include "hash.h"
 #include "hostpid.h"
 #include "str-sanitize.h"
 #include "unichar.h"
@@ -188,6 +189,8 @@ static int act_store_check_duplicate
 	(const struct sieve_runtime_env *renv,
 		const struct sieve_action *act,
 		const struct sieve_action *act_other);
+static const char *act_store_duplicate_key
+	(const struct sieve_runtime_env *renv, const struct sieve_action *act);
 static void act_store_print
 	(const struct sieve_action *action,
 		const struct sieve_result_print_env *rpenv, bool *keep);
@@ -214,6 +217,7 @@ const struct sieve_action_def act_store = {
 		SIEVE_ACTFLAG_MAIL_STORAGE,
 	.equals = act_store_equals,
 	.check_duplicate = act_store_check_duplicate,
+	.duplicate_key = act_store_duplicate_key,
 	.print = act_store_print,
 	.start = act_store_start,
 	.execute = act_store_execute,
@@ -328,6 +332,21 @@ static int act_store_check_duplicate
 	return ( act_store_equals(renv->scriptenv, act, act_other) ? 1 : 0 );
 }
 
+static const char *act_store_duplicate_key
+(const struct sieve_runtime_env *renv, const struct sieve_action *act)
+{
+	struct act_store_context *ctx = (struct act_store_context *) act->context;
+	const char *mailbox;
+
+	mailbox = ( ctx == NULL ?
+		SIEVE_SCRIPT_DEFAULT_MAILBOX(renv->scriptenv) : ctx->mailbox );
+
+	/* INBOX is case-insensitive; see act_store_equals() */
+	if ( strcasecmp(mailbox, "INBOX") == 0 )
+		return "INBOX";
+	return mailbox;
+}
+
 /* Result printing */
 
 static void act_store_print
@@ -359,15 +378,119 @@ void sieve_act_store_get_storage_error
 		&trans->error_code));
 }
 
+/* Mailbox cache */
+
+struct sieve_mailbox_cache_entry {
+	struct mailbox *box;
+
+	/* Used by a pending store transaction */
+	bool in_use:1;
+};
+
+struct sieve_mailbox_cache {
+	pool_t pool;
+	struct mail_user *user;
+
+	HASH_TABLE(const char *, struct sieve_mailbox_cache_entry *) entries;
+	unsigned int hits, misses;
+};
+
+struct sieve_mailbox_cache *sieve_mailbox_cache_create(struct mail_user *user)
+{
+	struct sieve_mailbox_cache *cache;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_mailbox_cache", 1024);
+	cache = p_new(pool, struct sieve_mailbox_cache, 1);
+	cache->pool = pool;
+	cache->user = user;
+	hash_table_create(&cache->entries, pool, 0, str_hash, strcmp);
+
+	return cache;
+}
+
+void sieve_mailbox_cache_free(struct sieve_mailbox_cache **_cache)
+{
+	struct sieve_mailbox_cache *cache = *_cache;
+	struct hash_iterate_context *iter;
+	struct sieve_mailbox_cache_entry *entry;
+	const char *name;
+
+	*_cache = NULL;
+
+	if ( cache->user->mail_debug ) {
+		i_debug("sieve: mailbox cache: %u hits, %u misses",
+			cache->hits, cache->misses);
+	}
+
+	iter = hash_table_iterate_init(cache->entries);
+	while ( hash_table_iterate(iter, cache->entries, &name, &entry) ) {
+		if ( !entry->in_use )
+			mailbox_free(&entry->box);
+	}
+	hash_table_iterate_deinit(&iter);
+
+	hash_table_destroy(&cache->entries);
+	pool_unref(&cache->pool);
+}
+
+static struct mailbox *sieve_mailbox_cache_get
+(struct sieve_mailbox_cache *cache, const char *mailbox)
+{
+	struct sieve_mailbox_cache_entry *entry;
+
+	entry = hash_table_lookup(cache->entries, mailbox);
+	if ( entry == NULL || entry->in_use ) {
+		/* A mailbox is only used by one transaction at a time */
+		cache->misses++;
+		return NULL;
+	}
+
+	cache->hits++;
+	entry->in_use = TRUE;
+	return entry->box;
+}
+
+static bool sieve_mailbox_cache_add
+(struct sieve_mailbox_cache *cache, const char *mailbox,
+	struct mailbox *box)
+{
+	struct sieve_mailbox_cache_entry *entry;
+
+	if ( hash_table_lookup(cache->entries, mailbox) != NULL )
+		return FALSE;
+
+	entry = p_new(cache->pool, struct sieve_mailbox_cache_entry, 1);
+	entry->box = box;
+	entry->in_use = TRUE;
+	hash_table_insert(cache->entries, p_strdup(cache->pool, mailbox), entry);
+	return TRUE;
+}
+
+static void sieve_mailbox_cache_release
+(struct sieve_mailbox_cache *cache, const char *mailbox)
+{
+	struct sieve_mailbox_cache_entry *entry;
+
+	entry = hash_table_lookup(cache->entries, mailbox);
+	i_assert(entry != NULL && entry->in_use);
+	entry->in_use = FALSE;
+}
+
+/* Store action */
+
 static bool act_store_mailbox_open
 (const struct sieve_action_exec_env *aenv, const char *mailbox,
-	struct mailbox **box_r, enum mail_error *error_code_r, const char **error_r)
+	struct mailbox **box_r, bool *cached_r,
+	enum mail_error *error_code_r, const char **error_r)
 {
+	struct sieve_mailbox_cache *cache = aenv->scriptenv->mailbox_cache;
 	struct mailbox *box;
 	struct mail_storage **storage = &(aenv->exec_status->last_storage);
 	enum mailbox_flags flags = 0;
 
 	*box_r = NULL;
+	*cached_r = FALSE;
 	*error_code_r = MAIL_ERROR_NONE;
 	*error_r = NULL;
 
@@ -380,6 +503,15 @@ static bool act_store_mailbox_open
 		return FALSE;
 	}
 
+	/* Reuse the mailbox if a previous store action already opened it */
+	if ( cache != NULL &&
+		(box=sieve_mailbox_cache_get(cache, mailbox)) != NULL ) {
+		*box_r = box;
+		*cached_r = TRUE;
+		*storage = mailbox_get_storage(box);
+		return TRUE;
+	}
+
 	if (aenv->scriptenv->mailbox_autocreate)
 		flags |= MAILBOX_FLAG_AUTO_CREATE;
 	if (aenv->scriptenv->mailbox_autosubscribe)
@@ -388,12 +520,32 @@ static bool act_store_mailbox_open
 		aenv->scriptenv->user, mailbox, flags);
 	*storage = mailbox_get_storage(box);
 
-	if (mailbox_open(box) == 0)
+	if (mailbox_open(box) == 0) {
+		if ( cache != NULL )
+			*cached_r = sieve_mailbox_cache_add(cache, mailbox, box);
 		return TRUE;
+	}
 	*error_r = mailbox_get_last_error(box, error_code_r);
 	return FALSE;
 }
 
+static void act_store_mailbox_close
+(const struct sieve_action_exec_env *aenv,
+	struct act_store_transaction *trans)
+{
+	if ( trans->box == NULL )
+		return;
+
+	if ( trans->box_cached ) {
+		sieve_mailbox_cache_release(aenv->scriptenv->mailbox_cache,
+			trans->context->mailbox);
+		trans->box = NULL;
+		trans->box_cached = FALSE;
+	} else {
+		mailbox_free(&trans->box);
+	}
+}
+
 static int act_store_start
 (const struct sieve_action *action,
 	const struct sieve_action_exec_env *aenv, void **tr_context)
@@ -405,7 +557,7 @@ static int act_store_start
 	pool_t pool = sieve_result_pool(aenv->result);
 	const char *error = NULL;
 	enum mail_error error_code = MAIL_ERROR_NONE;
-	bool disabled = FALSE, open_failed = FALSE;
+	bool disabled = FALSE, open_failed = FALSE, box_cached = FALSE;
 
 	/* If context is NULL, the store action is the result of (implicit) keep */
 	if ( ctx == NULL ) {
@@ -419,8 +571,8 @@ static int act_store_start
 	 * to NULL. This implementation will then skip actually storing the message.
 	 */
 	if ( senv->user != NULL ) {
-		if ( !act_store_mailbox_open
-			(aenv, ctx->mailbox, &box, &error_code, &error) ) {
+		if ( !act_store_mailbox_open(aenv, ctx->mailbox,
+			&box, &box_cached, &error_code, &error) ) {
 			open_failed = TRUE;
 		}
 	} else {
@@ -432,6 +584,7 @@ static int act_store_start
 
 	trans->context = ctx;
 	trans->box = box;
+	trans->box_cached = box_cached;
 	trans->flags = 0;
 
 	trans->disabled = disabled;
@@ -683,15 +836,13 @@ static int act_store_commit
 	if ( trans->disabled ) {
 		act_store_log_status(trans, aenv, FALSE, status);
 		*keep = FALSE;
-		if ( trans->box != NULL )
-			mailbox_free(&trans->box);
+		act_store_mailbox_close(aenv, trans);
 		return SIEVE_EXEC_OK;
 	} else if ( trans->redundant ) {
 		act_store_log_status(trans, aenv, FALSE, status);
 		aenv->exec_status->keep_original = TRUE;
 		aenv->exec_status->message_saved = TRUE;
-		if ( trans->box != NULL )
-			mailbox_free(&trans->box);
+		act_store_mailbox_close(aenv, trans);
 		return SIEVE_EXEC_OK;
 	}
 
@@ -716,8 +867,7 @@ static int act_store_commit
 	*keep = !status;
 
 	/* Close mailbox */
-	if ( trans->box != NULL )
-		mailbox_free(&trans->box);
+	act_store_mailbox_close(aenv, trans);
 
 	if (status)
 		return SIEVE_EXEC_OK;
@@ -750,7 +900,7 @@ static void act_store_rollback
 		mailbox_transaction_rollback(&trans->mail_trans);
 
 	/* Close the mailbox */
-	mailbox_free(&trans->box);
+	act_store_mailbox_close(aenv, trans);
 }
 
 /*
@@ -817,6 +967,49 @@ void sieve_action_duplicate_flush
 	senv->duplicate_flush(senv);
 }
 
+void sieve_action_duplicate_check_multiple
+(const struct sieve_script_env *senv,
+	const struct sieve_duplicate_id *ids, unsigned int count,
+	bool *results_r)
+{
+	unsigned int i;
+
+	if ( senv->duplicate_check == NULL || senv->duplicate_mark == NULL ) {
+		memset(results_r, 0, count * sizeof(*results_r));
+		return;
+	}
+
+	if ( senv->duplicate_check_multiple != NULL ) {
+		senv->duplicate_check_multiple(senv, ids, count, results_r);
+		return;
+	}
+
+	for ( i = 0; i < count; i++ ) {
+		results_r[i] = senv->duplicate_check
+			(senv, ids[i].id, ids[i].id_size);
+	}
+}
+
+void sieve_action_duplicate_mark_multiple
+(const struct sieve_script_env *senv,
+	const struct sieve_duplicate_id *ids, unsigned int count)
+{
+	unsigned int i;
+
+	if ( senv->duplicate_check == NULL || senv->duplicate_mark == NULL )
+		return;
+
+	if ( senv->duplicate_mark_multiple != NULL ) {
+		senv->duplicate_mark_multiple(senv, ids, count);
+		return;
+	}
+
+	for ( i = 0; i < count; i++ ) {
+		senv->duplicate_mark
+			(senv, ids[i].id, ids[i].id_size, ids[i].time);
+	}
+}
+
 
 /* Rejecting the mail */
 
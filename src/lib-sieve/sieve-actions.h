@@ -61,6 +61,13 @@ struct sieve_action_def {
 			const struct sieve_action *act,
 			const struct sieve_action *act_other);
 
+	/* Key identifying the target of the action (e.g. the mailbox). Used to
+	   index the result: check_duplicate() is only called for actions with
+	   the same key, so duplicates must always yield equal keys. */
+	const char *(*duplicate_key)
+		(const struct sieve_runtime_env *renv,
+			const struct sieve_action *act);
+
 	/* Result printing */
 
 	void (*print)
@@ -221,6 +228,11 @@ struct act_store_context {
 	const char *mailbox;
 };
 
+/* Cache of opened mailboxes (see sieve_script_env_enable_mailbox_cache()) */
+
+struct sieve_mailbox_cache *sieve_mailbox_cache_create(struct mail_user *user);
+void sieve_mailbox_cache_free(struct sieve_mailbox_cache **_cache);
+
 struct act_store_transaction {
 	struct act_store_context *context;
 	struct mailbox *box;
@@ -235,6 +247,7 @@ struct act_store_transaction {
 	bool flags_altered:1;
 	bool disabled:1;
 	bool redundant:1;
+	bool box_cached:1;
 };
 
 int sieve_act_store_add_to_result
@@ -252,8 +265,14 @@ void sieve_act_store_get_storage_error
  * Redirect action
  */
 
+struct act_redirect_batch;
+
 struct act_redirect_context {
 	const struct smtp_address *to_address;
+
+	/* Set when the message was submitted for this address together with
+	   an earlier redirect action */
+	struct act_redirect_batch *batch;
 };
 
 int sieve_act_redirect_add_to_result
@@ -277,6 +296,14 @@ void sieve_action_duplicate_mark
 void sieve_action_duplicate_flush
 	(const struct sieve_script_env *senv);
 
+void sieve_action_duplicate_check_multiple
+	(const struct sieve_script_env *senv,
+		const struct sieve_duplicate_id *ids, unsigned int count,
+		bool *results_r);
+void sieve_action_duplicate_mark_multiple
+	(const struct sieve_script_env *senv,
+		const struct sieve_duplicate_id *ids, unsigned int count);
+
 /* Rejecting mail */
 
 int sieve_action_reject_mail
@@ -9,6 +9,7 @@
 
 #include "sieve-common.h"
 #include "sieve-runtime-trace.h"
+#include "sieve-message.h"
 
 #include "sieve-address.h"
 
@@ -138,10 +139,8 @@ static int sieve_header_address_list_next_item
 				str_sanitize(str_c(value_item), 80));
 		}
 
-		addrlist->cur_address = message_address_parse(
-			pool_datastack_create(),
-			(const unsigned char *) str_data(value_item),
-			str_len(value_item), 256, 0);
+		addrlist->cur_address = sieve_message_get_addresses(
+			runenv->msgctx, str_c(value_item));
 	}
 	i_unreached();
 }
@@ -9,6 +9,8 @@
 #include "sieve-common.h"
 #include "sieve-script.h"
 #include "sieve-extensions.h"
+#include "sieve-commands.h"
+#include "sieve-manifest.h"
 
 #include "sieve-ast.h"
 
@@ -52,6 +54,9 @@ struct sieve_ast {
 
 	ARRAY(const struct sieve_extension *) linked_extensions;
 	ARRAY(struct sieve_ast_extension_reg) extensions;
+
+	/* Message fields accessed by the script */
+	struct sieve_manifest *manifest;
 };
 
 struct sieve_ast *sieve_ast_create
@@ -77,6 +82,8 @@ struct sieve_ast *sieve_ast_create
 	p_array_init(&ast->linked_extensions, pool, ext_count);
 	p_array_init(&ast->extensions, pool, ext_count);
 
+	ast->manifest = sieve_manifest_create(pool);
+
 	return ast;
 }
 
@@ -127,6 +134,11 @@ struct sieve_script *sieve_ast_script(struct sieve_ast *ast)
 	return ast->script;
 }
 
+struct sieve_manifest *sieve_ast_manifest(struct sieve_ast *ast)
+{
+	return ast->manifest;
+}
+
 /*
  * Extension support
  */
@@ -337,6 +349,11 @@ static bool sieve_ast_list_add
 (struct sieve_ast_list *list, struct sieve_ast_node *node)
 	__LIST_ADD(list, node)
 
+static bool sieve_ast_list_insert
+(struct sieve_ast_list *list, struct sieve_ast_node *before,
+	struct sieve_ast_node *node)
+	__LIST_INSERT(list, before, node)
+
 static struct sieve_ast_node *sieve_ast_list_detach
 (struct sieve_ast_node *first, unsigned int count)
 	__LIST_DETACH(first, struct sieve_ast_node, count)
@@ -455,6 +472,62 @@ struct sieve_ast_node *sieve_ast_node_detach
 	return sieve_ast_list_detach(first, 1);
 }
 
+struct sieve_ast_node *sieve_ast_nodes_detach
+(struct sieve_ast_node *first, unsigned int count)
+{
+	return sieve_ast_list_detach(first, count);
+}
+
+void sieve_ast_test_move_before
+(struct sieve_ast_node *test, struct sieve_ast_node *before)
+{
+	struct sieve_ast_list *list = before->list;
+
+	i_assert( test->list == list && test != before );
+
+	(void)sieve_ast_list_detach(test, 1);
+	(void)sieve_ast_list_insert(list, before, test);
+}
+
+void sieve_ast_test_splice
+(struct sieve_ast_node *test)
+{
+	struct sieve_ast_list *list = test->list;
+	struct sieve_ast_node *first, *last, *subtest;
+
+	i_assert( test->type == SAT_TEST && list != NULL );
+
+	first = sieve_ast_test_first(test);
+	if ( first == NULL ) {
+		(void)sieve_ast_node_detach(test);
+		return;
+	}
+	last = test->tests->tail;
+
+	/* Move the subtests to the list of the parent */
+	for ( subtest = first; subtest != NULL; subtest = subtest->next ) {
+		subtest->parent = test->parent;
+		subtest->list = list;
+	}
+
+	/* Link them in at the position of the test */
+	first->prev = test->prev;
+	last->next = test->next;
+	if ( test->prev != NULL )
+		test->prev->next = first;
+	else
+		list->head = first;
+	if ( test->next != NULL )
+		test->next->prev = last;
+	else
+		list->tail = last;
+	list->len += test->tests->len - 1;
+
+	test->tests->head = test->tests->tail = NULL;
+	test->tests->len = 0;
+	test->prev = test->next = NULL;
+}
+
 const char *sieve_ast_type_name
 (enum sieve_ast_type ast_type)
 {
@@ -777,6 +850,94 @@ struct sieve_ast_node *sieve_ast_command_create
  * Utility
  */
 
+static bool sieve_ast_arguments_equal
+(const struct sieve_ast_argument *arg1,
+	const struct sieve_ast_argument *arg2);
+
+static bool sieve_ast_argument_equal
+(const struct sieve_ast_argument *arg1,
+	const struct sieve_ast_argument *arg2)
+{
+	if ( arg1->type != arg2->type )
+		return FALSE;
+
+	if ( (arg1->argument == NULL) != (arg2->argument == NULL) ||
+		(arg1->argument != NULL &&
+			arg1->argument->def != arg2->argument->def) )
+		return FALSE;
+
+	switch ( arg1->type ) {
+	case SAAT_NUMBER:
+		if ( arg1->_value.number != arg2->_value.number )
+			return FALSE;
+		break;
+	case SAAT_STRING:
+		if ( !str_equals(arg1->_value.str, arg2->_value.str) )
+			return FALSE;
+		break;
+	case SAAT_STRING_LIST:
+		if ( !sieve_ast_arguments_equal
+			(arg1->_value.strlist->head, arg2->_value.strlist->head) )
+			return FALSE;
+		break;
+	case SAAT_TAG:
+		if ( strcmp(arg1->_value.tag, arg2->_value.tag) != 0 )
+			return FALSE;
+		break;
+	default:
+		return FALSE;
+	}
+
+	return sieve_ast_arguments_equal(arg1->parameters, arg2->parameters);
+}
+
+static bool sieve_ast_arguments_equal
+(const struct sieve_ast_argument *arg1,
+	const struct sieve_ast_argument *arg2)
+{
+	while ( arg1 != NULL && arg2 != NULL ) {
+		if ( !sieve_ast_argument_equal(arg1, arg2) )
+			return FALSE;
+
+		arg1 = arg1->next;
+		arg2 = arg2->next;
+	}
+
+	return ( arg1 == NULL && arg2 == NULL );
+}
+
+bool sieve_ast_node_equal
+(const struct sieve_ast_node *node1, const struct sieve_ast_node *node2)
+{
+	const struct sieve_ast_node *sub1, *sub2;
+
+	i_assert( node1->type == SAT_TEST && node2->type == SAT_TEST );
+
+	if ( strcmp(node1->identifier, node2->identifier) != 0 )
+		return FALSE;
+
+	if ( node1->command == NULL || node2->command == NULL ||
+		node1->command->def != node2->command->def ||
+		node1->command->ext != node2->command->ext )
+		return FALSE;
+
+	if ( !sieve_ast_arguments_equal
+		(__AST_LIST_FIRST(node1->arguments), __AST_LIST_FIRST(node2->arguments)) )
+		return FALSE;
+
+	sub1 = __AST_LIST_FIRST(node1->tests);
+	sub2 = __AST_LIST_FIRST(node2->tests);
+	while ( sub1 != NULL && sub2 != NULL ) {
+		if ( !sieve_ast_node_equal(sub1, sub2) )
+			return FALSE;
+
+		sub1 = sub1->next;
+		sub2 = sub2->next;
+	}
+
+	return ( sub1 == NULL && sub2 == NULL );
+}
+
 int sieve_ast_stringlist_map
 (struct sieve_ast_argument **listitem, void *context,
 	int (*map_function)(void *context, struct sieve_ast_argument *arg))
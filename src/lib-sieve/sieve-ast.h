@@ -173,6 +173,7 @@ void sieve_ast_unref(struct sieve_ast **ast);
 struct sieve_ast_node *sieve_ast_root(struct sieve_ast *ast);
 pool_t sieve_ast_pool(struct sieve_ast *ast);
 struct sieve_script *sieve_ast_script(struct sieve_ast *ast);
+struct sieve_manifest *sieve_ast_manifest(struct sieve_ast *ast);
 
 /* Extension support */
 
@@ -215,6 +216,15 @@ struct sieve_ast_node *sieve_ast_command_create
 
 struct sieve_ast_node *sieve_ast_node_detach
 	(struct sieve_ast_node *first);
+struct sieve_ast_node *sieve_ast_nodes_detach
+	(struct sieve_ast_node *first, unsigned int count);
+
+/* Move the test node in front of another node in the same list */
+void sieve_ast_test_move_before
+	(struct sieve_ast_node *test, struct sieve_ast_node *before);
+/* Replace the test node in its list with its own subtests */
+void sieve_ast_test_splice
+	(struct sieve_ast_node *test);
 
 const char *sieve_ast_type_name(enum sieve_ast_type ast_type);
 
@@ -284,6 +294,10 @@ bool sieve_ast_stringlist_add_strc
  * Utility
  */
 
+/* Structural comparison of (validated) test nodes */
+bool sieve_ast_node_equal
+	(const struct sieve_ast_node *node1, const struct sieve_ast_node *node2);
+
 int sieve_ast_stringlist_map
 	(struct sieve_ast_argument **listitem, void *context,
 		int (*map_function)(void *context, struct sieve_ast_argument *arg));
@@ -0,0 +1,197 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "llist.h"
+#include "hash.h"
+
+#include "sieve-common.h"
+#include "sieve-error.h"
+#include "sieve-script.h"
+
+#include "sieve-binary-private.h"
+
+#include <sys/stat.h>
+
+/*
+ * Binary cache
+ *
+ *   Keeps a limited number of loaded binaries open for the lifetime of the
+ *   Sieve instance, so that scripts that are opened repeatedly (e.g. by the
+ *   IMAPSieve and FILTER=SIEVE plugins for the duration of an IMAP session)
+ *   are not read from disk each time. Binaries are evicted in least-recently-used order.
+ */
+
+struct sieve_binary_cache_entry {
+	struct sieve_binary_cache_entry *prev, *next;
+
+	char *key;
+	struct sieve_binary *sbin;
+};
+
+struct sieve_binary_cache {
+	HASH_TABLE(const char *, struct sieve_binary_cache_entry *) entries;
+
+	/* Most recently used entry first */
+	struct sieve_binary_cache_entry *head, *tail;
+	unsigned int count, max_count;
+
+	/* Statistics */
+	unsigned int hits, misses, evictions;
+};
+
+static const char *sieve_binary_cache_key
+(struct sieve_script *script,
+	enum sieve_compile_flags cpflags)
+{
+	return t_strdup_printf("%x:%s", (unsigned int)cpflags,
+		sieve_script_location(script));
+}
+
+static void sieve_binary_cache_entry_free
+(struct sieve_binary_cache *cache,
+	struct sieve_binary_cache_entry *entry)
+{
+	hash_table_remove(cache->entries, entry->key);
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	cache->count--;
+
+	sieve_binary_unref(&entry->sbin);
+	i_free(entry->key);
+	i_free(entry);
+}
+
+void sieve_binary_cache_init(struct sieve_instance *svinst)
+{
+	struct sieve_binary_cache *cache;
+
+	if ( svinst->binary_cache_size == 0 )
+		return;
+
+	cache = p_new(svinst->pool, struct sieve_binary_cache, 1);
+	cache->max_count = svinst->binary_cache_size;
+	hash_table_create(&cache->entries, default_pool, 0, str_hash, strcmp);
+
+	svinst->binary_cache = cache;
+}
+
+void sieve_binary_cache_deinit(struct sieve_instance *svinst)
+{
+	struct sieve_binary_cache *cache = svinst->binary_cache;
+
+	if ( cache == NULL )
+		return;
+
+	if ( svinst->debug ) {
+		sieve_sys_debug(svinst, "binary cache: "
+			"%u hits, %u misses, %u evictions",
+			cache->hits, cache->misses, cache->evictions);
+	}
+
+	while ( cache->head != NULL )
+		sieve_binary_cache_entry_free(cache, cache->head);
+	hash_table_destroy(&cache->entries);
+
+	svinst->binary_cache = NULL;
+}
+
+static bool sieve_binary_cache_entry_is_valid
+(struct sieve_binary_cache_entry *entry,
+	struct sieve_script *script, enum sieve_compile_flags cpflags)
+{
+	struct sieve_binary *sbin = entry->sbin;
+	struct sieve_instance *svinst = sbin->svinst;
+	const struct stat *bst = &sbin->file->st;
+	struct stat st;
+
+	/* Was the binary file replaced in the mean time (e.g. because it was
+	   recompiled by another process)? */
+	if ( stat(sbin->path, &st) < 0 ) {
+		if ( errno != ENOENT ) {
+			sieve_sys_error(svinst,
+				"binary cache: stat(%s) failed: %m", sbin->path);
+		}
+		return FALSE;
+	}
+	if ( st.st_ino != bst->st_ino || !CMP_DEV_T(st.st_dev, bst->st_dev) ||
+		st.st_size != bst->st_size || st.st_mtime != bst->st_mtime ||
+		ST_MTIME_NSEC(st) != ST_MTIME_NSEC(*bst) )
+		return FALSE;
+
+	/* Check the binary against the freshly opened script; the script object
+	   held by the binary reflects the state at the time it was loaded. The
+	   binary may be in use elsewhere, so it is left untouched. */
+	return sieve_binary_up_to_date_script(sbin, script, cpflags);
+}
+
+struct sieve_binary *sieve_binary_cache_lookup
+(struct sieve_script *script,
+	enum sieve_compile_flags cpflags)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	struct sieve_binary_cache *cache = svinst->binary_cache;
+	struct sieve_binary_cache_entry *entry;
+
+	if ( cache == NULL )
+		return NULL;
+
+	entry = hash_table_lookup(cache->entries,
+		sieve_binary_cache_key(script, cpflags));
+	if ( entry == NULL ) {
+		cache->misses++;
+		return NULL;
+	}
+
+	if ( !sieve_binary_cache_entry_is_valid(entry, script, cpflags) ) {
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "binary cache: "
+				"cached binary %s is no longer up-to-date",
+				sieve_binary_path(entry->sbin));
+		}
+		sieve_binary_cache_entry_free(cache, entry);
+		cache->misses++;
+		return NULL;
+	}
+
+	/* Move to front */
+	if ( entry != cache->head ) {
+		DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+		DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	}
+	cache->hits++;
+
+	sieve_binary_ref(entry->sbin);
+	return entry->sbin;
+}
+
+void sieve_binary_cache_insert
+(struct sieve_binary *sbin,
+	enum sieve_compile_flags cpflags)
+{
+	struct sieve_binary_cache *cache = sbin->svinst->binary_cache;
+	struct sieve_binary_cache_entry *entry;
+	const char *key;
+
+	/* Only binaries loaded from a file can be validated later on */
+	if ( cache == NULL || sbin->file == NULL || sbin->script == NULL )
+		return;
+
+	key = sieve_binary_cache_key(sbin->script, cpflags);
+	entry = hash_table_lookup(cache->entries, key);
+	if ( entry != NULL )
+		sieve_binary_cache_entry_free(cache, entry);
+
+	while ( cache->count >= cache->max_count ) {
+		sieve_binary_cache_entry_free(cache, cache->tail);
+		cache->evictions++;
+	}
+
+	entry = i_new(struct sieve_binary_cache_entry, 1);
+	entry->key = i_strdup(key);
+	entry->sbin = sbin;
+	sieve_binary_ref(sbin);
+
+	hash_table_insert(cache->entries, entry->key, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	cache->count++;
+}
@@ -34,7 +34,7 @@ static inline sieve_size_t sieve_binary_emit_dynamic_data
 static inline void _sieve_binary_emit_data
 (struct sieve_binary_block *sblock, const void *data, sieve_size_t size)
 {
-	buffer_append(sblock->data, data, size);
+	buffer_append(_sieve_binary_block_get_writable(sblock), data, size);
 }
 
 static inline void _sieve_binary_emit_byte
@@ -47,7 +47,7 @@ static inline void _sieve_binary_update_data
 (struct sieve_binary_block *sblock, sieve_size_t address, const void *data,
 	sieve_size_t size)
 {
-	buffer_write(sblock->data, address, data, size);
+	buffer_write(_sieve_binary_block_get_writable(sblock), address, data, size);
 }
 
 sieve_size_t sieve_binary_emit_data
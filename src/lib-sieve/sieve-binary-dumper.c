@@ -11,6 +11,7 @@
 #include "sieve-extensions.h"
 #include "sieve-dump.h"
 #include "sieve-script.h"
+#include "sieve-manifest.h"
 
 #include "sieve-binary-private.h"
 
@@ -180,6 +181,19 @@ bool sieve_binary_dumper_run
 		}
 	}
 
+	/* Dump manifest */
+
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_MANIFEST);
+	if ( sblock != NULL && sieve_binary_block_get_size(sblock) > 0 ) {
+		sieve_binary_dump_sectionf
+			(denv, "Manifest (block: %d)", SBIN_SYSBLOCK_MANIFEST);
+
+		T_BEGIN {
+			success = sieve_manifest_dump(denv, sblock);
+		} T_END;
+		if ( !success ) return FALSE;
+	}
+
 	/* Dump main program */
 
 	sieve_binary_dump_sectionf
@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 /*
  * Macros
@@ -451,6 +452,9 @@ bool sieve_binary_file_open
 
 void sieve_binary_file_close(struct sieve_binary_file **file)
 {
+	if ( (*file)->unload != NULL )
+		(*file)->unload(*file);
+
 	if ( (*file)->fd != -1 ) {
 		if ( close((*file)->fd) < 0 ) {
 			sieve_sys_error((*file)->svinst,
@@ -464,120 +468,6 @@ void sieve_binary_file_close(struct sieve_binary_file **file)
 	*file = NULL;
 }
 
-#if 0 /* file_memory is currently unused */
-
-/* File loaded/mapped to memory */
-
-struct _file_memory {
-	struct sieve_binary_file binfile;
-
-	/* Pointer to the binary in memory */
-	const void *memory;
-	off_t memory_size;
-};
-
-static const void *_file_memory_load_data
-	(struct sieve_binary_file *file, off_t *offset, size_t size)
-{
-	struct _file_memory *fmem = (struct _file_memory *) file;
-
-	*offset = SIEVE_BINARY_ALIGN(*offset);
-
-	if ( (*offset) + size <= fmem->memory_size ) {
-		const void *data = PTR_OFFSET(fmem->memory, *offset);
-		*offset += size;
-		file->offset = *offset;
-
-		return data;
-	}
-
-	return NULL;
-}
-
-static buffer_t *_file_memory_load_buffer
-	(struct sieve_binary_file *file, off_t *offset, size_t size)
-{
-	struct _file_memory *fmem = (struct _file_memory *) file;
-
-	*offset = SIEVE_BINARY_ALIGN(*offset);
-
-	if ( (*offset) + size <= fmem->memory_size ) {
-		const void *data = PTR_OFFSET(fmem->memory, *offset);
-		*offset += size;
-		file->offset = *offset;
-
-		return buffer_create_const_data(file->pool, data, size);
-	}
-
-	return NULL;
-}
-
-static bool _file_memory_load(struct sieve_binary_file *file)
-{
-	struct _file_memory *fmem = (struct _file_memory *) file;
-	int ret;
-	size_t size;
-	void *indata;
-
-	i_assert(file->fd > 0);
-
-	/* Allocate memory buffer
-	 */
-	indata = p_malloc(file->pool, file->st.st_size);
-	size = file->st.st_size;
-
-	file->offset = 0;
-	fmem->memory = indata;
-	fmem->memory_size = file->st.st_size;
-
-	/* Return to beginning of the file */
-	if ( lseek(file->fd, 0, SEEK_SET) == (off_t) -1 ) {
-		sieve_sys_error("failed to seek() in binary %s: %m", file->path);
-		return FALSE;
-	}
-
-	/* Read the whole file into memory */
-	while (size > 0) {
-		if ( (ret=read(file->fd, indata, size)) <= 0 ) {
-			sieve_sys_error("failed to read from binary %s: %m", file->path);
-			break;
-		}
-
-		indata = PTR_OFFSET(indata, ret);
-		size -= ret;
-	}
-
-	if ( size != 0 ) {
-		/* Failed to read the whole file */
-		return FALSE;
-	}
-
-	return TRUE;
-}
-
-static struct sieve_binary_file *_file_memory_open(const char *path)
-{
-	pool_t pool;
-	struct _file_memory *file;
-
-	pool = pool_alloconly_create("sieve_binary_file_memory", 1024);
-	file = p_new(pool, struct _file_memory, 1);
-	file->binfile.pool = pool;
-	file->binfile.path = p_strdup(pool, path);
-	file->binfile.load = _file_memory_load;
-	file->binfile.load_data = _file_memory_load_data;
-	file->binfile.load_buffer = _file_memory_load_buffer;
-
-	if ( !sieve_binary_file_open(&file->binfile, path) ) {
-		pool_unref(&pool);
-		return NULL;
-	}
-
-	return &file->binfile;
-}
-
-#endif /* file_memory is currently unused */
-
 /* File open in lazy mode (only read what is needed into memory) */
 
 static bool _file_lazy_read
@@ -652,24 +542,129 @@ static buffer_t *_file_lazy_load_buffer
 	return NULL;
 }
 
-static struct sieve_binary_file *_file_lazy_open
+/* File mapped into memory (blocks are read-only views of the mapping) */
+
+struct _file_mmap {
+	struct sieve_binary_file binfile;
+
+	/* Read-only mapping of the whole binary */
+	const void *memory;
+	size_t memory_size;
+};
+
+static const void *_file_mmap_load_data
+(struct sieve_binary_file *file, off_t *offset, size_t size)
+{
+	struct _file_mmap *fmap = (struct _file_mmap *) file;
+	uoff_t aligned_offset = SIEVE_BINARY_ALIGN(*offset);
+
+	if ( aligned_offset > fmap->memory_size ||
+		size > fmap->memory_size - aligned_offset ) {
+		sieve_sys_error(file->svinst,
+			"binary read: binary %s is truncated (more data expected)",
+			file->path);
+		return NULL;
+	}
+
+	*offset = aligned_offset + size;
+	file->offset = *offset;
+
+	return CONST_PTR_OFFSET(fmap->memory, aligned_offset);
+}
+
+static buffer_t *_file_mmap_load_buffer
+(struct sieve_binary_file *file, off_t *offset, size_t size)
+{
+	const void *data;
+	buffer_t *buffer;
+
+	if ( (data=_file_mmap_load_data(file, offset, size)) == NULL )
+		return NULL;
+
+	buffer = p_new(file->pool, buffer_t, 1);
+	buffer_create_from_const_data(buffer, data, size);
+	return buffer;
+}
+
+static void _file_mmap_unload(struct sieve_binary_file *file)
+{
+	struct _file_mmap *fmap = (struct _file_mmap *) file;
+
+	if ( munmap((void *) fmap->memory, fmap->memory_size) < 0 ) {
+		sieve_sys_error(file->svinst,
+			"binary close: munmap(%s) failed: %m", file->path);
+	}
+	fmap->memory = NULL;
+}
+
+static bool _file_mmap_load(struct _file_mmap *fmap)
+{
+	struct sieve_binary_file *file = &fmap->binfile;
+	struct sieve_instance *svinst = file->svinst;
+	void *memory;
+
+	if ( file->st.st_size <= 0 || (uoff_t) file->st.st_size > SSIZE_T_MAX )
+		return FALSE;
+
+	memory = mmap(NULL, (size_t) file->st.st_size, PROT_READ, MAP_PRIVATE,
+		file->fd, 0);
+	if ( memory == MAP_FAILED ) {
+		/* Not all filesystems support mmap(); the caller falls back to
+		   reading the binary */
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "binary open: "
+				"mmap(%s) failed: %m (falling back to read())", file->path);
+		}
+		return FALSE;
+	}
+
+	/* The mapping is page-aligned, so the aligned offsets of all records are
+	   properly aligned in memory as well */
+	i_assert( SIEVE_BINARY_ALIGN_PTR(memory) == memory );
+
+	fmap->memory = memory;
+	fmap->memory_size = (size_t) file->st.st_size;
+	file->mapped = TRUE;
+	file->load_data = _file_mmap_load_data;
+	file->load_buffer = _file_mmap_load_buffer;
+	file->unload = _file_mmap_unload;
+
+	/* The mapping remains valid without the descriptor. Binaries are always
+	   replaced atomically by sieve_binary_save(), so the mapped file is never
+	   truncated underneath us. */
+	if ( close(file->fd) < 0 ) {
+		sieve_sys_error(svinst,
+			"binary open: close(fd=%s) failed after mmap(): %m", file->path);
+	}
+	file->fd = -1;
+
+	return TRUE;
+}
+
+static struct sieve_binary_file *_file_open
 (struct sieve_instance *svinst, const char *path, enum sieve_error *error_r)
 {
 	pool_t pool;
+	struct _file_mmap *fmap;
 	struct sieve_binary_file *file;
 
-	pool = pool_alloconly_create("sieve_binary_file_lazy", 4096);
-	file = p_new(pool, struct sieve_binary_file, 1);
+	pool = pool_alloconly_create("sieve_binary_file", 4096);
+	fmap = p_new(pool, struct _file_mmap, 1);
+	file = &fmap->binfile;
 	file->pool = pool;
 	file->path = p_strdup(pool, path);
-	file->load_data = _file_lazy_load_data;
-	file->load_buffer = _file_lazy_load_buffer;
 
 	if ( !sieve_binary_file_open(file, svinst, path, error_r) ) {
 		pool_unref(&pool);
 		return NULL;
 	}
 
+	if ( !_file_mmap_load(fmap) ) {
+		/* Only read what is needed into memory */
+		file->load_data = _file_lazy_load_data;
+		file->load_buffer = _file_lazy_load_buffer;
+	}
+
 	return file;
 }
 
@@ -711,6 +706,7 @@ bool sieve_binary_load_block
 			id, sbin->path, header->size);
 		return FALSE;
 	}
+	sblock->mapped = sbin->file->mapped;
 
 	return TRUE;
 }
@@ -736,6 +732,17 @@ static bool _read_block_index_record
 		return FALSE;
 	}
 
+	if ( record->offset != SIEVE_BINARY_ALIGN(record->offset) ||
+		SIEVE_BINARY_ALIGN((uoff_t) record->offset +
+			sizeof(struct sieve_binary_block_header)) + record->size >
+			(uoff_t) sbin->file->st.st_size ) {
+		sieve_sys_error(sbin->svinst,
+			"binary open: binary %s is corrupt: "
+			"block index record %d points outside the file "
+			"(offset=%u, size=%u)", sbin->path, id, record->offset, record->size);
+		return FALSE;
+	}
+
 	block = sieve_binary_block_create_id(sbin, id);
 	block->ext_index = record->ext_id;
 	block->offset = record->offset;
@@ -897,8 +904,7 @@ struct sieve_binary *sieve_binary_open
 
 	i_assert( script == NULL || sieve_script_svinst(script) == svinst );
 
-	//file = _file_memory_open(path);
-	if ( (file=_file_lazy_open(svinst, path, error_r)) == NULL )
+	if ( (file=_file_open(svinst, path, error_r)) == NULL )
 		return NULL;
 
 	/* Create binary object */
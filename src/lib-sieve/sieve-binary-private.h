@@ -24,6 +24,10 @@ struct sieve_binary_file {
 		(struct sieve_binary_file *file, off_t *offset, size_t size);
 	buffer_t *(*load_buffer)
 		(struct sieve_binary_file *file, off_t *offset, size_t size);
+	void (*unload)(struct sieve_binary_file *file);
+
+	/* Loaded buffers are read-only views of the file mapping */
+	bool mapped:1;
 };
 
 bool sieve_binary_file_open
@@ -67,6 +71,13 @@ struct sieve_binary_block {
 	buffer_t *data;
 
 	uoff_t offset;
+
+	/* Operations decoded by the interpreter */
+	struct sieve_operation_stream *opstream;
+
+	/* Data is a read-only view of the mapped binary file; it is copied before
+	   it is modified */
+	bool mapped:1;
 };
 
 /*
@@ -105,6 +116,9 @@ struct sieve_binary {
 
 	/* Blocks */
 	ARRAY(struct sieve_binary_block *) blocks;
+
+	/* Message fields accessed by the script (read on demand) */
+	struct sieve_manifest *manifest;
 };
 
 struct sieve_binary *sieve_binary_create
@@ -135,6 +149,17 @@ static inline size_t _sieve_binary_block_get_size
 	return buffer_get_used_size(sblock->data);
 }
 
+void sieve_binary_block_unmap(struct sieve_binary_block *sblock);
+
+static inline buffer_t *_sieve_binary_block_get_writable
+(struct sieve_binary_block *sblock)
+{
+	sblock->opstream = NULL;
+	if ( sblock->mapped )
+		sieve_binary_block_unmap(sblock);
+	return sblock->data;
+}
+
 struct sieve_binary_block *sieve_binary_block_create_id
 	(struct sieve_binary *sbin, unsigned int id);
 
@@ -16,6 +16,7 @@
 #include "sieve-extensions.h"
 #include "sieve-code.h"
 #include "sieve-script.h"
+#include "sieve-manifest.h"
 
 #include "sieve-binary-private.h"
 
@@ -281,9 +282,30 @@ struct sieve_binary_block *sieve_binary_block_get
 void sieve_binary_block_clear
 (struct sieve_binary_block *sblock)
 {
+	sblock->opstream = NULL;
+	if ( sblock->mapped ) {
+		sblock->data = buffer_create_dynamic(sblock->sbin->pool, 64);
+		sblock->mapped = FALSE;
+		return;
+	}
+
 	buffer_set_used_size(sblock->data, 0);
 }
 
+void sieve_binary_block_unmap
+(struct sieve_binary_block *sblock)
+{
+	const void *data;
+	size_t size;
+
+	i_assert( sblock->mapped );
+
+	data = buffer_get_data(sblock->data, &size);
+	sblock->data = buffer_create_dynamic(sblock->sbin->pool, size + 64);
+	buffer_append(sblock->data, data, size);
+	sblock->mapped = FALSE;
+}
+
 buffer_t *sieve_binary_block_get_buffer
 (struct sieve_binary_block *sblock)
 {
@@ -311,12 +333,39 @@ size_t sieve_binary_block_get_size
 	return _sieve_binary_block_get_size(sblock);
 }
 
+bool sieve_binary_block_contains
+(const struct sieve_binary_block *sblock, const void *data)
+{
+	const unsigned char *bdata;
+	size_t size;
+
+	if ( sblock->data == NULL )
+		return FALSE;
+
+	bdata = buffer_get_data(sblock->data, &size);
+	return ( (const unsigned char *)data >= bdata &&
+		(const unsigned char *)data < bdata + size );
+}
+
+struct sieve_operation_stream *sieve_binary_block_get_opstream
+(const struct sieve_binary_block *sblock)
+{
+	return sblock->opstream;
+}
+
+void sieve_binary_block_set_opstream
+(struct sieve_binary_block *sblock, struct sieve_operation_stream *opstream)
+{
+	sblock->opstream = opstream;
+}
+
 /*
  * Up-to-date checking
  */
 
-bool sieve_binary_up_to_date
-(struct sieve_binary *sbin, enum sieve_compile_flags cpflags)
+bool sieve_binary_up_to_date_script
+(struct sieve_binary *sbin, struct sieve_script *script,
+	enum sieve_compile_flags cpflags)
 {
 	struct sieve_binary_extension_reg *const *regs;
 	struct sieve_binary_block *sblock;
@@ -327,11 +376,11 @@ bool sieve_binary_up_to_date
 	i_assert(sbin->file != NULL);
 
 	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_SCRIPT_DATA);
-	if ( sblock == NULL || sbin->script == NULL )
+	if ( sblock == NULL || script == NULL )
 		return FALSE;
 
 	if ( (ret=sieve_script_binary_read_metadata
-		(sbin->script, sblock, &offset)) <= 0 ) {
+		(script, sblock, &offset)) <= 0 ) {
 		if (ret < 0) {
 			sieve_sys_debug(sbin->svinst, "binary up-to-date: "
 				"failed to read script metadata from binary %s",
@@ -361,6 +410,55 @@ bool sieve_binary_up_to_date
 	return TRUE;
 }
 
+bool sieve_binary_up_to_date
+(struct sieve_binary *sbin, enum sieve_compile_flags cpflags)
+{
+	return sieve_binary_up_to_date_script(sbin, sbin->script, cpflags);
+}
+
+/*
+ * Manifest
+ */
+
+struct sieve_manifest *sieve_binary_get_manifest(struct sieve_binary *sbin)
+{
+	struct sieve_binary_block *sblock;
+
+	if ( sbin->manifest != NULL )
+		return sbin->manifest;
+
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_MANIFEST);
+	if ( sblock != NULL && sieve_binary_block_get_size(sblock) > 0 ) {
+		sbin->manifest = sieve_manifest_read(sbin->pool, sblock);
+		if ( sbin->manifest == NULL ) {
+			sieve_sys_warning(sbin->svinst,
+				"binary %s has corrupt manifest block", sbin->path);
+		}
+	}
+
+	if ( sbin->manifest == NULL ) {
+		sbin->manifest = sieve_manifest_create(sbin->pool);
+
+		/* Nothing is known about what a loaded binary accesses */
+		if ( sbin->file != NULL ) {
+			sieve_manifest_add_flags(sbin->manifest,
+				SIEVE_MANIFEST_FLAG_ALL_HEADERS | SIEVE_MANIFEST_FLAG_BODY |
+				SIEVE_MANIFEST_FLAG_SIZE | SIEVE_MANIFEST_FLAG_ENVELOPE);
+		}
+	}
+	return sbin->manifest;
+}
+
+void sieve_binary_write_manifest(struct sieve_binary *sbin)
+{
+	struct sieve_binary_block *sblock;
+
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_MANIFEST);
+	i_assert( sblock != NULL );
+
+	sieve_manifest_write(sieve_binary_get_manifest(sbin), sblock);
+}
+
 /*
  * Activate the binary (after code generation)
  */
@@ -10,7 +10,7 @@
  */
 
 #define SIEVE_BINARY_VERSION_MAJOR     1
-#define SIEVE_BINARY_VERSION_MINOR     4
+#define SIEVE_BINARY_VERSION_MINOR     5
 
 /*
  * Binary object
@@ -71,6 +71,30 @@ struct sieve_binary *sieve_binary_open
 		struct sieve_script *script, enum sieve_error *error_r);
 bool sieve_binary_up_to_date
 	(struct sieve_binary *sbin, enum sieve_compile_flags cpflags);
+/* Checks the binary against the provided script rather than the one it was
+   loaded for, without changing the binary */
+bool sieve_binary_up_to_date_script
+	(struct sieve_binary *sbin, struct sieve_script *script,
+		enum sieve_compile_flags cpflags);
+
+/*
+ * Manifest
+ */
+
+struct sieve_manifest *sieve_binary_get_manifest(struct sieve_binary *sbin);
+void sieve_binary_write_manifest(struct sieve_binary *sbin);
+
+/*
+ * Binary cache
+ */
+
+void sieve_binary_cache_init(struct sieve_instance *svinst);
+void sieve_binary_cache_deinit(struct sieve_instance *svinst);
+
+struct sieve_binary *sieve_binary_cache_lookup
+	(struct sieve_script *script, enum sieve_compile_flags cpflags);
+void sieve_binary_cache_insert
+	(struct sieve_binary *sbin, enum sieve_compile_flags cpflags);
 
 /*
  * Block management
@@ -80,6 +104,7 @@ enum sieve_binary_system_block {
 	SBIN_SYSBLOCK_SCRIPT_DATA,
 	SBIN_SYSBLOCK_EXTENSIONS,
 	SBIN_SYSBLOCK_MAIN_PROGRAM,
+	SBIN_SYSBLOCK_MANIFEST,
 	SBIN_SYSBLOCK_LAST
 };
 
@@ -104,6 +129,17 @@ struct sieve_binary *sieve_binary_block_get_binary
 unsigned int sieve_binary_block_get_id
 	(const struct sieve_binary_block *sblock);
 
+bool sieve_binary_block_contains
+	(const struct sieve_binary_block *sblock, const void *data);
+
+/* Decoded operations recorded by the interpreter; discarded when the block
+   is modified */
+struct sieve_operation_stream *sieve_binary_block_get_opstream
+	(const struct sieve_binary_block *sblock);
+void sieve_binary_block_set_opstream
+	(struct sieve_binary_block *sblock,
+		struct sieve_operation_stream *opstream);
+
 /*
  * Extension support
  */
@@ -15,6 +15,7 @@
 #include "sieve-commands.h"
 #include "sieve-code.h"
 #include "sieve-interpreter.h"
+#include "sieve-manifest.h"
 
 /*
  * Literal arguments
@@ -381,10 +382,17 @@ static int _verify_header_name_item
 (void *context, struct sieve_ast_argument *header)
 {
 	struct sieve_validator *valdtr = (struct sieve_validator *) context;
+	struct sieve_manifest *manifest = sieve_ast_manifest(header->ast);
 	string_t *name = sieve_ast_argument_str(header);
 
-	if ( sieve_argument_is_string_literal(header) &&
-		!rfc2822_header_field_name_verify(str_c(name), str_len(name)) ) {
+	if ( !sieve_argument_is_string_literal(header) ) {
+		/* Name is determined at runtime */
+		sieve_manifest_add_flags
+			(manifest, SIEVE_MANIFEST_FLAG_ALL_HEADERS);
+		return 1;
+	}
+
+	if ( !rfc2822_header_field_name_verify(str_c(name), str_len(name)) ) {
 		sieve_argument_validate_warning
 			(valdtr, header, "specified header field name '%s' is invalid",
 				str_sanitize(str_c(name), 80));
@@ -392,6 +400,7 @@ static int _verify_header_name_item
 		return 0;
 	}
 
+	sieve_manifest_add_header(manifest, str_c(name));
 	return 1;
 }
 
@@ -120,6 +120,16 @@ enum sieve_command_type {
 	SCT_HYBRID
 };
 
+/* Static evaluation cost of a test, used by the optimizer to evaluate cheap
+   allof/anyof subtests first. Tests without a cost class may have side
+   effects and are never reordered or merged. */
+enum sieve_test_cost {
+	SIEVE_TEST_COST_UNKNOWN = 0,
+	SIEVE_TEST_COST_CHEAP,
+	SIEVE_TEST_COST_MEDIUM,
+	SIEVE_TEST_COST_EXPENSIVE
+};
+
 struct sieve_command_def {
 	const char *identifier;
 	enum sieve_command_type type;
@@ -130,6 +140,8 @@ struct sieve_command_def {
 	bool block_allowed;
 	bool block_required;
 
+	enum sieve_test_cost cost;
+
 	bool (*registered)
 		(struct sieve_validator *valdtr, const struct sieve_extension *ext,
 			struct sieve_command_registration *cmd_reg);
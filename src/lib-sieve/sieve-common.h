@@ -58,6 +58,9 @@ struct sieve_validator;
 /* sieve-generator.h */
 struct sieve_jumplist;
 struct sieve_generator;
+
+/* sieve-manifest.h */
+struct sieve_manifest;
 struct sieve_codegen_env;
 
 /* sieve-runtime.h */
@@ -92,6 +95,11 @@ struct sieve_binary;
 struct sieve_binary_block;
 struct sieve_binary_debug_writer;
 struct sieve_binary_debug_reader;
+struct sieve_binary_cache;
+struct sieve_script_cache;
+
+/* sieve-interpreter.h */
+struct sieve_operation_stream;
 
 /* sieve-objects.h */
 struct sieve_object_def;
@@ -188,6 +196,11 @@ struct sieve_instance {
 	/* System error handler */
 	struct sieve_error_handler *system_ehandler;
 
+	/* Loaded binaries kept open for reuse */
+	struct sieve_binary_cache *binary_cache;
+	/* Opened script dependencies kept for a while */
+	struct sieve_script_cache *script_cache;
+
 	/* Plugin modules */
 	struct sieve_plugin *plugins;
 	enum sieve_env_location env_location;
@@ -200,6 +213,14 @@ struct sieve_instance {
 	const struct smtp_address *user_email, *user_email_implicit;
 	struct sieve_address_source redirect_from;
 	unsigned int redirect_duplicate_period;
+	bool redirect_batch;
+	unsigned int binary_cache_size;
+	unsigned int script_cache_ttl;
+	const char *profile_report;
+	bool profile_cpu;
+	unsigned int profile_flush_interval;
+	/* Profile totals of this process */
+	struct sieve_profile *profile_totals;
 };
 
 /*
@@ -258,3 +258,160 @@ bool sieve_comparator_octet_skip
 
 	return FALSE;
 }
+
+/*
+ * Substring search
+ */
+
+/* Values shorter than this are scanned using the first-byte prefilter only;
+   building the Horspool skip table does not pay off for them. */
+#define SUBSTRING_HORSPOOL_MIN_VALUE 256
+#define SUBSTRING_HORSPOOL_MIN_KEY   3
+
+static inline bool
+_substring_equals(const unsigned char *val, const unsigned char *key,
+	size_t size, bool casefold)
+{
+	size_t i;
+
+	if ( !casefold )
+		return ( memcmp(val, key, size) == 0 );
+
+	for ( i = 0; i < size; i++ ) {
+		if ( i_tolower(val[i]) != i_tolower(key[i]) )
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Finds the next offset in [pos, end) where the value holds the first byte
+   of the key. The actual scanning is left to memchr(), which libc implements
+   with vector instructions. For a case-insensitive key starting with a
+   letter, both cases are searched and the last hit for each is remembered
+   so that the value is never scanned twice. */
+
+struct _substring_prefilter {
+	unsigned char first_lc, first_uc;
+	const unsigned char *next_lc, *next_uc;
+};
+
+static inline void
+_substring_prefilter_init(struct _substring_prefilter *pf,
+	unsigned char first, bool casefold)
+{
+	i_zero(pf);
+	if ( casefold ) {
+		pf->first_lc = (unsigned char)i_tolower(first);
+		pf->first_uc = (unsigned char)i_toupper(first);
+	} else {
+		pf->first_lc = pf->first_uc = first;
+	}
+}
+
+static inline const unsigned char *
+_substring_prefilter_next(struct _substring_prefilter *pf,
+	const unsigned char *pos, const unsigned char *end)
+{
+	if ( pf->next_lc == NULL || pf->next_lc < pos ) {
+		pf->next_lc = memchr(pos, pf->first_lc, end - pos);
+		if ( pf->next_lc == NULL )
+			pf->next_lc = end;
+	}
+	if ( pf->first_uc == pf->first_lc )
+		return pf->next_lc;
+
+	if ( pf->next_uc == NULL || pf->next_uc < pos ) {
+		pf->next_uc = memchr(pos, pf->first_uc, end - pos);
+		if ( pf->next_uc == NULL )
+			pf->next_uc = end;
+	}
+	return ( pf->next_lc < pf->next_uc ? pf->next_lc : pf->next_uc );
+}
+
+static const char *
+_substring_find_prefilter(const unsigned char *val, size_t val_size,
+	const unsigned char *key, size_t key_size, bool casefold)
+{
+	struct _substring_prefilter pf;
+	const unsigned char *vp = val;
+	const unsigned char *vend = val + (val_size - key_size) + 1;
+
+	_substring_prefilter_init(&pf, key[0], casefold);
+	for (;;) {
+		vp = _substring_prefilter_next(&pf, vp, vend);
+		if ( vp >= vend )
+			return NULL;
+		if ( _substring_equals(vp + 1, key + 1, key_size - 1, casefold) )
+			return (const char *)vp;
+		vp++;
+	}
+}
+
+/* Boyer-Moore-Horspool search. For case-insensitive matching the skip table
+   is filled for both cases of each key character. */
+
+static const char *
+_substring_find_horspool(const unsigned char *val, size_t val_size,
+	const unsigned char *key, size_t key_size, bool casefold)
+{
+	size_t skip[256];
+	size_t last = key_size - 1, pos, i;
+	unsigned char klast;
+
+	for ( i = 0; i < N_ELEMENTS(skip); i++ )
+		skip[i] = key_size;
+	for ( i = 0; i < last; i++ ) {
+		if ( casefold ) {
+			skip[(unsigned char)i_tolower(key[i])] = last - i;
+			skip[(unsigned char)i_toupper(key[i])] = last - i;
+		} else {
+			skip[key[i]] = last - i;
+		}
+	}
+
+	klast = ( casefold ? (unsigned char)i_tolower(key[last]) : key[last] );
+	for ( pos = 0; pos <= val_size - key_size; pos += skip[val[pos + last]] ) {
+		unsigned char vlast = val[pos + last];
+
+		if ( casefold )
+			vlast = (unsigned char)i_tolower(vlast);
+		if ( vlast == klast &&
+			_substring_equals(val + pos, key, last, casefold) )
+			return (const char *)val + pos;
+	}
+	return NULL;
+}
+
+static inline const char *
+_substring_find(const char *val, size_t val_size,
+	const char *key, size_t key_size, bool casefold)
+{
+	const unsigned char *v = (const unsigned char *)val;
+	const unsigned char *k = (const unsigned char *)key;
+
+	if ( key_size == 0 )
+		return val;
+	if ( key_size > val_size )
+		return NULL;
+
+	if ( val_size < SUBSTRING_HORSPOOL_MIN_VALUE ||
+		key_size < SUBSTRING_HORSPOOL_MIN_KEY )
+		return _substring_find_prefilter(v, val_size, k, key_size, casefold);
+	return _substring_find_horspool(v, val_size, k, key_size, casefold);
+}
+
+const char *sieve_comparator_octet_substring_find
+(const struct sieve_comparator *cmp ATTR_UNUSED,
+	const char *val, size_t val_size,
+	const char *key, size_t key_size)
+{
+	return _substring_find(val, val_size, key, key_size, FALSE);
+}
+
+const char *sieve_comparator_casemap_substring_find
+(const struct sieve_comparator *cmp ATTR_UNUSED,
+	const char *val, size_t val_size,
+	const char *key, size_t key_size)
+{
+	return _substring_find(val, val_size, key, key_size, TRUE);
+}
@@ -53,6 +53,14 @@ struct sieve_comparator_def {
 		const char **key, const char *key_end);
 	bool (*char_skip)(const struct sieve_comparator *cmp,
 		const char **val, const char *val_end);
+
+	/* Substring search (optional); when present, :contains uses this
+	   instead of calling char_match() at every value offset. Returns a
+	   pointer to the first occurrence of key in val or NULL. */
+
+	const char *(*substring_find)(const struct sieve_comparator *cmp,
+		const char *val, size_t val_size,
+		const char *key, size_t key_size);
 };
 
 /*
@@ -150,4 +158,13 @@ bool sieve_comparator_octet_skip
 	(const struct sieve_comparator *cmp ATTR_UNUSED,
 		const char **val, const char *val_end);
 
+const char *sieve_comparator_octet_substring_find
+	(const struct sieve_comparator *cmp ATTR_UNUSED,
+		const char *val, size_t val_size,
+		const char *key, size_t key_size);
+const char *sieve_comparator_casemap_substring_find
+	(const struct sieve_comparator *cmp ATTR_UNUSED,
+		const char *val, size_t val_size,
+		const char *key, size_t key_size);
+
 #endif
@@ -5,11 +5,13 @@
 #include "mempool.h"
 
 #include "sieve-common.h"
+#include "sieve-error.h"
 #include "sieve-script.h"
 #include "sieve-extensions.h"
 #include "sieve-commands.h"
 #include "sieve-code.h"
 #include "sieve-binary.h"
+#include "sieve-manifest.h"
 
 #include "sieve-generator.h"
 
@@ -224,6 +226,243 @@ const void *sieve_generator_extension_get_context
 	return *ctx;
 }
 
+/*
+ * AST optimization
+ */
+
+/* Runs between validation and code generation when the script is compiled
+   with SIEVE_COMPILE_FLAG_OPTIMIZE. Constant tests and the branches they
+   disable are already eliminated by the validator; this pass simplifies the
+   structure of what remains:
+
+     - nested allof/anyof tests of the same kind are flattened,
+     - allof/anyof subtests are reordered so that cheap ones are evaluated
+       first (see enum sieve_test_cost),
+     - adjacent identical subtests of allof/anyof are evaluated only once,
+     - commands following an unconditional exit (e.g. stop) are dropped.
+ */
+
+struct sieve_optimizer_stats {
+	unsigned int flattened;
+	unsigned int reordered;
+	unsigned int duplicates;
+	unsigned int unreachable;
+};
+
+static bool sieve_optimize_arguments_substitute
+(const struct sieve_ast_argument *arg)
+{
+	for ( ; arg != NULL; arg = sieve_ast_argument_next(arg) ) {
+		switch ( sieve_ast_argument_type(arg) ) {
+		case SAAT_STRING:
+			if ( strstr(sieve_ast_argument_strc(arg), "${") != NULL )
+				return TRUE;
+			break;
+		case SAAT_STRING_LIST:
+			if ( sieve_optimize_arguments_substitute
+				(sieve_ast_strlist_first(arg)) )
+				return TRUE;
+			break;
+		default:
+			break;
+		}
+
+		if ( sieve_optimize_arguments_substitute(arg->parameters) )
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static bool sieve_optimize_test_is_junction
+(const struct sieve_ast_node *test)
+{
+	return ( test->command != NULL &&
+		(test->command->def == &tst_allof ||
+			test->command->def == &tst_anyof) );
+}
+
+static bool sieve_optimize_test_sets_match_values
+(const struct sieve_ast_node *test)
+{
+	const struct sieve_ast_argument *arg;
+
+	for ( arg = sieve_ast_argument_first(test); arg != NULL;
+		arg = sieve_ast_argument_next(arg) ) {
+		if ( sieve_ast_argument_type(arg) == SAAT_TAG &&
+			(strcasecmp(sieve_ast_argument_tag(arg), "matches") == 0 ||
+				strcasecmp(sieve_ast_argument_tag(arg), "regex") == 0) )
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static enum sieve_test_cost sieve_optimize_test_cost
+(const struct sieve_ast_node *test)
+{
+	const struct sieve_ast_node *subtest;
+	enum sieve_test_cost cost, subcost;
+
+	if ( test->command == NULL )
+		return SIEVE_TEST_COST_UNKNOWN;
+
+	if ( sieve_optimize_test_is_junction(test) ||
+		test->command->def == &tst_not ) {
+		/* As expensive as the most expensive subtest */
+		cost = SIEVE_TEST_COST_CHEAP;
+		for ( subtest = sieve_ast_test_first(test); subtest != NULL;
+			subtest = sieve_ast_test_next(subtest) ) {
+			subcost = sieve_optimize_test_cost(subtest);
+			if ( subcost == SIEVE_TEST_COST_UNKNOWN )
+				return SIEVE_TEST_COST_UNKNOWN;
+			if ( subcost > cost )
+				cost = subcost;
+		}
+		return cost;
+	}
+
+	/* Moving tests that assign or refer to match values would change
+	   which values are visible */
+	if ( sieve_optimize_test_sets_match_values(test) ||
+		sieve_optimize_arguments_substitute(sieve_ast_argument_first(test)) )
+		return SIEVE_TEST_COST_UNKNOWN;
+
+	return test->command->def->cost;
+}
+
+static void sieve_optimize_reorder
+(struct sieve_ast_node *node, struct sieve_optimizer_stats *stats)
+{
+	struct sieve_ast_node *test, *next, *pos, *run_first = NULL;
+	enum sieve_test_cost cost;
+
+	/* Stable insertion sort by cost within each run of movable tests;
+	   nothing is ever moved across a test without a cost class */
+	test = sieve_ast_test_first(node);
+	while ( test != NULL ) {
+		next = sieve_ast_test_next(test);
+		cost = sieve_optimize_test_cost(test);
+
+		if ( cost == SIEVE_TEST_COST_UNKNOWN ) {
+			run_first = NULL;
+		} else if ( run_first == NULL ) {
+			run_first = test;
+		} else {
+			pos = run_first;
+			while ( pos != test && sieve_optimize_test_cost(pos) <= cost )
+				pos = sieve_ast_test_next(pos);
+
+			if ( pos != test ) {
+				sieve_ast_test_move_before(test, pos);
+				if ( pos == run_first )
+					run_first = test;
+				stats->reordered++;
+			}
+		}
+
+		test = next;
+	}
+}
+
+static void sieve_optimize_tests
+(struct sieve_ast_node *node, struct sieve_optimizer_stats *stats)
+{
+	struct sieve_ast_node *test, *next;
+	bool junction = sieve_optimize_test_is_junction(node);
+
+	/* Flatten nested junctions: allof(allof(a, b), c) => allof(a, b, c) */
+	test = sieve_ast_test_first(node);
+	while ( test != NULL ) {
+		next = sieve_ast_test_next(test);
+
+		sieve_optimize_tests(test, stats);
+
+		if ( junction && test->command != NULL &&
+			test->command->def == node->command->def ) {
+			sieve_ast_test_splice(test);
+			stats->flattened++;
+		}
+
+		test = next;
+	}
+
+	if ( !junction )
+		return;
+
+	/* Evaluate cheap tests first: anyof(body, size) => anyof(size, body) */
+	sieve_optimize_reorder(node, stats);
+
+	/* Drop adjacent duplicates: anyof(a, a, b) => anyof(a, b). Only tests
+	   with a cost class are known to have no side effects and not to depend
+	   on match values; e.g. two identical execute tests both need to run. */
+	test = sieve_ast_test_first(node);
+	while ( test != NULL ) {
+		next = sieve_ast_test_next(test);
+
+		if ( next != NULL && sieve_ast_node_equal(test, next) &&
+			sieve_optimize_test_cost(next) != SIEVE_TEST_COST_UNKNOWN ) {
+			(void)sieve_ast_node_detach(next);
+			stats->duplicates++;
+			continue;
+		}
+
+		test = next;
+	}
+}
+
+static void sieve_optimize_block
+(struct sieve_ast_node *block, struct sieve_optimizer_stats *stats)
+{
+	struct sieve_command *parent = block->command;
+	struct sieve_ast_node *cmd_node, *next;
+
+	cmd_node = sieve_ast_command_first(block);
+	while ( cmd_node != NULL ) {
+		struct sieve_command *cmd = cmd_node->command;
+
+		/* Blocks skipped by the validator are not generated at all */
+		if ( cmd == NULL )
+			return;
+
+		next = sieve_ast_command_next(cmd_node);
+
+		sieve_optimize_tests(cmd_node, stats);
+		sieve_optimize_block(cmd_node, stats);
+
+		if ( next != NULL && (cmd->def == &cmd_stop ||
+			(parent != NULL && parent->block_exit_command == cmd)) ) {
+			/* Nothing after an unconditional exit is ever executed */
+			unsigned int count = 0;
+
+			for ( ; next != NULL; next = sieve_ast_command_next(next) )
+				count++;
+			(void)sieve_ast_nodes_detach
+				(sieve_ast_command_next(cmd_node), count);
+			stats->unreachable += count;
+			return;
+		}
+
+		cmd_node = next;
+	}
+}
+
+static void sieve_generator_optimize(struct sieve_generator *gentr)
+{
+	struct sieve_instance *svinst = gentr->genenv.svinst;
+	struct sieve_optimizer_stats stats;
+
+	i_zero(&stats);
+	sieve_optimize_block(sieve_ast_root(gentr->genenv.ast), &stats);
+
+	if ( svinst->debug ) {
+		sieve_sys_debug(svinst, "optimizer: script %s: "
+			"%u tests flattened, %u tests reordered, "
+			"%u duplicate tests and %u unreachable commands removed",
+			sieve_script_name(gentr->genenv.script), stats.flattened,
+			stats.reordered, stats.duplicates, stats.unreachable);
+	}
+}
+
 /*
  * Code generation API
  */
@@ -497,12 +736,25 @@ struct sieve_binary *sieve_generator_run
 
 	/* Generate code */
 
+	if ( result &&
+		(gentr->genenv.flags & SIEVE_COMPILE_FLAG_OPTIMIZE) != 0 )
+		sieve_generator_optimize(gentr);
+
 	if ( result ) {
 		if ( !sieve_generate_block
-			(&gentr->genenv, sieve_ast_root(gentr->genenv.ast)))
+			(&gentr->genenv, sieve_ast_root(gentr->genenv.ast))) {
 			result = FALSE;
-		else if ( topmost )
-			sieve_binary_activate(sbin);
+		} else {
+			/* Record the message fields accessed by this script; included
+			   scripts are generated before the topmost one finishes */
+			sieve_manifest_merge(sieve_binary_get_manifest(sbin),
+				sieve_ast_manifest(gentr->genenv.ast));
+
+			if ( topmost ) {
+				sieve_binary_write_manifest(sbin);
+				sieve_binary_activate(sbin);
+			}
+		}
 	}
 
 	/* Cleanup */
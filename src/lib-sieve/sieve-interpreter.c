@@ -22,6 +22,7 @@
 #include "sieve-result.h"
 #include "sieve-comparators.h"
 #include "sieve-runtime-trace.h"
+#include "sieve-profile.h"
 
 #include "sieve-interpreter.h"
 
@@ -53,6 +54,57 @@ struct sieve_interpreter_loop {
 	void *context;
 };
 
+/*
+ * Decoded operation stream
+ */
+
+/* Operands are only read by the operations themselves, so the boundaries of
+   the operations in a code block are not known until they are executed. The
+   stream is therefore filled in as operations are executed for the first
+   time; any later execution of the same operation (loops, subsequent runs of
+   a binary that is kept open) is looked up instead of decoded again. It is
+   still executed like any other operation.
+ */
+
+struct sieve_operation_stream_entry {
+	sieve_size_t address;
+	struct sieve_operation oprtn;
+	sieve_size_t operands;
+};
+
+struct sieve_operation_stream {
+	/* Decoded operations, sorted by code address */
+	ARRAY(struct sieve_operation_stream_entry) entries;
+};
+
+static struct sieve_operation_stream *sieve_operation_stream_get
+(struct sieve_binary_block *sblock)
+{
+	struct sieve_binary *sbin = sieve_binary_block_get_binary(sblock);
+	pool_t pool = sieve_binary_pool(sbin);
+	struct sieve_operation_stream *opstream;
+
+	/* Created once for each block; writing the block drops it */
+	opstream = sieve_binary_block_get_opstream(sblock);
+	if ( opstream != NULL )
+		return opstream;
+
+	opstream = p_new(pool, struct sieve_operation_stream, 1);
+	p_array_init(&opstream->entries, pool, 64);
+
+	sieve_binary_block_set_opstream(sblock, opstream);
+	return opstream;
+}
+
+static int sieve_operation_stream_entry_cmp
+(const sieve_size_t *address,
+	const struct sieve_operation_stream_entry *entry)
+{
+	if ( *address < entry->address )
+		return -1;
+	return ( *address > entry->address ? 1 : 0 );
+}
+
 /*
  * Interpreter
  */
@@ -71,6 +123,7 @@ struct sieve_interpreter {
 	sieve_size_t pc;          /* Program counter */
 	bool interrupted;         /* Interpreter interrupt requested */
 	bool test_result;         /* Result of previous test command */
+	bool test_evaluated;      /* Current operation produced a test result */
 
 	/* Loop stack */
 	ARRAY(struct sieve_interpreter_loop) loop_stack;
@@ -83,10 +136,15 @@ struct sieve_interpreter {
 
 	/* Current operation */
 	struct sieve_operation oprtn;
+	struct sieve_operation_stream *opstream;
+	unsigned int op_count;
 
 	/* Location information */
 	struct sieve_binary_debug_reader *dreader;
 	unsigned int command_line;
+
+	/* Profile of the executed script (if enabled) */
+	struct sieve_profile_script *profile;
 };
 
 static struct sieve_interpreter *_sieve_interpreter_create
@@ -147,6 +205,11 @@ static struct sieve_interpreter *_sieve_interpreter_create
 	else
 		interp->runenv.script = script;
 
+	if ( senv->profile != NULL ) {
+		interp->profile = sieve_profile_get_script
+			(senv->profile, interp->runenv.script);
+	}
+
 	interp->runenv.pc = 0;
 	address = &(interp->runenv.pc);
 
@@ -232,6 +295,7 @@ static struct sieve_interpreter *_sieve_interpreter_create
 		interp = NULL;
 	} else {
 		interp->reset_vector = *address;
+		interp->opstream = sieve_operation_stream_get(sblock);
 	}
 
 	return interp;
@@ -809,6 +873,17 @@ void sieve_interpreter_interrupt(struct sieve_interpreter *interp)
 	interp->interrupted = TRUE;
 }
 
+void sieve_interpreter_disable_opstream(struct sieve_interpreter *interp)
+{
+	interp->opstream = NULL;
+}
+
+unsigned int sieve_interpreter_get_operation_count
+(struct sieve_interpreter *interp)
+{
+	return interp->op_count;
+}
+
 sieve_size_t sieve_interpreter_program_counter(struct sieve_interpreter *interp)
 {
 	return interp->runenv.pc;
@@ -877,6 +952,7 @@ void sieve_interpreter_set_test_result
 (struct sieve_interpreter *interp, bool result)
 {
 	interp->test_result = result;
+	interp->test_evaluated = TRUE;
 }
 
 bool sieve_interpreter_get_test_result
@@ -889,16 +965,54 @@ bool sieve_interpreter_get_test_result
  * Code execute
  */
 
+static bool sieve_interpreter_operation_read
+(struct sieve_interpreter *interp, sieve_size_t *address,
+	struct sieve_operation *oprtn)
+{
+	struct sieve_operation_stream *opstream = interp->opstream;
+	struct sieve_operation_stream_entry *entry;
+	unsigned int idx = 0;
+
+	/* Already decoded? */
+	if ( opstream != NULL &&
+		array_bsearch_insert_pos(&opstream->entries, address,
+			sieve_operation_stream_entry_cmp, &idx) ) {
+		entry = array_idx_modifiable(&opstream->entries, idx);
+		*oprtn = entry->oprtn;
+		*address = entry->operands;
+		return TRUE;
+	}
+
+	if ( !sieve_operation_read(interp->runenv.sblock, address, oprtn) )
+		return FALSE;
+
+	/* Record it */
+	if ( opstream != NULL ) {
+		entry = array_insert_space(&opstream->entries, idx);
+		entry->address = oprtn->address;
+		entry->oprtn = *oprtn;
+		entry->operands = *address;
+	}
+	return TRUE;
+}
+
 static int sieve_interpreter_operation_execute
 (struct sieve_interpreter *interp)
 {
 	struct sieve_operation *oprtn = &(interp->oprtn);
 	sieve_size_t *address = &(interp->runenv.pc);
+	struct sieve_profile_sample sample;
 
 	sieve_runtime_trace_toplevel(&interp->runenv);
+	interp->op_count++;
+
+	if ( interp->profile != NULL ) {
+		interp->test_evaluated = FALSE;
+		sieve_profile_sample_start(interp->profile, &sample);
+	}
 
 	/* Read the operation */
-	if ( sieve_operation_read(interp->runenv.sblock, address, oprtn) ) {
+	if ( sieve_interpreter_operation_read(interp, address, oprtn) ) {
 		const struct sieve_operation_def *op = oprtn->def;
 		int result = SIEVE_EXEC_OK;
 
@@ -916,6 +1030,12 @@ static int sieve_interpreter_operation_execute
 					sieve_operation_mnemonic(oprtn));
 		}
 
+		if ( interp->profile != NULL ) {
+			sieve_profile_script_record(interp->profile,
+				sieve_runtime_get_command_location(&interp->runenv),
+				&sample, interp->test_evaluated, interp->test_result);
+		}
+
 		return result;
 	}
 
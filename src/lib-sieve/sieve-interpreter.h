@@ -97,6 +97,15 @@ void sieve_interpreter_reset
 	(struct sieve_interpreter *interp);
 void sieve_interpreter_interrupt
 	(struct sieve_interpreter *interp);
+
+/* Decode every operation from the code (for benchmarking) */
+void sieve_interpreter_disable_opstream
+	(struct sieve_interpreter *interp);
+
+/* Number of operations executed so far (for benchmarking) */
+unsigned int sieve_interpreter_get_operation_count
+	(struct sieve_interpreter *interp);
+
 sieve_size_t sieve_interpreter_program_counter
 	(struct sieve_interpreter *interp);
 
@@ -9,6 +9,11 @@
 
 #define SIEVE_DEFAULT_MAX_SCRIPT_SIZE  (1 << 20)
 
+#define SIEVE_DEFAULT_BINARY_CACHE_SIZE 16
+#define SIEVE_DEFAULT_SCRIPT_CACHE_TTL  0
+
+#define SIEVE_DEFAULT_PROFILE_FLUSH_INTERVAL 60
+
 #define SIEVE_MAX_LOOP_DEPTH           4
 
 /*
@@ -0,0 +1,216 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "str.h"
+#include "str-sanitize.h"
+#include "array.h"
+
+#include "sieve-common.h"
+#include "sieve-binary.h"
+#include "sieve-dump.h"
+
+#include "sieve-manifest.h"
+
+/*
+ * Script manifest
+ */
+
+struct sieve_manifest {
+	pool_t pool;
+
+	enum sieve_manifest_flags flags;
+
+	ARRAY_TYPE(const_string) headers;
+	ARRAY_TYPE(const_string) envelope_parts;
+};
+
+struct sieve_manifest *sieve_manifest_create(pool_t pool)
+{
+	struct sieve_manifest *manifest;
+
+	manifest = p_new(pool, struct sieve_manifest, 1);
+	manifest->pool = pool;
+	p_array_init(&manifest->headers, pool, 8);
+	p_array_init(&manifest->envelope_parts, pool, 2);
+
+	return manifest;
+}
+
+static void sieve_manifest_add_name
+(pool_t pool, ARRAY_TYPE(const_string) *names, const char *name)
+{
+	const char *const *namep;
+
+	array_foreach(names, namep) {
+		if ( strcasecmp(*namep, name) == 0 )
+			return;
+	}
+
+	name = p_strdup(pool, name);
+	array_append(names, &name, 1);
+}
+
+void sieve_manifest_add_flags
+(struct sieve_manifest *manifest, enum sieve_manifest_flags flags)
+{
+	manifest->flags |= flags;
+}
+
+void sieve_manifest_add_header
+(struct sieve_manifest *manifest, const char *field_name)
+{
+	sieve_manifest_add_name
+		(manifest->pool, &manifest->headers, field_name);
+}
+
+void sieve_manifest_add_envelope_part
+(struct sieve_manifest *manifest, const char *part)
+{
+	manifest->flags |= SIEVE_MANIFEST_FLAG_ENVELOPE;
+	sieve_manifest_add_name
+		(manifest->pool, &manifest->envelope_parts, part);
+}
+
+void sieve_manifest_merge
+(struct sieve_manifest *dest, const struct sieve_manifest *src)
+{
+	const char *const *namep;
+
+	dest->flags |= src->flags;
+
+	array_foreach(&src->headers, namep)
+		sieve_manifest_add_header(dest, *namep);
+	array_foreach(&src->envelope_parts, namep)
+		sieve_manifest_add_envelope_part(dest, *namep);
+}
+
+enum sieve_manifest_flags sieve_manifest_get_flags
+(const struct sieve_manifest *manifest)
+{
+	return manifest->flags;
+}
+
+const char *const *sieve_manifest_get_headers
+(const struct sieve_manifest *manifest, unsigned int *count_r)
+{
+	return array_get(&manifest->headers, count_r);
+}
+
+const char *const *sieve_manifest_get_envelope_parts
+(const struct sieve_manifest *manifest, unsigned int *count_r)
+{
+	return array_get(&manifest->envelope_parts, count_r);
+}
+
+/*
+ * Binary block
+ *
+ *   <flags> <header count> <header name>* <envelope part count> <part>*
+ */
+
+static void sieve_manifest_write_names
+(struct sieve_binary_block *sblock, const ARRAY_TYPE(const_string) *names)
+{
+	const char *const *namep;
+
+	(void)sieve_binary_emit_unsigned(sblock, array_count(names));
+	array_foreach(names, namep)
+		(void)sieve_binary_emit_cstring(sblock, *namep);
+}
+
+void sieve_manifest_write
+(const struct sieve_manifest *manifest,
+	struct sieve_binary_block *sblock)
+{
+	sieve_binary_block_clear(sblock);
+
+	(void)sieve_binary_emit_unsigned(sblock, manifest->flags);
+	sieve_manifest_write_names(sblock, &manifest->headers);
+	sieve_manifest_write_names(sblock, &manifest->envelope_parts);
+}
+
+static bool sieve_manifest_read_names
+(struct sieve_binary_block *sblock, sieve_size_t *offset,
+	pool_t pool, ARRAY_TYPE(const_string) *names)
+{
+	unsigned int count, i;
+
+	if ( !sieve_binary_read_unsigned(sblock, offset, &count) )
+		return FALSE;
+
+	for ( i = 0; i < count; i++ ) {
+		string_t *name;
+
+		if ( !sieve_binary_read_string(sblock, offset, &name) )
+			return FALSE;
+		sieve_manifest_add_name(pool, names, str_c(name));
+	}
+	return TRUE;
+}
+
+struct sieve_manifest *sieve_manifest_read
+(pool_t pool, struct sieve_binary_block *sblock)
+{
+	struct sieve_manifest *manifest;
+	sieve_size_t offset = 0;
+	unsigned int flags;
+	bool result = TRUE;
+
+	manifest = sieve_manifest_create(pool);
+
+	T_BEGIN {
+		if ( !sieve_binary_read_unsigned(sblock, &offset, &flags) ||
+			!sieve_manifest_read_names
+				(sblock, &offset, pool, &manifest->headers) ||
+			!sieve_manifest_read_names
+				(sblock, &offset, pool, &manifest->envelope_parts) )
+			result = FALSE;
+	} T_END;
+
+	if ( !result )
+		return NULL;
+
+	manifest->flags = (enum sieve_manifest_flags)flags;
+	return manifest;
+}
+
+bool sieve_manifest_dump
+(const struct sieve_dumptime_env *denv,
+	struct sieve_binary_block *sblock)
+{
+	struct sieve_manifest *manifest;
+	const char *const *names;
+	unsigned int count, i;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_manifest_dump", 1024);
+	manifest = sieve_manifest_read(pool, sblock);
+	if ( manifest == NULL ) {
+		pool_unref(&pool);
+		return FALSE;
+	}
+
+	sieve_binary_dumpf(denv, "body: %s\n",
+		( (manifest->flags & SIEVE_MANIFEST_FLAG_BODY) != 0 ? "yes" : "no" ));
+	sieve_binary_dumpf(denv, "size: %s\n",
+		( (manifest->flags & SIEVE_MANIFEST_FLAG_SIZE) != 0 ? "yes" : "no" ));
+
+	names = array_get(&manifest->envelope_parts, &count);
+	sieve_binary_dumpf(denv, "envelope: %u parts\n", count);
+	for ( i = 0; i < count; i++ )
+		sieve_binary_dumpf(denv, "  %s\n", str_sanitize(names[i], 80));
+
+	names = array_get(&manifest->headers, &count);
+	if ( (manifest->flags & SIEVE_MANIFEST_FLAG_ALL_HEADERS) != 0 ) {
+		sieve_binary_dumpf(denv,
+			"headers: %u fields (others determined at runtime)\n", count);
+	} else {
+		sieve_binary_dumpf(denv, "headers: %u fields\n", count);
+	}
+	for ( i = 0; i < count; i++ )
+		sieve_binary_dumpf(denv, "  %s\n", str_sanitize(names[i], 80));
+
+	pool_unref(&pool);
+	return TRUE;
+}
@@ -0,0 +1,49 @@
+#ifndef SIEVE_MANIFEST_H
+#define SIEVE_MANIFEST_H
+
+#include "sieve-common.h"
+
+/*
+ * Script manifest
+ *
+ *   Records which parts of the message a script accesses. It is collected
+ *   while the script is validated and stored in the binary, so that callers
+ *   can prefetch the needed fields before the script is executed.
+ */
+
+struct sieve_manifest;
+
+struct sieve_manifest *sieve_manifest_create(pool_t pool);
+
+void sieve_manifest_add_flags
+	(struct sieve_manifest *manifest, enum sieve_manifest_flags flags);
+void sieve_manifest_add_header
+	(struct sieve_manifest *manifest, const char *field_name);
+void sieve_manifest_add_envelope_part
+	(struct sieve_manifest *manifest, const char *part);
+
+void sieve_manifest_merge
+	(struct sieve_manifest *dest, const struct sieve_manifest *src);
+
+enum sieve_manifest_flags sieve_manifest_get_flags
+	(const struct sieve_manifest *manifest);
+const char *const *sieve_manifest_get_headers
+	(const struct sieve_manifest *manifest, unsigned int *count_r);
+const char *const *sieve_manifest_get_envelope_parts
+	(const struct sieve_manifest *manifest, unsigned int *count_r);
+
+/*
+ * Binary block
+ */
+
+void sieve_manifest_write
+	(const struct sieve_manifest *manifest,
+		struct sieve_binary_block *sblock);
+struct sieve_manifest *sieve_manifest_read
+	(pool_t pool, struct sieve_binary_block *sblock);
+
+bool sieve_manifest_dump
+	(const struct sieve_dumptime_env *denv,
+		struct sieve_binary_block *sblock);
+
+#endif
@@ -6,6 +6,7 @@
 #include "mempool.h"
 #include "hash.h"
 #include "array.h"
+#include "str-slice.h"
 
 #include "sieve-common.h"
 #include "sieve-limits.h"
@@ -29,10 +30,24 @@
 
 struct sieve_match_values {
 	pool_t pool;
-	ARRAY(string_t *) values;
-	unsigned count;
+
+	/* Values are shared with variables they are assigned to; NULL entries
+	   are empty */
+	ARRAY(struct str_slice *) values;
 };
 
+static void sieve_match_values_free(struct sieve_match_values **_mvalues)
+{
+	struct sieve_match_values *mvalues = *_mvalues;
+	struct str_slice **slicep;
+
+	*_mvalues = NULL;
+
+	array_foreach_modifiable(&mvalues->values, slicep)
+		str_slice_unref(slicep);
+	pool_unref(&mvalues->pool);
+}
+
 /*
  * Default match types
  */
@@ -139,9 +154,8 @@ static void mtch_interpreter_free
 	struct mtch_interpreter_context *mctx =
 		(struct mtch_interpreter_context *) context;
 
-	if ( mctx->match_values != NULL ) {
-		pool_unref(&mctx->match_values->pool);
-	}
+	if ( mctx->match_values != NULL )
+		sieve_match_values_free(&mctx->match_values);
 }
 
 struct sieve_interpreter_extension
@@ -174,6 +188,94 @@ static inline struct mtch_interpreter_context *get_interpreter_context
 	return ctx;
 }
 
+/*
+ * Binary context
+ */
+
+struct mtch_binary_context {
+	HASH_TABLE(const void *, void *) key_cache;
+};
+
+static void mtch_binary_free
+(const struct sieve_extension *ext ATTR_UNUSED,
+	struct sieve_binary *sbin ATTR_UNUSED, void *context)
+{
+	struct mtch_binary_context *bctx =
+		(struct mtch_binary_context *) context;
+
+	hash_table_destroy(&bctx->key_cache);
+}
+
+const struct sieve_binary_extension mtch_binary_extension = {
+	.extension = &match_type_extension,
+	.binary_free = mtch_binary_free
+};
+
+static struct mtch_binary_context *get_binary_context
+(struct sieve_binary *sbin, bool create)
+{
+	struct sieve_instance *svinst;
+	const struct sieve_extension *mcht_ext;
+	struct mtch_binary_context *bctx;
+
+	svinst = sieve_binary_svinst(sbin);
+	mcht_ext = sieve_get_match_type_extension(svinst);
+
+	bctx = (struct mtch_binary_context *)
+		sieve_binary_extension_get_context(sbin, mcht_ext);
+
+	if ( bctx == NULL && create ) {
+		pool_t pool = sieve_binary_pool(sbin);
+
+		bctx = p_new(pool, struct mtch_binary_context, 1);
+		hash_table_create_direct(&bctx->key_cache, default_pool, 0);
+
+		sieve_binary_extension_set
+			(sbin, mcht_ext, &mtch_binary_extension, (void *) bctx);
+	}
+
+	return bctx;
+}
+
+/*
+ * Key cache
+ */
+
+bool sieve_match_key_is_constant
+(const struct sieve_runtime_env *renv, const char *key)
+{
+	/* Literal keys are read directly from the code block, so their data
+	   lies within it. Keys composed at runtime (e.g. from variables) do not.
+	 */
+	return sieve_binary_block_contains(renv->sblock, key);
+}
+
+pool_t sieve_match_key_cache_pool
+(const struct sieve_runtime_env *renv)
+{
+	return sieve_binary_pool(renv->sbin);
+}
+
+void *sieve_match_key_cache_lookup
+(const struct sieve_runtime_env *renv, const void *key)
+{
+	struct mtch_binary_context *bctx =
+		get_binary_context(renv->sbin, FALSE);
+
+	if ( bctx == NULL )
+		return NULL;
+	return hash_table_lookup(bctx->key_cache, key);
+}
+
+void sieve_match_key_cache_insert
+(const struct sieve_runtime_env *renv, const void *key, void *data)
+{
+	struct mtch_binary_context *bctx =
+		get_binary_context(renv->sbin, TRUE);
+
+	hash_table_update(bctx->key_cache, key, data);
+}
+
 /*
  * Match values
  */
@@ -217,65 +319,69 @@ struct sieve_match_values *sieve_match_values_start
 
 	match_values = p_new(pool, struct sieve_match_values, 1);
 	match_values->pool = pool;
-	match_values->count = 0;
 
 	p_array_init(&match_values->values, pool, 4);
 
 	return match_values;
 }
 
-static string_t *sieve_match_values_add_entry
-(struct sieve_match_values *mvalues)
+static void sieve_match_values_add_entry
+(struct sieve_match_values *mvalues, struct str_slice *slice)
 {
-	string_t *entry;
-
-	if ( mvalues == NULL ) return NULL;
-
-	if ( mvalues->count >= SIEVE_MAX_MATCH_VALUES ) return NULL;
-
-	if ( mvalues->count >= array_count(&mvalues->values) ) {
-		entry = str_new(mvalues->pool, 64);
-		array_append(&mvalues->values, &entry, 1);	} else {
-		string_t * const *ep = array_idx(&mvalues->values, mvalues->count);
-		entry = *ep;
-		str_truncate(entry, 0);
+	if ( mvalues == NULL ||
+		array_count(&mvalues->values) >= SIEVE_MAX_MATCH_VALUES ) {
+		str_slice_unref(&slice);
+		return;
 	}
 
-	mvalues->count++;
-
-	return entry;
+	array_append(&mvalues->values, &slice, 1);
 }
 
 void sieve_match_values_set
 (struct sieve_match_values *mvalues, unsigned int index, string_t *value)
 {
-	if ( mvalues != NULL && index < array_count(&mvalues->values) ) {
-		string_t * const *ep = array_idx(&mvalues->values, index);
-    	string_t *entry = *ep;
+	if ( mvalues != NULL && value != NULL &&
+		index < array_count(&mvalues->values) ) {
+		struct str_slice **ep = array_idx_modifiable(&mvalues->values, index);
 
-	    if ( entry != NULL && value != NULL ) {
-			str_truncate(entry, 0);
-        	str_append_str(entry, value);
-		}
+		str_slice_unref(ep);
+		*ep = str_slice_create_str(value);
 	}
 }
 
 void sieve_match_values_add
 (struct sieve_match_values *mvalues, string_t *value)
 {
-	string_t *entry = sieve_match_values_add_entry(mvalues);
+	if ( mvalues == NULL ) return;
+
+	sieve_match_values_add_entry(mvalues,
+		( value == NULL ? NULL : str_slice_create_str(value) ));
+}
+
+void sieve_match_values_add_data
+(struct sieve_match_values *mvalues, const void *data, size_t size)
+{
+	if ( mvalues == NULL ) return;
 
-	if ( entry != NULL && value != NULL )
-		str_append_str(entry, value);
+	sieve_match_values_add_entry(mvalues, str_slice_create(data, size));
 }
 
 void sieve_match_values_add_char
 (struct sieve_match_values *mvalues, char c)
 {
-	string_t *entry = sieve_match_values_add_entry(mvalues);
+	if ( mvalues == NULL ) return;
+
+	sieve_match_values_add_entry(mvalues, str_slice_create(&c, 1));
+}
+
+void sieve_match_values_add_slice
+(struct sieve_match_values *mvalues, struct str_slice *slice,
+	size_t offset, size_t size)
+{
+	if ( mvalues == NULL ) return;
 
-	if ( entry != NULL )
-		str_append_c(entry, c);
+	sieve_match_values_add_entry(mvalues,
+		str_slice_sub(slice, offset, size));
 }
 
 void sieve_match_values_skip
@@ -284,7 +390,7 @@ void sieve_match_values_skip
 	int i;
 
 	for ( i = 0; i < num; i++ )
-		(void) sieve_match_values_add_entry(mvalues);
+		sieve_match_values_add_entry(mvalues, NULL);
 }
 
 void sieve_match_values_commit
@@ -298,10 +404,8 @@ void sieve_match_values_commit
 	if ( ctx == NULL || !ctx->match_values_enabled )
 		return;
 
-	if ( ctx->match_values != NULL ) {
-		pool_unref(&ctx->match_values->pool);
-		ctx->match_values = NULL;
-	}
+	if ( ctx->match_values != NULL )
+		sieve_match_values_free(&ctx->match_values);
 
 	ctx->match_values = *mvalues;
 	*mvalues = NULL;
@@ -312,31 +416,34 @@ void sieve_match_values_abort
 {
 	if ( (*mvalues) == NULL ) return;
 
-	pool_unref(&(*mvalues)->pool);
-	*mvalues = NULL;
+	sieve_match_values_free(mvalues);
 }
 
-void sieve_match_values_get
-(const struct sieve_runtime_env *renv, unsigned int index, string_t **value_r)
+struct str_slice *sieve_match_values_get_slice
+(const struct sieve_runtime_env *renv, unsigned int index)
 {
 	struct mtch_interpreter_context *ctx =
 		get_interpreter_context(renv->interp, FALSE);
 	struct sieve_match_values *mvalues;
+	struct str_slice *const *entry;
 
-	if ( ctx == NULL || ctx->match_values == NULL ) {
-		*value_r = NULL;
-		return;
-	}
+	if ( ctx == NULL || ctx->match_values == NULL )
+		return NULL;
 
 	mvalues = ctx->match_values;
-	if ( index < array_count(&mvalues->values) && index < mvalues->count ) {
-		string_t * const *entry = array_idx(&mvalues->values, index);
+	if ( index >= array_count(&mvalues->values) )
+		return NULL;
 
-		*value_r = *entry;
-		return;
-	}
+	entry = array_idx(&mvalues->values, index);
+	return *entry;
+}
+
+void sieve_match_values_get
+(const struct sieve_runtime_env *renv, unsigned int index, string_t **value_r)
+{
+	struct str_slice *slice = sieve_match_values_get_slice(renv, index);
 
-	*value_r = NULL;
+	*value_r = ( slice == NULL ? NULL : str_slice_get_str(slice) );
 }
 
 /*
@@ -127,6 +127,7 @@ void sieve_match_type_register
  */
 
 struct sieve_match_values;
+struct str_slice;
 
 bool sieve_match_values_set_enabled
 	(const struct sieve_runtime_env *renv, bool enable);
@@ -139,8 +140,14 @@ void sieve_match_values_set
 	(struct sieve_match_values *mvalues, unsigned int index, string_t *value);
 void sieve_match_values_add
 	(struct sieve_match_values *mvalues, string_t *value);
+void sieve_match_values_add_data
+	(struct sieve_match_values *mvalues, const void *data, size_t size);
 void sieve_match_values_add_char
 	(struct sieve_match_values *mvalues, char c);
+/* Adds part of a slice without copying it */
+void sieve_match_values_add_slice
+	(struct sieve_match_values *mvalues, struct str_slice *slice,
+		size_t offset, size_t size);
 void sieve_match_values_skip
 	(struct sieve_match_values *mvalues, int num);
 
@@ -151,6 +158,30 @@ void sieve_match_values_abort
 
 void sieve_match_values_get
 	(const struct sieve_runtime_env *renv, unsigned int index, string_t **value_r);
+/* Returns the match value itself, so that it can be shared rather than
+   copied; NULL if it is empty */
+struct str_slice *sieve_match_values_get_slice
+	(const struct sieve_runtime_env *renv, unsigned int index);
+
+/*
+ * Key cache
+ */
+
+/* Match types can cache data they derive from constant keys (e.g. compiled
+ * patterns) in the binary, so that this work is done only once for as long as
+ * the binary is loaded. Cache entries are indexed by the address of the key
+ * data in the binary and should be allocated from the cache pool.
+ */
+
+bool sieve_match_key_is_constant
+	(const struct sieve_runtime_env *renv, const char *key);
+
+pool_t sieve_match_key_cache_pool
+	(const struct sieve_runtime_env *renv);
+void *sieve_match_key_cache_lookup
+	(const struct sieve_runtime_env *renv, const void *key);
+void sieve_match_key_cache_insert
+	(const struct sieve_runtime_env *renv, const void *key, void *data);
 
 /*
  * Match type tagged argument
@@ -5,10 +5,12 @@
 #include "ioloop.h"
 #include "mempool.h"
 #include "array.h"
+#include "hash.h"
 #include "str.h"
 #include "str-sanitize.h"
 #include "istream.h"
 #include "rfc822-parser.h"
+#include "message-address.h"
 #include "message-date.h"
 #include "message-parser.h"
 #include "message-decoder.h"
@@ -105,16 +107,53 @@ struct sieve_message_context {
 
 	ARRAY(void *) ext_contexts;
 
+	/* Header cache */
+
+	HASH_TABLE(const char *,
+		   struct sieve_message_cached_header *) header_cache;
+	unsigned int header_cache_hits, header_cache_misses;
+
+	/* Parsed address cache */
+
+	HASH_TABLE(const char *,
+		   struct sieve_message_cached_address_list *) address_cache;
+	unsigned int address_cache_hits, address_cache_misses;
+
 	/* Body */
 
 	ARRAY(struct sieve_message_part *) cached_body_parts;
 	ARRAY(struct sieve_message_part_data) return_body_parts;
 	buffer_t *raw_body;
+	/* All parts of the message are in cached_body_parts (a body stream
+	   stops parsing once it is finished) */
+	bool have_all_body_parts:1;
 
 	bool edit_snapshot:1;
 	bool substitute_snapshot:1;
 };
 
+/*
+ * Cached header fields
+ */
+
+struct sieve_message_cached_header {
+	const char *name;
+
+	/* Right-trimmed values, raw and MIME-decoded (NULL if not fetched) */
+	const char *const *values[2];
+};
+
+/*
+ * Cached address lists
+ */
+
+struct sieve_message_cached_address_list {
+	const char *value;
+
+	/* Parsed address list (NULL if the value contains no addresses) */
+	const struct message_address *addresses;
+};
+
 /*
  * Message versions
  */
@@ -207,6 +246,19 @@ void sieve_message_context_unref(struct sieve_message_context **msgctx)
 	if (--(*msgctx)->refcount != 0)
 		return;
 
+	if ( (*msgctx)->svinst->debug &&
+		((*msgctx)->header_cache_hits + (*msgctx)->header_cache_misses) > 0 ) {
+		sieve_sys_debug((*msgctx)->svinst, "message context: "
+			"header cache: %u hits, %u misses",
+			(*msgctx)->header_cache_hits, (*msgctx)->header_cache_misses);
+	}
+	if ( (*msgctx)->svinst->debug &&
+		((*msgctx)->address_cache_hits + (*msgctx)->address_cache_misses) > 0 ) {
+		sieve_sys_debug((*msgctx)->svinst, "message context: "
+			"address cache: %u hits, %u misses",
+			(*msgctx)->address_cache_hits, (*msgctx)->address_cache_misses);
+	}
+
 	if ( (*msgctx)->raw_mail_user != NULL )
 		mail_user_unref(&(*msgctx)->raw_mail_user);
 
@@ -232,9 +284,15 @@ static void sieve_message_context_flush(struct sieve_message_context *msgctx)
 	p_array_init(&msgctx->ext_contexts, pool,
 		sieve_extensions_get_count(msgctx->svinst));
 
+	hash_table_create(&msgctx->header_cache, pool, 0,
+		strcase_hash, strcasecmp);
+	hash_table_create(&msgctx->address_cache, pool, 0,
+		str_hash, strcmp);
+
 	p_array_init(&msgctx->cached_body_parts, pool, 8);
 	p_array_init(&msgctx->return_body_parts, pool, 8);
 	msgctx->raw_body = NULL;
+	msgctx->have_all_body_parts = FALSE;
 }
 
 void sieve_message_context_reset(struct sieve_message_context *msgctx)
@@ -411,6 +469,10 @@ struct edit_mail *sieve_message_edit
 
 	msgctx->edit_snapshot = FALSE;
 
+	/* The caller is about to modify the headers */
+	hash_table_clear(msgctx->header_cache, TRUE);
+	hash_table_clear(msgctx->address_cache, TRUE);
+
 	return version->edit_mail;
 }
 
@@ -421,6 +483,34 @@ void sieve_message_snapshot
 	msgctx->substitute_snapshot = TRUE;
 }
 
+/*
+ * Parsed addresses
+ */
+
+/* Address header values are parsed only once per message version; the same
+   header is often inspected by several address tests and actions. */
+const struct message_address *sieve_message_get_addresses
+(struct sieve_message_context *msgctx, const char *value)
+{
+	pool_t pool = msgctx->context_pool;
+	struct sieve_message_cached_address_list *alist;
+
+	alist = hash_table_lookup(msgctx->address_cache, value);
+	if ( alist != NULL ) {
+		msgctx->address_cache_hits++;
+		return alist->addresses;
+	}
+	msgctx->address_cache_misses++;
+
+	alist = p_new(pool, struct sieve_message_cached_address_list, 1);
+	alist->value = p_strdup(pool, value);
+	alist->addresses = message_address_parse(pool,
+		(const unsigned char *) alist->value, strlen(alist->value), 256, 0);
+	hash_table_insert(msgctx->address_cache, alist->value, alist);
+
+	return alist->addresses;
+}
+
 /*
  * Message header list
  */
@@ -468,23 +558,66 @@ struct sieve_header_list *sieve_message_header_list_create
 	return &hdrlist->hdrlist;
 }
 
-// NOTE: get rid of this once we have a proper Sieve string type
-static inline string_t *_header_right_trim(const char *raw)
+static const char *_header_right_trim(pool_t pool, const char *raw)
 {
-	string_t *result;
 	const char *p, *pend;
 
 	pend = raw + strlen(raw);
-	if (raw == pend) {
-		result = t_str_new(1);
-	} else {
-		for ( p = pend-1; p >= raw; p-- ) {
-			if ( *p != ' ' && *p != '\t' ) break;
-		}
-		result = t_str_new(p - raw + 1);
-		str_append_data(result, raw, p - raw + 1);
+	for ( p = pend; p > raw; p-- ) {
+		if ( p[-1] != ' ' && p[-1] != '\t' ) break;
 	}
-	return result;
+	if ( p == pend )
+		return p_strdup(pool, raw);
+	return p_strdup_until(pool, raw, p);
+}
+
+/* Header fields are fetched from the mail only once per message version; the
+   cache is cleared when the message is edited or substituted. */
+static int sieve_message_get_header_values
+(struct sieve_message_context *msgctx, const char *field_name,
+	bool mime_decode, const char *const **values_r, bool *cached_r)
+{
+	struct mail *mail = sieve_message_get_mail(msgctx);
+	pool_t pool = msgctx->context_pool;
+	struct sieve_message_cached_header *header;
+	unsigned int idx = ( mime_decode ? 1 : 0 );
+	const char *const *headers;
+	const char **values;
+	unsigned int count, i;
+	int ret;
+
+	header = hash_table_lookup(msgctx->header_cache, field_name);
+	if ( header != NULL && header->values[idx] != NULL ) {
+		msgctx->header_cache_hits++;
+		*values_r = header->values[idx];
+		*cached_r = TRUE;
+		return 0;
+	}
+	msgctx->header_cache_misses++;
+	*cached_r = FALSE;
+
+	/* Fetch all matching headers from the e-mail */
+	if ( mime_decode )
+		ret = mail_get_headers_utf8(mail, field_name, &headers);
+	else
+		ret = mail_get_headers(mail, field_name, &headers);
+	if ( ret < 0 )
+		return -1;
+
+	count = ( ret == 0 ? 0 : str_array_length(headers) );
+	values = p_new(pool, const char *, count + 1);
+	for ( i = 0; i < count; i++ )
+		values[i] = _header_right_trim(pool, headers[i]);
+
+	if ( header == NULL ) {
+		header = p_new(pool, struct sieve_message_cached_header, 1);
+		header->name = p_strdup(pool, field_name);
+		hash_table_insert(msgctx->header_cache, header->name, header);
+	}
+	header->values[idx] = values;
+
+	*values_r = values;
+	return 0;
 }
 
 /* String list implementation */
@@ -496,7 +629,7 @@ static int sieve_message_header_list_next_item
 	struct sieve_message_header_list *hdrlist =
 		(struct sieve_message_header_list *) _hdrlist;
 	const struct sieve_runtime_env *renv = _hdrlist->strlist.runenv;
-	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	const char *value;
 
 	if ( name_r != NULL )
 		*name_r = NULL;
@@ -513,6 +646,7 @@ static int sieve_message_header_list_next_item
 	/* Fetch next header */
 	while ( hdrlist->headers == NULL ) {
 		string_t *hdr_item = NULL;
+		bool cached;
 		int ret;
 
 		/* Read next header name from source list */
@@ -522,29 +656,26 @@ static int sieve_message_header_list_next_item
 
 		hdrlist->header_name = str_c(hdr_item);
 
-		if ( _hdrlist->strlist.trace ) {
-			sieve_runtime_trace(renv, 0,
-				"extracting `%s' headers from message",
-				str_sanitize(str_c(hdr_item), 80));
-		}
-
-		/* Fetch all matching headers from the e-mail */
-		if ( hdrlist->mime_decode ) {
-			ret = mail_get_headers_utf8(mail,
-				str_c(hdr_item), &hdrlist->headers);
-		} else {
-			ret = mail_get_headers(mail,
-				str_c(hdr_item), &hdrlist->headers);
-		}
+		/* Fetch all matching headers */
+		if ( sieve_message_get_header_values(renv->msgctx,
+			str_c(hdr_item), hdrlist->mime_decode,
+			&hdrlist->headers, &cached) < 0 ) {
+			struct mail *mail = sieve_message_get_mail(renv->msgctx);
 
-		if (ret < 0) {
 			_hdrlist->strlist.exec_status =
 				sieve_runtime_mail_error(renv, mail,
 					"failed to read header field `%s'", str_c(hdr_item));
 			return -1;
 		}
 
-		if ( ret == 0 || hdrlist->headers[0] == NULL ) {
+		if ( _hdrlist->strlist.trace ) {
+			sieve_runtime_trace(renv, 0,
+				"extracting `%s' headers from message%s",
+				str_sanitize(str_c(hdr_item), 80),
+				( cached ? " (cached)" : "" ));
+		}
+
+		if ( hdrlist->headers[0] == NULL ) {
 			/* Try next item when no headers found */
 			hdrlist->headers = NULL;
 		}
@@ -553,7 +684,9 @@ static int sieve_message_header_list_next_item
 	/* Return next item */
 	if ( name_r != NULL )
 		*name_r = hdrlist->header_name;
-	*value_r = _header_right_trim(hdrlist->headers[hdrlist->headers_index++]);
+	value = hdrlist->headers[hdrlist->headers_index++];
+	*value_r = t_str_new(strlen(value) + 1);
+	str_append(*value_r, value);
 	return 1;
 }
 
@@ -913,7 +1046,7 @@ static bool sieve_message_body_get_return_parts
 
 	/* Check whether any body parts are cached already */
 	body_parts = array_get(&msgctx->cached_body_parts, &count);
-	if ( count == 0 )
+	if ( count == 0 || !msgctx->have_all_body_parts )
 		return FALSE;
 
 	/* Clear result array */
@@ -1064,14 +1197,105 @@ _parse_content_disposition(const struct message_header_line *hdr)
 	return str_c(content_disp);
 }
 
+/*
+ * Body streaming
+ */
+
+struct sieve_message_body_stream {
+	const char *const *content_types;
+
+	const struct sieve_message_body_stream_vfuncs *v;
+	void *context;
+
+	/* Body part currently being streamed */
+	struct sieve_message_part *part;
+
+	bool finished:1;
+};
+
+static void sieve_message_body_stream_begin
+(struct sieve_message_body_stream *stream,
+	struct sieve_message_part *body_part)
+{
+	if ( stream->finished || stream->part == body_part )
+		return;
+	i_assert( stream->part == NULL );
+
+	/* Same selection as sieve_message_body_get_return_parts() */
+	if ( !body_part->have_body || !_is_wanted_content_type
+		(stream->content_types, body_part->content_type) )
+		return;
+	stream->part = body_part;
+}
+
+static void sieve_message_body_stream_data
+(struct sieve_message_body_stream *stream,
+	const unsigned char *data, size_t size)
+{
+	if ( stream->part == NULL || size == 0 )
+		return;
+
+	if ( stream->v->part_data(stream->context, data, size) ) {
+		stream->part = NULL;
+		stream->finished = TRUE;
+	}
+}
+
+static void sieve_message_body_stream_end
+(struct sieve_message_body_stream *stream,
+	struct sieve_message_part *body_part)
+{
+	if ( stream->part == NULL || stream->part != body_part )
+		return;
+
+	stream->part = NULL;
+	if ( stream->v->part_end(stream->context) )
+		stream->finished = TRUE;
+}
+
+static void sieve_message_body_stream_cached
+(struct sieve_message_body_stream *stream,
+	const struct sieve_message_part_data *parts, unsigned int count)
+{
+	unsigned int i;
+
+	for ( i = 0; i < count && !stream->finished; i++ ) {
+		if ( parts[i].size > 0 &&
+			stream->v->part_data(stream->context,
+				(const unsigned char *)parts[i].content, parts[i].size) ) {
+			stream->finished = TRUE;
+			break;
+		}
+		if ( stream->v->part_end(stream->context) )
+			stream->finished = TRUE;
+	}
+}
+
+static void sieve_message_part_end
+(const struct sieve_runtime_env *renv, buffer_t *buf,
+	struct sieve_message_part *body_part, bool extract_text,
+	struct sieve_message_body_stream *stream)
+{
+	if ( stream != NULL ) {
+		/* Streaming; the part content is not kept */
+		sieve_message_body_stream_end(stream, body_part);
+		return;
+	}
+
+	sieve_message_part_save(renv, buf, body_part, extract_text);
+}
+
 /* sieve_message_parts_add_missing():
- *   Add requested message body parts to the cache that are missing.
+ *   Add requested message body parts to the cache that are missing. When a
+ *   body stream is provided, the decoded content of the wanted parts is
+ *   passed to it instead and it is not added to the cache.
  */
 static int sieve_message_parts_add_missing
 (const struct sieve_runtime_env *renv,
 	const char *const *content_types,
-	bool extract_text, bool iter_all)
-	ATTR_NULL(2)
+	bool extract_text, bool iter_all,
+	struct sieve_message_body_stream *stream)
+	ATTR_NULL(2, 5)
 {
 	struct sieve_message_context *msgctx = renv->msgctx;
 	pool_t pool = msgctx->context_pool;
@@ -1091,12 +1315,21 @@ static int sieve_message_parts_add_missing
 	unsigned int idx = 0;
 	bool save_body = FALSE, have_all;
 	string_t *hdr_content = NULL;
-	int ret;
+	int ret = 0;
+
+	i_assert( stream == NULL || (!iter_all && !extract_text) );
 
 	/* First check whether any are missing */
 	if ( !iter_all && sieve_message_body_get_return_parts
 		(renv, content_types, extract_text) ) {
 		/* Cache hit; all are present */
+		if ( stream != NULL ) {
+			const struct sieve_message_part_data *parts;
+			unsigned int count;
+
+			parts = array_get(&msgctx->return_body_parts, &count);
+			sieve_message_body_stream_cached(stream, parts, count);
+		}
 		return SIEVE_EXEC_OK;
 	}
 
@@ -1129,8 +1362,9 @@ static int sieve_message_parts_add_missing
 		// hparser_flags, mparser_flags);
 	parser = message_parser_init(pool_datastack_create(),
 		input, hparser_flags, mparser_flags);
-	while ( (ret=message_parser_parse_next_block
-		(parser, &block)) > 0 ) {
+	/* A finished body stream needs nothing more from the message */
+	while ( (stream == NULL || !stream->finished) &&
+		(ret=message_parser_parse_next_block(parser, &block)) > 0 ) {
 		struct sieve_message_part **body_part_idx;
 		struct message_header_line *hdr = block.hdr;
 		struct sieve_message_header *header;
@@ -1147,8 +1381,8 @@ static int sieve_message_parts_add_missing
 					message_rfc822 = TRUE;
 				} else {
 					if ( save_body ) {
-						sieve_message_part_save
-							(renv, buf, body_part, extract_text);
+						sieve_message_part_end
+							(renv, buf, body_part, extract_text, stream);
 					}
 				}
 				if ( iter_all && !array_is_created(&body_part->headers) &&
@@ -1181,6 +1415,8 @@ static int sieve_message_parts_add_missing
 				body_part->epilogue = TRUE;
 				save_body = iter_all || _is_wanted_content_type
 					(content_types, body_part->content_type);
+				if ( stream != NULL && save_body )
+					sieve_message_body_stream_begin(stream, body_part);
 
 			} else {
 				struct sieve_message_part *parent = NULL;
@@ -1244,8 +1480,8 @@ static int sieve_message_parts_add_missing
 			if ( hdr == NULL ) {
 				/* Save headers for message/rfc822 part */
 				if ( header_part != NULL ) {
-					sieve_message_part_save
-						(renv, buf, header_part, FALSE);
+					sieve_message_part_end
+						(renv, buf, header_part, FALSE, stream);
 					header_part = NULL;
 				}
 
@@ -1253,6 +1489,8 @@ static int sieve_message_parts_add_missing
 				i_assert( body_part != NULL );
 				save_body = iter_all || _is_wanted_content_type
 					(content_types, body_part->content_type);
+				if ( stream != NULL && save_body )
+					sieve_message_body_stream_begin(stream, body_part);
 				continue;
 			}
 
@@ -1263,6 +1501,23 @@ static int sieve_message_parts_add_missing
 				i_assert( body_part != NULL );
 				body_part->have_body = TRUE;
 				continue;
+			} else if ( header_part != NULL && stream != NULL ) {
+				/* Stream message/rfc822 header as part content */
+				if ( hdr->continued ) {
+					sieve_message_body_stream_data(stream,
+						hdr->value, hdr->value_len);
+				} else {
+					sieve_message_body_stream_data(stream,
+						(const unsigned char *)hdr->name, hdr->name_len);
+					sieve_message_body_stream_data(stream,
+						hdr->middle, hdr->middle_len);
+					sieve_message_body_stream_data(stream,
+						hdr->value, hdr->value_len);
+				}
+				if ( !hdr->no_newline ) {
+					sieve_message_body_stream_data(stream,
+						(const unsigned char *)"\r\n", 2);
+				}
 			} else if ( header_part != NULL ) {
 				/* Save message/rfc822 header as part content */
 				if ( hdr->continued ) {
@@ -1369,7 +1624,15 @@ static int sieve_message_parts_add_missing
 		}
 
 		/* Reading body */
-		if ( save_body ) {
+		if ( stream != NULL ) {
+			/* Only decode what the stream still needs */
+			if ( save_body && stream->part != NULL ) {
+				(void)message_decoder_decode_next_block
+						(decoder, &block, &decoded);
+				sieve_message_body_stream_data
+					(stream, decoded.data, decoded.size);
+			}
+		} else if ( save_body ) {
 			(void)message_decoder_decode_next_block
 					(decoder, &block, &decoded);
 			buffer_append(buf, decoded.data, decoded.size);
@@ -1378,11 +1641,11 @@ static int sieve_message_parts_add_missing
 
 	/* Save last body part if necessary */
 	if ( header_part != NULL ) {
-		sieve_message_part_save
-			(renv, buf, header_part, FALSE);
+		sieve_message_part_end
+			(renv, buf, header_part, FALSE, stream);
 	} else if ( body_part != NULL && save_body ) {
-		sieve_message_part_save
-			(renv, buf, body_part, extract_text);
+		sieve_message_part_end
+			(renv, buf, body_part, extract_text, stream);
 	}
 	if ( iter_all && !array_is_created(&body_part->headers) &&
 		array_count(&headers) > 0 ) {
@@ -1391,9 +1654,15 @@ static int sieve_message_parts_add_missing
 			&headers.arr, 0, array_count(&headers));
 	}
 
-	/* Try to fill the return_body_parts array once more */
-	have_all = iter_all || sieve_message_body_get_return_parts
-		(renv, content_types, extract_text);
+	/* The parser reached the end of the message */
+	if ( ret < 0 )
+		msgctx->have_all_body_parts = TRUE;
+
+	/* Try to fill the return_body_parts array once more; streamed parts are
+	   not cached */
+	have_all = iter_all || stream != NULL ||
+		sieve_message_body_get_return_parts
+			(renv, content_types, extract_text);
 
 	/* This time, failure is a bug */
 	i_assert(have_all);
@@ -1426,7 +1695,7 @@ int sieve_message_body_get_content
 	T_BEGIN {
 		/* Fill the return_body_parts array */
 		status = sieve_message_parts_add_missing
-			(renv, content_types, FALSE, FALSE);
+			(renv, content_types, FALSE, FALSE, NULL);
 	} T_END;
 
 	/* Check status */
@@ -1460,7 +1729,7 @@ int sieve_message_body_get_text
 	T_BEGIN {
 		/* Fill the return_body_parts array */
 		status = sieve_message_parts_add_missing
-			(renv, _text_content_types, TRUE, FALSE);
+			(renv, _text_content_types, TRUE, FALSE, NULL);
 	} T_END;
 
 	/* Check status */
@@ -1547,6 +1816,84 @@ int sieve_message_body_get_raw
 	return SIEVE_EXEC_OK;
 }
 
+int sieve_message_body_stream_content
+(const struct sieve_runtime_env *renv,
+	const char * const *content_types,
+	const struct sieve_message_body_stream_vfuncs *v, void *context)
+{
+	struct sieve_message_body_stream stream;
+	int status;
+
+	i_zero(&stream);
+	stream.content_types = content_types;
+	stream.v = v;
+	stream.context = context;
+
+	T_BEGIN {
+		status = sieve_message_parts_add_missing
+			(renv, content_types, FALSE, FALSE, &stream);
+	} T_END;
+
+	return status;
+}
+
+int sieve_message_body_stream_raw
+(const struct sieve_runtime_env *renv,
+	const struct sieve_message_body_stream_vfuncs *v, void *context)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	struct istream *input;
+	struct message_size hdr_size, body_size;
+	const unsigned char *data;
+	size_t size;
+	bool have_data = FALSE, finished = FALSE;
+	int ret = 0;
+
+	/* Use the cached raw body if it was read before */
+	if ( msgctx->raw_body != NULL ) {
+		const buffer_t *buf = msgctx->raw_body;
+
+		if ( buf->used > 1 &&
+			!v->part_data(context, buf->data, buf->used - 1) )
+			(void)v->part_end(context);
+		return SIEVE_EXEC_OK;
+	}
+
+	/* Get stream for message */
+	if ( mail_get_stream(mail, &hdr_size, &body_size, &input) < 0 ) {
+		return sieve_runtime_mail_error(renv, mail,
+			"failed to open input message");
+	}
+
+	/* Skip stream to beginning of body */
+	i_stream_skip(input, hdr_size.physical_size);
+
+	/* Read raw message body */
+	while ( !finished &&
+		(ret=i_stream_read_more(input, &data, &size)) > 0 ) {
+		have_data = TRUE;
+		finished = v->part_data(context, data, size);
+
+		i_stream_skip(input, size);
+	}
+
+	if ( !finished ) {
+		if ( ret < 0 && input->stream_errno != 0 ) {
+			sieve_runtime_critical(renv, NULL,
+				"failed to read input message",
+				"read(%s) failed: %s",
+				i_stream_get_name(input),
+				i_stream_get_error(input));
+			return SIEVE_EXEC_TEMP_FAILURE;
+		}
+		/* Empty bodies are not matched; see sieve_message_body_get_raw() */
+		if ( have_data )
+			(void)v->part_end(context);
+	}
+	return SIEVE_EXEC_OK;
+}
+
 /*
  * Message part iterator
  */
@@ -1563,7 +1910,7 @@ int sieve_message_part_iter_init
 	T_BEGIN {
 		/* Fill the return_body_parts array */
 		status = sieve_message_parts_add_missing
-			(renv, NULL, TRUE, TRUE);
+			(renv, NULL, TRUE, TRUE, NULL);
 	} T_END;
 
 	/* Check status */
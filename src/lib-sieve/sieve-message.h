@@ -60,6 +60,15 @@ struct edit_mail *sieve_message_edit
 void sieve_message_snapshot
 	(struct sieve_message_context *msgctx);
 
+/*
+ * Parsed addresses
+ */
+
+struct message_address;
+
+const struct message_address *sieve_message_get_addresses
+	(struct sieve_message_context *msgctx, const char *value);
+
 /*
  * Header stringlist
  */
@@ -241,6 +250,28 @@ int sieve_message_body_get_raw
 	(const struct sieve_runtime_env *renv,
 		struct sieve_message_part_data **parts_r);
 
+/* Streaming access to the message body: the content of the selected body
+   parts is passed to the handler as it is read, without keeping it in memory.
+   Body parts that were cached earlier are passed from the cache.
+ */
+
+struct sieve_message_body_stream_vfuncs {
+	/* Body data of the current part; returns TRUE when no further data is
+	   needed */
+	bool (*part_data)(void *context, const unsigned char *data, size_t size);
+	/* End of the current part; returns TRUE when no further data is
+	   needed */
+	bool (*part_end)(void *context);
+};
+
+int sieve_message_body_stream_content
+	(const struct sieve_runtime_env *renv,
+		const char * const *content_types,
+		const struct sieve_message_body_stream_vfuncs *v, void *context);
+int sieve_message_body_stream_raw
+	(const struct sieve_runtime_env *renv,
+		const struct sieve_message_body_stream_vfuncs *v, void *context);
+
 /*
  * Message part iterator
  */
@@ -0,0 +1,480 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "str.h"
+#include "strnum.h"
+#include "strescape.h"
+#include "ioloop.h"
+#include "hostpid.h"
+#include "time-util.h"
+#include "eacces-error.h"
+#include "safe-mkstemp.h"
+#include "file-dotlock.h"
+#include "istream.h"
+#include "ostream.h"
+
+#include "sieve-common.h"
+#include "sieve-error.h"
+#include "sieve-script.h"
+
+#include "sieve.h"
+#include "sieve-profile.h"
+
+#include <sys/resource.h>
+
+/*
+ * Script profile
+ *
+ *   Accumulates, per source line of each executed script, how many operations
+ *   were executed, how many of these were tests (and how many of those
+ *   matched) and how much wall clock and CPU time was spent. Time spent in
+ *   an included script is also attributed to the line of the include command.
+ *   CPU time is only measured when sieve_profile_cpu is enabled, since it
+ *   takes a getrusage() call for every operation.
+ *
+ *   When a profile opened for the sieve_profile_report setting is closed, it
+ *   is added to totals that are kept for the lifetime of the instance. These
+ *   are written to a report file of their own for each instance, at most once
+ *   every sieve_profile_flush_interval and when the instance is deinitialized.
+ *   This way deliveries never wait for each other.
+ */
+
+struct sieve_profile_line {
+	unsigned int ops;
+	unsigned int tests, matches;
+	uint64_t wall_usecs, cpu_usecs;
+};
+
+struct sieve_profile_script {
+	struct sieve_profile *profile;
+	const char *location;
+
+	/* Indexed by source line */
+	ARRAY(struct sieve_profile_line) lines;
+};
+
+struct sieve_profile {
+	pool_t pool;
+	struct sieve_instance *svinst;
+
+	HASH_TABLE(const char *, struct sieve_profile_script *) scripts;
+
+	/* Totals only: report file of this process and when it was written */
+	const char *path;
+	time_t flushed;
+
+	bool cpu:1;
+};
+
+static unsigned int sieve_profile_totals_seq = 0;
+
+struct sieve_profile *sieve_profile_create(struct sieve_instance *svinst)
+{
+	struct sieve_profile *profile;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_profile", 4096);
+	profile = p_new(pool, struct sieve_profile, 1);
+	profile->pool = pool;
+	profile->svinst = svinst;
+	profile->cpu = svinst->profile_cpu;
+	hash_table_create(&profile->scripts, pool, 0, str_hash, strcmp);
+
+	return profile;
+}
+
+struct sieve_profile *sieve_profile_open(struct sieve_instance *svinst)
+{
+	if ( svinst->profile_report == NULL )
+		return NULL;
+	return sieve_profile_create(svinst);
+}
+
+void sieve_profile_free(struct sieve_profile **_profile)
+{
+	struct sieve_profile *profile = *_profile;
+
+	if ( profile == NULL )
+		return;
+	*_profile = NULL;
+
+	hash_table_destroy(&profile->scripts);
+	pool_unref(&profile->pool);
+}
+
+static void sieve_profile_add
+	(struct sieve_profile *profile, struct sieve_profile *other);
+
+void sieve_profile_close(struct sieve_profile **_profile)
+{
+	struct sieve_profile *profile = *_profile;
+	struct sieve_instance *svinst;
+	struct sieve_profile *totals;
+
+	if ( profile == NULL )
+		return;
+	svinst = profile->svinst;
+
+	if ( svinst->profile_report != NULL ) {
+		if ( (totals=svinst->profile_totals) == NULL ) {
+			totals = svinst->profile_totals = sieve_profile_create(svinst);
+			/* Several instances can be created by a process within the
+			   same second */
+			totals->path = p_strdup_printf(totals->pool, "%s.%s.%s.%u",
+				svinst->profile_report, dec2str(ioloop_time), my_pid,
+				++sieve_profile_totals_seq);
+			totals->flushed = ioloop_time;
+		}
+		sieve_profile_add(totals, profile);
+
+		if ( ioloop_time - totals->flushed >=
+			(time_t)svinst->profile_flush_interval )
+			(void)sieve_profile_flush(svinst);
+	}
+	sieve_profile_free(_profile);
+}
+
+void sieve_profile_deinit(struct sieve_instance *svinst)
+{
+	if ( svinst->profile_totals == NULL )
+		return;
+
+	(void)sieve_profile_flush(svinst);
+	sieve_profile_free(&svinst->profile_totals);
+}
+
+static struct sieve_profile_script *sieve_profile_get_location
+(struct sieve_profile *profile, const char *location)
+{
+	struct sieve_profile_script *pscript;
+
+	pscript = hash_table_lookup(profile->scripts, location);
+	if ( pscript == NULL ) {
+		pscript = p_new(profile->pool, struct sieve_profile_script, 1);
+		pscript->profile = profile;
+		pscript->location = p_strdup(profile->pool, location);
+		p_array_init(&pscript->lines, profile->pool, 64);
+		hash_table_insert(profile->scripts, pscript->location, pscript);
+	}
+	return pscript;
+}
+
+struct sieve_profile_script *sieve_profile_get_script
+(struct sieve_profile *profile, struct sieve_script *script)
+{
+	const char *location = ( script == NULL ?
+		NULL : sieve_script_location(script) );
+
+	return sieve_profile_get_location
+		(profile, ( location == NULL ? "" : location ));
+}
+
+/*
+ * Recording
+ */
+
+static void sieve_profile_get_cpu_time(struct timeval *tv_r)
+{
+	struct rusage usage;
+
+	if ( getrusage(RUSAGE_SELF, &usage) < 0 )
+		i_fatal("getrusage() failed: %m");
+	tv_r->tv_sec = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec;
+	tv_r->tv_usec = usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+	if ( tv_r->tv_usec >= 1000000 ) {
+		tv_r->tv_sec++;
+		tv_r->tv_usec -= 1000000;
+	}
+}
+
+void sieve_profile_sample_start
+(struct sieve_profile_script *pscript, struct sieve_profile_sample *sample)
+{
+	if ( gettimeofday(&sample->wall, NULL) < 0 )
+		i_fatal("gettimeofday() failed: %m");
+	if ( pscript->profile->cpu )
+		sieve_profile_get_cpu_time(&sample->cpu);
+}
+
+void sieve_profile_script_record
+(struct sieve_profile_script *pscript, unsigned int line,
+	const struct sieve_profile_sample *start, bool tested, bool matched)
+{
+	struct sieve_profile_sample end;
+	struct sieve_profile_line *pline;
+	long long wall, cpu = 0;
+
+	sieve_profile_sample_start(pscript, &end);
+	wall = timeval_diff_usecs(&end.wall, &start->wall);
+	if ( pscript->profile->cpu )
+		cpu = timeval_diff_usecs(&end.cpu, &start->cpu);
+
+	pline = array_idx_get_space(&pscript->lines, line);
+	pline->ops++;
+	if ( tested ) {
+		pline->tests++;
+		if ( matched )
+			pline->matches++;
+	}
+	if ( wall > 0 )
+		pline->wall_usecs += wall;
+	if ( cpu > 0 )
+		pline->cpu_usecs += cpu;
+}
+
+static void sieve_profile_add
+(struct sieve_profile *profile, struct sieve_profile *other)
+{
+	struct hash_iterate_context *hctx;
+	const char *location;
+	struct sieve_profile_script *opscript, *pscript;
+	const struct sieve_profile_line *olines;
+	struct sieve_profile_line *pline;
+	unsigned int count, i;
+
+	hctx = hash_table_iterate_init(other->scripts);
+	while ( hash_table_iterate(hctx, other->scripts, &location, &opscript) ) {
+		pscript = sieve_profile_get_location(profile, location);
+
+		olines = array_get(&opscript->lines, &count);
+		for ( i = 0; i < count; i++ ) {
+			if ( olines[i].ops == 0 )
+				continue;
+			pline = array_idx_get_space(&pscript->lines, i);
+			pline->ops += olines[i].ops;
+			pline->tests += olines[i].tests;
+			pline->matches += olines[i].matches;
+			pline->wall_usecs += olines[i].wall_usecs;
+			pline->cpu_usecs += olines[i].cpu_usecs;
+		}
+	}
+	hash_table_iterate_deinit(&hctx);
+}
+
+/*
+ * Report
+ */
+
+struct sieve_profile_entry {
+	const char *location;
+	unsigned int line;
+	const struct sieve_profile_line *stats;
+};
+
+static int sieve_profile_entry_cmp
+(const struct sieve_profile_entry *entry1,
+	const struct sieve_profile_entry *entry2)
+{
+	int ret;
+
+	/* Most expensive lines first */
+	if ( entry1->stats->wall_usecs != entry2->stats->wall_usecs )
+		return ( entry1->stats->wall_usecs > entry2->stats->wall_usecs ? -1 : 1 );
+
+	if ( (ret=strcmp(entry1->location, entry2->location)) != 0 )
+		return ret;
+	return ( entry1->line < entry2->line ? -1 :
+		( entry1->line > entry2->line ? 1 : 0 ) );
+}
+
+void sieve_profile_write
+(struct sieve_profile *profile, struct ostream *output)
+{
+	struct hash_iterate_context *hctx;
+	const char *location;
+	struct sieve_profile_script *pscript;
+
+	T_BEGIN {
+		ARRAY(struct sieve_profile_entry) entries;
+		const struct sieve_profile_entry *entry;
+		const struct sieve_profile_line *lines;
+		unsigned int count, i;
+		string_t *str;
+
+		t_array_init(&entries, 128);
+		hctx = hash_table_iterate_init(profile->scripts);
+		while ( hash_table_iterate
+			(hctx, profile->scripts, &location, &pscript) ) {
+			lines = array_get(&pscript->lines, &count);
+			for ( i = 0; i < count; i++ ) {
+				struct sieve_profile_entry *new_entry;
+
+				if ( lines[i].ops == 0 )
+					continue;
+
+				new_entry = array_append_space(&entries);
+				new_entry->location = pscript->location;
+				new_entry->line = i;
+				new_entry->stats = &lines[i];
+			}
+		}
+		hash_table_iterate_deinit(&hctx);
+
+		array_sort(&entries, sieve_profile_entry_cmp);
+
+		str = t_str_new(256);
+		o_stream_nsend_str(output,
+			"# script\tline\tops\ttests\tmatches\twall_usecs\tcpu_usecs\n");
+		array_foreach(&entries, entry) {
+			str_truncate(str, 0);
+			str_append_tabescaped(str, entry->location);
+			str_printfa(str, "\t%u\t%u\t%u\t%u\t%llu\t%llu\n",
+				entry->line, entry->stats->ops, entry->stats->tests,
+				entry->stats->matches,
+				(unsigned long long)entry->stats->wall_usecs,
+				(unsigned long long)entry->stats->cpu_usecs);
+			o_stream_nsend(output, str_data(str), str_len(str));
+		}
+	} T_END;
+}
+
+static bool sieve_profile_parse_line
+(struct sieve_profile *profile, const char *line)
+{
+	const char *const *fields = t_strsplit_tabescaped(line);
+	struct sieve_profile_script *pscript;
+	struct sieve_profile_line *pline;
+	unsigned int lineno, ops, tests, matches;
+	uint64_t wall, cpu;
+
+	if ( str_array_length(fields) != 7 ||
+		str_to_uint(fields[1], &lineno) < 0 ||
+		str_to_uint(fields[2], &ops) < 0 ||
+		str_to_uint(fields[3], &tests) < 0 ||
+		str_to_uint(fields[4], &matches) < 0 ||
+		str_to_uint64(fields[5], &wall) < 0 ||
+		str_to_uint64(fields[6], &cpu) < 0 )
+		return FALSE;
+
+	pscript = sieve_profile_get_location(profile, fields[0]);
+	pline = array_idx_get_space(&pscript->lines, lineno);
+	pline->ops += ops;
+	pline->tests += tests;
+	pline->matches += matches;
+	pline->wall_usecs += wall;
+	pline->cpu_usecs += cpu;
+	return TRUE;
+}
+
+int sieve_profile_merge_report
+(struct sieve_profile *profile, const char *path)
+{
+	struct sieve_instance *svinst = profile->svinst;
+	struct dotlock_settings dotlock_set;
+	struct dotlock *dotlock;
+	struct istream *input;
+	struct ostream *output;
+	const char *line;
+	int fd, ret = 0;
+
+	i_zero(&dotlock_set);
+	dotlock_set.timeout = 10;
+	dotlock_set.stale_timeout = 30;
+
+	fd = file_dotlock_open(&dotlock_set, path, 0, &dotlock);
+	if ( fd == -1 ) {
+		sieve_sys_error(svinst, "profile: "
+			"file_dotlock_open(%s) failed: %m", path);
+		return -1;
+	}
+
+	/* Add the totals recorded so far */
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	while ( (line=i_stream_read_next_line(input)) != NULL ) {
+		if ( *line == '#' || *line == '\0' )
+			continue;
+		T_BEGIN {
+			if ( !sieve_profile_parse_line(profile, line) ) {
+				sieve_sys_warning(svinst, "profile: "
+					"%s: ignored invalid line", path);
+			}
+		} T_END;
+	}
+	if ( input->stream_errno != 0 && input->stream_errno != ENOENT ) {
+		sieve_sys_error(svinst, "profile: read(%s) failed: %s",
+			path, i_stream_get_error(input));
+		ret = -1;
+	}
+	i_stream_destroy(&input);
+
+	if ( ret < 0 ) {
+		file_dotlock_delete(&dotlock);
+		return -1;
+	}
+
+	/* Write the merged report */
+	output = o_stream_create_fd(fd, 0);
+	sieve_profile_write(profile, output);
+	if ( o_stream_finish(output) < 0 ) {
+		sieve_sys_error(svinst, "profile: write(%s) failed: %s",
+			path, o_stream_get_error(output));
+		ret = -1;
+	}
+	o_stream_destroy(&output);
+
+	if ( ret < 0 ) {
+		file_dotlock_delete(&dotlock);
+		return -1;
+	}
+	if ( file_dotlock_replace(&dotlock, 0) < 0 ) {
+		sieve_sys_error(svinst, "profile: "
+			"file_dotlock_replace(%s) failed: %m", path);
+		return -1;
+	}
+	return 0;
+}
+
+int sieve_profile_flush(struct sieve_instance *svinst)
+{
+	struct sieve_profile *totals = svinst->profile_totals;
+	struct ostream *output;
+	string_t *temp_path;
+	int fd, ret = 0;
+
+	if ( totals == NULL )
+		return 0;
+	totals->flushed = ioloop_time;
+
+	/* Only this process writes the file; replace it atomically so that it
+	   can be read at any time */
+	temp_path = t_str_new(256);
+	str_append(temp_path, totals->path);
+	str_append_c(temp_path, '.');
+	fd = safe_mkstemp_hostpid(temp_path, 0600, (uid_t)-1, (gid_t)-1);
+	if ( fd == -1 ) {
+		if ( errno == EACCES ) {
+			sieve_sys_error(svinst, "profile: %s",
+				eacces_error_get_creating("open", str_c(temp_path)));
+		} else {
+			sieve_sys_error(svinst, "profile: "
+				"open(%s) failed: %m", str_c(temp_path));
+		}
+		return -1;
+	}
+
+	output = o_stream_create_fd(fd, 0);
+	sieve_profile_write(totals, output);
+	if ( o_stream_finish(output) < 0 ) {
+		sieve_sys_error(svinst, "profile: write(%s) failed: %s",
+			str_c(temp_path), o_stream_get_error(output));
+		ret = -1;
+	}
+	o_stream_destroy(&output);
+	if ( close(fd) < 0 ) {
+		sieve_sys_error(svinst, "profile: "
+			"close(%s) failed: %m", str_c(temp_path));
+		ret = -1;
+	}
+
+	if ( ret == 0 && rename(str_c(temp_path), totals->path) < 0 ) {
+		sieve_sys_error(svinst, "profile: "
+			"rename(%s, %s) failed: %m", str_c(temp_path), totals->path);
+		ret = -1;
+	}
+	if ( ret < 0 )
+		i_unlink_if_exists(str_c(temp_path));
+	return ret;
+}
@@ -0,0 +1,35 @@
+#ifndef SIEVE_PROFILE_H
+#define SIEVE_PROFILE_H
+
+#include "sieve-common.h"
+
+#include <sys/time.h>
+
+/*
+ * Script profile
+ *
+ *   Public API (creating, writing and merging profiles) is in sieve.h; this
+ *   is the interface used by the interpreter to record samples.
+ */
+
+struct sieve_profile_script;
+
+struct sieve_profile_sample {
+	struct timeval wall;
+	struct timeval cpu;
+};
+
+struct sieve_profile_script *sieve_profile_get_script
+	(struct sieve_profile *profile, struct sieve_script *script);
+
+void sieve_profile_sample_start
+	(struct sieve_profile_script *pscript, struct sieve_profile_sample *sample);
+void sieve_profile_script_record
+	(struct sieve_profile_script *pscript, unsigned int line,
+		const struct sieve_profile_sample *start, bool tested, bool matched);
+
+/* Writes the totals recorded for the sieve_profile_report setting and frees
+   them */
+void sieve_profile_deinit(struct sieve_instance *svinst);
+
+#endif
@@ -28,6 +28,8 @@
  * Types
  */
 
+ARRAY_DEFINE_TYPE(sieve_result_action, struct sieve_result_action *);
+
 struct sieve_result_action {
 	struct sieve_action action;
 
@@ -39,6 +41,20 @@ struct sieve_result_action {
 	struct sieve_side_effects_list *seffects;
 
 	struct sieve_result_action *prev, *next;
+
+	/* Position in the action list and index entries */
+	unsigned int seq;
+	struct sieve_result_action_index *index;
+	ARRAY_TYPE(sieve_result_action) *target_index;
+};
+
+struct sieve_result_action_index {
+	/* All actions of this definition */
+	ARRAY_TYPE(sieve_result_action) actions;
+
+	/* The same actions by target; only for action definitions with a
+	   duplicate_key() function */
+	HASH_TABLE(const char *, ARRAY_TYPE(sieve_result_action) *) targets;
 };
 
 struct sieve_side_effects_list {
@@ -83,9 +99,19 @@ struct sieve_result {
 
 	struct sieve_result_action *last_attempted_action;
 
+	/* Action index */
+	unsigned int action_seq;
+	HASH_TABLE(const struct sieve_action_def *,
+		   struct sieve_result_action_index *) action_index;
+	ARRAY_TYPE(sieve_result_action) keep_actions;
+	ARRAY_TYPE(sieve_result_action) conflict_actions;
+
 	HASH_TABLE(const struct sieve_action_def *,
 			   struct sieve_result_action_context *) action_contexts;
 
+	/* Duplicate ids marked by the actions of the current execution */
+	ARRAY(struct sieve_duplicate_id) duplicate_marks;
+
 	bool executed:1;
 	bool executed_delivery:1;
 };
@@ -122,6 +148,10 @@ struct sieve_result *sieve_result_create
 	result->first_action = NULL;
 	result->last_action = NULL;
 
+	hash_table_create_direct(&result->action_index, pool, 0);
+	p_array_init(&result->keep_actions, pool, 4);
+	p_array_init(&result->conflict_actions, pool, 4);
+
 	return result;
 }
 
@@ -320,6 +350,45 @@ int sieve_result_mail_error
 	return 	SIEVE_EXEC_TEMP_FAILURE;
 }
 
+/*
+ * Duplicate marks
+ */
+
+void sieve_result_duplicate_mark
+(const struct sieve_action_exec_env *aenv, const void *id, size_t id_size,
+	time_t time)
+{
+	struct sieve_result *result = aenv->result;
+	struct sieve_duplicate_id *mark;
+
+	if ( !sieve_action_duplicate_check_available(aenv->scriptenv) )
+		return;
+
+	if ( !array_is_created(&result->duplicate_marks) )
+		p_array_init(&result->duplicate_marks, result->pool, 4);
+
+	mark = array_append_space(&result->duplicate_marks);
+	mark->id = p_memdup(result->pool, id, id_size);
+	mark->id_size = id_size;
+	mark->time = time;
+}
+
+static void sieve_result_duplicate_marks_flush(struct sieve_result *result)
+{
+	const struct sieve_duplicate_id *marks;
+	unsigned int count;
+
+	if ( !array_is_created(&result->duplicate_marks) )
+		return;
+
+	marks = array_get(&result->duplicate_marks, &count);
+	if ( count > 0 ) {
+		sieve_action_duplicate_mark_multiple
+			(result->action_env.scriptenv, marks, count);
+	}
+	array_clear(&result->duplicate_marks);
+}
+
 /*
  * Result composition
  */
@@ -447,9 +516,167 @@ static int sieve_result_side_effects_merge
 	return 1;
 }
 
+/* Action index
+ *
+ * Avoids scanning the whole action list for each new action. Only actions
+ * that can influence the outcome are checked: keep actions, actions of the
+ * same definition (and target), and actions that check for conflicts.
+ */
+
+static void sieve_result_action_array_remove
+(ARRAY_TYPE(sieve_result_action) *ractions,
+	struct sieve_result_action *raction)
+{
+	struct sieve_result_action *const *racs;
+	unsigned int count, i;
+
+	racs = array_get(ractions, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( racs[i] == raction ) {
+			array_delete(ractions, i, 1);
+			break;
+		}
+	}
+}
+
+static struct sieve_result_action_index *sieve_result_action_index_get
+(struct sieve_result *result, const struct sieve_action_def *act_def)
+{
+	struct sieve_result_action_index *index;
+
+	index = hash_table_lookup(result->action_index, act_def);
+	if ( index == NULL ) {
+		index = p_new(result->pool, struct sieve_result_action_index, 1);
+		p_array_init(&index->actions, result->pool, 4);
+		if ( act_def->duplicate_key != NULL ) {
+			hash_table_create(&index->targets, result->pool, 0,
+				str_hash, strcmp);
+		}
+		hash_table_insert(result->action_index, act_def, index);
+	}
+	return index;
+}
+
+static ARRAY_TYPE(sieve_result_action) *sieve_result_action_target_get
+(const struct sieve_runtime_env *renv,
+	struct sieve_result_action_index *index,
+	const struct sieve_action *action, bool create)
+{
+	struct sieve_result *result = renv->result;
+	ARRAY_TYPE(sieve_result_action) *ractions;
+	const char *key;
+
+	key = action->def->duplicate_key(renv, action);
+	ractions = hash_table_lookup(index->targets, key);
+	if ( ractions == NULL && create ) {
+		ractions = p_new(result->pool, ARRAY_TYPE(sieve_result_action), 1);
+		p_array_init(ractions, result->pool, 2);
+		hash_table_insert(index->targets,
+			p_strdup(result->pool, key), ractions);
+	}
+	return ractions;
+}
+
+static void sieve_result_action_index_add
+(const struct sieve_runtime_env *renv, struct sieve_result_action *raction)
+{
+	struct sieve_result *result = renv->result;
+	const struct sieve_action_def *act_def = raction->action.def;
+
+	if ( raction->keep )
+		array_append(&result->keep_actions, &raction, 1);
+
+	if ( act_def == NULL )
+		return;
+
+	if ( act_def->check_conflict != NULL )
+		array_append(&result->conflict_actions, &raction, 1);
+
+	raction->index = sieve_result_action_index_get(result, act_def);
+	array_append(&raction->index->actions, &raction, 1);
+
+	if ( act_def->duplicate_key != NULL ) {
+		raction->target_index = sieve_result_action_target_get
+			(renv, raction->index, &raction->action, TRUE);
+		array_append(raction->target_index, &raction, 1);
+	}
+}
+
+static void sieve_result_action_index_remove
+(struct sieve_result *result, struct sieve_result_action *raction)
+{
+	sieve_result_action_array_remove(&result->keep_actions, raction);
+	sieve_result_action_array_remove(&result->conflict_actions, raction);
+
+	if ( raction->index != NULL ) {
+		sieve_result_action_array_remove(&raction->index->actions, raction);
+		raction->index = NULL;
+	}
+	if ( raction->target_index != NULL ) {
+		sieve_result_action_array_remove(raction->target_index, raction);
+		raction->target_index = NULL;
+	}
+}
+
+static int sieve_result_action_cmp_seq
+(struct sieve_result_action *const *rac1,
+	struct sieve_result_action *const *rac2)
+{
+	if ( (*rac1)->seq < (*rac2)->seq )
+		return -1;
+	if ( (*rac1)->seq > (*rac2)->seq )
+		return 1;
+	return 0;
+}
+
+/* Collects the existing actions that a new action needs to be checked
+   against, in result order. Returns the total number of actions with the
+   same definition. */
+static unsigned int sieve_result_action_candidates
+(const struct sieve_runtime_env *renv, const struct sieve_action *action,
+	bool keep, ARRAY_TYPE(sieve_result_action) *candidates)
+{
+	struct sieve_result *result = renv->result;
+	const struct sieve_action_def *act_def = action->def;
+	struct sieve_result_action_index *index = NULL;
+	ARRAY_TYPE(sieve_result_action) *ractions;
+	struct sieve_result_action *raction;
+
+	if ( act_def != NULL )
+		index = hash_table_lookup(result->action_index, act_def);
+
+	/* An action that checks for conflicts needs to see all others */
+	if ( act_def != NULL && act_def->check_conflict != NULL ) {
+		for ( raction = result->first_action; raction != NULL;
+			raction = raction->next )
+			array_append(candidates, &raction, 1);
+		return ( index == NULL ? 0 : array_count(&index->actions) );
+	}
+
+	if ( keep )
+		array_append_array(candidates, &result->keep_actions);
+	array_append_array(candidates, &result->conflict_actions);
+
+	if ( index != NULL ) {
+		if ( act_def->duplicate_key != NULL ) {
+			ractions = sieve_result_action_target_get
+				(renv, index, action, FALSE);
+			if ( ractions != NULL )
+				array_append_array(candidates, ractions);
+		} else {
+			array_append_array(candidates, &index->actions);
+		}
+	}
+
+	array_sort(candidates, sieve_result_action_cmp_seq);
+	return ( index == NULL ? 0 : array_count(&index->actions) );
+}
+
 static void sieve_result_action_detach
 (struct sieve_result *result, struct sieve_result_action *raction)
 {
+	sieve_result_action_index_remove(result, raction);
+
 	if ( result->first_action == raction )
 		result->first_action = raction->next;
 
@@ -476,11 +703,15 @@ static int _sieve_result_add_action
 	void *context, unsigned int instance_limit, bool preserve_mail, bool keep)
 {
 	int ret = 0;
-	unsigned int instance_count = 0;
+	unsigned int instance_count;
 	struct sieve_instance *svinst = renv->svinst;
 	struct sieve_result *result = renv->result;
 	struct sieve_result_action *raction = NULL, *kaction = NULL;
+	struct sieve_result_action *const *candidates;
+	ARRAY_TYPE(sieve_result_action) candidate_list;
 	struct sieve_action action;
+	unsigned int count, i;
+	bool listed;
 
 	action.def = act_def;
 	action.ext = ext;
@@ -489,9 +720,18 @@ static int _sieve_result_add_action
 	action.executed = FALSE;
 
 	/* First, check for duplicates or conflicts */
-	raction = result->first_action;
-	while ( raction != NULL ) {
-		const struct sieve_action *oact = &raction->action;
+	t_array_init(&candidate_list, 16);
+	instance_count = sieve_result_action_candidates
+		(renv, &action, keep, &candidate_list);
+
+	candidates = array_get(&candidate_list, &count);
+	for ( i = 0; i < count; i++ ) {
+		const struct sieve_action *oact;
+
+		raction = candidates[i];
+		if ( i > 0 && raction == candidates[i-1] )
+			continue;
+		oact = &raction->action;
 
 		if ( keep && raction->keep ) {
 
@@ -516,8 +756,6 @@ static int _sieve_result_add_action
 			}
 
 		} if ( act_def != NULL && raction->action.def == act_def ) {
-			instance_count++;
-
 			/* Possible duplicate */
 			if ( act_def->check_duplicate != NULL ) {
 				if ( (ret=act_def->check_duplicate(renv, &action, &raction->action))
@@ -574,7 +812,10 @@ static int _sieve_result_add_action
 					return ret;
 			}
 		}
-		raction = raction->next;
+
+		/* Stop once an action was detached (or at the end of the list) */
+		if ( raction->next == NULL )
+			break;
 	}
 
 	if ( kaction != NULL ) {
@@ -606,14 +847,20 @@ static int _sieve_result_add_action
 		raction->success = FALSE;
 	}
 
+	/* Re-index existing action once modified */
+	listed = ( raction->prev != NULL || raction == result->first_action );
+	if ( listed )
+		sieve_result_action_index_remove(result, raction);
+
 	raction->action.context = context;
 	raction->action.def = act_def;
 	raction->action.ext = ext;
 	raction->action.location = p_strdup(result->pool, action.location);
 	raction->keep = keep;
 
-	if ( raction->prev == NULL && raction != result->first_action ) {
+	if ( !listed ) {
 		/* Add */
+		raction->seq = ++result->action_seq;
 		if ( result->first_action == NULL ) {
 			result->first_action = raction;
 			result->last_action = raction;
@@ -673,6 +920,8 @@ static int _sieve_result_add_action
 		}
 	}
 
+	sieve_result_action_index_add(renv, raction);
+
 	if ( preserve_mail ) {
 		raction->action.mail = sieve_message_get_mail(renv->msgctx);
 		sieve_message_snapshot(renv->msgctx);
@@ -1456,6 +1705,9 @@ int sieve_result_execute
 	sieve_result_transaction_finish
 		(result, first_action, status);
 
+	/* Record all duplicate ids marked during execution at once */
+	sieve_result_duplicate_marks_flush(result);
+
 	result->action_env.ehandler = NULL;
 	return result_status;
 }
@@ -1518,6 +1770,8 @@ void sieve_result_iterate_delete
 
 	/* Delete action */
 
+	sieve_result_action_index_remove(result, rac);
+
 	if ( rac->prev == NULL )
 		result->first_action = rac->next;
 	else
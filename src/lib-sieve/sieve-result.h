@@ -111,6 +111,17 @@ int sieve_result_mail_error
 (const struct sieve_action_exec_env *aenv, struct mail *mail,
 	const char *fmt, ...) ATTR_FORMAT(3, 4);
 
+/*
+ * Duplicate marks
+ */
+
+/* Marks the id as seen once execution of the result is finished; all ids
+   marked during one execution are passed to the script environment at once.
+ */
+void sieve_result_duplicate_mark
+(const struct sieve_action_exec_env *aenv, const void *id, size_t id_size,
+	time_t time);
+
 /*
  * Result composition
  */
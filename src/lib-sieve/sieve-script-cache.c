@@ -0,0 +1,293 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "llist.h"
+#include "hash.h"
+
+#include "sieve-common.h"
+#include "sieve-error.h"
+#include "sieve-storage-private.h"
+#include "sieve-script-private.h"
+
+#include "sieve-script.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+#  include <sys/inotify.h>
+#endif
+
+/*
+ * Script cache
+ *
+ *   Keeps opened scripts that binaries depend upon (e.g. the scripts included
+ *   by a binary) for a limited time, so that the dependencies of binaries
+ *   that are loaded repeatedly do not need to be opened again each time.
+ *   The cache is bound to the Sieve instance, so it is only useful where the
+ *   instance outlives a single script execution (e.g. the IMAPSieve plugin,
+ *   which keeps its instance for the IMAP session). It is created
+ *   once the first script is cached, and only then is an inotify instance
+ *   allocated for it. Where inotify is available, cached file scripts are
+ *   dropped as soon as their file changes; otherwise changes are noticed
+ *   once the entry expires.
+ */
+
+#define SIEVE_SCRIPT_CACHE_MAX_ENTRIES 256
+
+struct sieve_script_cache_entry {
+	struct sieve_script_cache_entry *prev, *next;
+
+	char *key;
+	struct sieve_script *script;
+
+	time_t expires;
+
+	/* Watched directory and the name of the script file within it */
+	int watch;
+	char *filename;
+};
+
+struct sieve_script_cache {
+	HASH_TABLE(const char *, struct sieve_script_cache_entry *) entries;
+
+	/* Oldest entry first */
+	struct sieve_script_cache_entry *head, *tail;
+	unsigned int count;
+
+	int inotify_fd;
+	bool inotify_failed:1;
+
+	/* Statistics */
+	unsigned int hits, misses, invalidations;
+};
+
+static const char *sieve_script_cache_key
+(struct sieve_storage *storage, const char *name)
+{
+	return t_strdup_printf("%s\t%s", storage->location, name);
+}
+
+static void sieve_script_cache_entry_free
+(struct sieve_script_cache *cache,
+	struct sieve_script_cache_entry *entry)
+{
+	hash_table_remove(cache->entries, entry->key);
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	cache->count--;
+
+	sieve_script_unref(&entry->script);
+	i_free(entry->filename);
+	i_free(entry->key);
+	i_free(entry);
+}
+
+static struct sieve_script_cache *sieve_script_cache_create
+(struct sieve_instance *svinst)
+{
+	struct sieve_script_cache *cache;
+
+	cache = p_new(svinst->pool, struct sieve_script_cache, 1);
+	hash_table_create(&cache->entries, default_pool, 0, str_hash, strcmp);
+	cache->inotify_fd = -1;
+
+	svinst->script_cache = cache;
+	return cache;
+}
+
+void sieve_script_cache_deinit(struct sieve_instance *svinst)
+{
+	struct sieve_script_cache *cache = svinst->script_cache;
+
+	if ( cache == NULL )
+		return;
+
+	if ( svinst->debug ) {
+		sieve_sys_debug(svinst, "script cache: "
+			"%u hits, %u misses, %u invalidations",
+			cache->hits, cache->misses, cache->invalidations);
+	}
+
+	while ( cache->head != NULL )
+		sieve_script_cache_entry_free(cache, cache->head);
+	hash_table_destroy(&cache->entries);
+
+	if ( cache->inotify_fd != -1 && close(cache->inotify_fd) < 0 )
+		sieve_sys_error(svinst, "script cache: close(inotify) failed: %m");
+
+	svinst->script_cache = NULL;
+}
+
+static void sieve_script_cache_invalidate
+(struct sieve_script_cache *cache, int watch, const char *filename)
+{
+	struct sieve_script_cache_entry *entry, *next;
+
+	for ( entry = cache->head; entry != NULL; entry = next ) {
+		next = entry->next;
+
+		if ( watch != -1 && entry->watch != watch )
+			continue;
+		if ( filename != NULL &&
+			(entry->filename == NULL || strcmp(entry->filename, filename) != 0) )
+			continue;
+
+		sieve_script_cache_entry_free(cache, entry);
+		cache->invalidations++;
+	}
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static void sieve_script_cache_read_events
+(struct sieve_instance *svinst, struct sieve_script_cache *cache)
+{
+	union {
+		struct inotify_event event;
+		unsigned char data[4096];
+	} buf;
+	const struct inotify_event *event;
+	ssize_t ret, pos;
+
+	for (;;) {
+		ret = read(cache->inotify_fd, buf.data, sizeof(buf.data));
+		if ( ret <= 0 )
+			break;
+
+		for ( pos = 0; pos < ret; ) {
+			event = (const struct inotify_event *)(buf.data + pos);
+			i_assert( event->len <= (size_t)(ret - pos) );
+
+			if ( (event->mask & IN_Q_OVERFLOW) != 0 ) {
+				/* Events were lost; we don't know what changed */
+				sieve_script_cache_invalidate(cache, -1, NULL);
+			} else if ( event->len == 0 ||
+				(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) != 0 ) {
+				/* The directory itself changed */
+				sieve_script_cache_invalidate(cache, event->wd, NULL);
+			} else {
+				/* Only the scripts with this file name are affected;
+				   e.g. saving a binary next to a script is ignored */
+				sieve_script_cache_invalidate(cache, event->wd, event->name);
+			}
+
+			pos += sizeof(*event) + event->len;
+		}
+	}
+
+	if ( ret < 0 && errno != EAGAIN ) {
+		sieve_sys_error(svinst, "script cache: "
+			"read(inotify) failed: %m");
+		sieve_script_cache_invalidate(cache, -1, NULL);
+	}
+}
+
+static int sieve_script_cache_add_watch
+(struct sieve_instance *svinst, struct sieve_script_cache *cache,
+	struct sieve_script *script)
+{
+	const char *dirpath;
+	int watch;
+
+	if ( (dirpath=sieve_file_script_get_dirpath(script)) == NULL )
+		return -1;
+
+	if ( cache->inotify_fd == -1 ) {
+		/* Only try once; don't warn for each script */
+		if ( cache->inotify_failed )
+			return -1;
+		cache->inotify_fd = inotify_init();
+		if ( cache->inotify_fd == -1 ) {
+			sieve_sys_warning(svinst, "script cache: "
+				"inotify_init() failed: %m");
+			cache->inotify_failed = TRUE;
+			return -1;
+		}
+		fd_set_nonblock(cache->inotify_fd, TRUE);
+		fd_close_on_exec(cache->inotify_fd, TRUE);
+	}
+
+	/* Watch the directory rather than the script itself, since scripts are
+	   normally replaced by renaming a new file over them */
+	watch = inotify_add_watch(cache->inotify_fd, dirpath,
+		IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+		IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+	if ( watch == -1 ) {
+		sieve_sys_warning(svinst, "script cache: "
+			"inotify_add_watch(%s) failed: %m", dirpath);
+	}
+	return watch;
+}
+#endif
+
+struct sieve_script *sieve_script_cache_lookup
+(struct sieve_storage *storage, const char *name)
+{
+	struct sieve_instance *svinst = storage->svinst;
+	struct sieve_script_cache *cache = svinst->script_cache;
+	struct sieve_script_cache_entry *entry;
+	time_t now;
+
+	if ( cache == NULL || svinst->script_cache_ttl == 0 )
+		return NULL;
+
+#ifdef HAVE_SYS_INOTIFY_H
+	if ( cache->inotify_fd != -1 )
+		sieve_script_cache_read_events(svinst, cache);
+#endif
+
+	/* Drop expired entries */
+	now = time(NULL);
+	while ( cache->head != NULL && cache->head->expires <= now )
+		sieve_script_cache_entry_free(cache, cache->head);
+
+	entry = hash_table_lookup(cache->entries,
+		sieve_script_cache_key(storage, name));
+	if ( entry == NULL ) {
+		cache->misses++;
+		return NULL;
+	}
+	cache->hits++;
+
+	sieve_script_ref(entry->script);
+	return entry->script;
+}
+
+void sieve_script_cache_insert(struct sieve_script *script)
+{
+	struct sieve_instance *svinst = script->storage->svinst;
+	struct sieve_script_cache *cache = svinst->script_cache;
+	struct sieve_script_cache_entry *entry;
+	const char *key;
+
+	/* Only opened scripts say anything about the script's current state */
+	if ( svinst->script_cache_ttl == 0 || !sieve_script_is_open(script) )
+		return;
+	if ( cache == NULL )
+		cache = sieve_script_cache_create(svinst);
+
+	key = sieve_script_cache_key(script->storage, script->name);
+	entry = hash_table_lookup(cache->entries, key);
+	if ( entry != NULL )
+		sieve_script_cache_entry_free(cache, entry);
+
+	while ( cache->count >= SIEVE_SCRIPT_CACHE_MAX_ENTRIES )
+		sieve_script_cache_entry_free(cache, cache->head);
+
+	entry = i_new(struct sieve_script_cache_entry, 1);
+	entry->key = i_strdup(key);
+	entry->script = script;
+	sieve_script_ref(script);
+	entry->expires = time(NULL) + svinst->script_cache_ttl;
+	entry->watch = -1;
+#ifdef HAVE_SYS_INOTIFY_H
+	entry->watch = sieve_script_cache_add_watch(svinst, cache, script);
+	if ( entry->watch != -1 ) {
+		const char *path = sieve_file_script_get_path(script);
+		const char *p = strrchr(path, '/');
+
+		entry->filename = i_strdup(p == NULL ? path : p + 1);
+	}
+#endif
+
+	hash_table_insert(cache->entries, entry->key, entry);
+	DLLIST2_APPEND(&cache->head, &cache->tail, entry);
+	cache->count++;
+}
@@ -134,6 +134,18 @@ const char *sieve_file_script_get_dirpath
 const char *sieve_file_script_get_path
 	(const struct sieve_script *script) ATTR_PURE;
 
+/*
+ * Script cache
+ */
+
+void sieve_script_cache_deinit(struct sieve_instance *svinst);
+
+/* Returns a recently opened script with this name from the storage, if it
+   is not known to have changed since */
+struct sieve_script *sieve_script_cache_lookup
+	(struct sieve_storage *storage, const char *name);
+void sieve_script_cache_insert(struct sieve_script *script);
+
 /*
  * Comparison
  */
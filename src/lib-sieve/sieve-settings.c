@@ -214,6 +214,21 @@ void sieve_settings_load
 		svinst->max_script_size = size_setting;
 	}
 
+	svinst->binary_cache_size = SIEVE_DEFAULT_BINARY_CACHE_SIZE;
+	if ( sieve_setting_get_uint_value
+		(svinst, "sieve_binary_cache_size", &uint_setting) ) {
+		svinst->binary_cache_size = (unsigned int) uint_setting;
+	}
+
+	svinst->script_cache_ttl = SIEVE_DEFAULT_SCRIPT_CACHE_TTL;
+	if ( sieve_setting_get_duration_value
+		(svinst, "sieve_script_cache_ttl", &period) ) {
+		if (period > UINT_MAX)
+			svinst->script_cache_ttl = UINT_MAX;
+		else
+			svinst->script_cache_ttl = (unsigned int)period;
+	}
+
 	svinst->max_actions = SIEVE_DEFAULT_MAX_ACTIONS;
 	if ( sieve_setting_get_uint_value
 		(svinst, "sieve_max_actions", &uint_setting) ) {
@@ -239,6 +254,28 @@ void sieve_settings_load
 			svinst->redirect_duplicate_period = (unsigned int)period;
 	}
 
+	svinst->redirect_batch = TRUE;
+	(void)sieve_setting_get_bool_value
+		(svinst, "sieve_redirect_batch", &svinst->redirect_batch);
+
+	svinst->profile_report = NULL;
+	str_setting = sieve_setting_get(svinst, "sieve_profile_report");
+	if ( str_setting != NULL && *str_setting != '\0' )
+		svinst->profile_report = p_strdup(svinst->pool, str_setting);
+
+	svinst->profile_cpu = FALSE;
+	(void)sieve_setting_get_bool_value
+		(svinst, "sieve_profile_cpu", &svinst->profile_cpu);
+
+	svinst->profile_flush_interval = SIEVE_DEFAULT_PROFILE_FLUSH_INTERVAL;
+	if ( sieve_setting_get_duration_value
+		(svinst, "sieve_profile_flush_interval", &period) ) {
+		if (period > UINT_MAX)
+			svinst->profile_flush_interval = UINT_MAX;
+		else
+			svinst->profile_flush_interval = (unsigned int)period;
+	}
+
 	str_setting = sieve_setting_get(svinst, "sieve_user_email");
 	if ( str_setting != NULL && *str_setting != '\0' ) {
 		struct smtp_address *address;
@@ -23,6 +23,8 @@ struct sieve_message_data;
 struct sieve_script_env;
 struct sieve_exec_status;
 struct sieve_trace_log;
+struct sieve_profile;
+struct sieve_mailbox_cache;
 
 /*
  * System environment
@@ -119,7 +121,26 @@ enum sieve_compile_flags {
 	/* Script is being activated (usually through ManageSieve) */
 	SIEVE_COMPILE_FLAG_ACTIVATED = (1<<2),
 	/* Compiled for environment with no access to envelope */
-	SIEVE_COMPILE_FLAG_NO_ENVELOPE = (1<<3)
+	SIEVE_COMPILE_FLAG_NO_ENVELOPE = (1<<3),
+	/* Simplify the validated script before generating code */
+	SIEVE_COMPILE_FLAG_OPTIMIZE = (1<<4)
+};
+
+/*
+ * Manifest flags
+ *
+ * - Parts of the message accessed by a script, as recorded at compile time
+ */
+
+enum sieve_manifest_flags {
+	/* Header fields are accessed by names that are only known at runtime */
+	SIEVE_MANIFEST_FLAG_ALL_HEADERS = (1<<0),
+	/* The message body is accessed */
+	SIEVE_MANIFEST_FLAG_BODY = (1<<1),
+	/* The message size is accessed */
+	SIEVE_MANIFEST_FLAG_SIZE = (1<<2),
+	/* The envelope is accessed */
+	SIEVE_MANIFEST_FLAG_ENVELOPE = (1<<3)
 };
 
 /*
@@ -188,6 +209,14 @@ struct sieve_trace_config {
  * - Environment for currently executing script
  */
 
+struct sieve_duplicate_id {
+	const void *id;
+	size_t id_size;
+
+	/* Expiry time (only used for marking) */
+	time_t time;
+};
+
 struct sieve_script_env {
 	/* Mail-related */
 	struct mail_user *user;
@@ -230,6 +259,16 @@ struct sieve_script_env {
 			time_t time);
 	void (*duplicate_flush)
 		(const struct sieve_script_env *senv);
+	/* Optional: check or mark several ids in one go. For each id that was
+	   seen before, results_r[i] is set to TRUE. When these are not provided,
+	   the ids are checked and marked one by one. */
+	void (*duplicate_check_multiple)
+		(const struct sieve_script_env *senv,
+			const struct sieve_duplicate_id *ids, unsigned int count,
+			bool *results_r);
+	void (*duplicate_mark_multiple)
+		(const struct sieve_script_env *senv,
+			const struct sieve_duplicate_id *ids, unsigned int count);
 
 	/* Interface for rejecting mail */
 	int (*reject_mail)(const struct sieve_script_env *senv,
@@ -241,6 +280,12 @@ struct sieve_script_env {
 	/* Runtime trace*/
 	struct sieve_trace_log *trace_log;
 	struct sieve_trace_config trace_config;
+
+	/* Per-line execution profile (optional) */
+	struct sieve_profile *profile;
+
+	/* Mailboxes kept open for reuse by store actions (optional) */
+	struct sieve_mailbox_cache *mailbox_cache;
 };
 
 #define SIEVE_SCRIPT_DEFAULT_MAILBOX(senv) \
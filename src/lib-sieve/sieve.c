@@ -12,16 +12,19 @@
 #include "hostpid.h"
 #include "message-address.h"
 #include "mail-user.h"
+#include "mail-storage.h"
 
 #include "sieve-settings.h"
 #include "sieve-extensions.h"
 #include "sieve-plugins.h"
 
 #include "sieve-address.h"
+#include "sieve-message.h"
 #include "sieve-script.h"
 #include "sieve-storage-private.h"
 #include "sieve-ast.h"
 #include "sieve-binary.h"
+#include "sieve-manifest.h"
 #include "sieve-actions.h"
 #include "sieve-result.h"
 
@@ -30,6 +33,7 @@
 #include "sieve-generator.h"
 #include "sieve-interpreter.h"
 #include "sieve-binary-dumper.h"
+#include "sieve-profile.h"
 
 #include "sieve.h"
 #include "sieve-common.h"
@@ -103,6 +107,7 @@ struct sieve_instance *sieve_init
 	/* Read configuration */
 
 	sieve_settings_load(svinst);
+	sieve_binary_cache_init(svinst);
 
 	/* Initialize extensions */
 	if ( !sieve_extensions_init(svinst) ) {
@@ -126,6 +131,9 @@ void sieve_deinit(struct sieve_instance **_svinst)
 {
 	struct sieve_instance *svinst = *_svinst;
 
+	sieve_profile_deinit(svinst);
+	sieve_binary_cache_deinit(svinst);
+	sieve_script_cache_deinit(svinst);
 	sieve_plugins_unload(svinst);
 	sieve_storages_deinit(svinst);
 	sieve_extensions_deinit(svinst);
@@ -371,6 +379,23 @@ struct sieve_binary *sieve_open_script
 	struct sieve_instance *svinst = sieve_script_svinst(script);
 	struct sieve_binary *sbin;
 
+	T_BEGIN {
+		/* First check whether the binary is still open from earlier */
+		sbin = sieve_binary_cache_lookup(script, flags);
+		if ( sbin != NULL ) {
+			if ( svinst->debug ) {
+				sieve_sys_debug(svinst,
+					"Script binary %s reused from cache",
+					sieve_binary_path(sbin));
+			}
+			if ( error_r != NULL )
+				*error_r = SIEVE_ERROR_NONE;
+		}
+	} T_END;
+
+	if ( sbin != NULL )
+		return sbin;
+
 	T_BEGIN {
 		/* Then try to open the matching binary */
 		sbin = sieve_script_binary_load(script, error_r);
@@ -398,6 +423,7 @@ struct sieve_binary *sieve_open_script
 					"Script binary %s successfully loaded",
 					sieve_binary_path(sbin));
 			}
+			sieve_binary_cache_insert(sbin, flags);
 
 		} else {
 			sbin = sieve_compile_script(script, ehandler, flags, error_r);
@@ -460,6 +486,64 @@ bool sieve_is_loaded(struct sieve_binary *sbin)
 	return sieve_binary_loaded(sbin);
 }
 
+/*
+ * Message access
+ */
+
+enum sieve_manifest_flags sieve_get_wanted_fields
+(struct sieve_binary *sbin, ARRAY_TYPE(const_string) *headers)
+{
+	const struct sieve_manifest *manifest = sieve_binary_get_manifest(sbin);
+	const char *const *fields, *const *field;
+	unsigned int count, i;
+
+	fields = sieve_manifest_get_headers(manifest, &count);
+	for ( i = 0; i < count; i++ ) {
+		bool found = FALSE;
+
+		array_foreach(headers, field) {
+			if ( *field != NULL && strcasecmp(*field, fields[i]) == 0 ) {
+				found = TRUE;
+				break;
+			}
+		}
+		if ( !found )
+			array_append(headers, &fields[i], 1);
+	}
+
+	return sieve_manifest_get_flags(manifest);
+}
+
+void sieve_prefetch_wanted_fields
+(struct sieve_binary *sbin, struct mail *mail)
+{
+	T_BEGIN {
+		struct mailbox_header_lookup_ctx *headers_ctx = NULL;
+		ARRAY_TYPE(const_string) headers;
+		enum sieve_manifest_flags flags;
+		enum mail_fetch_field fields = 0;
+
+		t_array_init(&headers, 16);
+		flags = sieve_get_wanted_fields(sbin, &headers);
+
+		if ( (flags & SIEVE_MANIFEST_FLAG_BODY) != 0 )
+			fields |= MAIL_FETCH_STREAM_BODY;
+		if ( (flags & SIEVE_MANIFEST_FLAG_SIZE) != 0 )
+			fields |= MAIL_FETCH_PHYSICAL_SIZE;
+
+		if ( array_count(&headers) > 0 ) {
+			array_append_zero(&headers);
+			headers_ctx = mailbox_header_lookup_init
+				(mail->box, array_idx(&headers, 0));
+		}
+
+		if ( fields != 0 || headers_ctx != NULL )
+			mail_add_temp_wanted_fields(mail, fields, headers_ctx);
+		if ( headers_ctx != NULL )
+			mailbox_header_lookup_unref(&headers_ctx);
+	} T_END;
+}
+
 int sieve_save_as
 (struct sieve_binary *sbin, const char *bin_path, bool update,
 	mode_t save_mode, enum sieve_error *error_r)
@@ -561,6 +645,18 @@ int sieve_script_env_init(struct sieve_script_env *senv,
 	return 0;
 }
 
+void sieve_script_env_deinit(struct sieve_script_env *senv)
+{
+	if ( senv->mailbox_cache != NULL )
+		sieve_mailbox_cache_free(&senv->mailbox_cache);
+}
+
+void sieve_script_env_enable_mailbox_cache(struct sieve_script_env *senv)
+{
+	if ( senv->mailbox_cache == NULL )
+		senv->mailbox_cache = sieve_mailbox_cache_create(senv->user);
+}
+
 int sieve_execute
 (struct sieve_binary *sbin, const struct sieve_message_data *msgdata,
 	const struct sieve_script_env *senv,
@@ -771,6 +867,24 @@ int sieve_multiscript_status(struct sieve_multiscript *mscript)
 	return mscript->status;
 }
 
+void sieve_multiscript_get_pool_usage
+(struct sieve_multiscript *mscript, size_t *used_r, size_t *alloc_r)
+{
+	struct sieve_message_context *msgctx =
+		sieve_result_get_message_context(mscript->result);
+	pool_t pools[2];
+	unsigned int i;
+
+	pools[0] = sieve_result_pool(mscript->result);
+	pools[1] = sieve_message_context_pool(msgctx);
+
+	*used_r = *alloc_r = 0;
+	for ( i = 0; i < N_ELEMENTS(pools); i++ ) {
+		*used_r += pool_alloconly_get_total_used_size(pools[i]);
+		*alloc_r += pool_alloconly_get_total_alloc_size(pools[i]);
+	}
+}
+
 int sieve_multiscript_tempfail(struct sieve_multiscript **_mscript,
 	struct sieve_error_handler *action_ehandler,
 	enum sieve_execute_flags flags)
@@ -129,6 +129,31 @@ const char *sieve_get_source(struct sieve_binary *sbin);
  */
 bool sieve_is_loaded(struct sieve_binary *sbin);
 
+/*
+ * Message access
+ */
+
+/* sieve_get_wanted_fields:
+ *
+ *   Obtains which parts of the message the script accesses, as recorded when
+ *   it was compiled. The names of the header fields it accesses are added to
+ *   the headers array, unless already present; these remain valid for as
+ *   long as the binary is open. The returned flags indicate whether the
+ *   body, size or envelope is accessed and whether the script accesses
+ *   header fields with names that are only known at runtime.
+ */
+enum sieve_manifest_flags sieve_get_wanted_fields
+	(struct sieve_binary *sbin, ARRAY_TYPE(const_string) *headers);
+
+/* sieve_prefetch_wanted_fields:
+ *
+ *   Adds the fields accessed by the script to the fields the mail storage
+ *   fetches for this mail, so that they are read in one pass rather than
+ *   when the script first needs them.
+ */
+void sieve_prefetch_wanted_fields
+	(struct sieve_binary *sbin, struct mail *mail);
+
 /*
  * Debugging
  */
@@ -167,6 +192,20 @@ int sieve_test
  */
 int sieve_script_env_init(struct sieve_script_env *senv,
 	struct mail_user *user, const char **error_r);
+/* sieve_script_env_deinit:
+ *
+ *   Frees resources held by the script environment (e.g. the mailbox
+ *   cache).
+ */
+void sieve_script_env_deinit(struct sieve_script_env *senv);
+
+/* sieve_script_env_enable_mailbox_cache:
+ *
+ *   Keeps the mailboxes opened by store actions open, so that later store
+ *   actions executed with this environment (e.g. from subsequent scripts)
+ *   can reuse them. They are closed by sieve_script_env_deinit().
+ */
+void sieve_script_env_enable_mailbox_cache(struct sieve_script_env *senv);
 
 /* sieve_execute:
  *
@@ -208,6 +247,10 @@ void sieve_multiscript_run_discard
 
 int sieve_multiscript_status(struct sieve_multiscript *mscript);
 
+/* Memory used so far for processing the message (for statistics) */
+void sieve_multiscript_get_pool_usage
+	(struct sieve_multiscript *mscript, size_t *used_r, size_t *alloc_r);
+
 int sieve_multiscript_tempfail
 	(struct sieve_multiscript **_mscript,
 		struct sieve_error_handler *action_ehandler,
@@ -259,4 +302,26 @@ void sieve_trace_log_free(struct sieve_trace_log **_trace_log);
 int sieve_trace_config_get(struct sieve_instance *svinst,
 	struct sieve_trace_config *tr_config);
 
+/*
+ * Script profile
+ */
+
+struct sieve_profile;
+
+struct sieve_profile *sieve_profile_create(struct sieve_instance *svinst);
+void sieve_profile_free(struct sieve_profile **_profile);
+
+/* Returns NULL unless the sieve_profile_report setting is configured; closing
+   the profile adds it to the totals of this process, which are written to
+   their own report file from time to time */
+struct sieve_profile *sieve_profile_open(struct sieve_instance *svinst);
+void sieve_profile_close(struct sieve_profile **_profile);
+/* Writes the totals of this process to its report file right away */
+int sieve_profile_flush(struct sieve_instance *svinst);
+
+void sieve_profile_write
+	(struct sieve_profile *profile, struct ostream *output);
+int sieve_profile_merge_report
+	(struct sieve_profile *profile, const char *path);
+
 #endif
@@ -44,6 +44,7 @@ const struct sieve_command_def tst_address = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_MEDIUM,
 	.registered = tst_address_registered,
 	.validate = tst_address_validate,
 	.generate = tst_address_generate
@@ -33,6 +33,7 @@ const struct sieve_command_def tst_exists = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_CHEAP,
 	.validate = tst_exists_validate,
 	.generate = tst_exists_generate
 };
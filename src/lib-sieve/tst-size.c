@@ -12,6 +12,7 @@
 #include "sieve-generator.h"
 #include "sieve-interpreter.h"
 #include "sieve-dump.h"
+#include "sieve-manifest.h"
 
 /*
  * Size test
@@ -37,6 +38,7 @@ const struct sieve_command_def tst_size = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_CHEAP,
 	.registered = tst_size_registered,
 	.pre_validate = tst_size_pre_validate,
 	.validate = tst_size_validate,
@@ -184,6 +186,9 @@ static bool tst_size_validate
 		return FALSE;
 	}
 
+	sieve_manifest_add_flags(sieve_ast_manifest(tst->ast_node->ast),
+		SIEVE_MANIFEST_FLAG_SIZE);
+
 	return sieve_validator_argument_activate(valdtr, tst, arg, FALSE);
 }
 
@@ -28,6 +28,7 @@ const struct sieve_command_def tst_false = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_CHEAP,
 	.validate_const = tst_false_validate_const,
 	.control_generate = tst_false_generate
 };
@@ -46,6 +47,7 @@ const struct sieve_command_def tst_true = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.cost = SIEVE_TEST_COST_CHEAP,
 	.validate_const = tst_true_validate_const,
 	.control_generate = tst_true_generate
 };
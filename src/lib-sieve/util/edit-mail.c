@@ -3,6 +3,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "hash.h"
 #include "str.h"
 #include "mempool.h"
 #include "llist.h"
@@ -37,6 +38,7 @@ struct istream *edit_mail_istream_create(struct edit_mail *edmail);
 
 static struct _header_index *edit_mail_header_clone
 	(struct edit_mail *edmail, struct _header *header);
+static void edit_mail_headers_index_rebuild(struct edit_mail *edmail);
 
 /*
  * Raw storage
@@ -73,11 +75,13 @@ static void edit_mail_raw_storage_drop(void)
  * Headers
  */
 
+/* The header fields and their names are allocated from an arena pool that is
+   shared between an edit mail and its snapshots. The indexes below are
+   private to each edit mail. */
+
 struct _header_field {
 	struct _header *header;
 
-	unsigned int refcount;
-
 	char *data;
 	size_t size;
 	size_t virtual_size;
@@ -90,15 +94,19 @@ struct _header_field {
 };
 
 struct _header_field_index {
+	/* All header fields in message order */
 	struct _header_field_index *prev, *next;
+	/* Header fields with the same name in message order */
+	struct _header_field_index *hprev, *hnext;
 
 	struct _header_field *field;
 	struct _header_index *header;
+
+	/* Appended before the message headers were parsed */
+	bool appended:1;
 };
 
 struct _header {
-	unsigned int refcount;
-
 	char *name;
 };
 
@@ -112,66 +120,28 @@ struct _header_index {
 	unsigned int count;
 };
 
-static inline struct _header *_header_create(const char *name)
+static inline struct _header *_header_create
+(pool_t pool, const char *name)
 {
 	struct _header *header;
 
-	header = i_new(struct _header, 1);
-	header->name = i_strdup(name);
-	header->refcount = 1;
+	header = p_new(pool, struct _header, 1);
+	header->name = p_strdup(pool, name);
 
 	return header;
 }
 
-static inline void _header_ref(struct _header *header)
-{
-	header->refcount++;
-}
-
-static inline void _header_unref(struct _header *header)
-{
-	i_assert( header->refcount > 0 );
-	if ( --header->refcount != 0 )
-		return;
-
-	i_free(header->name);
-	i_free(header);
-}
-
-static inline struct _header_field *_header_field_create(struct _header *header)
+static inline struct _header_field *_header_field_create
+(pool_t pool, struct _header *header)
 {
 	struct _header_field *hfield;
 
-	hfield = i_new(struct _header_field, 1);
-	hfield->refcount = 1;
+	hfield = p_new(pool, struct _header_field, 1);
 	hfield->header = header;
-	if ( header != NULL )
-		_header_ref(header);
 
 	return hfield;
 }
 
-static inline void _header_field_ref(struct _header_field *hfield)
-{
-	hfield->refcount++;
-}
-
-static inline void _header_field_unref(struct _header_field *hfield)
-{
-	i_assert( hfield->refcount > 0 );
-	if ( --hfield->refcount != 0 )
-		return;
-
-	if ( hfield->header != NULL )
-		_header_unref(hfield->header);
-
-	if ( hfield->data != NULL )
-		i_free(hfield->data);
-	if ( hfield->utf8_value != NULL )
-		i_free(hfield->utf8_value);
-	i_free(hfield);
-}
-
 /*
  * Edit mail object
  */
@@ -186,6 +156,8 @@ struct edit_mail {
 	struct istream *wrapped_stream;
 	struct istream *stream;
 
+	pool_t header_pool;
+	HASH_TABLE(const char *, struct _header_index *) header_names;
 	struct _header_index *headers_head, *headers_tail;
 	struct _header_field_index *header_fields_head, *header_fields_tail;
 	struct message_size hdr_size, body_size;
@@ -241,6 +213,11 @@ struct edit_mail *edit_mail_wrap(struct mail *mail)
 	edmail->refcount = 1;
 	edmail->mail.pool = pool;
 
+	edmail->header_pool =
+		pool_alloconly_create(MEMPOOL_GROWING"edit_mail_headers", 4096);
+	hash_table_create(&edmail->header_names, default_pool, 0,
+		strcase_hash, strcasecmp);
+
 	edmail->wrapped = mailp;
 	edmail->wrapped_hdr_size = hdr_size;
 	edmail->wrapped_body_size = body_size;
@@ -281,6 +258,11 @@ struct edit_mail *edit_mail_snapshot(struct edit_mail *edmail)
 	edmail_new->refcount = 1;
 	edmail_new->mail.pool = pool;
 
+	edmail_new->header_pool = edmail->header_pool;
+	pool_ref(edmail_new->header_pool);
+	hash_table_create(&edmail_new->header_names, default_pool, 0,
+		strcase_hash, strcasecmp);
+
 	edmail_new->wrapped = edmail->wrapped;
 	edmail_new->wrapped_hdr_size = edmail->wrapped_hdr_size;
 	edmail_new->wrapped_body_size = edmail->wrapped_body_size;
@@ -310,30 +292,25 @@ struct edit_mail *edit_mail_snapshot(struct edit_mail *edmail)
 		while ( field_idx != NULL ) {
 			struct _header_field_index *next = field_idx->next;
 
-			field_idx_new = i_new(struct _header_field_index, 1);
+			field_idx_new = p_new(pool, struct _header_field_index, 1);
 
 			field_idx_new->header =
 				edit_mail_header_clone(edmail_new, field_idx->header->header);
 
 			field_idx_new->field = field_idx->field;
-			_header_field_ref(field_idx_new->field);
+			field_idx_new->appended = field_idx->appended;
 
 			DLLIST2_APPEND
 				(&edmail_new->header_fields_head, &edmail_new->header_fields_tail,
 					field_idx_new);
 
-			field_idx_new->header->count++;
-			if ( field_idx->header->first == field_idx )
-				field_idx_new->header->first = field_idx_new;
-			if ( field_idx->header->last == field_idx )
-				field_idx_new->header->last = field_idx_new;
-
 			if ( field_idx == edmail->header_fields_appended )
 				edmail_new->header_fields_appended = field_idx_new;
 
 			field_idx = next;
 		}
 
+		edit_mail_headers_index_rebuild(edmail_new);
 		edmail_new->modified = TRUE;
 	}
 
@@ -347,30 +324,14 @@ struct edit_mail *edit_mail_snapshot(struct edit_mail *edmail)
 
 void edit_mail_reset(struct edit_mail *edmail)
 {
-	struct _header_index *header_idx;
-	struct _header_field_index *field_idx;
-
 	i_stream_unref(&edmail->stream);
 
-	field_idx = edmail->header_fields_head;
-	while ( field_idx != NULL ) {
-		struct _header_field_index *next = field_idx->next;
-
-		_header_field_unref(field_idx->field);
-		i_free(field_idx);
-
-		field_idx = next;
-	}
-
-	header_idx = edmail->headers_head;
-	while ( header_idx != NULL ) {
-		struct _header_index *next = header_idx->next;
-
-		_header_unref(header_idx->header);
-		i_free(header_idx);
-
-		header_idx = next;
-	}
+	/* The index items are allocated from the mail pool and the fields from
+	   the header pool; these are freed together with the edit mail */
+	hash_table_clear(edmail->header_names, FALSE);
+	edmail->headers_head = edmail->headers_tail = NULL;
+	edmail->header_fields_head = edmail->header_fields_tail = NULL;
+	edmail->header_fields_appended = NULL;
 
 	edmail->modified = FALSE;
 }
@@ -385,6 +346,8 @@ void edit_mail_unwrap(struct edit_mail **edmail)
 
 	edit_mail_reset(*edmail);
 	i_stream_unref(&(*edmail)->wrapped_stream);
+	hash_table_destroy(&(*edmail)->header_names);
+	pool_unref(&(*edmail)->header_pool);
 
 	parent = (*edmail)->parent;
 
@@ -424,7 +387,7 @@ static inline void edit_mail_modify(struct edit_mail *edmail)
 /* Header modification */
 
 static inline char *_header_value_unfold
-(const char *value)
+(pool_t pool, const char *value)
 {
 	string_t *out;
 	unsigned int i;
@@ -434,7 +397,7 @@ static inline char *_header_value_unfold
 			break;
 	}
 	if ( value[i] == '\0' ) {
-		return i_strdup(value);
+		return p_strdup(pool, value);
 	}
 
 	out = t_str_new(i + strlen(value+i) + 10);
@@ -459,23 +422,38 @@ static inline char *_header_value_unfold
 		}
 	}
 
-	return i_strndup(str_c(out), str_len(out));
+	return p_strndup(pool, str_c(out), str_len(out));
 }
 
 static struct _header_index *edit_mail_header_find
 (struct edit_mail *edmail, const char *field_name)
+{
+	if ( field_name == NULL )
+		return NULL;
+	return hash_table_lookup(edmail->header_names, field_name);
+}
+
+static struct _header_index *edit_mail_header_add_index
+(struct edit_mail *edmail, struct _header *header)
 {
 	struct _header_index *header_idx;
 
-	header_idx = edmail->headers_head;
-	while ( header_idx != NULL ) {
-		if ( strcasecmp(header_idx->header->name, field_name) == 0 )
-			return header_idx;
+	header_idx = p_new(edmail->mail.pool, struct _header_index, 1);
+	header_idx->header = header;
 
-		header_idx = header_idx->next;
-	}
+	DLLIST2_APPEND(&edmail->headers_head, &edmail->headers_tail, header_idx);
+	hash_table_insert(edmail->header_names, header->name, header_idx);
 
-	return NULL;
+	return header_idx;
+}
+
+static void edit_mail_header_remove_index
+(struct edit_mail *edmail, struct _header_index *header_idx)
+{
+	i_assert( header_idx->count == 0 );
+
+	hash_table_remove(edmail->header_names, header_idx->header->name);
+	DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
 }
 
 static struct _header_index *edit_mail_header_create
@@ -484,10 +462,8 @@ static struct _header_index *edit_mail_header_create
 	struct _header_index *header_idx;
 
 	if ( (header_idx=edit_mail_header_find(edmail, field_name)) == NULL ) {
-		header_idx = i_new(struct _header_index, 1);
-		header_idx->header = _header_create(field_name);
-
-		DLLIST2_APPEND(&edmail->headers_head, &edmail->headers_tail, header_idx);
+		header_idx = edit_mail_header_add_index
+			(edmail, _header_create(edmail->header_pool, field_name));
 	}
 
 	return header_idx;
@@ -498,20 +474,87 @@ static struct _header_index *edit_mail_header_clone
 {
 	struct _header_index *header_idx;
 
+	/* Header names are unique within an edit mail */
+	header_idx = edit_mail_header_find(edmail, header->name);
+	if ( header_idx != NULL ) {
+		i_assert( header_idx->header == header );
+		return header_idx;
+	}
+
+	return edit_mail_header_add_index(edmail, header);
+}
+
+static void edit_mail_header_field_link
+(struct _header_field_index *field_idx)
+{
+	struct _header_index *header_idx = field_idx->header;
+	struct _header_field_index *prev;
+
+	/* Find the preceding field with the same name; the field is normally
+	   inserted right next to it */
+	prev = NULL;
+	if ( header_idx->count > 0 ) {
+		prev = field_idx->prev;
+		while ( prev != NULL && prev->header != header_idx )
+			prev = prev->prev;
+	}
+
+	if ( prev == NULL ) {
+		DLLIST2_PREPEND_FULL(&header_idx->first, &header_idx->last,
+			field_idx, hprev, hnext);
+	} else {
+		DLLIST2_INSERT_AFTER_FULL(&header_idx->first, &header_idx->last,
+			prev, field_idx, hprev, hnext);
+	}
+	header_idx->count++;
+}
+
+static void edit_mail_header_field_unlink
+(struct edit_mail *edmail, struct _header_field_index *field_idx)
+{
+	struct _header_index *header_idx = field_idx->header;
+
+	i_assert( header_idx->count > 0 );
+
+	DLLIST2_REMOVE_FULL(&header_idx->first, &header_idx->last,
+		field_idx, hprev, hnext);
+	if ( --header_idx->count == 0 )
+		edit_mail_header_remove_index(edmail, header_idx);
+}
+
+static void edit_mail_headers_index_rebuild(struct edit_mail *edmail)
+{
+	struct _header_index *header_idx;
+	struct _header_field_index *current;
+
 	header_idx = edmail->headers_head;
 	while ( header_idx != NULL ) {
-		if ( header_idx->header == header )
-			return header_idx;
+		header_idx->first = header_idx->last = NULL;
+		header_idx->count = 0;
 
 		header_idx = header_idx->next;
 	}
 
-	header_idx = i_new(struct _header_index, 1);
-	header_idx->header = header;
-	_header_ref(header);
-	DLLIST2_APPEND(&edmail->headers_head, &edmail->headers_tail, header_idx);
+	current = edmail->header_fields_head;
+	while ( current != NULL ) {
+		header_idx = current->header;
+		DLLIST2_APPEND_FULL(&header_idx->first, &header_idx->last,
+			current, hprev, hnext);
+		header_idx->count++;
 
-	return header_idx;
+		current = current->next;
+	}
+
+	/* Drop names that no longer occur */
+	header_idx = edmail->headers_head;
+	while ( header_idx != NULL ) {
+		struct _header_index *next = header_idx->next;
+
+		if ( header_idx->count == 0 )
+			edit_mail_header_remove_index(edmail, header_idx);
+
+		header_idx = next;
+	}
 }
 
 static struct _header_field_index *
@@ -529,9 +572,10 @@ edit_mail_header_field_create
 	header = header_idx->header;
 
 	/* Create new field index item */
-	field_idx = i_new(struct _header_field_index, 1);
+	field_idx = p_new(edmail->mail.pool, struct _header_field_index, 1);
 	field_idx->header = header_idx;
-	field_idx->field = field = _header_field_create(header);
+	field_idx->field = field =
+		_header_field_create(edmail->header_pool, header);
 
 	/* Create header field data (folded if necessary) */
 	T_BEGIN {
@@ -546,71 +590,52 @@ edit_mail_header_field_create
 			(data, field_name, str_c(enc_value), edmail->crlf, &field->body_offset);
 
 		/* Copy to new field */
-		field->data = i_strndup(str_data(data), str_len(data));
+		field->data = p_strndup(edmail->header_pool,
+			str_data(data), str_len(data));
 		field->size = str_len(data);
 		field->virtual_size = ( edmail->crlf ? field->size : field->size + lines );
 		field->lines = lines;
 	} T_END;
 
 	/* Record original (utf8) value */
-	field->utf8_value = _header_value_unfold(value);
+	field->utf8_value = _header_value_unfold(edmail->header_pool, value);
 
 	return field_idx;
 }
 
 static void edit_mail_header_field_delete
-(struct edit_mail *edmail, struct _header_field_index *field_idx,
-	bool update_index)
+(struct edit_mail *edmail, struct _header_field_index *field_idx)
 {
-	struct _header_index *header_idx = field_idx->header;
 	struct _header_field *field = field_idx->field;
 
-	i_assert( header_idx != NULL );
+	i_assert( field_idx->header != NULL );
 
 	edmail->hdr_size.physical_size -= field->size;
 	edmail->hdr_size.virtual_size -= field->virtual_size;
 	edmail->hdr_size.lines -= field->lines;
 
-	header_idx->count--;
-	if ( update_index ) {
-		if ( header_idx->count == 0 ) {
-			DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
-			_header_unref(header_idx->header);
-			i_free(header_idx);
-		} else if ( header_idx->first == field_idx ) {
-			struct _header_field_index *hfield = header_idx->first->next;
-
-			while ( hfield != NULL && hfield->header != header_idx ) {
-				hfield = hfield->next;
-			}
-
-			i_assert( hfield != NULL );
-			header_idx->first = hfield;
-		} else if ( header_idx->last == field_idx ) {
-			struct _header_field_index *hfield = header_idx->last->prev;
-
-			while ( hfield != NULL && hfield->header != header_idx ) {
-				hfield = hfield->prev;
-			}
+	if ( !edmail->headers_parsed && field_idx->appended ) {
+		edmail->appended_hdr_size.physical_size -= field->size;
+		edmail->appended_hdr_size.virtual_size -= field->virtual_size;
+		edmail->appended_hdr_size.lines -= field->lines;
 
-			i_assert( hfield != NULL );
-			header_idx->last = hfield;
-		}
+		/* Appended fields are always at the end */
+		if ( edmail->header_fields_appended == field_idx )
+			edmail->header_fields_appended = field_idx->next;
 	}
 
+	edit_mail_header_field_unlink(edmail, field_idx);
 	DLLIST2_REMOVE
 		(&edmail->header_fields_head, &edmail->header_fields_tail, field_idx);
-	_header_field_unref(field_idx->field);
-	i_free(field_idx);
 }
 
 static struct _header_field_index *
 edit_mail_header_field_replace
 (struct edit_mail *edmail, struct _header_field_index *field_idx,
-	const char *newname, const char *newvalue, bool update_index)
+	const char *newname, const char *newvalue)
 {
 	struct _header_field_index *field_idx_new;
-	struct _header_index *header_idx = field_idx->header, *header_idx_new;
+	struct _header_index *header_idx = field_idx->header;
 	struct _header_field *field = field_idx->field, *field_new;
 
 	i_assert( header_idx != NULL );
@@ -623,7 +648,6 @@ edit_mail_header_field_replace
 	field_idx_new = edit_mail_header_field_create
 		(edmail, newname, newvalue);
 	field_new = field_idx_new->field;
-	header_idx_new = field_idx_new->header;
 
 	edmail->hdr_size.physical_size -= field->size;
 	edmail->hdr_size.virtual_size -= field->virtual_size;
@@ -633,80 +657,33 @@ edit_mail_header_field_replace
 	edmail->hdr_size.virtual_size += field_new->virtual_size;
 	edmail->hdr_size.lines += field_new->lines;
 
-	/* Replace header field index */
-	field_idx_new->prev = field_idx->prev;
-	field_idx_new->next = field_idx->next;
-	if ( field_idx->prev != NULL )
-		field_idx->prev->next = field_idx_new;
-	if ( field_idx->next != NULL )
-		field_idx->next->prev = field_idx_new;
-	if (edmail->header_fields_head == field_idx)
-		edmail->header_fields_head = field_idx_new;
-	if (edmail->header_fields_tail == field_idx)
-		edmail->header_fields_tail = field_idx_new;
-
-	if ( header_idx_new == header_idx ) {
-		if (header_idx->first == field_idx)
-			header_idx->first = field_idx_new;
-		if (header_idx->last == field_idx)
-			header_idx->last = field_idx_new;
-	} else {
-		header_idx->count--;
-		header_idx_new->count++;
-
-		if ( update_index ) {
-			if ( header_idx->count == 0 ) {
-				DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
-				_header_unref(header_idx->header);
-				i_free(header_idx);
-			} else if ( header_idx->first == field_idx ) {
-				struct _header_field_index *hfield = header_idx->first->next;
-
-				while ( hfield != NULL && hfield->header != header_idx ) {
-					hfield = hfield->next;
-				}
-
-				i_assert( hfield != NULL );
-				header_idx->first = hfield;
-			} else if ( header_idx->last == field_idx ) {
-				struct _header_field_index *hfield = header_idx->last->prev;
-
-				while ( hfield != NULL && hfield->header != header_idx ) {
-					hfield = hfield->prev;
-				}
-
-				i_assert( hfield != NULL );
-				header_idx->last = hfield;
-			}
-			if ( header_idx_new->count > 0 ) {
-				struct _header_field_index *hfield;
-
-				hfield = edmail->header_fields_head;
-				while ( hfield != NULL && hfield->header != header_idx_new ) {
-					hfield = hfield->next;
-				}
-
-				i_assert( hfield != NULL );
-				header_idx_new->first = hfield;
+	if ( !edmail->headers_parsed && field_idx->appended ) {
+		edmail->appended_hdr_size.physical_size -= field->size;
+		edmail->appended_hdr_size.virtual_size -= field->virtual_size;
+		edmail->appended_hdr_size.lines -= field->lines;
 
-				hfield = edmail->header_fields_tail;
-				while ( hfield != NULL && hfield->header != header_idx_new ) {
-					hfield = hfield->prev;
-				}
+		edmail->appended_hdr_size.physical_size += field_new->size;
+		edmail->appended_hdr_size.virtual_size += field_new->virtual_size;
+		edmail->appended_hdr_size.lines += field_new->lines;
 
-				i_assert( hfield != NULL );
-				header_idx_new->last = hfield;
-			}
-		}
+		field_idx_new->appended = TRUE;
+		if ( edmail->header_fields_appended == field_idx )
+			edmail->header_fields_appended = field_idx_new;
 	}
 
-	_header_field_unref(field_idx->field);
-	i_free(field_idx);
+	/* Put the new field in place of the old one */
+	DLLIST2_INSERT_AFTER(&edmail->header_fields_head,
+		&edmail->header_fields_tail, field_idx, field_idx_new);
+	edit_mail_header_field_link(field_idx_new);
+
+	edit_mail_header_field_unlink(edmail, field_idx);
+	DLLIST2_REMOVE
+		(&edmail->header_fields_head, &edmail->header_fields_tail, field_idx);
 	return field_idx_new;
 }
 
 static inline char *_header_decode
-(const unsigned char *hdr_data, size_t hdr_data_len)
+(pool_t pool, const unsigned char *hdr_data, size_t hdr_data_len)
 {
 	string_t *str = t_str_new(512);
 
@@ -715,7 +692,7 @@ static inline char *_header_decode
 	/* Decode MIME encoded-words. */
 	message_header_decode_utf8
 		((const unsigned char *)hdr_data, hdr_data_len, str, NULL);
-	return i_strdup(str_c(str));
+	return p_strdup(pool, str_c(str));
 }
 
 static int edit_mail_headers_parse
@@ -727,7 +704,7 @@ static int edit_mail_headers_parse
 		MESSAGE_HEADER_PARSER_FLAG_CLEAN_ONELINE;
 	struct message_header_line *hdr;
 	struct _header_index *header_idx;
-	struct _header_field_index *head = NULL, *tail = NULL, *current;
+	struct _header_field_index *head = NULL, *tail = NULL;
 	string_t *hdr_data;
 	uoff_t offset = 0, body_offset = 0, vsize_diff = 0;
 	unsigned int lines = 0;
@@ -791,21 +768,23 @@ static int edit_mail_headers_parse
 
 			/* Create new header field index entry */
 
-			field_idx_new = i_new(struct _header_field_index, 1);
+			field_idx_new = p_new(edmail->mail.pool, struct _header_field_index, 1);
 
 			header_idx = edit_mail_header_create(edmail, hdr->name);
-			header_idx->count++;
 			field_idx_new->header = header_idx;
-			field_idx_new->field = field = _header_field_create(header_idx->header);
+			field_idx_new->field = field =
+				_header_field_create(edmail->header_pool, header_idx->header);
 
 			i_assert( body_offset > 0 );
 			field->body_offset = body_offset;
 
-			field->utf8_value = _header_decode(hdr->full_value, hdr->full_value_len);
+			field->utf8_value = _header_decode
+				(edmail->header_pool, hdr->full_value, hdr->full_value_len);
 
 			field->size = str_len(hdr_data);
 			field->virtual_size = field->size + vsize_diff;
-			field->data = i_strndup(str_data(hdr_data), field->size);
+			field->data = p_strndup(edmail->header_pool,
+				str_data(hdr_data), field->size);
 			field->offset = offset;
 			field->lines = lines;
 
@@ -827,16 +806,9 @@ static int edit_mail_headers_parse
 		i_error("read(%s) failed: %s",
 			i_stream_get_name(edmail->wrapped_stream),
 			i_stream_get_error(edmail->wrapped_stream));
-		current = head;
-		while ( current != NULL ) {
-			struct _header_field_index *next = current->next;
-
-			_header_field_unref(current->field);
-			i_free(current);
-
-			current = next;
-		}
 
+		/* Drop names that were only added for the discarded fields */
+		edit_mail_headers_index_rebuild(edmail);
 		return ret;
 	}
 
@@ -863,14 +835,7 @@ static int edit_mail_headers_parse
 	}
 
 	/* Rebuild header index */
-	current = edmail->header_fields_head;
-	while ( current != NULL ) {
-		if ( current->header->first == NULL )
-			current->header->first = current;
-		current->header->last = current;
-
-		current = current->next;
-	}
+	edit_mail_headers_index_rebuild(edmail);
 
 	/* Clear appended headers */
 	edmail->header_fields_appended = NULL;
@@ -884,6 +849,29 @@ static int edit_mail_headers_parse
 	return 1;
 }
 
+static int edit_mail_headers_prepare
+(struct edit_mail *edmail, const char *field_name)
+{
+	const char *value;
+	int ret;
+
+	if ( edmail->headers_parsed )
+		return 1;
+
+	/* As long as the original message has no header with this name, all
+	   fields that have it were added by us; these can be edited without
+	   parsing (and copying) the whole original header first. */
+	if ( field_name != NULL ) {
+		if ( (ret=edmail->wrapped->v.get_first_header
+			(&edmail->wrapped->mail, field_name, FALSE, &value)) < 0 )
+			return -1;
+		if ( ret == 0 )
+			return 1;
+	}
+
+	return edit_mail_headers_parse(edmail);
+}
+
 void edit_mail_header_add
 (struct edit_mail *edmail, const char *field_name, const char *value,
 	bool last)
@@ -902,16 +890,15 @@ void edit_mail_header_add
 	if ( last ) {
 		DLLIST2_APPEND
 			(&edmail->header_fields_head, &edmail->header_fields_tail, field_idx);
-
-		header_idx->last = field_idx;
-		if ( header_idx->first == NULL )
-			header_idx->first = field_idx;
+		DLLIST2_APPEND_FULL(&header_idx->first, &header_idx->last,
+			field_idx, hprev, hnext);
 
 		if ( !edmail->headers_parsed )  {
 			if ( edmail->header_fields_appended == NULL ) {
 				/* Record beginning of appended headers */
 				edmail->header_fields_appended = field_idx;
 			}
+			field_idx->appended = TRUE;
 
 			edmail->appended_hdr_size.physical_size += field->size;
 			edmail->appended_hdr_size.virtual_size += field->virtual_size;
@@ -920,10 +907,8 @@ void edit_mail_header_add
 	} else {
 		DLLIST2_PREPEND
 			(&edmail->header_fields_head, &edmail->header_fields_tail, field_idx);
-
-		header_idx->first = field_idx;
-		if ( header_idx->last == NULL )
-			header_idx->last = field_idx;
+		DLLIST2_PREPEND_FULL(&header_idx->first, &header_idx->last,
+			field_idx, hprev, hnext);
 	}
 
 	header_idx->count++;
@@ -941,8 +926,8 @@ int edit_mail_header_delete
 	int pos = 0;
 	int ret = 0;
 
-	/* Make sure headers are parsed */
-	if ( edit_mail_headers_parse(edmail) <= 0 )
+	/* Make sure headers are parsed if necessary */
+	if ( edit_mail_headers_prepare(edmail, field_name) <= 0 )
 		return -1;
 
 	/* Find the header entry */
@@ -954,54 +939,29 @@ int edit_mail_header_delete
 	/* Signal modification */
 	edit_mail_modify(edmail);
 
-	/* Iterate through all header fields and remove those that match */
+	/* Iterate through all fields with this name and remove those that match;
+	   the header index is dropped once the last one is removed */
 	field_idx = ( index >= 0 ? header_idx->first : header_idx->last );
 	while ( field_idx != NULL ) {
 		struct _header_field_index *next =
-			( index >= 0 ? field_idx->next : field_idx->prev );
-
-		if ( field_idx->field->header == header_idx->header ) {
-			bool final;
+			( index >= 0 ? field_idx->hnext : field_idx->hprev );
 
-			if ( index >= 0 ) {
-				pos++;
-				final = ( header_idx->last == field_idx );
-			} else {
-				pos--;
-				final = ( header_idx->first == field_idx );
-			}
+		if ( index >= 0 )
+			pos++;
+		else
+			pos--;
 
-			if ( index == 0 || index == pos ) {
-				if ( header_idx->first == field_idx ) header_idx->first = NULL;
-				if ( header_idx->last == field_idx ) header_idx->last = NULL;
-				edit_mail_header_field_delete(edmail, field_idx, FALSE);
-				ret++;
-			}
+		if ( index == 0 || index == pos ) {
+			edit_mail_header_field_delete(edmail, field_idx);
+			ret++;
 
-			if ( final || (index != 0 && index == pos) )
+			if ( index != 0 )
 				break;
 		}
 
 		field_idx = next;
 	}
 
-	if ( index == 0 || header_idx->count == 0 ) {
-		DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
-		_header_unref(header_idx->header);
-		i_free(header_idx);
-	} else if ( header_idx->first == NULL || header_idx->last == NULL ) {
-		struct _header_field_index *current = edmail->header_fields_head;
-
-		while ( current != NULL ) {
-			if ( current->header == header_idx ) {
-				if ( header_idx->first == NULL )
-					header_idx->first = current;
-				header_idx->last = current;
-			}
-			current = current->next;
-		}
-	}
-
 	return ret;
 }
 
@@ -1009,13 +969,13 @@ int edit_mail_header_replace
 (struct edit_mail *edmail, const char *field_name, int index,
 	const char *newname, const char *newvalue)
 {
-	struct _header_index *header_idx, *header_idx_new;
-	struct _header_field_index *field_idx, *field_idx_new;
+	struct _header_index *header_idx;
+	struct _header_field_index *field_idx;
 	int pos = 0;
 	int ret = 0;
 
-	/* Make sure headers are parsed */
-	if ( edit_mail_headers_parse(edmail) <= 0 )
+	/* Make sure headers are parsed if necessary */
+	if ( edit_mail_headers_prepare(edmail, field_name) <= 0 )
 		return -1;
 
 	/* Find the header entry */
@@ -1027,72 +987,30 @@ int edit_mail_header_replace
 	/* Signal modification */
 	edit_mail_modify(edmail);
 
-	/* Iterate through all header fields and replace those that match */
+	/* Iterate through all fields with this name and replace those that
+	   match */
 	field_idx = ( index >= 0 ? header_idx->first : header_idx->last );
-	field_idx_new = NULL;
 	while ( field_idx != NULL ) {
 		struct _header_field_index *next =
-			( index >= 0 ? field_idx->next : field_idx->prev );
-
-		if ( field_idx->field->header == header_idx->header ) {
-			bool final;
+			( index >= 0 ? field_idx->hnext : field_idx->hprev );
 
-			if ( index >= 0 ) {
-				pos++;
-				final = ( header_idx->last == field_idx );
-			} else {
-				pos--;
-				final = ( header_idx->first == field_idx );
-			}
+		if ( index >= 0 )
+			pos++;
+		else
+			pos--;
 
-			if ( index == 0 || index == pos ) {
-				if ( header_idx->first == field_idx ) header_idx->first = NULL;
-				if ( header_idx->last == field_idx ) header_idx->last = NULL;
-				field_idx_new = edit_mail_header_field_replace
-					(edmail, field_idx, newname, newvalue, FALSE);
-				ret++;
-			}
+		if ( index == 0 || index == pos ) {
+			(void)edit_mail_header_field_replace
+				(edmail, field_idx, newname, newvalue);
+			ret++;
 
-			if ( final || (index != 0 && index == pos) )
+			if ( index != 0 )
 				break;
 		}
 
 		field_idx = next;
 	}
 
-	/* Update old header index */
-	if ( header_idx->count == 0 ) {
-		DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
-		_header_unref(header_idx->header);
-		i_free(header_idx);
-	} else if ( header_idx->first == NULL || header_idx->last == NULL ) {
-		struct _header_field_index *current = edmail->header_fields_head;
-
-		while ( current != NULL ) {
-			if ( current->header == header_idx ) {
-				if ( header_idx->first == NULL )
-					header_idx->first = current;
-				header_idx->last = current;
-			}
-			current = current->next;
-		}
-	}
-
-	/* Update new header index */	
-	if ( field_idx_new != NULL ) {
-		struct _header_field_index *current = edmail->header_fields_head;
-	
-		header_idx_new = field_idx_new->header;	
-		while ( current != NULL ) {
-			if ( current->header == header_idx_new ) {
-				if ( header_idx_new->first == NULL )
-					header_idx_new->first = current;
-				header_idx_new->last = current;
-			}
-			current = current->next;
-		}
-	}
-
 	return ret;
 }
 
@@ -1113,8 +1031,8 @@ int edit_mail_headers_iterate_init
 	struct _header_index *header_idx = NULL;
 	struct _header_field_index *current = NULL;
 
-	/* Make sure headers are parsed */
-	if ( edit_mail_headers_parse(edmail) <= 0 ) {
+	/* Make sure headers are parsed if necessary */
+	if ( edit_mail_headers_prepare(edmail, field_name) <= 0 ) {
 		/* Failure */
 		return -1;
 	}
@@ -1175,11 +1093,13 @@ bool edit_mail_headers_iterate_next
 	if ( edhiter->current == NULL )
 		return FALSE;
 
-	do {
-		edhiter->current = 
-			( !edhiter->reverse ? edhiter->current->next : edhiter->current->prev );
-	} while ( edhiter->current != NULL && edhiter->current->header != NULL &&
-		edhiter->header != NULL && edhiter->current->header != edhiter->header );
+	if ( edhiter->header != NULL ) {
+		edhiter->current = ( !edhiter->reverse ?
+			edhiter->current->hnext : edhiter->current->hprev );
+	} else {
+		edhiter->current = ( !edhiter->reverse ?
+			edhiter->current->next : edhiter->current->prev );
+	}
 
 	return ( edhiter->current != NULL && edhiter->current->header != NULL);
 }
@@ -1196,7 +1116,7 @@ bool edit_mail_headers_iterate_remove
 
 	field_idx = edhiter->current;
 	next = edit_mail_headers_iterate_next(edhiter);
-	edit_mail_header_field_delete(edhiter->mail, field_idx, TRUE);
+	edit_mail_header_field_delete(edhiter->mail, field_idx);
 
 	return next;
 }
@@ -1214,8 +1134,8 @@ bool edit_mail_headers_iterate_replace
 
 	field_idx = edhiter->current;
 	next = edit_mail_headers_iterate_next(edhiter);
-	edit_mail_header_field_replace
-		(edhiter->mail, field_idx, newname, newvalue, TRUE);
+	(void)edit_mail_header_field_replace
+		(edhiter->mail, field_idx, newname, newvalue);
 
 	return next;
 }
@@ -1405,37 +1325,13 @@ static int edit_mail_get_first_header
 		return 0;
 	}
 
-	/* Get the first occurrence */
-	if ( edmail->header_fields_appended == NULL ) {
-		/* There are no appended headers, so first is found directly */
-		field = header_idx->first->field;
-	} else {
-		struct _header_field_index *field_idx;
-
-		/* Scan prepended headers */
-		field_idx = edmail->header_fields_head;
-		while ( field_idx != NULL ) {
-			if ( field_idx->header == header_idx )
-				break;
-
-			if ( field_idx == edmail->header_fields_appended ) {
-				field_idx = NULL;
-				break;
-			}
-			field_idx = field_idx->next;
-		}
-
-		if ( field_idx == NULL ) {
-			/* Check original message */
-			if ( (ret=edmail->wrapped->v.get_first_header
-				(&edmail->wrapped->mail, field_name, decode_to_utf8, value_r)) != 0 )
-				return ret;
-
-			/* Use first (apparently appended) header */
-			field = header_idx->first->field;
-		} else {
-			field = field_idx->field;
-		}
+	/* Get the first occurrence; if it was appended, the original message
+	   (which is not parsed yet) may have one in front of it */
+	field = header_idx->first->field;
+	if ( edmail->header_fields_appended != NULL && header_idx->first->appended ) {
+		if ( (ret=edmail->wrapped->v.get_first_header
+			(&edmail->wrapped->mail, field_name, decode_to_utf8, value_r)) != 0 )
+			return ret;
 	}
 
 	if ( decode_to_utf8 )
@@ -1488,11 +1384,13 @@ static int edit_mail_get_headers
 	p_array_init(&header_values, edmail->mail.pool, 32);
 	field_idx = header_idx->first;
 	while ( field_idx != NULL ) {
+		struct _header_field *field = field_idx->field;
+		const char *value;
 
 		/* If current field is the first appended one, we need to add original
 		 * headers first.
 		 */
-		if ( field_idx == edmail->header_fields_appended && headers != NULL ) {
+		if ( field_idx->appended && headers != NULL ) {
 			while ( *headers != NULL ) {
 				array_append(&header_values, headers, 1);
 
@@ -1501,22 +1399,14 @@ static int edit_mail_get_headers
 		}
 
 		/* Add modified header to the list */
-		if ( field_idx->field->header == header_idx->header ) {
-			struct _header_field *field = field_idx->field;
-
-			const char *value;
-			if ( decode_to_utf8 )
-				value = field->utf8_value;
-			else
-				value = (const char *)(field->data + field->body_offset);
-
-			array_append(&header_values, &value, 1);
+		if ( decode_to_utf8 )
+			value = field->utf8_value;
+		else
+			value = (const char *)(field->data + field->body_offset);
 
-			if ( field_idx == header_idx->last )
-				break;
-		}
+		array_append(&header_values, &value, 1);
 
-		field_idx = field_idx->next;
+		field_idx = field_idx->hnext;
 	}
 
 	/* Add original headers if necessary */
@@ -0,0 +1,149 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "buffer.h"
+#include "str.h"
+
+#include "str-slice.h"
+
+struct str_slice_buffer {
+	int refcount;
+	size_t size;
+
+	/* NUL-terminated data follows */
+};
+
+struct str_slice {
+	int refcount;
+
+	struct str_slice_buffer *buf;
+	size_t offset, size;
+
+	/* Read-only string referring to the shared data */
+	buffer_t view;
+	/* Private copy for slices that cannot refer to the shared data */
+	string_t *copy;
+
+	bool view_initialized:1;
+};
+
+static inline const unsigned char *
+str_slice_buffer_data(const struct str_slice_buffer *buf)
+{
+	return (const unsigned char *)(buf + 1);
+}
+
+static void str_slice_buffer_unref(struct str_slice_buffer **_buf)
+{
+	struct str_slice_buffer *buf = *_buf;
+
+	*_buf = NULL;
+
+	i_assert(buf->refcount > 0);
+	if (--buf->refcount > 0)
+		return;
+	i_free(buf);
+}
+
+static struct str_slice *
+str_slice_new(struct str_slice_buffer *buf, size_t offset, size_t size)
+{
+	struct str_slice *slice;
+
+	slice = i_new(struct str_slice, 1);
+	slice->refcount = 1;
+	slice->buf = buf;
+	slice->offset = offset;
+	slice->size = size;
+	return slice;
+}
+
+struct str_slice *str_slice_create(const void *data, size_t size)
+{
+	struct str_slice_buffer *buf;
+	unsigned char *bdata;
+
+	buf = i_malloc(MALLOC_ADD(sizeof(*buf), MALLOC_ADD(size, 1)));
+	buf->refcount = 1;
+	buf->size = size;
+
+	bdata = (unsigned char *)(buf + 1);
+	if (size > 0)
+		memcpy(bdata, data, size);
+	bdata[size] = '\0';
+
+	return str_slice_new(buf, 0, size);
+}
+
+struct str_slice *str_slice_create_str(const string_t *str)
+{
+	return str_slice_create(str_data(str), str_len(str));
+}
+
+struct str_slice *
+str_slice_sub(struct str_slice *slice, size_t offset, size_t size)
+{
+	i_assert(offset <= slice->size && size <= slice->size - offset);
+
+	slice->buf->refcount++;
+	return str_slice_new(slice->buf, slice->offset + offset, size);
+}
+
+void str_slice_ref(struct str_slice *slice)
+{
+	i_assert(slice->refcount > 0);
+	slice->refcount++;
+}
+
+void str_slice_unref(struct str_slice **_slice)
+{
+	struct str_slice *slice = *_slice;
+
+	if (slice == NULL)
+		return;
+	*_slice = NULL;
+
+	i_assert(slice->refcount > 0);
+	if (--slice->refcount > 0)
+		return;
+
+	if (slice->copy != NULL)
+		str_free(&slice->copy);
+	str_slice_buffer_unref(&slice->buf);
+	i_free(slice);
+}
+
+const unsigned char *str_slice_data(const struct str_slice *slice)
+{
+	return str_slice_buffer_data(slice->buf) + slice->offset;
+}
+
+size_t str_slice_len(const struct str_slice *slice)
+{
+	return slice->size;
+}
+
+string_t *str_slice_get_str(struct str_slice *slice)
+{
+	const unsigned char *data = str_slice_data(slice);
+
+	if (slice->view_initialized)
+		return &slice->view;
+	if (slice->copy != NULL)
+		return slice->copy;
+
+	if (slice->offset + slice->size == slice->buf->size) {
+		/* The slice ends at the NUL terminator of the shared data, so
+		   the string can refer to it directly */
+		buffer_create_from_const_data(&slice->view, data,
+					      slice->size + 1);
+		buffer_set_used_size(&slice->view, slice->size);
+		slice->view_initialized = TRUE;
+		return &slice->view;
+	}
+
+	slice->copy = str_new(default_pool, slice->size + 1);
+	str_append_data(slice->copy, data, slice->size);
+	return slice->copy;
+}
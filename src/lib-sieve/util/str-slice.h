@@ -0,0 +1,35 @@
+#ifndef STR_SLICE_H
+#define STR_SLICE_H
+
+#include "lib.h"
+
+/*
+ * String slice
+ *
+ *   An immutable, reference-counted string value. A slice refers to (part
+ *   of) a shared data buffer, so that substrings of a value can be held and
+ *   passed around without copying the data.
+ */
+
+struct str_slice;
+
+/* Create a new slice holding a copy of the data */
+struct str_slice *str_slice_create(const void *data, size_t size);
+struct str_slice *str_slice_create_str(const string_t *str);
+/* Create a slice that refers to part of an existing slice; nothing is
+   copied */
+struct str_slice *
+str_slice_sub(struct str_slice *slice, size_t offset, size_t size);
+
+void str_slice_ref(struct str_slice *slice);
+void str_slice_unref(struct str_slice **_slice);
+
+const unsigned char *str_slice_data(const struct str_slice *slice);
+size_t str_slice_len(const struct str_slice *slice);
+
+/* Returns the slice as a string, which must not be modified. The data is
+   only copied (once) when the slice does not extend to the end of the
+   shared buffer, since strings need to be NUL-terminated. */
+string_t *str_slice_get_str(struct str_slice *slice);
+
+#endif
@@ -744,11 +744,95 @@ static void test_edit_mail_big_header(void)
 	test_end();
 }
 
+static void test_edit_mail_unparsed(void)
+{
+	static const char *msg_header =
+		"From: <stephan@example.com>\r\n"
+		"To: <timo@example.org>\r\n"
+		"Subject: Spam tagging\r\n";
+	static const char *msg_body =
+		"\r\n"
+		"Frop!\r\n";
+	struct istream *input_msg, *input_mail;
+	buffer_t *buffer;
+	struct mail_raw *rawmail;
+	struct edit_mail *edmail;
+	struct mail *mail;
+	string_t *expected;
+	const char *msg, *value;
+
+	test_begin("edit-mail - added headers only");
+	test_init();
+
+	/* compose the message */
+
+	msg = t_strconcat(msg_header, msg_body, NULL);
+	input_msg = i_stream_create_from_data(msg, strlen(msg));
+
+	rawmail = mail_raw_open_stream(test_raw_mail_user, input_msg);
+
+	edmail = edit_mail_wrap(rawmail->mail);
+
+	/* add headers and delete one of those again; the original header
+	   has no fields with these names */
+
+	edit_mail_header_add(edmail, "X-Spam-Flag", "YES", FALSE);
+	edit_mail_header_add(edmail, "X-Spam-Tag", "one", TRUE);
+	edit_mail_header_add(edmail, "X-Spam-Tag", "two", TRUE);
+	test_assert(edit_mail_header_delete(edmail, "X-Spam-Tag", 1) == 1);
+	test_assert(edit_mail_header_delete(edmail, "X-Nonexistent", 0) == 0);
+
+	mail = edit_mail_get_mail(edmail);
+
+	/* evaluate modified header */
+
+	test_assert(mail_get_first_header_utf8(mail, "X-Spam-Flag",
+					  &value) > 0);
+	test_assert(strcmp(value, "YES") == 0);
+	test_assert(mail_get_first_header_utf8(mail, "X-Spam-Tag",
+					  &value) > 0);
+	test_assert(strcmp(value, "two") == 0);
+	test_assert(mail_get_first_header_utf8(mail, "Subject",
+					  &value) > 0);
+	test_assert(strcmp(value, "Spam tagging") == 0);
+
+	/* check the spliced message */
+
+	if (mail_get_stream(mail, NULL, NULL, &input_mail) < 0) {
+		i_fatal("Failed to open mail stream: %s",
+			mailbox_get_last_error(mail->box, NULL));
+	}
+
+	buffer = buffer_create_dynamic(default_pool, 1024);
+	expected = t_str_new(1024);
+
+	i_stream_seek(input_mail, 0);
+	test_stream_data(input_mail, buffer);
+
+	str_append(expected, "X-Spam-Flag: YES\r\n");
+	str_append(expected, msg_header);
+	str_append(expected, "X-Spam-Tag: two\r\n");
+	str_append(expected, msg_body);
+
+	test_out("added",
+		 strcmp(str_c(buffer), str_c(expected)) == 0);
+
+	/* clean up */
+
+	buffer_free(&buffer);
+	edit_mail_unwrap(&edmail);
+	mail_raw_close(&rawmail);
+	i_stream_unref(&input_msg);
+	test_deinit();
+	test_end();
+}
+
 int main(int argc, char *argv[])
 {
 	static void (*test_functions[])(void) = {
 		test_edit_mail_concatenated,
 		test_edit_mail_big_header,
+		test_edit_mail_unparsed,
 		NULL
 	};
 	const enum master_service_flags service_flags =
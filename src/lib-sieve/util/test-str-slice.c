@@ -0,0 +1,89 @@
+/* Copyright (c) 2018 Pigeonhole authors, see the included COPYING file */
+
+#include "lib.h"
+#include "test-common.h"
+#include "str.h"
+
+#include "str-slice.h"
+
+static void test_str_slice_create(void)
+{
+	struct str_slice *slice;
+	string_t *str;
+
+	test_begin("str slice - create");
+
+	str = t_str_new(64);
+	str_append(str, "frop");
+	slice = str_slice_create_str(str);
+	str_truncate(str, 0);
+	str_append(str, "friep");
+
+	test_assert(str_slice_len(slice) == 4);
+	test_assert(memcmp(str_slice_data(slice), "frop", 4) == 0);
+	test_assert(strcmp(str_c(str_slice_get_str(slice)), "frop") == 0);
+	/* Repeated requests yield the same string */
+	test_assert(str_slice_get_str(slice) == str_slice_get_str(slice));
+	str_slice_unref(&slice);
+	test_assert(slice == NULL);
+
+	slice = str_slice_create("", 0);
+	test_assert(str_len(str_slice_get_str(slice)) == 0);
+	test_assert(strcmp(str_c(str_slice_get_str(slice)), "") == 0);
+	str_slice_unref(&slice);
+
+	test_end();
+}
+
+static void test_str_slice_sub(void)
+{
+	static const char *data = "From: stephan@example.org";
+	struct str_slice *slice, *sub1, *sub2, *sub3;
+
+	test_begin("str slice - sub");
+
+	slice = str_slice_create(data, strlen(data));
+
+	/* Tail of the data */
+	sub1 = str_slice_sub(slice, 6, strlen(data) - 6);
+	test_assert(str_slice_data(sub1) == str_slice_data(slice) + 6);
+	test_assert(strcmp(str_c(str_slice_get_str(sub1)),
+			   "stephan@example.org") == 0);
+	test_assert(str_data(str_slice_get_str(sub1)) ==
+		    str_slice_data(sub1));
+
+	/* Middle of the data */
+	sub2 = str_slice_sub(slice, 6, 7);
+	test_assert(strcmp(str_c(str_slice_get_str(sub2)), "stephan") == 0);
+
+	/* Sub of sub */
+	sub3 = str_slice_sub(sub1, 8, 7);
+	test_assert(strcmp(str_c(str_slice_get_str(sub3)), "example") == 0);
+
+	/* The shared data outlives the original slice */
+	str_slice_unref(&slice);
+	str_slice_unref(&sub1);
+	test_assert(strcmp(str_c(str_slice_get_str(sub2)), "stephan") == 0);
+	test_assert(memcmp(str_slice_data(sub3), "example", 7) == 0);
+
+	/* References */
+	sub1 = sub2;
+	str_slice_ref(sub1);
+	str_slice_unref(&sub2);
+	test_assert(sub2 == NULL);
+	test_assert(strcmp(str_c(str_slice_get_str(sub1)), "stephan") == 0);
+	str_slice_unref(&sub1);
+	str_slice_unref(&sub3);
+
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_str_slice_create,
+		test_str_slice_sub,
+		NULL
+	};
+	return test_run(test_functions);
+}
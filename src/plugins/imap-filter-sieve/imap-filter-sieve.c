@@ -710,6 +710,9 @@ imap_sieve_filter_run_scripts(struct imap_filter_sieve_context *sctx,
 			ehandler = ifsuser->master_ehandler;
 		}
 
+		/* Prefetch the message fields used by the script */
+		sieve_prefetch_wanted_fields(sbin, msgdata->mail);
+
 		/* Execute */
 		if (debug) {
 			sieve_sys_debug(svinst,
@@ -635,6 +635,9 @@ static int imap_sieve_run_scripts
 			}
 		}
 
+		/* Prefetch the message fields used by the script */
+		sieve_prefetch_wanted_fields(sbin, msgdata->mail);
+
 		/* Execute */
 		if ( debug ) {
 			sieve_sys_debug(svinst,
@@ -467,6 +467,9 @@ lda_sieve_execute_script(struct lda_sieve_run_context *srctx,
 	if ( sbin == NULL )
 		return FALSE;
 
+	/* Prefetch the message fields used by the script */
+	sieve_prefetch_wanted_fields(sbin, srctx->msgdata->mail);
+
 	/* Execute */
 
 	if ( debug ) {
@@ -803,6 +806,7 @@ static int lda_sieve_execute
 	struct sieve_exec_status estatus;
 	struct sieve_trace_config trace_config;
 	struct sieve_trace_log *trace_log;
+	struct sieve_profile *profile;
 	bool debug = mdctx->rcpt_user->mail_debug;
 	const char *error;
 	int ret;
@@ -868,6 +872,9 @@ static int lda_sieve_execute
 		return -1;
 	}
 
+	/* Profile execution when sieve_profile_report is configured */
+	profile = sieve_profile_open(svinst);
+
 	scriptenv.default_mailbox = mdctx->rcpt_default_mailbox;
 	scriptenv.mailbox_autocreate = mdctx->set->lda_mailbox_autocreate;
 	scriptenv.mailbox_autosubscribe = mdctx->set->lda_mailbox_autosubscribe;
@@ -883,6 +890,10 @@ static int lda_sieve_execute
 	scriptenv.script_context = (void *) mdctx;
 	scriptenv.trace_log = trace_log;
 	scriptenv.trace_config = trace_config;
+	scriptenv.profile = profile;
+
+	/* Scripts that store into the same mailbox share one open mailbox */
+	sieve_script_env_enable_mailbox_cache(&scriptenv);
 
 	i_zero(&estatus);
 	scriptenv.exec_status = &estatus;
@@ -898,6 +909,9 @@ static int lda_sieve_execute
 	mdctx->tried_default_save = estatus.tried_default_save;
 	*storage_r = estatus.last_storage;
 
+	sieve_script_env_deinit(&scriptenv);
+
+	sieve_profile_close(&profile);
 	if ( trace_log != NULL )
 		sieve_trace_log_free(&trace_log);
 
@@ -0,0 +1,446 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "strnum.h"
+#include "json-parser.h"
+#include "time-util.h"
+#include "istream.h"
+#include "ostream.h"
+#include "mail-storage.h"
+#include "master-service.h"
+
+#include "sieve.h"
+#include "sieve-binary.h"
+
+#include "sieve-tool.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sysexits.h>
+
+/*
+ * Print help
+ */
+
+static void print_help(void)
+{
+	printf(
+"Usage: sieve-bench [-c <config-file>] [-D] [-n <iterations>] [-O]\n"
+"                   [-P <plugin>] [-s <script-file>] [-x <extensions>]\n"
+"                   <script-file> <corpus> [<corpus> ...]\n"
+	);
+}
+
+/*
+ * Corpus
+ *
+ *   All messages are read into memory before the benchmark starts, so that
+ *   the measurements do not include reading them from disk. A corpus is
+ *   either a Maildir (or any directory of message files), an mbox file or a
+ *   single message file.
+ */
+
+struct bench_corpus {
+	pool_t pool;
+	ARRAY(string_t *) messages;
+};
+
+static string_t *bench_read_file(pool_t pool, const char *path)
+{
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+	string_t *str;
+
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	str = str_new(pool, 8192);
+	while ( i_stream_read_more(input, &data, &size) > 0 ) {
+		str_append_data(str, data, size);
+		i_stream_skip(input, size);
+	}
+	if ( input->stream_errno != 0 ) {
+		i_fatal("read(%s) failed: %s",
+			path, i_stream_get_error(input));
+	}
+	i_stream_destroy(&input);
+	return str;
+}
+
+static void bench_corpus_add_mbox
+(struct bench_corpus *corpus, const string_t *mbox)
+{
+	const char *data = str_c(mbox), *end = data + str_len(mbox);
+	const char *line, *line_end;
+	string_t *msg = NULL;
+	bool blank = TRUE;
+
+	for ( line = data; line < end; line = line_end ) {
+		line_end = memchr(line, '\n', end - line);
+		line_end = ( line_end == NULL ? end : line_end + 1 );
+
+		/* A "From " line after an empty line starts a new message */
+		if ( blank && (size_t)(line_end - line) >= 5 &&
+			memcmp(line, "From ", 5) == 0 ) {
+			msg = str_new(corpus->pool, 8192);
+			array_append(&corpus->messages, &msg, 1);
+			blank = FALSE;
+			continue;
+		}
+
+		blank = ( line_end - line == 1 ||
+			(line_end - line == 2 && line[0] == '\r') );
+		if ( msg != NULL )
+			str_append_data(msg, line, line_end - line);
+	}
+}
+
+static void bench_corpus_add_path
+(struct bench_corpus *corpus, const char *path, bool toplevel)
+{
+	struct stat st;
+
+	if ( stat(path, &st) < 0 )
+		i_fatal("stat(%s) failed: %m", path);
+
+	if ( S_ISDIR(st.st_mode) ) {
+		struct dirent *dp;
+		DIR *dirp;
+
+		if ( toplevel ) {
+			const char *cur = t_strconcat(path, "/cur", NULL);
+			const char *new = t_strconcat(path, "/new", NULL);
+
+			/* Maildir */
+			if ( stat(cur, &st) == 0 && S_ISDIR(st.st_mode) ) {
+				bench_corpus_add_path(corpus, cur, FALSE);
+				if ( stat(new, &st) == 0 && S_ISDIR(st.st_mode) )
+					bench_corpus_add_path(corpus, new, FALSE);
+				return;
+			}
+		}
+
+		if ( (dirp = opendir(path)) == NULL )
+			i_fatal("opendir(%s) failed: %m", path);
+		errno = 0;
+		while ( (dp = readdir(dirp)) != NULL ) {
+			const char *file;
+
+			if ( dp->d_name[0] == '.' )
+				continue;
+
+			file = t_strconcat(path, "/", dp->d_name, NULL);
+			if ( stat(file, &st) == 0 && S_ISREG(st.st_mode) )
+				bench_corpus_add_path(corpus, file, FALSE);
+			errno = 0;
+		}
+		if ( errno != 0 )
+			i_fatal("readdir(%s) failed: %m", path);
+		if ( closedir(dirp) < 0 )
+			i_fatal("closedir(%s) failed: %m", path);
+
+	} else {
+		string_t *msg = bench_read_file(corpus->pool, path);
+
+		if ( toplevel && str_len(msg) >= 5 &&
+			memcmp(str_data(msg), "From ", 5) == 0 )
+			bench_corpus_add_mbox(corpus, msg);
+		else
+			array_append(&corpus->messages, &msg, 1);
+	}
+}
+
+/*
+ * Dummy duplicate check implementation
+ */
+
+static bool duplicate_check
+(const struct sieve_script_env *senv ATTR_UNUSED,
+	const void *id ATTR_UNUSED, size_t id_size ATTR_UNUSED)
+{
+	return FALSE;
+}
+
+static void duplicate_mark
+(const struct sieve_script_env *senv ATTR_UNUSED,
+	const void *id ATTR_UNUSED, size_t id_size ATTR_UNUSED,
+	time_t time ATTR_UNUSED)
+{
+}
+
+/*
+ * Benchmark
+ */
+
+struct bench_stats {
+	ARRAY(uint64_t) latencies;
+	unsigned int failures;
+	uint64_t total_usecs;
+	uint64_t pool_used, pool_alloc;
+};
+
+static int bench_latency_cmp(const uint64_t *l1, const uint64_t *l2)
+{
+	return ( *l1 < *l2 ? -1 : ( *l1 > *l2 ? 1 : 0 ) );
+}
+
+static int bench_message
+(struct sieve_instance *svinst, string_t *message,
+	struct sieve_binary *const *sbins, unsigned int sbin_count,
+	struct sieve_script_env *scriptenv, struct sieve_error_handler *ehandler,
+	struct ostream *output, struct bench_stats *stats)
+{
+	struct sieve_message_data msgdata;
+	struct sieve_multiscript *mscript;
+	struct timeval start, end;
+	struct mail *mail;
+	size_t used, alloc;
+	uint64_t usecs;
+	unsigned int i;
+	int ret;
+
+	mail = sieve_tool_open_data_as_mail(sieve_tool, message);
+
+	i_zero(&msgdata);
+	msgdata.mail = mail;
+	msgdata.auth_user = sieve_tool_get_username(sieve_tool);
+	(void)mail_get_first_header(mail, "Message-ID", &msgdata.id);
+	sieve_tool_get_envelope_data(&msgdata, mail, NULL, NULL, NULL);
+
+	if ( gettimeofday(&start, NULL) < 0 )
+		i_fatal("gettimeofday() failed: %m");
+
+	mscript = sieve_multiscript_start_test
+		(svinst, &msgdata, scriptenv, output);
+	for ( i = 0; i < sbin_count; i++ ) {
+		if ( !sieve_multiscript_run(mscript, sbins[i],
+			ehandler, ehandler, 0) )
+			break;
+	}
+	sieve_multiscript_get_pool_usage(mscript, &used, &alloc);
+	ret = sieve_multiscript_finish(&mscript, ehandler, 0, NULL);
+
+	if ( gettimeofday(&end, NULL) < 0 )
+		i_fatal("gettimeofday() failed: %m");
+
+	usecs = timeval_diff_usecs(&end, &start);
+	array_append(&stats->latencies, &usecs, 1);
+	stats->total_usecs += usecs;
+	stats->pool_used += used;
+	stats->pool_alloc += alloc;
+	if ( ret != SIEVE_EXEC_OK )
+		stats->failures++;
+	return ret;
+}
+
+static uint64_t bench_percentile
+(const uint64_t *latencies, unsigned int count, unsigned int pct)
+{
+	unsigned int idx;
+
+	if ( count == 0 )
+		return 0;
+	idx = (count * pct + 99) / 100;
+	return latencies[( idx == 0 ? 0 : idx - 1 )];
+}
+
+static void bench_report
+(const ARRAY_TYPE(const_string) *scriptfiles, unsigned int messages,
+	unsigned int iterations, uint64_t compile_usecs,
+	struct bench_stats *stats)
+{
+	const char *const *files;
+	const uint64_t *latencies;
+	unsigned int count, i;
+	string_t *str = t_str_new(512);
+
+	array_sort(&stats->latencies, bench_latency_cmp);
+	latencies = array_get(&stats->latencies, &count);
+
+	str_append(str, "{\"scripts\":[");
+	files = array_get(scriptfiles, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( i > 0 )
+			str_append_c(str, ',');
+		str_append_c(str, '"');
+		json_append_escaped(str, files[i]);
+		str_append_c(str, '"');
+	}
+	count = array_count(&stats->latencies);
+
+	str_printfa(str, "],\"messages\":%u,\"iterations\":%u,"
+		"\"executions\":%u,\"failures\":%u,", messages, iterations,
+		count, stats->failures);
+	str_printfa(str, "\"compile_usecs\":%llu,\"total_usecs\":%llu,",
+		(unsigned long long)compile_usecs,
+		(unsigned long long)stats->total_usecs);
+	str_printfa(str, "\"messages_per_sec\":%.1f,",
+		( stats->total_usecs == 0 ? 0.0 :
+			(double)count * 1000000 / stats->total_usecs ));
+	str_printfa(str, "\"latency_usecs\":"
+		"{\"p50\":%llu,\"p99\":%llu,\"max\":%llu},",
+		(unsigned long long)bench_percentile(latencies, count, 50),
+		(unsigned long long)bench_percentile(latencies, count, 99),
+		(unsigned long long)( count == 0 ? 0 : latencies[count-1] ));
+	str_printfa(str, "\"pool_used_bytes_per_message\":%llu,"
+		"\"pool_alloc_bytes_per_message\":%llu}\n",
+		(unsigned long long)( count == 0 ? 0 : stats->pool_used / count ),
+		(unsigned long long)( count == 0 ? 0 : stats->pool_alloc / count ));
+
+	printf("%s", str_c(str));
+}
+
+/*
+ * Tool implementation
+ */
+
+int main(int argc, char **argv)
+{
+	struct sieve_instance *svinst;
+	ARRAY_TYPE(const_string) scriptfiles;
+	ARRAY(struct sieve_binary *) sbins;
+	struct sieve_binary **sbinp;
+	struct bench_corpus corpus;
+	struct bench_stats stats;
+	struct sieve_script_env scriptenv;
+	struct sieve_exec_status estatus;
+	struct sieve_error_handler *ehandler;
+	struct ostream *output;
+	enum sieve_compile_flags cpflags = 0;
+	const char *scriptfile, *const *files, *errstr;
+	string_t *const *messages;
+	struct timeval start, end;
+	unsigned int iterations = 1, msg_count, count, i, j;
+	uint64_t compile_usecs;
+	int fd, c;
+
+	sieve_tool = sieve_tool_init
+		("sieve-bench", &argc, &argv, "n:Os:DP:x:u:", FALSE);
+
+	t_array_init(&scriptfiles, 16);
+
+	/* Parse arguments */
+	while ((c = sieve_tool_getopt(sieve_tool)) > 0) {
+		switch (c) {
+		case 'n':
+			/* number of passes over the corpus */
+			if ( str_to_uint(optarg, &iterations) < 0 ||
+				iterations == 0 ) {
+				i_fatal_status(EX_USAGE,
+					"Invalid -n parameter: %s", optarg);
+			}
+			break;
+		case 'O':
+			/* optimize */
+			cpflags |= SIEVE_COMPILE_FLAG_OPTIMIZE;
+			break;
+		case 's':
+			/* scriptfile executed before main script */
+			{
+				const char *file;
+
+				file = t_strdup(optarg);
+				array_append(&scriptfiles, &file, 1);
+			}
+			break;
+		default:
+			print_help();
+			i_fatal_status(EX_USAGE, "Unknown argument: %c", c);
+			break;
+		}
+	}
+
+	if ( optind < argc ) {
+		scriptfile = t_strdup(argv[optind++]);
+		array_append(&scriptfiles, &scriptfile, 1);
+	} else {
+		print_help();
+		i_fatal_status(EX_USAGE, "Missing <script-file> argument");
+	}
+
+	if ( optind >= argc ) {
+		print_help();
+		i_fatal_status(EX_USAGE, "Missing <corpus> argument");
+	}
+
+	/* Finish tool initialization */
+	svinst = sieve_tool_init_finish(sieve_tool, TRUE, FALSE);
+
+	/* Read corpus */
+	i_zero(&corpus);
+	corpus.pool = pool_alloconly_create("sieve-bench corpus", 1024*1024);
+	i_array_init(&corpus.messages, 1024);
+	for ( ; optind < argc; optind++ )
+		bench_corpus_add_path(&corpus, argv[optind], TRUE);
+	messages = array_get(&corpus.messages, &msg_count);
+	if ( msg_count == 0 )
+		i_fatal("No messages found in corpus");
+
+	/* Create error handler */
+	ehandler = sieve_stderr_ehandler_create(svinst, 0);
+	sieve_system_ehandler_set(ehandler);
+	sieve_error_handler_accept_infolog(ehandler, FALSE);
+
+	/* Compile all scripts once */
+	if ( gettimeofday(&start, NULL) < 0 )
+		i_fatal("gettimeofday() failed: %m");
+	t_array_init(&sbins, 16);
+	files = array_get(&scriptfiles, &count);
+	for ( i = 0; i < count; i++ ) {
+		struct sieve_binary *sbin =
+			sieve_tool_script_compile(svinst, files[i], NULL, cpflags);
+
+		array_append(&sbins, &sbin, 1);
+	}
+	if ( gettimeofday(&end, NULL) < 0 )
+		i_fatal("gettimeofday() failed: %m");
+	compile_usecs = timeval_diff_usecs(&end, &start);
+
+	/* Compose script environment */
+	if (sieve_script_env_init(&scriptenv,
+		sieve_tool_get_mail_user(sieve_tool), &errstr) < 0)
+		i_fatal("Failed to initialize script execution: %s", errstr);
+	scriptenv.default_mailbox = "INBOX";
+	scriptenv.duplicate_mark = duplicate_mark;
+	scriptenv.duplicate_check = duplicate_check;
+	i_zero(&estatus);
+	scriptenv.exec_status = &estatus;
+
+	/* Test results are not of interest */
+	if ( (fd = open("/dev/null", O_WRONLY)) < 0 )
+		i_fatal("open(/dev/null) failed: %m");
+	output = o_stream_create_fd_autoclose(&fd, 0);
+	o_stream_set_no_error_handling(output, TRUE);
+
+	/* Run */
+	i_zero(&stats);
+	i_array_init(&stats.latencies, msg_count * iterations);
+	for ( j = 0; j < iterations; j++ ) {
+		for ( i = 0; i < msg_count; i++ ) {
+			(void)bench_message(svinst, messages[i],
+				array_idx(&sbins, 0), array_count(&sbins),
+				&scriptenv, ehandler, output, &stats);
+		}
+	}
+
+	bench_report(&scriptfiles, msg_count, iterations, compile_usecs, &stats);
+
+	/* Cleanup */
+	o_stream_destroy(&output);
+	array_foreach_modifiable(&sbins, sbinp)
+		sieve_close(sbinp);
+	array_free(&stats.latencies);
+	array_free(&corpus.messages);
+	pool_unref(&corpus.pool);
+	sieve_error_handler_unref(&ehandler);
+
+	sieve_tool_deinit(&sieve_tool);
+
+	return ( stats.failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS );
+}
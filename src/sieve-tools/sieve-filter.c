@@ -7,8 +7,14 @@
 #include "env-util.h"
 #include "str.h"
 #include "str-sanitize.h"
+#include "strnum.h"
+#include "write-full.h"
+#include "istream.h"
 #include "ostream.h"
 #include "array.h"
+#include "seq-range-array.h"
+#include "imap-util.h"
+#include "imap-seqset.h"
 #include "mail-namespace.h"
 #include "mail-storage.h"
 #include "mail-search-build.h"
@@ -23,6 +29,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pwd.h>
+#include <poll.h>
+#include <sys/wait.h>
 #include <sysexits.h>
 
 /*
@@ -32,9 +40,10 @@
 static void print_help(void)
 {
 	printf(
-"Usage: sieve-filter [-c <config-file>] [-C] [-D] [-e] [-m <default-mailbox>]\n"
-"                    [-P <plugin>] [-q <output-mailbox>] [-Q <mail-command>]\n"
-"                    [-s <script-file>] [-u <user>] [-v] [-W] [-x <extensions>]\n"
+"Usage: sieve-filter [-c <config-file>] [-C] [-D] [-e] [-j <workers>]\n"
+"                    [-m <default-mailbox>] [-P <plugin>] [-q <output-mailbox>]\n"
+"                    [-Q <mail-command>] [-r <checkpoint-file>] [-s <script-file>]\n"
+"                    [-u <user>] [-v] [-W] [-x <extensions>]\n"
 "                    <script-file> <source-mailbox> [<discard-action>]\n"
 	);
 }
@@ -46,14 +55,47 @@ enum sieve_filter_discard_action {
 	SIEVE_FILTER_DACT_EXPUNGE      /* Expunge discarded messages */
 };
 
+/* What needs to happen with the message in the source folder */
+enum sieve_filter_action {
+	SIEVE_FILTER_ACT_NONE = 0,     /* Leave message in source folder */
+	SIEVE_FILTER_ACT_EXPUNGE,      /* Expunge message */
+	SIEVE_FILTER_ACT_DELETE,       /* Flag message as \DELETED */
+	SIEVE_FILTER_ACT_MOVE          /* Move message to move mailbox */
+};
+
+/* Number of messages handled in one source mailbox transaction; the
+   checkpoint file is updated after each of these is committed */
+#define SIEVE_FILTER_BATCH_SIZE 1000
+
+struct sieve_filter_worker {
+	pid_t pid;
+	int fd_uids;               /* Parent -> worker: UIDs to filter */
+	int fd_results;            /* Worker -> parent: filter results */
+	struct istream *results;
+};
+
+struct sieve_filter_result {
+	uint32_t uid;
+	enum sieve_filter_action action;
+};
+ARRAY_DEFINE_TYPE(sieve_filter_result, struct sieve_filter_result);
+
 struct sieve_filter_data {
 	enum sieve_filter_discard_action discard_action;
+	const char *move_mailbox_name;
 	struct mailbox *move_mailbox;
 
 	struct sieve_script_env *senv;
 	struct sieve_binary *main_sbin;
 	struct sieve_error_handler *ehandler;
 
+	const char *checkpoint_path;
+
+	/* Parallel mode */
+	struct sieve_filter_worker *workers;
+	unsigned int worker_count;
+	int worker_fd_uids, worker_fd_results; /* In worker process */
+
 	bool execute:1;
 	bool source_write:1;
 	bool default_move:1;
@@ -65,10 +107,20 @@ struct sieve_filter_context {
 	struct mailbox_transaction_context *move_trans;
 
 	struct ostream *teststream;
+
+	/* Worker: results are reported to the parent process instead of
+	   being applied to the source mailbox */
+	struct ostream *results;
+
+	/* UIDs for which the results are committed */
+	ARRAY_TYPE(seq_range) done_uids;
+	uint32_t uid_validity;
+	unsigned int total, processed;
 };
 
 static int filter_message
-(struct sieve_filter_context *sfctx, struct mail *mail)
+(struct sieve_filter_context *sfctx, struct mail *mail,
+	enum sieve_filter_action *action_r)
 {
 	struct sieve_error_handler *ehandler = sfctx->data->ehandler;
 	struct sieve_script_env *senv = sfctx->data->senv;
@@ -81,6 +133,8 @@ static int filter_message
 	uoff_t size = 0;
 	int ret;
 
+	*action_r = SIEVE_FILTER_ACT_NONE;
+
 	/* Initialize execution status */
 	i_zero(&estatus);
 	senv->exec_status = &estatus;
@@ -128,6 +182,9 @@ static int filter_message
 		sieve_error_handler_unref(&action_ehandler);
 
 	} else {
+		/* Keep the output for each message together when several
+		   workers write to the same stream */
+		o_stream_cork(sfctx->teststream);
 		o_stream_nsend_str(sfctx->teststream,
 			t_strdup_printf(">> Filtering message:\n\n"
 				"  ID:      %s\n"
@@ -138,11 +195,11 @@ static int filter_message
 
 		ret = sieve_test
 			(sbin, &msgdata, senv, ehandler, sfctx->teststream, 0, NULL);
+		o_stream_uncork(sfctx->teststream);
 	}
 
 	/* Handle message in source folder */
 	if ( ret > 0 ) {
-		struct mailbox *move_box = sfctx->data->move_mailbox;
 		enum sieve_filter_discard_action discard_action =
 			sfctx->data->discard_action;
 
@@ -158,7 +215,7 @@ static int filter_message
 				"message expunged from source mailbox upon successful move");
 
 			if ( execute )
-				mail_expunge(mail);
+				*action_r = SIEVE_FILTER_ACT_EXPUNGE;
 
 		} else {
 
@@ -171,41 +228,22 @@ static int filter_message
 			case SIEVE_FILTER_DACT_MOVE:
 				sieve_info(ehandler, NULL,
 					"message in source mailbox moved to mailbox '%s'",
-					mailbox_get_name(move_box));
-
-				if ( execute && move_box != NULL ) {
-					struct mailbox_transaction_context *t = sfctx->move_trans;
-					struct mail_save_context *save_ctx;
-
-					save_ctx = mailbox_save_alloc(t);
-
-					if ( mailbox_copy(&save_ctx, mail) < 0 ) {
-						enum mail_error error;
-						const char *errstr;
-
-						errstr = mail_storage_get_last_error
-							(mailbox_get_storage(move_box), &error);
-
-						sieve_error(ehandler, NULL,
-							"failed to move message to mailbox %s: %s",
-							mailbox_get_name(move_box), errstr);
-						return -1;
-				    }
+					sfctx->data->move_mailbox_name);
 
-					mail_expunge(mail);
-				}
+				if ( execute )
+					*action_r = SIEVE_FILTER_ACT_MOVE;
 				break;
 			/* Flag message as \DELETED */
 			case SIEVE_FILTER_DACT_DELETE:
 				sieve_info(ehandler, NULL, "message flagged as deleted in source mailbox");
 				if ( execute )
-					mail_update_flags(mail, MODIFY_ADD, MAIL_DELETED);
+					*action_r = SIEVE_FILTER_ACT_DELETE;
 				break;
 			/* Expunge the message immediately */
 			case SIEVE_FILTER_DACT_EXPUNGE:
 				sieve_info(ehandler, NULL, "message expunged from source mailbox");
 				if ( execute )
-					mail_expunge(mail);
+					*action_r = SIEVE_FILTER_ACT_EXPUNGE;
 				break;
 			/* Unknown */
 			default:
@@ -230,7 +268,7 @@ static int filter_message
 			sieve_error(ehandler, NULL,
 				"sieve script execution failed for this message; "
 				"message moved to default mailbox");
-			mail_expunge(mail);
+			*action_r = SIEVE_FILTER_ACT_EXPUNGE;
 			return 0;
 		}
 		/* Fall through */
@@ -244,6 +282,51 @@ static int filter_message
 	return 1;
 }
 
+static int filter_message_apply
+(struct sieve_filter_context *sfctx, struct mail *mail,
+	enum sieve_filter_action action)
+{
+	struct sieve_error_handler *ehandler = sfctx->data->ehandler;
+	struct mailbox *move_box = sfctx->data->move_mailbox;
+
+	switch ( action ) {
+	case SIEVE_FILTER_ACT_NONE:
+		break;
+	case SIEVE_FILTER_ACT_EXPUNGE:
+		mail_expunge(mail);
+		break;
+	case SIEVE_FILTER_ACT_DELETE:
+		mail_update_flags(mail, MODIFY_ADD, MAIL_DELETED);
+		break;
+	case SIEVE_FILTER_ACT_MOVE:
+		if ( move_box != NULL ) {
+			struct mailbox_transaction_context *t = sfctx->move_trans;
+			struct mail_save_context *save_ctx;
+
+			save_ctx = mailbox_save_alloc(t);
+
+			if ( mailbox_copy(&save_ctx, mail) < 0 ) {
+				enum mail_error error;
+				const char *errstr;
+
+				errstr = mail_storage_get_last_error
+					(mailbox_get_storage(move_box), &error);
+
+				sieve_error(ehandler, NULL,
+					"failed to move message to mailbox %s: %s",
+					mailbox_get_name(move_box), errstr);
+				return -1;
+			}
+
+			mail_expunge(mail);
+		}
+		break;
+	default:
+		i_unreached();
+	}
+	return 0;
+}
+
 /* FIXME: introduce this into Dovecot */
 static void mail_search_build_add_flags
 (struct mail_search_args *args, enum mail_flags flags, bool not)
@@ -259,59 +342,237 @@ static void mail_search_build_add_flags
 	args->args = arg;
 }
 
-static int filter_mailbox
-(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
+static struct mail_search_args *
+filter_search_args(const ARRAY_TYPE(seq_range) *uids)
 {
-	struct sieve_filter_context sfctx;
-	struct mailbox *move_box = sfdata->move_mailbox;
-	struct sieve_error_handler *ehandler = sfdata->ehandler;
 	struct mail_search_args *search_args;
-	struct mailbox_transaction_context *t;
-	struct mail_search_context *search_ctx;
-	struct mail *mail;
-	int ret = 1;
+	struct mail_search_arg *arg;
 
-	/* Sync source mailbox */
+	/* Search non-deleted messages in the source folder */
 
-	if ( mailbox_sync(src_box, MAILBOX_SYNC_FLAG_FULL_READ) < 0 ) {
-		sieve_error(ehandler, NULL, "failed to sync source mailbox");
+	search_args = mail_search_build_init();
+	mail_search_build_add_flags(search_args, MAIL_DELETED, TRUE);
+
+	if ( uids != NULL ) {
+		arg = mail_search_build_add(search_args, SEARCH_UIDSET);
+		p_array_init(&arg->value.seqset, search_args->pool,
+			array_count(uids));
+		array_append_array(&arg->value.seqset, uids);
+	}
+	return search_args;
+}
+
+/*
+ * Checkpoint
+ *
+ *   Records the UIDs of the messages for which the results are committed to
+ *   the source mailbox, so that an interrupted run can be resumed without
+ *   filtering these messages again.
+ */
+
+static int filter_checkpoint_read
+(struct sieve_filter_context *sfctx, ARRAY_TYPE(seq_range) *uids)
+{
+	struct sieve_error_handler *ehandler = sfctx->data->ehandler;
+	const char *path = sfctx->data->checkpoint_path;
+	struct istream *input;
+	const char *line, *const *args;
+	uint32_t uid_validity;
+	int ret = 0;
+
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	line = i_stream_read_next_line(input);
+	if ( line == NULL ) {
+		if ( input->stream_errno != 0 && input->stream_errno != ENOENT ) {
+			sieve_error(ehandler, NULL, "read(%s) failed: %s",
+				path, i_stream_get_error(input));
+			ret = -1;
+		}
+		i_stream_destroy(&input);
+		return ret;
+	}
+
+	args = t_strsplit(line, "\t");
+	if ( str_array_length(args) != 2 ||
+		str_to_uint32(args[0], &uid_validity) < 0 ||
+		(*args[1] != '\0' &&
+			imap_seq_set_nostar_parse(args[1], &sfctx->done_uids) < 0) ) {
+		sieve_error(ehandler, NULL,
+			"checkpoint file %s is corrupt", path);
+		ret = -1;
+	} else if ( uid_validity != sfctx->uid_validity ) {
+		sieve_warning(ehandler, NULL,
+			"checkpoint file %s is for another mailbox (uidvalidity changed); "
+			"ignoring it", path);
+		array_clear(&sfctx->done_uids);
+	} else {
+		seq_range_array_remove_seq_range(uids, &sfctx->done_uids);
+	}
+	i_stream_destroy(&input);
+	return ret;
+}
+
+static int filter_checkpoint_write(struct sieve_filter_context *sfctx)
+{
+	struct sieve_error_handler *ehandler = sfctx->data->ehandler;
+	const char *path = sfctx->data->checkpoint_path;
+	const char *temp_path;
+	string_t *str;
+	int fd, ret = 0;
+
+	if ( path == NULL )
+		return 0;
+
+	str = t_str_new(256);
+	str_printfa(str, "%u\t", sfctx->uid_validity);
+	imap_write_seq_range(str, &sfctx->done_uids);
+	str_append_c(str, '\n');
+
+	/* Replace the checkpoint file atomically */
+	temp_path = t_strconcat(path, ".tmp", NULL);
+	fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if ( fd < 0 ) {
+		sieve_error(ehandler, NULL, "open(%s) failed: %m", temp_path);
 		return -1;
 	}
+	if ( write_full(fd, str_data(str), str_len(str)) < 0 ) {
+		sieve_error(ehandler, NULL, "write(%s) failed: %m", temp_path);
+		ret = -1;
+	}
+	if ( close(fd) < 0 ) {
+		sieve_error(ehandler, NULL, "close(%s) failed: %m", temp_path);
+		ret = -1;
+	}
+	if ( ret == 0 && rename(temp_path, path) < 0 ) {
+		sieve_error(ehandler, NULL,
+			"rename(%s, %s) failed: %m", temp_path, path);
+		ret = -1;
+	}
+	if ( ret < 0 )
+		i_unlink_if_exists(temp_path);
+	return ret;
+}
 
-	/* Initialize */
+/*
+ * Filtering
+ */
 
-	i_zero(&sfctx);
-	sfctx.data = sfdata;
+static void filter_progress
+(struct sieve_filter_context *sfctx, unsigned int count)
+{
+	sfctx->processed += count;
+	sieve_info(sfctx->data->ehandler, NULL,
+		"progress: %u/%u messages filtered",
+		sfctx->processed, sfctx->total);
+}
 
-	/* Create test stream */
-	if ( !sfdata->execute ) {
-		sfctx.teststream = o_stream_create_fd(1, 0);
-		o_stream_set_no_error_handling(sfctx.teststream, TRUE);
+static int filter_commit
+(struct sieve_filter_context *sfctx,
+	struct mailbox_transaction_context **_t,
+	const ARRAY_TYPE(seq_range) *batch_uids)
+{
+	int ret = 0;
+
+	if ( sfctx->move_trans != NULL ) {
+		if ( mailbox_transaction_commit(&sfctx->move_trans) < 0 ) {
+			mailbox_transaction_rollback(_t);
+			return -1;
+		}
 	}
+	if ( mailbox_transaction_commit(_t) < 0 )
+		return -1;
+
+	/* Workers leave the bookkeeping to the parent */
+	if ( sfctx->results != NULL )
+		return 0;
+
+	seq_range_array_merge(&sfctx->done_uids, batch_uids);
+	if ( filter_checkpoint_write(sfctx) < 0 )
+		ret = -1;
+	filter_progress(sfctx, seq_range_count(batch_uids));
+	return ret;
+}
+
+static int filter_uids
+(struct sieve_filter_context *sfctx, struct mailbox *src_box,
+	const ARRAY_TYPE(seq_range) *uids)
+{
+	static const char *const filter_headers[] = {
+		"Message-ID", "Date", "Subject", NULL
+	};
+	struct mailbox *move_box = sfctx->data->move_mailbox;
+	struct mail_search_args *search_args;
+	struct mailbox_transaction_context *t;
+	struct mailbox_header_lookup_ctx *headers_ctx;
+	struct mail_search_context *search_ctx;
+	ARRAY_TYPE(const_string) wanted_headers;
+	ARRAY_TYPE(seq_range) batch_uids;
+	enum sieve_manifest_flags manifest_flags;
+	enum mail_fetch_field wanted_fields = MAIL_FETCH_VIRTUAL_SIZE;
+	struct mail *mail;
+	int ret = 1;
 
 	/* Start move mailbox transaction */
 
 	if ( move_box != NULL ) {
-		sfctx.move_trans = mailbox_transaction_begin
+		sfctx->move_trans = mailbox_transaction_begin
 			(move_box, MAILBOX_TRANSACTION_FLAG_EXTERNAL,
 			 "sieve_filter_data move_box");
 	}
 
-	/* Search non-deleted messages in the source folder */
+	search_args = filter_search_args(uids);
 
-	search_args = mail_search_build_init();
-	mail_search_build_add_flags(search_args, MAIL_DELETED, TRUE);
+	/* Fetch the fields used by the script along with the search */
+
+	t_array_init(&wanted_headers, 16);
+	array_append(&wanted_headers, filter_headers,
+		N_ELEMENTS(filter_headers) - 1);
+	manifest_flags = sieve_get_wanted_fields
+		(sfctx->data->main_sbin, &wanted_headers);
+	if ( (manifest_flags & SIEVE_MANIFEST_FLAG_BODY) != 0 )
+		wanted_fields |= MAIL_FETCH_STREAM_BODY;
+	if ( (manifest_flags & SIEVE_MANIFEST_FLAG_SIZE) != 0 )
+		wanted_fields |= MAIL_FETCH_PHYSICAL_SIZE;
+	array_append_zero(&wanted_headers);
+	headers_ctx = mailbox_header_lookup_init
+		(src_box, array_idx(&wanted_headers, 0));
 
 	t = mailbox_transaction_begin(src_box, 0,
 				      "sieve_filter_data src_box");
-	search_ctx = mailbox_search_init(t, search_args, NULL, 0, NULL);
+	search_ctx = mailbox_search_init
+		(t, search_args, NULL, wanted_fields, headers_ctx);
 	mail_search_args_unref(&search_args);
+	mailbox_header_lookup_unref(&headers_ctx);
 
 	/* Iterate through all requested messages */
 
+	t_array_init(&batch_uids, 64);
+	if ( sfctx->results != NULL )
+		o_stream_cork(sfctx->results);
 	while ( ret >= 0 && mailbox_search_next(search_ctx, &mail) ) {
-		ret = filter_message(&sfctx, mail);
+		enum sieve_filter_action action;
+
+		ret = filter_message(sfctx, mail, &action);
+		if ( ret < 0 )
+			break;
+
+		/* Messages for which script execution failed are left alone
+		   and not checkpointed, so that a resumed run retries them */
+		if ( ret == 0 && action == SIEVE_FILTER_ACT_NONE )
+			continue;
+
+		if ( sfctx->results != NULL ) {
+			o_stream_nsend_str(sfctx->results,
+				t_strdup_printf("%u\t%u\n", mail->uid,
+					(unsigned int)action));
+		} else if ( filter_message_apply(sfctx, mail, action) < 0 ) {
+			ret = -1;
+			break;
+		}
+		seq_range_array_add(&batch_uids, mail->uid);
 	}
+	if ( sfctx->results != NULL )
+		o_stream_uncork(sfctx->results);
 
 	/* Cleanup */
 
@@ -319,18 +580,459 @@ static int filter_mailbox
 		ret = -1;
 	}
 
-	if ( sfctx.move_trans != NULL ) {
-		if ( mailbox_transaction_commit(&sfctx.move_trans) < 0 ) {
+	if ( filter_commit(sfctx, &t, &batch_uids) < 0 ) {
+		ret = -1;
+	}
+	return ret;
+}
+
+static int filter_mailbox_uids
+(struct sieve_filter_context *sfctx, struct mailbox *src_box,
+	const ARRAY_TYPE(seq_range) *uids)
+{
+	ARRAY_TYPE(seq_range) batch;
+	const struct seq_range *range;
+	unsigned int count;
+	uint32_t seq1;
+	int ret = 1;
+
+	/* Filter the messages in batches, so that the results are committed
+	   (and checkpointed) regularly */
+	t_array_init(&batch, 16);
+	count = 0;
+	array_foreach(uids, range) {
+		for ( seq1 = range->seq1; seq1 <= range->seq2 && ret >= 0; ) {
+			uint32_t seq2 = range->seq2;
+
+			if ( seq2 - seq1 >= SIEVE_FILTER_BATCH_SIZE - count )
+				seq2 = seq1 + (SIEVE_FILTER_BATCH_SIZE - count) - 1;
+			seq_range_array_add_range(&batch, seq1, seq2);
+			count += seq2 - seq1 + 1;
+
+			if ( count == SIEVE_FILTER_BATCH_SIZE ) {
+				T_BEGIN {
+					ret = filter_uids(sfctx, src_box, &batch);
+				} T_END;
+				array_clear(&batch);
+				count = 0;
+			}
+			if ( seq2 == range->seq2 )
+				break;
+			seq1 = seq2 + 1;
+		}
+		if ( ret < 0 )
+			break;
+	}
+	if ( ret >= 0 && count > 0 ) {
+		T_BEGIN {
+			ret = filter_uids(sfctx, src_box, &batch);
+		} T_END;
+	}
+	return ret;
+}
+
+/*
+ * Parallel mode
+ *
+ *   The workers are forked before any mailbox is opened. Each of these opens
+ *   its own view of the source mailbox and filters the range of UIDs it is
+ *   assigned by the parent, using the script binary compiled by the parent.
+ *   The workers only report what needs to happen with each message in the
+ *   source mailbox; the parent applies these results and commits them in
+ *   batches.
+ */
+
+static void filter_workers_start(struct sieve_filter_data *sfdata)
+{
+	unsigned int i;
+
+	sfdata->workers = i_new(struct sieve_filter_worker,
+		sfdata->worker_count);
+	for ( i = 0; i < sfdata->worker_count; i++ ) {
+		struct sieve_filter_worker *worker = &sfdata->workers[i];
+		int fd_uids[2], fd_results[2];
+
+		if ( pipe(fd_uids) < 0 || pipe(fd_results) < 0 )
+			i_fatal("pipe() failed: %m");
+
+		worker->pid = fork();
+		if ( worker->pid < 0 )
+			i_fatal("fork() failed: %m");
+		if ( worker->pid == 0 ) {
+			unsigned int j;
+
+			/* Worker */
+			for ( j = 0; j < i; j++ ) {
+				i_close_fd(&sfdata->workers[j].fd_uids);
+				i_close_fd(&sfdata->workers[j].fd_results);
+			}
+			i_free(sfdata->workers);
+			sfdata->worker_count = 0;
+
+			i_close_fd(&fd_uids[1]);
+			i_close_fd(&fd_results[0]);
+			sfdata->worker_fd_uids = fd_uids[0];
+			sfdata->worker_fd_results = fd_results[1];
+			return;
+		}
+
+		/* Parent */
+		i_close_fd(&fd_uids[0]);
+		i_close_fd(&fd_results[1]);
+		worker->fd_uids = fd_uids[1];
+		worker->fd_results = fd_results[0];
+	}
+}
+
+static int filter_worker_run
+(struct sieve_filter_context *sfctx, struct mailbox *src_box)
+{
+	struct sieve_error_handler *ehandler = sfctx->data->ehandler;
+	ARRAY_TYPE(seq_range) uids;
+	struct istream *input;
+	const char *line;
+	int ret = 0;
+
+	/* Read the assigned UIDs */
+	input = i_stream_create_fd(sfctx->data->worker_fd_uids, (size_t)-1);
+	line = i_stream_read_next_line(input);
+	t_array_init(&uids, 64);
+	if ( line == NULL ) {
+		sieve_error(ehandler, NULL,
+			"worker: failed to read UIDs from parent: %s",
+			( input->stream_errno == 0 ?
+				"EOF" : i_stream_get_error(input) ));
+		ret = -1;
+	} else if ( *line != '\0' &&
+		imap_seq_set_nostar_parse(line, &uids) < 0 ) {
+		sieve_error(ehandler, NULL,
+			"worker: received invalid UID set from parent");
+		ret = -1;
+	}
+	i_stream_destroy(&input);
+
+	if ( ret < 0 || array_count(&uids) == 0 )
+		return ret;
+
+	sfctx->results = o_stream_create_fd
+		(sfctx->data->worker_fd_results, (size_t)-1);
+	o_stream_set_no_error_handling(sfctx->results, TRUE);
+
+	ret = filter_mailbox_uids(sfctx, src_box, &uids);
+
+	if ( o_stream_finish(sfctx->results) < 0 ) {
+		sieve_error(ehandler, NULL,
+			"worker: failed to report results to parent: %s",
+			o_stream_get_error(sfctx->results));
+		ret = -1;
+	}
+	o_stream_destroy(&sfctx->results);
+	return ret;
+}
+
+static void filter_workers_assign
+(struct sieve_filter_context *sfctx, const ARRAY_TYPE(seq_range) *uids)
+{
+	const struct sieve_filter_data *sfdata = sfctx->data;
+	unsigned int worker_count = sfdata->worker_count;
+	unsigned int per_worker, count, idx;
+	const struct seq_range *range;
+	ARRAY_TYPE(seq_range) worker_uids;
+	string_t *str;
+	uint32_t seq1, seq2;
+
+	/* Split the UIDs into contiguous parts of about equal size */
+	per_worker = (sfctx->total + worker_count - 1) / worker_count;
+	if ( per_worker == 0 )
+		per_worker = 1;
+
+	str = t_str_new(256);
+	t_array_init(&worker_uids, 16);
+	idx = count = 0;
+	array_foreach(uids, range) {
+		for ( seq1 = range->seq1;; seq1 = seq2 + 1 ) {
+			seq2 = range->seq2;
+			if ( idx < worker_count - 1 &&
+				seq2 - seq1 >= per_worker - count )
+				seq2 = seq1 + (per_worker - count) - 1;
+			seq_range_array_add_range(&worker_uids, seq1, seq2);
+			count += seq2 - seq1 + 1;
+
+			if ( count == per_worker && idx < worker_count - 1 ) {
+				str_truncate(str, 0);
+				imap_write_seq_range(str, &worker_uids);
+				str_append_c(str, '\n');
+				if ( write_full(sfdata->workers[idx].fd_uids,
+					str_data(str), str_len(str)) < 0 )
+					i_fatal("write(worker pipe) failed: %m");
+				array_clear(&worker_uids);
+				idx++;
+				count = 0;
+			}
+			if ( seq2 == range->seq2 )
+				break;
+		}
+	}
+
+	/* The last worker gets the remainder; any others get nothing */
+	for ( ; idx < worker_count; idx++ ) {
+		str_truncate(str, 0);
+		imap_write_seq_range(str, &worker_uids);
+		str_append_c(str, '\n');
+		if ( write_full(sfdata->workers[idx].fd_uids,
+			str_data(str), str_len(str)) < 0 )
+			i_fatal("write(worker pipe) failed: %m");
+		array_clear(&worker_uids);
+	}
+}
+
+static int filter_workers_apply
+(struct sieve_filter_context *sfctx, struct mailbox *src_box,
+	ARRAY_TYPE(sieve_filter_result) *results)
+{
+	struct mailbox *move_box = sfctx->data->move_mailbox;
+	struct mailbox_transaction_context *t;
+	const struct sieve_filter_result *result;
+	ARRAY_TYPE(seq_range) batch_uids;
+	struct mail *mail;
+	int ret = 0;
+
+	if ( move_box != NULL ) {
+		sfctx->move_trans = mailbox_transaction_begin
+			(move_box, MAILBOX_TRANSACTION_FLAG_EXTERNAL,
+			 "sieve_filter_data move_box");
+	}
+	t = mailbox_transaction_begin(src_box, 0,
+				      "sieve_filter_data src_box");
+	mail = mail_alloc(t, 0, NULL);
+
+	/* Workers only report the messages that were filtered successfully */
+	t_array_init(&batch_uids, 64);
+	array_foreach(results, result) {
+		if ( result->action != SIEVE_FILTER_ACT_NONE ) {
+			if ( !mail_set_uid(mail, result->uid) )
+				continue;
+			if ( filter_message_apply(sfctx, mail, result->action) < 0 ) {
+				ret = -1;
+				break;
+			}
+		}
+		seq_range_array_add(&batch_uids, result->uid);
+	}
+	mail_free(&mail);
+	array_clear(results);
+
+	if ( filter_commit(sfctx, &t, &batch_uids) < 0 )
+		ret = -1;
+	return ret;
+}
+
+static int filter_workers_read
+(struct sieve_filter_worker *worker,
+	ARRAY_TYPE(sieve_filter_result) *results)
+{
+	struct sieve_filter_result *result;
+	const char *line, *const *args;
+	unsigned int action;
+	uint32_t uid;
+	int ret;
+
+	if ( (ret=i_stream_read(worker->results)) == -1 &&
+		worker->results->stream_errno != 0 ) {
+		i_error("Failed to read results from worker %s: %s",
+			dec2str(worker->pid), i_stream_get_error(worker->results));
+		return -1;
+	}
+	while ( (line=i_stream_next_line(worker->results)) != NULL ) {
+		args = t_strsplit(line, "\t");
+		if ( str_array_length(args) != 2 ||
+			str_to_uint32(args[0], &uid) < 0 ||
+			str_to_uint(args[1], &action) < 0 ||
+			action > SIEVE_FILTER_ACT_MOVE ) {
+			i_error("Received invalid result from worker %s: %s",
+				dec2str(worker->pid), line);
+			return -1;
+		}
+		result = array_append_space(results);
+		result->uid = uid;
+		result->action = (enum sieve_filter_action)action;
+	}
+	return ( ret == -1 ? 0 : 1 );
+}
+
+static int filter_workers_wait
+(const struct sieve_filter_data *sfdata, bool report)
+{
+	struct sieve_filter_worker *workers = sfdata->workers;
+	unsigned int i;
+	int status, ret = 0;
+
+	for ( i = 0; i < sfdata->worker_count; i++ ) {
+		/* Workers that receive no UIDs exit by themselves */
+		i_close_fd(&workers[i].fd_uids);
+		i_close_fd(&workers[i].fd_results);
+
+		if ( workers[i].pid == -1 )
+			continue;
+		if ( waitpid(workers[i].pid, &status, 0) < 0 ) {
+			i_error("waitpid(%s) failed: %m", dec2str(workers[i].pid));
+			ret = -1;
+		} else if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+			if ( report ) {
+				i_error("Worker %s failed; "
+					"not all messages were filtered",
+					dec2str(workers[i].pid));
+			}
 			ret = -1;
 		}
+		workers[i].pid = -1;
+	}
+	return ret;
+}
+
+static int filter_workers_run
+(struct sieve_filter_context *sfctx, struct mailbox *src_box,
+	const ARRAY_TYPE(seq_range) *uids)
+{
+	const struct sieve_filter_data *sfdata = sfctx->data;
+	struct sieve_filter_worker *workers = sfdata->workers;
+	unsigned int worker_count = sfdata->worker_count;
+	ARRAY_TYPE(sieve_filter_result) results;
+	struct pollfd *pfds;
+	unsigned int i, active;
+	int ret = 1;
+
+	filter_workers_assign(sfctx, uids);
+
+	pfds = t_new(struct pollfd, worker_count);
+	for ( i = 0; i < worker_count; i++ ) {
+		i_close_fd(&workers[i].fd_uids);
+		workers[i].results =
+			i_stream_create_fd(workers[i].fd_results, (size_t)-1);
+		pfds[i].fd = workers[i].fd_results;
+		pfds[i].events = POLLIN;
+	}
+
+	/* Merge the results reported by the workers */
+	t_array_init(&results, SIEVE_FILTER_BATCH_SIZE);
+	active = worker_count;
+	while ( active > 0 ) {
+		if ( poll(pfds, worker_count, -1) < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			i_fatal("poll() failed: %m");
+		}
+
+		for ( i = 0; i < worker_count; i++ ) {
+			int rret;
+
+			if ( pfds[i].fd == -1 || pfds[i].revents == 0 )
+				continue;
+
+			T_BEGIN {
+				rret = filter_workers_read(&workers[i], &results);
+			} T_END;
+			if ( rret <= 0 ) {
+				if ( rret < 0 )
+					ret = -1;
+				i_stream_destroy(&workers[i].results);
+				i_close_fd(&workers[i].fd_results);
+				pfds[i].fd = -1;
+				active--;
+			}
+		}
+
+		if ( ret >= 0 &&
+			array_count(&results) >= SIEVE_FILTER_BATCH_SIZE ) {
+			T_BEGIN {
+				if ( filter_workers_apply(sfctx, src_box, &results) < 0 )
+					ret = -1;
+			} T_END;
+		}
+	}
+	if ( ret >= 0 && array_count(&results) > 0 ) {
+		T_BEGIN {
+			if ( filter_workers_apply(sfctx, src_box, &results) < 0 )
+				ret = -1;
+		} T_END;
+	}
+
+	/* Wait for the workers to finish */
+	if ( filter_workers_wait(sfdata, TRUE) < 0 )
+		ret = -1;
+	return ret;
+}
+
+static int filter_mailbox
+(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
+{
+	struct sieve_filter_context sfctx;
+	struct sieve_error_handler *ehandler = sfdata->ehandler;
+	struct mail_search_args *search_args;
+	struct mailbox_transaction_context *t;
+	struct mail_search_context *search_ctx;
+	struct mailbox_status status;
+	ARRAY_TYPE(seq_range) uids;
+	struct mail *mail;
+	int ret = 1;
+
+	/* Sync source mailbox */
+
+	if ( mailbox_sync(src_box, MAILBOX_SYNC_FLAG_FULL_READ) < 0 ) {
+		sieve_error(ehandler, NULL, "failed to sync source mailbox");
+		return -1;
+	}
+
+	/* Initialize */
+
+	i_zero(&sfctx);
+	sfctx.data = sfdata;
+	i_array_init(&sfctx.done_uids, 64);
+
+	mailbox_get_open_status(src_box, STATUS_UIDVALIDITY, &status);
+	sfctx.uid_validity = status.uidvalidity;
+
+	/* Create test stream */
+	if ( !sfdata->execute ) {
+		sfctx.teststream = o_stream_create_fd(1, 0);
+		o_stream_set_no_error_handling(sfctx.teststream, TRUE);
 	}
 
-	if ( mailbox_transaction_commit(&t) < 0 ) {
+	/* Determine which messages to filter */
+
+	t_array_init(&uids, 64);
+	search_args = filter_search_args(NULL);
+	t = mailbox_transaction_begin(src_box, 0,
+				      "sieve_filter_data src_box");
+	search_ctx = mailbox_search_init(t, search_args, NULL, 0, NULL);
+	mail_search_args_unref(&search_args);
+	while ( mailbox_search_next(search_ctx, &mail) )
+		seq_range_array_add(&uids, mail->uid);
+	if ( mailbox_search_deinit(&search_ctx) < 0 )
 		ret = -1;
+	(void)mailbox_transaction_commit(&t);
+
+	if ( ret >= 0 && sfdata->checkpoint_path != NULL ) {
+		if ( filter_checkpoint_read(&sfctx, &uids) < 0 )
+			ret = -1;
+	}
+	sfctx.total = seq_range_count(&uids);
+
+	/* Filter the messages */
+
+	if ( ret < 0 ) {
+		/* Nothing */
+	} else if ( sfdata->worker_count > 0 ) {
+		ret = filter_workers_run(&sfctx, src_box, &uids);
+	} else {
+		ret = filter_mailbox_uids(&sfctx, src_box, &uids);
 	}
 
+	/* Cleanup */
+
 	if ( sfctx.teststream != NULL )
 		o_stream_destroy(&sfctx.teststream);
+	array_free(&sfctx.done_uids);
 
 	if ( ret < 0 ) return ret;
 
@@ -346,6 +1048,35 @@ static int filter_mailbox
 	return ret;
 }
 
+static int filter_worker_mailbox
+(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
+{
+	struct sieve_filter_context sfctx;
+	struct sieve_error_handler *ehandler = sfdata->ehandler;
+	int ret;
+
+	if ( mailbox_sync(src_box, MAILBOX_SYNC_FLAG_FULL_READ) < 0 ) {
+		sieve_error(ehandler, NULL, "failed to sync source mailbox");
+		return -1;
+	}
+
+	i_zero(&sfctx);
+	sfctx.data = sfdata;
+	i_array_init(&sfctx.done_uids, 64);
+
+	if ( !sfdata->execute ) {
+		sfctx.teststream = o_stream_create_fd(1, 0);
+		o_stream_set_no_error_handling(sfctx.teststream, TRUE);
+	}
+
+	ret = filter_worker_run(&sfctx, src_box);
+
+	if ( sfctx.teststream != NULL )
+		o_stream_destroy(&sfctx.teststream);
+	array_free(&sfctx.done_uids);
+	return ret;
+}
+
 /*
  * Tool implementation
  */
@@ -355,6 +1086,7 @@ int main(int argc, char **argv)
 	struct sieve_instance *svinst;
 	ARRAY_TYPE (const_string) scriptfiles;
 	const char *scriptfile,	*src_mailbox, *dst_mailbox, *move_mailbox;
+	const char *checkpoint_path;
 	struct sieve_filter_data sfdata;
 	enum sieve_filter_discard_action discard_action = SIEVE_FILTER_DACT_KEEP;
 	struct mail_user *mail_user;
@@ -362,20 +1094,22 @@ int main(int argc, char **argv)
 	struct sieve_script_env scriptenv;
 	struct sieve_error_handler *ehandler;
 	bool force_compile, execute, source_write, verbose, default_move;
+	bool worker = FALSE;
+	unsigned int workers = 0;
 	struct mail_namespace *ns;
 	struct mailbox *src_box = NULL, *move_box = NULL;
 	enum mailbox_flags open_flags = MAILBOX_FLAG_IGNORE_ACLS;
 	enum mail_error error;
 	const char *errstr;
-	int c;
+	int c, ret;
 
 	sieve_tool = sieve_tool_init("sieve-filter", &argc, &argv,
-		"m:s:x:P:u:q:Q:DCevW", FALSE);
+		"m:s:x:P:u:q:Q:r:j:DCevW", FALSE);
 
 	t_array_init(&scriptfiles, 16);
 
 	/* Parse arguments */
-	dst_mailbox = move_mailbox = NULL;
+	dst_mailbox = move_mailbox = checkpoint_path = NULL;
 	force_compile = execute = source_write = default_move = FALSE;
 	verbose = FALSE;	
 	while ((c = sieve_tool_getopt(sieve_tool)) > 0) {
@@ -405,6 +1139,17 @@ int main(int argc, char **argv)
 			i_fatal_status(EX_USAGE,
 				"The -Q argument is currently NOT IMPLEMENTED");
 			break;
+		case 'j':
+			/* number of parallel workers */
+			if ( str_to_uint(optarg, &workers) < 0 || workers == 0 ) {
+				i_fatal_status(EX_USAGE,
+					"Invalid -j parameter: %s", optarg);
+			}
+			break;
+		case 'r':
+			/* checkpoint file for resuming */
+			checkpoint_path = t_strdup(optarg);
+			break;
 		case 'e':
 			/* execution mode */
 			execute = TRUE;
@@ -497,7 +1242,7 @@ int main(int argc, char **argv)
 
 	/* Compile main sieve script */
 	if ( force_compile ) {
-		main_sbin = sieve_tool_script_compile(svinst, scriptfile, NULL);
+		main_sbin = sieve_tool_script_compile(svinst, scriptfile, NULL, 0);
 		if ( main_sbin != NULL )
 			(void) sieve_save(main_sbin, TRUE, NULL);
 	} else {
@@ -507,12 +1252,41 @@ int main(int argc, char **argv)
 	/* Initialize mail user */
 	mail_user = sieve_tool_get_mail_user(sieve_tool);
 
+	/* Compose script environment */
+	if (sieve_script_env_init(&scriptenv, mail_user, &errstr) < 0)
+		i_fatal("Failed to initialize script execution: %s", errstr);
+	scriptenv.mailbox_autocreate = FALSE;
+	scriptenv.default_mailbox = dst_mailbox;
+
+	/* Compose filter context */
+	i_zero(&sfdata);
+	sfdata.senv = &scriptenv;
+	sfdata.discard_action = discard_action;
+	sfdata.move_mailbox_name = move_mailbox;
+	sfdata.main_sbin = main_sbin;
+	sfdata.ehandler = ehandler;
+	sfdata.checkpoint_path = checkpoint_path;
+	sfdata.worker_fd_uids = sfdata.worker_fd_results = -1;
+	sfdata.execute = execute;
+	sfdata.source_write = source_write;
+	sfdata.default_move = default_move;
+
+	/* Start parallel workers before any mailbox is opened */
+	if ( workers > 1 && main_sbin != NULL ) {
+		sfdata.worker_count = workers;
+		filter_workers_start(&sfdata);
+		worker = ( sfdata.worker_fd_results != -1 );
+	}
+
 	/* Open the source mailbox */
 
 	ns = mail_namespace_find(mail_user->namespaces, src_mailbox);
 	if ( ns == NULL )
 		i_fatal("Unknown namespace for source mailbox '%s'", src_mailbox);
 
+	/* Workers commit the flag changes made by the script themselves, but
+	   moving and removing messages from the source mailbox is left to the
+	   parent */
 	if ( !source_write || !execute )
 		open_flags |= MAILBOX_FLAG_READONLY;
 
@@ -524,7 +1298,7 @@ int main(int argc, char **argv)
 
 	/* Open move box if necessary */
 
-	if ( execute && discard_action == SIEVE_FILTER_DACT_MOVE &&
+	if ( execute && !worker && discard_action == SIEVE_FILTER_DACT_MOVE &&
 		move_mailbox != NULL ) {
 		ns = mail_namespace_find(mail_user->namespaces, move_mailbox);
 		if ( ns == NULL )
@@ -540,26 +1314,13 @@ int main(int argc, char **argv)
 			i_fatal("Source mailbox and mailbox for move action are identical.");
 		}
 	}
-
-	/* Compose script environment */
-	if (sieve_script_env_init(&scriptenv, mail_user, &errstr) < 0)
-		i_fatal("Failed to initialize script execution: %s", errstr);
-	scriptenv.mailbox_autocreate = FALSE;
-	scriptenv.default_mailbox = dst_mailbox;
-
-	/* Compose filter context */
-	i_zero(&sfdata);
-	sfdata.senv = &scriptenv;
-	sfdata.discard_action = discard_action;
 	sfdata.move_mailbox = move_box;
-	sfdata.main_sbin = main_sbin;
-	sfdata.ehandler = ehandler;
-	sfdata.execute = execute;
-	sfdata.source_write = source_write;
-	sfdata.default_move = default_move;
 
 	/* Apply Sieve filter to all messages found */
-	(void) filter_mailbox(&sfdata, src_box);
+	if ( worker )
+		ret = filter_worker_mailbox(&sfdata, src_box);
+	else
+		ret = filter_mailbox(&sfdata, src_box);
 
 	/* Close the source mailbox */
 	if ( src_box != NULL )
@@ -576,7 +1337,21 @@ int main(int argc, char **argv)
 	/* Cleanup error handler */
 	sieve_error_handler_unref(&ehandler);
 
+	if ( worker ) {
+		i_close_fd(&sfdata.worker_fd_uids);
+		i_close_fd(&sfdata.worker_fd_results);
+	} else if ( sfdata.worker_count > 0 ) {
+		/* Reap the workers when filtering failed before they were
+		   assigned any messages */
+		if ( filter_workers_wait(&sfdata, FALSE) < 0 && ret >= 0 )
+			ret = -1;
+	}
+	i_free(sfdata.workers);
+
 	sieve_tool_deinit(&sieve_tool);
 
-	return 0;
+	/* Workers report failure to the parent through their exit status, and
+	   the parent reports it when any of the workers failed */
+	return ( (worker || sfdata.worker_count > 0) && ret < 0 ?
+		EXIT_FAILURE : 0 );
 }
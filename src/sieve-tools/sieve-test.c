@@ -43,7 +43,7 @@ static void print_help(void)
 "Usage: sieve-test [-a <orig-recipient-address] [-c <config-file>]\n"
 "                  [-C] [-D] [-d <dump-filename>] [-e]\n"
 "                  [-f <envelope-sender>] [-l <mail-location>]\n"
-"                  [-m <default-mailbox>] [-P <plugin>]\n"
+"                  [-m <default-mailbox>] [-p <profile-file>] [-P <plugin>]\n"
 "                  [-r <recipient-address>] [-s <script-file>]\n"
 "                  [-t <trace-file>] [-T <trace-option>] [-x <extensions>]\n"
 "                  <script-file> <mail-file>\n"
@@ -134,8 +134,8 @@ int main(int argc, char **argv)
 {
 	struct sieve_instance *svinst;
 	ARRAY_TYPE (const_string) scriptfiles;
-	const char *scriptfile, *mailbox, *dumpfile, *tracefile, *mailfile,
-		*mailloc, *errstr;
+	const char *scriptfile, *mailbox, *dumpfile, *tracefile, *profilefile,
+		*mailfile, *mailloc, *errstr;
 	struct smtp_address *rcpt_to, *final_rcpt_to, *mail_from;
 	struct sieve_trace_config trace_config;
 	struct mail *mail;
@@ -146,18 +146,19 @@ int main(int argc, char **argv)
 	struct sieve_error_handler *ehandler, *action_ehandler;
 	struct ostream *teststream = NULL;
 	struct sieve_trace_log *trace_log = NULL;
+	struct sieve_profile *profile = NULL;
 	bool force_compile = FALSE, execute = FALSE;
 	int exit_status = EXIT_SUCCESS;
 	int ret, c;
 
 	sieve_tool = sieve_tool_init
-		("sieve-test", &argc, &argv, "r:a:f:m:d:l:s:eCt:T:DP:x:u:", FALSE);
+		("sieve-test", &argc, &argv, "r:a:f:m:d:l:p:s:eCt:T:DP:x:u:", FALSE);
 
 	ehandler = action_ehandler = NULL;
 	t_array_init(&scriptfiles, 16);
 
 	/* Parse arguments */
-	mailbox = dumpfile = tracefile = mailloc = NULL;
+	mailbox = dumpfile = tracefile = profilefile = mailloc = NULL;
 	mail_from = final_rcpt_to = rcpt_to = NULL;
 	i_zero(&trace_config);
 	trace_config.level = SIEVE_TRLVL_ACTIONS;
@@ -206,6 +207,10 @@ int main(int argc, char **argv)
 			/* dump file */
 			dumpfile = optarg;
 			break;
+		case 'p':
+			/* profile file */
+			profilefile = optarg;
+			break;
 		case 's':
 			/* scriptfile executed before main script */
 			{
@@ -264,7 +269,7 @@ int main(int argc, char **argv)
 
 	/* Compile main sieve script */
 	if ( force_compile ) {
-		main_sbin = sieve_tool_script_compile(svinst, scriptfile, NULL);
+		main_sbin = sieve_tool_script_compile(svinst, scriptfile, NULL, 0);
 		if ( main_sbin != NULL )
 			(void) sieve_save(main_sbin, TRUE, NULL);
 	} else {
@@ -315,6 +320,9 @@ int main(int argc, char **argv)
 				&trace_log);
 		}
 
+		if ( profilefile != NULL )
+			profile = sieve_profile_create(svinst);
+
 		/* Compose script environment */
 		if (sieve_script_env_init(&scriptenv,
 			sieve_tool_get_mail_user(sieve_tool), &errstr) < 0)
@@ -330,6 +338,7 @@ int main(int argc, char **argv)
 		scriptenv.duplicate_check = duplicate_check;
 		scriptenv.trace_log = trace_log;
 		scriptenv.trace_config = trace_config;
+		scriptenv.profile = profile;
 
 		i_zero(&estatus);
 		scriptenv.exec_status = &estatus;
@@ -377,7 +386,8 @@ int main(int argc, char **argv)
 
 				/* Compile sieve script */
 				if ( force_compile ) {
-					sbin = sieve_tool_script_compile(svinst, sfiles[i], sfiles[i]);
+					sbin = sieve_tool_script_compile
+						(svinst, sfiles[i], sfiles[i], 0);
 					if ( sbin != NULL )
 						(void) sieve_save(sbin, FALSE, NULL);
 				} else {
@@ -444,6 +454,20 @@ int main(int argc, char **argv)
 		if ( trace_log != NULL )
 			sieve_trace_log_free(&trace_log);
 
+		/* Write profile */
+		if ( profile != NULL ) {
+			if ( strcmp(profilefile, "-") == 0 ) {
+				struct ostream *output = o_stream_create_fd(1, 0);
+
+				o_stream_set_no_error_handling(output, TRUE);
+				sieve_profile_write(profile, output);
+				o_stream_destroy(&output);
+			} else if ( sieve_profile_merge_report(profile, profilefile) < 0 ) {
+				exit_status = EXIT_FAILURE;
+			}
+			sieve_profile_free(&profile);
+		}
+
 		/* Cleanup remaining binaries */
 		if ( sbin != NULL )
 			sieve_close(&sbin);
@@ -45,6 +45,7 @@
  */
 
 struct sieve_instance *testsuite_sieve_instance = NULL;
+enum sieve_compile_flags testsuite_compile_flags = 0;
 char *testsuite_test_path = NULL;
 
 /* Test context */
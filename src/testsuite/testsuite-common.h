@@ -10,6 +10,7 @@
  */
 
 extern struct sieve_instance *testsuite_sieve_instance;
+extern enum sieve_compile_flags testsuite_compile_flags;
 
 extern const struct sieve_extension_def testsuite_extension;
 
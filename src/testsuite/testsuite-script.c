@@ -2,9 +2,13 @@
  */
 
 #include "lib.h"
+#include "ioloop.h"
+#include "hash.h"
+#include "hex-binary.h"
 
 #include "sieve.h"
 #include "sieve-common.h"
+#include "sieve-settings.h"
 #include "sieve-script.h"
 #include "sieve-binary.h"
 #include "sieve-interpreter.h"
@@ -19,16 +23,80 @@
 
 #include "testsuite-script.h"
 
+/*
+ * Duplicate database
+ */
+
+/* Kept in memory for the whole testsuite run. It is only used while the
+   testsuite_duplicate_db setting is enabled, so that other tests are not
+   affected by the messages they handle. */
+
+static pool_t testsuite_duplicate_pool;
+static HASH_TABLE(const char *, void *) testsuite_duplicates;
+
+static bool testsuite_duplicate_enabled(void)
+{
+	bool enabled = FALSE;
+
+	(void)sieve_setting_get_bool_value(testsuite_sieve_instance,
+		"testsuite_duplicate_db", &enabled);
+	return enabled;
+}
+
+static bool testsuite_duplicate_check
+(const struct sieve_script_env *senv ATTR_UNUSED, const void *id,
+	size_t id_size)
+{
+	void *value;
+
+	if ( !testsuite_duplicate_enabled() )
+		return FALSE;
+
+	value = hash_table_lookup(testsuite_duplicates,
+		binary_to_hex(id, id_size));
+	return ( value != NULL && (time_t)POINTER_CAST_TO(value, long) > ioloop_time );
+}
+
+static void testsuite_duplicate_mark
+(const struct sieve_script_env *senv ATTR_UNUSED, const void *id,
+	size_t id_size, time_t time)
+{
+	const char *key = binary_to_hex(id, id_size);
+	const char *orig_key;
+	void *value;
+
+	if ( !testsuite_duplicate_enabled() )
+		return;
+
+	if ( !hash_table_lookup_full
+		(testsuite_duplicates, key, &orig_key, &value) )
+		orig_key = p_strdup(testsuite_duplicate_pool, key);
+	hash_table_update(testsuite_duplicates, orig_key,
+		POINTER_CAST((long)time));
+}
+
+void testsuite_script_env_set_duplicate(struct sieve_script_env *scriptenv)
+{
+	scriptenv->duplicate_check = testsuite_duplicate_check;
+	scriptenv->duplicate_mark = testsuite_duplicate_mark;
+}
+
 /*
  * Tested script environment
  */
 
 void testsuite_script_init(void)
 {
+	testsuite_duplicate_pool =
+		pool_alloconly_create("testsuite duplicates", 1024);
+	hash_table_create(&testsuite_duplicates,
+		testsuite_duplicate_pool, 0, str_hash, strcmp);
 }
 
 void testsuite_script_deinit(void)
 {
+	hash_table_destroy(&testsuite_duplicates);
+	pool_unref(&testsuite_duplicate_pool);
 }
 
 static struct sieve_binary *_testsuite_script_compile
@@ -47,7 +115,8 @@ static struct sieve_binary *_testsuite_script_compile
 	script_path = t_strconcat(script_path, "/", script, NULL);
 
 	if ( (sbin = sieve_compile
-		(svinst, script_path, NULL, testsuite_log_ehandler, 0, NULL)) == NULL )
+		(svinst, script_path, NULL, testsuite_log_ehandler,
+			testsuite_compile_flags, NULL)) == NULL )
 		return NULL;
 
 	return sbin;
@@ -121,10 +190,10 @@ bool testsuite_script_run(const struct sieve_runtime_env *renv)
 	scriptenv.smtp_send = testsuite_smtp_send;
 	scriptenv.smtp_abort = testsuite_smtp_abort;
 	scriptenv.smtp_finish = testsuite_smtp_finish;
-	scriptenv.duplicate_mark = NULL;
-	scriptenv.duplicate_check = NULL;
+	testsuite_script_env_set_duplicate(&scriptenv);
 	scriptenv.trace_log = renv->scriptenv->trace_log;
 	scriptenv.trace_config = renv->scriptenv->trace_config;
+	scriptenv.profile = sieve_profile_open(renv->svinst);
 
 	result = testsuite_result_get();
 
@@ -132,12 +201,15 @@ bool testsuite_script_run(const struct sieve_runtime_env *renv)
 	interp=sieve_interpreter_create(ictx->compiled_script,
 		NULL, renv->msgdata, &scriptenv, testsuite_log_ehandler, 0);
 
-	if ( interp == NULL )
+	if ( interp == NULL ) {
+		sieve_profile_free(&scriptenv.profile);
 		return FALSE;
+	}
 
 	ret = sieve_interpreter_run(interp, result);
 
 	sieve_interpreter_free(&interp);
+	sieve_profile_close(&scriptenv.profile);
 
 	return ( ret > 0 || sieve_binary_extension_get_index
                 (ictx->compiled_script, testsuite_ext) >= 0 );
@@ -200,8 +272,7 @@ bool testsuite_script_multiscript
 	scriptenv.smtp_send = testsuite_smtp_send;
 	scriptenv.smtp_abort = testsuite_smtp_abort;
 	scriptenv.smtp_finish = testsuite_smtp_finish;
-	scriptenv.duplicate_mark = NULL;
-	scriptenv.duplicate_check = NULL;
+	testsuite_script_env_set_duplicate(&scriptenv);
 	scriptenv.trace_log = renv->scriptenv->trace_log;
 	scriptenv.trace_config = renv->scriptenv->trace_config;
 
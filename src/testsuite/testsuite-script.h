@@ -6,6 +6,8 @@
 void testsuite_script_init(void);
 void testsuite_script_deinit(void);
 
+void testsuite_script_env_set_duplicate(struct sieve_script_env *scriptenv);
+
 bool testsuite_script_is_subtest(const struct sieve_runtime_env *renv);
 
 bool testsuite_script_compile
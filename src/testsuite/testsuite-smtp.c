@@ -27,6 +27,7 @@ struct testsuite_smtp_message {
 static pool_t testsuite_smtp_pool;
 static const char *testsuite_smtp_tmp;
 static ARRAY(struct testsuite_smtp_message) testsuite_smtp_messages;
+static unsigned int testsuite_smtp_transactions;
 
 /*
  * Initialize
@@ -47,6 +48,7 @@ void testsuite_smtp_init(void)
 	}
 
 	p_array_init(&testsuite_smtp_messages, pool, 16);
+	testsuite_smtp_transactions = 0;
 }
 
 void testsuite_smtp_deinit(void)
@@ -146,6 +148,8 @@ int testsuite_smtp_finish
 		i_error("write(%s) failed: %s", smtp->msg_file,
 			o_stream_get_error(smtp->output));
 		ret = -1;
+	} else {
+		testsuite_smtp_transactions++;
 	}
 	o_stream_unref(&smtp->output);
 	i_free(smtp->msg_file);
@@ -174,3 +178,8 @@ bool testsuite_smtp_get
 
 	return TRUE;
 }
+
+unsigned int testsuite_smtp_get_transaction_count(void)
+{
+	return testsuite_smtp_transactions;
+}
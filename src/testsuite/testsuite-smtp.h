@@ -31,5 +31,6 @@ int testsuite_smtp_finish
 
 bool testsuite_smtp_get
 	(const struct sieve_runtime_env *renv, unsigned int index);
+unsigned int testsuite_smtp_get_transaction_count(void);
 
 #endif
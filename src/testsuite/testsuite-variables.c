@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "str.h"
 
 #include "sieve-common.h"
 #include "sieve-ast.h"
@@ -16,6 +17,7 @@
 #include "sieve-ext-variables.h"
 
 #include "testsuite-common.h"
+#include "testsuite-smtp.h"
 #include "testsuite-variables.h"
 
 /*
@@ -149,9 +151,18 @@ int testsuite_varnamespace_read_variable
 	}
 
 	if ( str_r != NULL ) {
+		const char *tmp_dir;
+
 		if ( strcmp(str_c(var_name), "path") == 0 )
 			*str_r = t_str_new_const(testsuite_test_path, strlen(testsuite_test_path));
-		else
+		else if ( strcmp(str_c(var_name), "tmp_dir") == 0 ) {
+			tmp_dir = testsuite_tmp_dir_get();
+			*str_r = t_str_new_const(tmp_dir, strlen(tmp_dir));
+		} else if ( strcmp(str_c(var_name), "smtp_transactions") == 0 ) {
+			*str_r = t_str_new(8);
+			str_printfa(*str_r, "%u",
+				testsuite_smtp_get_transaction_count());
+		} else
 			*str_r = NULL;
 	}
 	return SIEVE_EXEC_OK;
@@ -8,6 +8,7 @@
 #include "ostream.h"
 #include "hostpid.h"
 #include "path-util.h"
+#include "time-util.h"
 
 #include "sieve.h"
 #include "sieve-extensions.h"
@@ -25,6 +26,7 @@
 #include "testsuite-message.h"
 #include "testsuite-smtp.h"
 #include "testsuite-mailstore.h"
+#include "testsuite-script.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -47,7 +49,7 @@ const struct sieve_script_env *testsuite_scriptenv;
 static void print_help(void)
 {
 	printf(
-"Usage: testsuite [-D] [-E] [-d <dump-filename>]\n"
+"Usage: testsuite [-b] [-B] [-D] [-E] [-O] [-d <dump-filename>]\n"
 "                 [-t <trace-filename>] [-T <trace-option>]\n"
 "                 [-P <plugin>] [-x <extensions>]\n"
 "                 <scriptfile>\n"
@@ -56,23 +58,40 @@ static void print_help(void)
 
 static int testsuite_run
 (struct sieve_binary *sbin, const struct sieve_message_data *msgdata,
-	const struct sieve_script_env *senv, struct sieve_error_handler *ehandler)
+	const struct sieve_script_env *senv, struct sieve_error_handler *ehandler,
+	bool benchmark, bool no_opstream)
 {
 	struct sieve_interpreter *interp;
 	struct sieve_result *result;
+	struct timeval start, end;
 	int ret = 0;
 
+	i_zero(&start);
+	i_zero(&end);
+
 	/* Create the interpreter */
 	if ( (interp=sieve_interpreter_create
 		(sbin, NULL, msgdata, senv, ehandler, 0)) == NULL )
 		return SIEVE_EXEC_BIN_CORRUPT;
+	if ( no_opstream )
+		sieve_interpreter_disable_opstream(interp);
 
 	/* Run the interpreter */
 	result = testsuite_result_get();
 	sieve_result_ref(result);
+	if ( benchmark && gettimeofday(&start, NULL) < 0 )
+		i_fatal("gettimeofday() failed: %m");
 	ret = sieve_interpreter_run(interp, result);
+	if ( benchmark && gettimeofday(&end, NULL) < 0 )
+		i_fatal("gettimeofday() failed: %m");
 	sieve_result_unref(&result);
 
+	if ( benchmark ) {
+		printf("Benchmark: %u operations in %lld usecs\n",
+			sieve_interpreter_get_operation_count(interp),
+			timeval_diff_usecs(&end, &start));
+	}
+
 	/* Free the interpreter */
 	sieve_interpreter_free(&interp);
 
@@ -86,11 +105,11 @@ int main(int argc, char **argv)
 	struct sieve_trace_config trace_config;
 	struct sieve_binary *sbin;
 	const char *sieve_dir, *cwd, *error;
-	bool log_stdout = FALSE;
+	bool log_stdout = FALSE, benchmark = FALSE, no_opstream = FALSE;
 	int ret, c;
 
 	sieve_tool = sieve_tool_init
-		("testsuite", &argc, &argv, "d:t:T:EDP:", TRUE);
+		("testsuite", &argc, &argv, "bBd:t:T:EODP:", TRUE);
 
 	/* Parse arguments */
 	dumpfile = tracefile = NULL;
@@ -112,6 +131,18 @@ int main(int argc, char **argv)
 		case 'E':
 			log_stdout = TRUE;
 			break;
+		case 'b':
+			/* report operation throughput */
+			benchmark = TRUE;
+			break;
+		case 'B':
+			/* decode every operation (for comparison) */
+			no_opstream = TRUE;
+			break;
+		case 'O':
+			/* compile with optimization pass */
+			testsuite_compile_flags |= SIEVE_COMPILE_FLAG_OPTIMIZE;
+			break;
 		default:
 			print_help();
 			i_fatal_status(EX_USAGE,
@@ -165,7 +196,8 @@ int main(int argc, char **argv)
 
 	/* Compile sieve script */
 	if ( (sbin = sieve_compile
-		(svinst, scriptfile, NULL, testsuite_log_main_ehandler, 0, NULL))
+		(svinst, scriptfile, NULL, testsuite_log_main_ehandler,
+			testsuite_compile_flags, NULL))
 			!= NULL ) {
 		struct sieve_trace_log *trace_log = NULL;
 		struct sieve_script_env scriptenv;
@@ -192,6 +224,7 @@ int main(int argc, char **argv)
 		scriptenv.smtp_send = testsuite_smtp_send;
 		scriptenv.smtp_abort = testsuite_smtp_abort;
 		scriptenv.smtp_finish = testsuite_smtp_finish;
+		testsuite_script_env_set_duplicate(&scriptenv);
 		scriptenv.trace_log = trace_log;
 		scriptenv.trace_config = trace_config;
 
@@ -200,8 +233,8 @@ int main(int argc, char **argv)
 		testsuite_result_init();
 
 		/* Run the test */
-		ret = testsuite_run
-			(sbin, &testsuite_msgdata, &scriptenv, testsuite_log_main_ehandler);
+		ret = testsuite_run(sbin, &testsuite_msgdata, &scriptenv,
+			testsuite_log_main_ehandler, benchmark, no_opstream);
 
 		switch ( ret ) {
 		case SIEVE_EXEC_OK: